@@ -1 +1 @@
-qemu-system-x86_64 -cdrom .\dist\x86_64\femboyOS.iso
\ No newline at end of file
+qemu-system-x86_64 -cdrom .\dist\x86_64\femboyOS.iso -netdev user,id=n0,hostfwd=tcp::5001-:5001,hostfwd=udp::5555-:7 -device virtio-net-pci,netdev=n0
\ No newline at end of file
@@ -1 +1,18 @@
-qemu-system-x86_64 -cdrom ./dist/x86_64/femboyOS.iso -m 128M
+# NIC=e1000 or NIC=e1000e selects an Intel card instead of virtio-net
+# DISK=disk.img attaches a raw image as virtio-blk, with DISK_IF=ahci it
+# goes on the q35 SATA controller instead, with DISK_IF=nvme on an NVMe
+# controller. An ext2 image (mke2fs -t ext2 -d dir disk.img 64M) is
+# mounted on /mnt.
+DISK_ARGS=
+if [ -n "$DISK" ]; then
+    if [ "$DISK_IF" = ahci ]; then
+        DISK_ARGS="-machine q35 -drive file=$DISK,format=raw,if=none,id=d0 -device ide-hd,drive=d0,bus=ide.0"
+    elif [ "$DISK_IF" = nvme ]; then
+        DISK_ARGS="-drive file=$DISK,format=raw,if=none,id=d0 -device nvme,drive=d0,serial=femboy0,max_ioqpairs=4"
+    else
+        DISK_ARGS="-drive file=$DISK,format=raw,if=none,id=d0 -device virtio-blk-pci,drive=d0,num-queues=4"
+    fi
+fi
+qemu-system-x86_64 -cdrom ./dist/x86_64/femboyOS.iso -m 128M \
+    -netdev user,id=n0,hostfwd=tcp::5001-:5001,hostfwd=udp::5555-:7 \
+    -device ${NIC:-virtio-net-pci},netdev=n0 $DISK_ARGS
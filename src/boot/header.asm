@@ -9,6 +9,11 @@ header_start:
     ; checksum
     dd 0x100000000 - (0xe85250d6 + 0 + (header_end - header_start))
 
+    ; module alignment tag: modules start on a page
+    dw 6
+    dw 0
+    dd 8
+
     ; end tag
     dw 0
     dw 0
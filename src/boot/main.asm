@@ -5,6 +5,10 @@ section .text
 bits 32
 start:
 	mov esp, stack_top
+	; multiboot magic and information for kernel_main, nothing below
+	; touches edi and esi
+	mov edi, eax
+	mov esi, ebx
 
 	call check_multiboot
 	call check_cpuid
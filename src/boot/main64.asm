@@ -12,5 +12,8 @@ long_mode_start:
     mov fs, ax
     mov gs, ax
 
+    ; The upper halves are undefined after the switch, 32 bit moves clear them
+    mov edi, edi
+    mov esi, esi
 	call kernel_main
     hlt
@@ -0,0 +1,217 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/random.h"
+#include "../../libs/ioring.h"
+#include "../../libs/net/ip.h"
+#include "aio.h"
+
+#define AIO_DEFAULT_MS      1000
+#define AIO_MAX_MS          60000
+#define AIO_DEFAULT_DEPTH   32
+#define AIO_MAX_DEPTH       (IORING_ENTRIES / 2 - 1)    // Chains of two, and the end timer
+#define AIO_IO_SIZE         4096
+#define AIO_SECTORS         (AIO_IO_SIZE / BLK_SECTOR_SIZE)
+#define AIO_SEND_SIZE       1024        // Bytes of each block sent on
+#define AIO_USAGE           "Usage: aio [device] [send] [depth] [ms]\n"
+
+// user_data of the sends and of the timer that ends the run
+#define SEND_BIT            0x100
+#define END_TIMER           0x200
+
+static uint8_t buffers[AIO_MAX_DEPTH][AIO_IO_SIZE] __attribute__((aligned(4096)));
+
+typedef struct {
+    uint64_t chains;
+    uint64_t reads;
+    uint64_t sends;
+    uint64_t errors;
+    uint64_t canceled;
+    uint64_t waits;                 // ioring_wait calls
+    uint64_t reaped;                // Results they found
+} result_t;
+
+// Read a random 4K block into buffer i, and send it on if asked
+static void queue(ioring_t* ring, blk_device_t* dev, udp_socket_t* sock, int i) {
+    uint64_t blocks = dev->sectors / AIO_SECTORS;
+    uint64_t block = (((uint64_t)random_next() << 32) | random_next()) % blocks;
+
+    ioring_sqe_t* sqe = ioring_get_sqe(ring);
+    sqe->op = IORING_OP_READ;
+    sqe->flags = sock ? IORING_LINK : 0;
+    sqe->target = dev;
+    sqe->off = block * AIO_SECTORS;
+    sqe->len = AIO_SECTORS;
+    sqe->addr = buffers[i];
+    sqe->user_data = i;
+    if (!sock) return;
+
+    sqe = ioring_get_sqe(ring);
+    sqe->op = IORING_OP_SENDTO;
+    sqe->target = sock;
+    sqe->off = IP_LOOPBACK;
+    sqe->port = UDP_PORT_DISCARD;
+    sqe->len = AIO_SEND_SIZE;
+    sqe->addr = buffers[i];
+    sqe->user_data = i | SEND_BIT;
+}
+
+// Keep depth chains going until a timeout operation on the same ring says
+// the time is up, refilling everything that finished with one submit
+static void run(ioring_t* ring, blk_device_t* dev, udp_socket_t* sock, uint32_t depth,
+                uint32_t ms, result_t* r) {
+    ioring_sqe_t* sqe = ioring_get_sqe(ring);
+    sqe->op = IORING_OP_TIMEOUT;
+    sqe->len = ms;
+    sqe->user_data = END_TIMER;
+    for (uint32_t i = 0; i < depth; i++) queue(ring, dev, sock, i);
+    ioring_submit(ring);
+
+    bool ending = false;
+    while (ioring_inflight(ring) > 0) {
+        r->reaped += ioring_wait(ring, 1);
+        r->waits++;
+
+        ioring_cqe_t* cqe;
+        while ((cqe = ioring_peek_cqe(ring)) != NULL) {
+            uint64_t data = cqe->user_data;
+            int32_t result = cqe->result;
+            ioring_cqe_seen(ring);
+
+            if (data == END_TIMER) {
+                ending = true;
+                continue;
+            }
+            if (result == IORING_ERR_CANCELED) {
+                r->canceled++;
+            } else if (result < 0) {
+                r->errors++;
+            } else if (data & SEND_BIT) {
+                r->sends++;
+            } else {
+                r->reads++;
+            }
+
+            // The chain is done after its last operation
+            if (sock && !(data & SEND_BIT)) continue;
+            r->chains++;
+            if (!ending) queue(ring, dev, sock, data & ~SEND_BIT);
+        }
+        ioring_submit(ring);
+    }
+}
+
+static void CMD_aio(const char* args) {
+    char word[16];
+    bool send = false;
+    uint64_t numbers[2] = { AIO_DEFAULT_DEPTH, AIO_DEFAULT_MS };
+    int count = 0;
+    blk_device_t* dev = blk_get_device(0);
+
+    while ((args = str_next_word(args, word, sizeof(word))) != NULL) {
+        if (strcmp(word, "send") == 0) {
+            send = true;
+        } else if (blk_find_device(word)) {
+            dev = blk_find_device(word);
+        } else if (count == 2 || !str_to_uint(word, &numbers[count++])) {
+            print_str(AIO_USAGE);
+            return;
+        }
+    }
+    uint64_t depth = numbers[0];
+    uint64_t ms = numbers[1];
+    if (depth == 0 || depth > AIO_MAX_DEPTH || ms == 0 || ms > AIO_MAX_MS) {
+        print_str(AIO_USAGE);
+        return;
+    }
+    if (!dev) {
+        print_str("No disk found\n");
+        return;
+    }
+    if (dev->sectors < AIO_SECTORS) {
+        print_str("Disk too small\n");
+        return;
+    }
+
+    ioring_t* ring = ioring_create();
+    udp_socket_t* sock = send ? udp_socket() : NULL;
+    if (!ring || (send && !sock)) {
+        print_str(ring ? "No free UDP socket\n" : "No free ring\n");
+        if (ring) ioring_destroy(ring);
+        return;
+    }
+
+    result_t r;
+    memset(&r, 0, sizeof(r));
+    blk_reset_stats(dev);
+    uint64_t begin = rdtsc();
+    run(ring, dev, sock, depth, ms, &r);
+    uint64_t ns = tsc_to_ns(rdtsc() - begin);
+    const ioring_stats_t* s = &ring->stats;
+
+    print_str(dev->name);
+    print_str(send ? ": 4K random reads, each linked to a 1K UDP send to the discard "
+                     "service, "
+                   : ": 4K random reads, ");
+    print_number(depth);
+    print_str(send ? " chains in flight\n" : " in flight\n");
+    print_str("  ");
+    print_number(r.chains);
+    print_str(send ? " chains, " : " reads, ");
+    print_number(ns ? r.chains * 1000000000 / ns : 0);
+    print_str(send ? " chains/s, " : " IOPS, ");
+    print_number(ns ? r.reads * AIO_IO_SIZE * 1000 / ns : 0);
+    print_str(" MB/s read");
+    if (send) {
+        print_str(", ");
+        print_number(r.sends);
+        print_str(" sends");
+    }
+    print_str("\n  ");
+    print_number(s->submit_calls);
+    print_str(" submits of ");
+    print_number(s->submit_calls ? s->submitted / s->submit_calls : 0);
+    print_str(" ops, ");
+    print_number(r.waits);
+    print_str(" waits reaping ");
+    print_number(r.waits ? r.reaped / r.waits : 0);
+    print_str(", ");
+    print_number(s->kicks);
+    print_str(" kicks, ");
+    print_number(dev->stats.interrupts);
+    print_str(" interrupts, ");
+    print_number(s->busy);
+    print_str(" queue full, at most ");
+    print_number(s->max_inflight);
+    print_str(" in flight\n");
+    if (r.errors || r.canceled) {
+        print_str("  ");
+        print_number(r.errors);
+        print_str(" errors, ");
+        print_number(r.canceled);
+        print_str(" canceled\n");
+    }
+
+    if (sock) udp_close(sock);
+    ioring_destroy(ring);
+}
+
+static const command_t aio_command = {
+    .name = "aio",
+    .short_desc = "Drive a disk through an I/O ring",
+    .usage = "aio [device] [send] [depth] [ms]",
+    .long_desc = "Keeps depth random 4K reads (default 32, at most 63) going against a disk "
+                 "through one submission and completion ring for ms milliseconds (default "
+                 "1000), with one submit for everything that finished in between. With send "
+                 "each read is linked to a UDP send of the block to the local discard "
+                 "service, which only starts once the read succeeded. The end of the run is "
+                 "a timeout on the same ring. Reports throughput, operations per submit, "
+                 "results per wait, device kicks and interrupts.",
+    .examples = "aio\naio nvme 64\naio virtio send 16 2000",
+    .execute = CMD_aio
+};
+
+void CMD_init_aio() {
+    register_command(&aio_command);
+}
@@ -0,0 +1,164 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/block/bcache.h"
+#include "bcache.h"
+
+#define BCACHE_READ_MAX_COUNT  (1024 * 1024)
+
+// n out of total as a whole percentage
+static void print_percent(uint64_t n, uint64_t total) {
+    print_number(total ? n * 100 / total : 0);
+    print_str("%");
+}
+
+static void show(void) {
+    const bcache_stats_t* s = bcache_get_stats();
+    uint32_t resident, dirty, a1in, am, a1out;
+
+    bcache_counts(&resident, &dirty, &a1in, &am, &a1out);
+    print_str("Block cache: ");
+    print_number(bcache_size());
+    print_str(" blocks of ");
+    print_number(BCACHE_BLOCK_SIZE / 1024);
+    print_str("K (");
+    print_number((uint64_t)bcache_size() * BCACHE_BLOCK_SIZE / (1024 * 1024));
+    print_str(" MiB)\n");
+
+    print_str("  cached ");
+    print_number(resident);
+    print_str(", dirty ");
+    print_number(dirty);
+    print_str(", A1in ");
+    print_number(a1in);
+    print_str(", Am ");
+    print_number(am);
+    print_str(", A1out ");
+    print_number(a1out);
+    print_str("\n");
+
+    print_str("  lookups ");
+    print_number(s->lookups);
+    print_str(", hits ");
+    print_number(s->hits);
+    print_str(" (");
+    print_percent(s->hits, s->lookups);
+    print_str("), A1out hits ");
+    print_number(s->ghost_hits);
+    print_str(", evictions ");
+    print_number(s->evictions);
+    print_str("\n");
+
+    print_str("  read ");
+    print_number(s->reads);
+    print_str(" on demand, ");
+    print_number(s->ra_blocks);
+    print_str(" ahead: ");
+    print_number(s->ra_used);
+    print_str(" used (");
+    print_percent(s->ra_used, s->ra_blocks);
+    print_str("), ");
+    print_number(s->ra_wasted);
+    print_str(" evicted unused\n");
+
+    print_str("  written back ");
+    print_number(s->writebacks);
+    print_str(" in ");
+    print_number(s->write_ios);
+    print_str(" requests, avg ");
+    print_number(s->write_ios ? tsc_to_ns(s->wb_latency_sum / s->write_ios) / 1000 : 0);
+    print_str(" us, max ");
+    print_number(tsc_to_ns(s->wb_latency_max) / 1000);
+    print_str(" us\n");
+
+    print_str("  throttled ");
+    print_number(s->throttled);
+    print_str(" writes for ");
+    print_number(tsc_to_ns(s->throttle_cycles) / 1000000);
+    print_str(" ms, errors ");
+    print_number(s->errors);
+    print_str("\n");
+}
+
+// Read count blocks from first on through the cache and time it
+static void read_blocks(blk_device_t* dev, uint64_t first, uint64_t count) {
+    uint64_t start = rdtsc();
+    uint64_t done = 0;
+
+    for (; done < count; done++) {
+        bcache_buf_t* buf = bcache_read(dev, first + done);
+        if (!buf) break;
+        bcache_release(buf);
+    }
+    uint64_t us = tsc_to_ns(rdtsc() - start) / 1000;
+
+    print_number(done);
+    print_str(" blocks in ");
+    print_number(us / 1000);
+    print_str(" ms, ");
+    print_number(us ? done * BCACHE_BLOCK_SIZE / us : 0);
+    print_str(" MB/s\n");
+    if (done < count) {
+        print_str("Stopped at block ");
+        print_number(first + done);
+        print_str("\n");
+    }
+}
+
+static void CMD_bcache(const char* args) {
+    char word[16];
+
+    if (!bcache_size()) {
+        print_str("No block cache\n");
+        return;
+    }
+
+    const char* rest = str_next_word(args, word, sizeof(word));
+    if (!rest || strcmp(word, "stats") == 0) {
+        show();
+        return;
+    }
+    if (strcmp(word, "reset") == 0) {
+        bcache_reset_stats();
+        return;
+    }
+    if (strcmp(word, "sync") == 0) {
+        print_str(bcache_sync(NULL) ? "Synced\n" : "A write failed\n");
+        return;
+    }
+    if (strcmp(word, "read") == 0) {
+        uint64_t first, count;
+        blk_device_t* dev = NULL;
+        if ((rest = str_next_word(rest, word, sizeof(word))) != NULL) {
+            dev = blk_find_device(word);
+        }
+        if (!dev || !(rest = str_next_word(rest, word, sizeof(word))) ||
+            !str_to_uint(word, &first) || !str_next_word(rest, word, sizeof(word)) ||
+            !str_to_uint(word, &count) || count == 0 || count > BCACHE_READ_MAX_COUNT) {
+            print_str("Usage: bcache read <device> <first block> <count>\n");
+            return;
+        }
+        read_blocks(dev, first, count);
+        return;
+    }
+
+    print_str("Usage: bcache [stats | reset | sync | read <device> <first block> <count>]\n");
+}
+
+static const command_t bcache_command = {
+    .name = "bcache",
+    .short_desc = "Show block cache statistics",
+    .usage = "bcache [stats | reset | sync | read <device> <first block> <count>]",
+    .long_desc = "The block cache keeps 4K disk blocks in memory, sized at boot from what is free. "
+                 "stats shows what it holds, the hit rate, how much of the read-ahead was used, "
+                 "and how long write-back requests took and writers were throttled. sync writes "
+                 "back every dirty block. read reads blocks through the cache and reports the "
+                 "throughput, run it twice to see the cached speed.",
+    .examples = "bcache\nbcache read virtio 0 10000\nbcache reset\nbcache sync",
+    .execute = CMD_bcache
+};
+
+void CMD_init_bcache() {
+    register_command(&bcache_command);
+}
@@ -0,0 +1,288 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/random.h"
+#include "../../libs/interrupt.h"
+#include "../../libs/block/blkdev.h"
+#include "blkbench.h"
+
+#define BLKBENCH_DEFAULT_MS   500      // Per pattern and queue depth
+#define BLKBENCH_MAX_MS       60000
+#define BLKBENCH_IO_SIZE      4096
+#define BLKBENCH_SECTORS      (BLKBENCH_IO_SIZE / BLK_SECTOR_SIZE)
+#define BLKBENCH_STALL_MS     5000     // Give up when nothing completes for this long
+#define BLKBENCH_MAX_DEPTH    64
+
+// Latencies are counted in buckets of 8 per power of two, so a percentile
+// is off by at most an eighth
+#define LATENCY_SUB_BITS      3
+#define LATENCY_BUCKETS       ((64 - LATENCY_SUB_BITS + 1) << LATENCY_SUB_BITS)
+
+static uint8_t buffers[BLKBENCH_MAX_DEPTH][BLKBENCH_IO_SIZE] __attribute__((aligned(4096)));
+static blk_request_t requests[BLKBENCH_MAX_DEPTH];
+
+// Requests of a run, completed in the interrupt handler
+static struct {
+    uint64_t start[BLKBENCH_MAX_DEPTH];
+    volatile uint64_t idle;          // Requests not in flight
+    volatile uint64_t completed;
+    volatile uint64_t errors;
+    volatile uint64_t latency_sum;   // TSC cycles
+    volatile uint64_t latency_max;
+    volatile uint64_t last_completion;
+    uint32_t histogram[LATENCY_BUCKETS];
+} run;
+
+typedef struct {
+    uint64_t ios;
+    uint64_t errors;
+    uint64_t cycles;
+    uint64_t latency_avg;
+    uint64_t latency_p50;
+    uint64_t latency_p99;
+    uint64_t latency_p999;
+    uint64_t latency_max;
+} result_t;
+
+static int latency_bucket(uint64_t cycles) {
+    if (cycles < (1 << LATENCY_SUB_BITS)) return cycles;
+    int msb = 63 - __builtin_clzll(cycles);
+    int shift = msb - LATENCY_SUB_BITS;
+    return ((shift + 1) << LATENCY_SUB_BITS) + ((cycles >> shift) & ((1 << LATENCY_SUB_BITS) - 1));
+}
+
+// Largest latency that falls in a bucket
+static uint64_t bucket_limit(int bucket) {
+    if (bucket < (1 << LATENCY_SUB_BITS)) return bucket;
+    int shift = (bucket >> LATENCY_SUB_BITS) - 1;
+    uint64_t low = (uint64_t)((1 << LATENCY_SUB_BITS) + (bucket & ((1 << LATENCY_SUB_BITS) - 1))) << shift;
+    return low + (1ULL << shift) - 1;
+}
+
+// Latency that permille of the completed requests stayed within
+static uint64_t percentile(uint32_t permille) {
+    uint64_t wanted = (run.completed * permille + 999) / 1000;
+    uint64_t seen = 0;
+
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += run.histogram[i];
+        if (seen >= wanted && seen > 0) return bucket_limit(i);
+    }
+    return 0;
+}
+
+static void io_done(blk_request_t* req) {
+    int i = req - requests;
+    uint64_t now = rdtsc();
+    uint64_t latency = now - run.start[i];
+
+    if (req->ok) {
+        run.completed++;
+        run.latency_sum += latency;
+        if (latency > run.latency_max) run.latency_max = latency;
+        run.histogram[latency_bucket(latency)]++;
+    } else {
+        run.errors++;
+    }
+    run.last_completion = now;
+    run.idle |= 1ULL << i;
+}
+
+// Keep depth 4K requests in flight for ms milliseconds, sequential from
+// the start of the disk or at random aligned offsets. The requests refilled
+// in one go are started with one kick.
+static bool bench(blk_device_t* dev, bool write, bool sequential, uint32_t depth, uint32_t ms,
+                  result_t* result) {
+    uint64_t blocks = dev->sectors / BLKBENCH_SECTORS;
+    uint64_t all = depth == 64 ? ~0ULL : (1ULL << depth) - 1;
+    uint64_t next = 0;
+
+    memset(&run, 0, sizeof(run));
+    run.idle = all;
+
+    uint64_t begin = rdtsc();
+    uint64_t end = begin + ms * tsc_per_ms;
+    run.last_completion = begin;
+
+    while (1) {
+        uint64_t now = rdtsc();
+
+        bool submitted = false;
+        while (now < end && run.idle) {
+            uint64_t flags = irq_save();
+            int i = __builtin_ctzll(run.idle);
+            run.idle &= ~(1ULL << i);
+            irq_restore(flags);
+
+            uint64_t block;
+            if (sequential) {
+                block = next++ % blocks;
+            } else {
+                block = (((uint64_t)random_next() << 32) | random_next()) % blocks;
+            }
+
+            blk_request_t* req = &requests[i];
+            req->write = write;
+            req->lba = block * BLKBENCH_SECTORS;
+            req->count = BLKBENCH_SECTORS;
+            req->sg[0] = (blk_sg_t){ buffers[i], BLKBENCH_IO_SIZE };
+            req->sg_count = 1;
+            req->done = io_done;
+            run.start[i] = rdtsc();
+            if (!blk_submit(dev, req)) {
+                flags = irq_save();
+                run.idle |= 1ULL << i;
+                irq_restore(flags);
+                break;
+            }
+            submitted = true;
+        }
+        if (submitted) blk_kick(dev);
+
+        if (now >= end && run.idle == all) break;
+        if (rdtsc() > run.last_completion + BLKBENCH_STALL_MS * tsc_per_ms) return false;
+        blk_wait(dev);
+    }
+
+    result->ios = run.completed;
+    result->errors = run.errors;
+    result->cycles = rdtsc() - begin;
+    result->latency_avg = run.completed ? run.latency_sum / run.completed : 0;
+    result->latency_p50 = percentile(500);
+    result->latency_p99 = percentile(990);
+    result->latency_p999 = percentile(999);
+    result->latency_max = run.latency_max;
+    return true;
+}
+
+// Right align a number in a column
+static void print_column(uint64_t value, int width) {
+    int digits = 1;
+    for (uint64_t v = value; v >= 10; v /= 10) digits++;
+    for (int i = digits; i < width; i++) print_char(' ');
+    print_number(value);
+}
+
+static void print_device(blk_device_t* dev) {
+    print_str(dev->name);
+    print_str(": ");
+    print_str(dev->model);
+    print_str(", ");
+    print_number(dev->sectors * BLK_SECTOR_SIZE / (1024 * 1024));
+    print_str(" MiB, ");
+    print_number(dev->queues);
+    print_str(dev->queues == 1 ? " queue, " : " queues, ");
+    if (dev->features[0]) {
+        print_str(dev->features);
+        print_str(", ");
+    }
+    print_str(dev->msi ? "MSI" : "no MSI");
+    print_str("\n");
+}
+
+static void print_us(uint64_t cycles) {
+    print_column(tsc_to_ns(cycles) / 1000, 7);
+}
+
+static void CMD_blkbench(const char* args) {
+    char word[16];
+    bool write = false;
+    bool poll = false;
+    uint64_t ms = BLKBENCH_DEFAULT_MS;
+    blk_device_t* dev = blk_get_device(0);
+
+    if (!dev) {
+        print_str("No disk found\n");
+        return;
+    }
+
+    while ((args = str_next_word(args, word, sizeof(word))) != NULL) {
+        if (strcmp(word, "read") == 0) {
+            write = false;
+        } else if (strcmp(word, "write") == 0) {
+            write = true;
+        } else if (strcmp(word, "poll") == 0) {
+            poll = true;
+        } else if (blk_find_device(word)) {
+            dev = blk_find_device(word);
+        } else if (!str_to_uint(word, &ms) || ms == 0 || ms > BLKBENCH_MAX_MS) {
+            print_str("Usage: blkbench [device] [read|write] [poll] [ms]\n");
+            return;
+        }
+    }
+    if (dev->sectors < BLKBENCH_SECTORS) {
+        print_str("Disk too small\n");
+        return;
+    }
+    if (write && dev->read_only) {
+        print_str("Disk is read only\n");
+        return;
+    }
+
+    bool was_polled = dev->polled;
+    if (!blk_set_polled(dev, poll)) {
+        print_str(poll ? "The disk can't be polled\n" : "The disk can only be polled\n");
+        return;
+    }
+
+    uint32_t max_depth = dev->queue_depth < BLKBENCH_MAX_DEPTH ? dev->queue_depth : BLKBENCH_MAX_DEPTH;
+    print_device(dev);
+    print_str(write ? "4K writes, " : "4K reads, ");
+    print_str(dev->polled ? "polled" : "interrupts");
+    print_str(", latency in us\n");
+    print_str("  pattern  depth     IOPS    avg    p50    p99  p99.9    max  kicks   irqs\n");
+
+    for (int pattern = 0; pattern < 2; pattern++) {
+        bool sequential = pattern == 0;
+        for (uint32_t step = 1; ; step *= 2) {
+            uint32_t depth = step < max_depth ? step : max_depth;
+            result_t r;
+            blk_reset_stats(dev);
+            if (!bench(dev, write, sequential, depth, ms, &r)) {
+                print_str("The disk stopped completing requests\n");
+                blk_set_polled(dev, was_polled);
+                return;
+            }
+            uint64_t ns = tsc_to_ns(r.cycles);
+
+            print_str(sequential ? "  seq    " : "  rand   ");
+            print_column(depth, 6);
+            print_column(ns ? r.ios * 1000000000 / ns : 0, 9);
+            print_us(r.latency_avg);
+            print_us(r.latency_p50);
+            print_us(r.latency_p99);
+            print_us(r.latency_p999);
+            print_us(r.latency_max);
+            print_column(dev->stats.kicks, 7);
+            print_column(dev->stats.interrupts, 7);
+            if (r.errors) {
+                print_str("  ");
+                print_number(r.errors);
+                print_str(" errors");
+            }
+            print_str("\n");
+            if (depth == max_depth) break;
+        }
+    }
+    blk_set_polled(dev, was_polled);
+}
+
+static const command_t blkbench_command = {
+    .name = "blkbench",
+    .short_desc = "Measure disk IOPS and latency",
+    .usage = "blkbench [device] [read|write] [poll] [ms]",
+    .long_desc = "Runs 4K requests against a disk (ahci, virtio or nvme, default the first one "
+                 "found), first sequential then at random offsets, at queue depths 1, 2, 4 and on "
+                 "up to what the disk takes (32 with NCQ, 64 for virtio and nvme), each for ms "
+                 "milliseconds (default 500). Reports IOPS, the average, median, 99th and 99.9th "
+                 "percentile and worst completion latency, and the doorbell kicks and interrupts "
+                 "the run took. poll takes completions by spinning instead of interrupts, where "
+                 "the disk allows it (nvme). write overwrites data on the disk.",
+    .examples = "blkbench\nblkbench virtio read 2000\nblkbench nvme poll\nblkbench ahci write",
+    .execute = CMD_blkbench
+};
+
+void CMD_init_blkbench() {
+    register_command(&blkbench_command);
+}
@@ -0,0 +1,288 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/net/bpf.h"
+#include "bpf.h"
+
+#define BPF_BENCH_DEFAULT_COUNT  100000
+#define BPF_BENCH_MAX_COUNT      10000000
+
+// Program being put together by add, a command line only holds a few
+// instructions
+static bpf_insn_t staged[BPF_MAXINSNS];
+static uint32_t staged_len = 0;
+
+// 64 byte TCP SYN to port 80 the benchmark runs the filters over
+static const uint8_t sample_frame[] = {
+    0x52, 0x54, 0x00, 0x12, 0x34, 0x56, 0x52, 0x54, 0x00, 0xab, 0xcd, 0xef, 0x08, 0x00,
+    0x45, 0x00, 0x00, 0x2c, 0x12, 0x34, 0x40, 0x00, 0x40, 0x06, 0x00, 0x00,
+    0x0a, 0x00, 0x02, 0x02, 0x0a, 0x00, 0x02, 0x0f,
+    0xc0, 0x01, 0x00, 0x50, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00, 0x00, 0x00,
+    0x60, 0x02, 0xff, 0xff, 0x00, 0x00, 0x00, 0x00, 0x02, 0x04, 0x05, 0xb4,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// Right align a number in a column
+static void print_column(uint64_t value, int width) {
+    int digits = 1;
+    for (uint64_t v = value; v >= 10; v /= 10) digits++;
+    for (int i = digits; i < width; i++) print_char(' ');
+    print_number(value);
+}
+
+// One instruction as 16 hex digits: code (4), jt (2), jf (2), k (8)
+static bool parse_insn(const char* word, bpf_insn_t* insn) {
+    uint64_t value = 0;
+
+    if (strlen(word) != 16) return false;
+    for (int i = 0; i < 16; i++) {
+        char c = word[i];
+        uint8_t digit;
+        if (c >= '0' && c <= '9') {
+            digit = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            digit = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            digit = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        value = (value << 4) | digit;
+    }
+
+    insn->code = value >> 48;
+    insn->jt = value >> 40;
+    insn->jf = value >> 32;
+    insn->k = (uint32_t)value;
+    return true;
+}
+
+// Append the instructions in args to the staged program. Stops at the
+// first word that isn't one and returns the rest, NULL on a bad word.
+static const char* stage(const char* args, bool* interp) {
+    char word[24];
+    const char* next;
+
+    *interp = false;
+    while ((next = str_next_word(args, word, sizeof(word))) != NULL) {
+        if (strcmp(word, "interp") == 0) {
+            *interp = true;
+        } else {
+            if (staged_len == BPF_MAXINSNS) {
+                print_str("Programs have at most 256 instructions\n");
+                return NULL;
+            }
+            if (!parse_insn(word, &staged[staged_len])) {
+                print_str("Bad instruction ");
+                print_str(word);
+                print_str(", expected 16 hex digits CCCCJTJFKKKKKKKK\n");
+                return NULL;
+            }
+            staged_len++;
+        }
+        args = next;
+    }
+    return args;
+}
+
+static void attach(bool interp) {
+    const char* error;
+    int id = bpf_attach(staged, staged_len, !interp, &error);
+    uint32_t len = staged_len;
+    staged_len = 0;
+
+    if (id < 0) {
+        print_str("Rejected: ");
+        print_str(error);
+        print_str("\n");
+        return;
+    }
+    const bpf_filter_t* f = bpf_get_filter(id);
+    print_str("Attached filter ");
+    print_number(id);
+    print_str(", ");
+    print_number(len);
+    print_str(" instructions");
+    if (!f->jit) print_str(", too long to compile");
+    print_str(f->use_jit ? ", jit\n" : ", interpreted\n");
+}
+
+static void list(void) {
+    bool any = false;
+
+    for (int id = 0; id < BPF_MAX_FILTERS; id++) {
+        const bpf_filter_t* f = bpf_get_filter(id);
+        if (!f) continue;
+        if (!any) {
+            print_str("  id  mode    insns    packets    dropped  interp cyc/pkt  jit cyc/pkt\n");
+            any = true;
+        }
+        print_column(id, 4);
+        print_str(f->use_jit ? "  jit   " : "  interp");
+        print_column(f->len, 7);
+        print_column(f->packets, 11);
+        print_column(f->dropped, 11);
+        print_column(f->interp_runs ? f->interp_cycles / f->interp_runs : 0, 16);
+        print_column(f->jit_runs ? f->jit_cycles / f->jit_runs : 0, 13);
+        print_str("\n");
+    }
+    if (!any) print_str("No filters attached\n");
+    if (staged_len) {
+        print_number(staged_len);
+        print_str(" instructions staged\n");
+    }
+}
+
+// Run one filter over the sample frame count times with each of the two
+// engines and compare the cycles per packet
+static void bench(const char* args) {
+    char word[24];
+    uint64_t id;
+    uint64_t count = BPF_BENCH_DEFAULT_COUNT;
+
+    if (!(args = str_next_word(args, word, sizeof(word))) || !str_to_uint(word, &id) ||
+        !bpf_get_filter(id)) {
+        print_str("No such filter\n");
+        return;
+    }
+    if (str_next_word(args, word, sizeof(word)) &&
+        (!str_to_uint(word, &count) || count == 0 || count > BPF_BENCH_MAX_COUNT)) {
+        print_str("Count must be 1-10000000\n");
+        return;
+    }
+
+    const bpf_filter_t* f = bpf_get_filter(id);
+    volatile uint32_t result = 0;
+
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < count; i++) {
+        result = bpf_run(f->insns, sample_frame, sizeof(sample_frame));
+    }
+    uint64_t interp = (rdtsc() - start) / count;
+
+    print_str("interp  ");
+    print_column(interp, 8);
+    print_str(" cycles/pkt, returns ");
+    print_number(result);
+    print_str("\n");
+
+    if (!f->jit) {
+        print_str("Not compiled, too long\n");
+        return;
+    }
+
+    start = rdtsc();
+    for (uint64_t i = 0; i < count; i++) {
+        result = f->jit(sample_frame, sizeof(sample_frame));
+    }
+    uint64_t jit = (rdtsc() - start) / count;
+
+    print_str("jit     ");
+    print_column(jit, 8);
+    print_str(" cycles/pkt, returns ");
+    print_number(result);
+    print_str("\n");
+    if (jit) {
+        print_str("speedup ");
+        print_number(interp / jit);
+        print_char('.');
+        print_number(interp * 10 / jit % 10);
+        print_str("x\n");
+    }
+}
+
+static void CMD_bpf(const char* args) {
+    char word[16];
+    bool interp;
+    uint64_t id;
+
+    const char* rest = str_next_word(args, word, sizeof(word));
+    if (!rest || strcmp(word, "list") == 0) {
+        list();
+        return;
+    }
+
+    if (strcmp(word, "load") == 0) {
+        staged_len = 0;
+        if (!stage(rest, &interp)) {
+            staged_len = 0;
+            return;
+        }
+        attach(interp);
+        return;
+    }
+    if (strcmp(word, "add") == 0) {
+        if (stage(rest, &interp)) {
+            print_number(staged_len);
+            print_str(" instructions staged\n");
+        }
+        return;
+    }
+    if (strcmp(word, "attach") == 0) {
+        stage(rest, &interp);
+        attach(interp);
+        return;
+    }
+    if (strcmp(word, "clear") == 0) {
+        staged_len = 0;
+        return;
+    }
+    if (strcmp(word, "reset") == 0) {
+        bpf_reset_stats();
+        return;
+    }
+    if (strcmp(word, "bench") == 0) {
+        bench(rest);
+        return;
+    }
+
+    if (strcmp(word, "del") == 0) {
+        if (!str_next_word(rest, word, sizeof(word)) || !str_to_uint(word, &id) || !bpf_detach(id)) {
+            print_str("No such filter\n");
+        }
+        return;
+    }
+    if (strcmp(word, "mode") == 0) {
+        rest = str_next_word(rest, word, sizeof(word));
+        if (!rest || !str_to_uint(word, &id) || !bpf_get_filter(id)) {
+            print_str("No such filter\n");
+            return;
+        }
+        if (str_next_word(rest, word, sizeof(word))) {
+            if (strcmp(word, "interp") == 0) {
+                bpf_set_jit(id, false);
+                return;
+            }
+            if (strcmp(word, "jit") == 0) {
+                if (!bpf_set_jit(id, true)) print_str("Not compiled, too long\n");
+                return;
+            }
+        }
+    }
+    print_str("Usage: bpf [list | load <insn>... [interp] | add <insn>... | attach [interp] | clear |\n"
+              "            del <id> | mode <id> jit|interp | bench <id> [count] | reset]\n");
+}
+
+static const command_t bpf_command = {
+    .name = "bpf",
+    .short_desc = "Attach classic BPF packet filters",
+    .usage = "bpf [list | load <insn>... [interp] | add <insn>... | attach [interp] | clear | "
+             "del <id> | mode <id> jit|interp | bench <id> [count] | reset]",
+    .long_desc = "Filters run on every received frame before it goes up the stack, and one "
+                 "returning 0 drops it. An instruction is 16 hex digits: the opcode (4), jt (2), "
+                 "jf (2) and k (8), as printed by tcpdump -dd. load verifies, compiles to x86-64 and "
+                 "attaches a program, with interp it runs in the interpreter instead. Longer programs "
+                 "are staged with add over several lines and attached with attach. list shows the "
+                 "frames every filter saw and dropped and the cycles per packet of both engines, "
+                 "mode switches a filter between them. bench runs a filter over a sample TCP SYN "
+                 "with each engine and compares them.",
+    .examples = "bpf load 002800000000000c 0015000300000800 0030000000000017 0015000100000001 "
+                "0006000000000000 000600000000ffff\n"
+                "bpf list\nbpf bench 0 1000000\nbpf mode 0 interp\nbpf del 0",
+    .execute = CMD_bpf
+};
+
+void CMD_init_bpf() {
+    register_command(&bpf_command);
+}
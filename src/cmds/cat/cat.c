@@ -0,0 +1,62 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/fs/vfs.h"
+#include "cat.h"
+
+// Reads this large go straight from the disk on mounted file systems
+#define CAT_CHUNK  (64 * 1024)
+
+static uint8_t buffer[CAT_CHUNK];
+
+static void cat(const char* path) {
+    vfs_dentry_t* d;
+    vfs_error_t error = vfs_lookup(path, &d);
+    if (error == VFS_OK && d->inode->type == VFS_DIR) error = VFS_ERR_IS_DIR;
+    if (error != VFS_OK) {
+        print_str(path);
+        print_str(": ");
+        print_str(vfs_error_string(error));
+        print_str("\n");
+        return;
+    }
+
+    uint64_t offset = 0;
+    uint64_t n;
+    char last = '\n';
+    while ((n = vfs_read(d->inode, offset, buffer, sizeof(buffer))) > 0) {
+        for (uint64_t i = 0; i < n; i++) {
+            print_char(buffer[i]);
+        }
+        last = buffer[n - 1];
+        offset += n;
+    }
+    if (last != '\n') print_str("\n");
+}
+
+static void CMD_cat(const char* args) {
+    char path[VFS_PATH_MAX];
+    const char* rest = args;
+
+    if (!str_next_word(rest, path, sizeof(path))) {
+        print_str("Usage: cat <path>...\n");
+        return;
+    }
+    while ((rest = str_next_word(rest, path, sizeof(path))) != NULL) {
+        cat(path);
+    }
+}
+
+static const command_t cat_command = {
+    .name = "cat",
+    .short_desc = "Print files",
+    .usage = "cat <path>...",
+    .long_desc = "Prints the contents of files one after the other. Parts of a file that "
+                 "were never written read as zeros.",
+    .examples = "cat /notes\ncat /a /b\ncat /mnt/README",
+    .execute = CMD_cat
+};
+
+void CMD_init_cat() {
+    register_command(&cat_command);
+}
@@ -13,6 +13,26 @@
 #include "hardtest/hardtest.h"
 #include "keytest/keytest.h"
 #include "clear/clear.h"
+#include "netpoll/netpoll.h"
+#include "ping/ping.h"
+#include "netstat/netstat.h"
+#include "netbench/netbench.h"
+#include "route/route.h"
+#include "offload/offload.h"
+#include "bpf/bpf.h"
+#include "blkbench/blkbench.h"
+#include "bcache/bcache.h"
+#include "initramfs/initramfs.h"
+#include "ls/ls.h"
+#include "cat/cat.h"
+#include "write/write.h"
+#include "rm/rm.h"
+#include "mkdir/mkdir.h"
+#include "fsstat/fsstat.h"
+#include "hexdump/hexdump.h"
+#include "mount/mount.h"
+#include "aio/aio.h"
+#include "lz4bench/lz4bench.h"
 
 static command_t command_registry[MAX_COMMANDS];
 static int command_count = 0;
@@ -28,7 +48,27 @@ static void (*command_init_functions[])() = {
     CMD_init_fortune,
     CMD_init_hardtest,
     CMD_init_keytest,
-    CMD_init_clear
+    CMD_init_clear,
+    CMD_init_netpoll,
+    CMD_init_ping,
+    CMD_init_netstat,
+    CMD_init_netbench,
+    CMD_init_route,
+    CMD_init_offload,
+    CMD_init_bpf,
+    CMD_init_blkbench,
+    CMD_init_bcache,
+    CMD_init_initramfs,
+    CMD_init_ls,
+    CMD_init_cat,
+    CMD_init_write,
+    CMD_init_rm,
+    CMD_init_mkdir,
+    CMD_init_fsstat,
+    CMD_init_hexdump,
+    CMD_init_mount,
+    CMD_init_aio,
+    CMD_init_lz4bench
 };
 
 void register_command(const command_t* cmd) {
@@ -0,0 +1,239 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/memory.h"
+#include "../../libs/fs/vfs.h"
+#include "../../libs/fs/tmpfs.h"
+#include "../../libs/fs/ext2.h"
+#include "../../libs/fs/pcache.h"
+#include "fsstat.h"
+
+#define FSSTAT_CHUNK  (64 * 1024)       // Per read of fsstat read
+#define FSSTAT_USAGE  "Usage: fsstat [reset | read <path>]\n"
+
+static uint8_t buffer[FSSTAT_CHUNK];
+
+// n out of total as a whole percentage
+static void print_percent(uint64_t n, uint64_t total) {
+    print_number(total ? n * 100 / total : 0);
+    print_str("%");
+}
+
+// n / d with one decimal
+static void print_ratio(uint64_t n, uint64_t d) {
+    uint64_t tenths = d ? n * 10 / d : 0;
+    print_number(tenths / 10);
+    print_str(".");
+    print_number(tenths % 10);
+}
+
+static void show(void) {
+    const vfs_stats_t* s = vfs_get_stats();
+    const tmpfs_stats_t* t = tmpfs_get_stats();
+    uint32_t inodes, dentries;
+
+    vfs_counts(&inodes, &dentries);
+    print_str("inodes ");
+    print_number(inodes);
+    print_str(" of ");
+    print_number(VFS_MAX_INODES);
+    print_str(", dentries ");
+    print_number(dentries);
+    print_str(" of ");
+    print_number(VFS_MAX_DENTRIES);
+    print_str("\n");
+
+    print_str("tmpfs: ");
+    print_number((uint64_t)t->pages * PAGE_SIZE / 1024);
+    print_str(" KiB in ");
+    print_number(t->pages);
+    print_str(" pages, ");
+    print_number(t->nodes);
+    print_str(" tree nodes, ");
+    print_number(t->free_pages);
+    print_str(" pages free\n");
+    print_str("  page lookups ");
+    print_number(t->page_lookups);
+    print_str(", holes ");
+    print_number(t->holes);
+    print_str("\n");
+
+    print_str("path lookups ");
+    print_number(s->lookups);
+    print_str(", path cache hits ");
+    print_number(s->cache_hits);
+    print_str(" (");
+    print_percent(s->cache_hits, s->lookups);
+    print_str("), invalidated ");
+    print_number(s->invalidations);
+    print_str(" times\n");
+
+    print_str("  hit avg ");
+    print_number(s->cache_hits ? tsc_to_ns(s->hit_cycles / s->cache_hits) : 0);
+    print_str(" ns, walk avg ");
+    print_number(s->walks ? tsc_to_ns(s->walk_cycles / s->walks) : 0);
+    print_str(" ns, ");
+    print_ratio(s->components, s->walks);
+    print_str(" components per walk, ");
+    print_ratio(s->probes, s->components);
+    print_str(" dentries compared per component\n");
+    print_str("  names asked of disk file systems ");
+    print_number(s->fs_lookups);
+    print_str(", cached dentries dropped ");
+    print_number(s->evictions);
+    print_str("\n");
+
+    if (pcache_size()) {
+        const pcache_stats_t* c = pcache_get_stats();
+        uint32_t resident, held;
+        pcache_counts(&resident, &held);
+        print_str("page cache: ");
+        print_number(resident);
+        print_str(" of ");
+        print_number(pcache_size());
+        print_str(" pages, ");
+        print_number(held);
+        print_str(" held\n  lookups ");
+        print_number(c->lookups);
+        print_str(", hits ");
+        print_number(c->hits);
+        print_str(" (");
+        print_percent(c->hits, c->lookups);
+        print_str("), filled ");
+        print_number(c->fills);
+        print_str(" avg ");
+        print_number(c->fills ? tsc_to_ns(c->fill_cycles / c->fills) : 0);
+        print_str(" ns, ");
+        print_number(c->direct_pages);
+        print_str(" from long reads\n  evicted ");
+        print_number(c->evictions);
+        print_str(", invalidated ");
+        print_number(c->invalidated);
+        print_str(", reads around the cache ");
+        print_number(c->bypassed);
+        print_str(", errors ");
+        print_number(c->errors);
+        print_str("\n");
+    }
+
+    blk_device_t* dev;
+    const char* path;
+    uint32_t block_size;
+    uint64_t blocks;
+    if (!ext2_get_mount(0, &dev, &path, &block_size, &blocks)) return;
+
+    // Read amplification: what the disks read against what readers got
+    const ext2_stats_t* e = ext2_get_stats();
+    uint64_t device = ext2_device_bytes();
+    print_str("ext2: ");
+    print_number(e->bytes / 1024);
+    print_str(" KiB read, disks read ");
+    print_number(device / 1024);
+    print_str(" KiB (");
+    print_ratio(device, e->bytes);
+    print_str("x)\n");
+    print_str("  file blocks ");
+    print_number(e->direct_blocks);
+    print_str(" direct in ");
+    print_number(e->direct_reads);
+    print_str(" reads, ");
+    print_number(e->cached_blocks);
+    print_str(" cached, ");
+    print_number(e->hole_blocks);
+    print_str(" holes, ");
+    print_number(e->meta_blocks);
+    print_str(" metadata blocks\n");
+    print_str("  extent cache hits ");
+    print_number(e->extent_hits);
+    print_str(" (");
+    print_percent(e->extent_hits, e->extent_hits + e->extent_misses);
+    print_str("), block map walks ");
+    print_number(e->extent_misses);
+    print_str(", directory lookups ");
+    print_number(e->dir_lookups);
+    print_str(" scanning ");
+    print_ratio(e->dir_blocks, e->dir_lookups);
+    print_str(" blocks each, errors ");
+    print_number(e->errors);
+    print_str("\n");
+}
+
+// Read a whole file and say how fast, and how much the disks read for it
+static void read_file(const char* path) {
+    vfs_dentry_t* d;
+    vfs_error_t error = vfs_lookup(path, &d);
+    if (error == VFS_OK && d->inode->type == VFS_DIR) error = VFS_ERR_IS_DIR;
+    if (error != VFS_OK) {
+        print_str(path);
+        print_str(": ");
+        print_str(vfs_error_string(error));
+        print_str("\n");
+        return;
+    }
+
+    uint64_t device = ext2_device_bytes();
+    uint64_t begin = rdtsc();
+    uint64_t offset = 0;
+    uint64_t n;
+    while ((n = vfs_read(d->inode, offset, buffer, sizeof(buffer))) > 0) {
+        offset += n;
+    }
+    uint64_t ns = tsc_to_ns(rdtsc() - begin);
+    device = ext2_device_bytes() - device;
+
+    print_number(offset / 1024);
+    print_str(" KiB in ");
+    print_number(ns / 1000);
+    print_str(" us, ");
+    print_number(ns ? offset * 1000 / ns : 0);
+    print_str(" MB/s, disks read ");
+    print_number(device / 1024);
+    print_str(" KiB (");
+    print_ratio(device, offset);
+    print_str("x)\n");
+    if (offset < d->inode->size) {
+        print_str("Stopped short of ");
+        print_number(d->inode->size);
+        print_str(" bytes, the disk failed\n");
+    }
+}
+
+static void CMD_fsstat(const char* args) {
+    char word[16];
+    char path[VFS_PATH_MAX];
+
+    const char* rest = str_next_word(args, word, sizeof(word));
+    if (!rest) {
+        show();
+    } else if (strcmp(word, "reset") == 0) {
+        vfs_reset_stats();
+        pcache_reset_stats();
+        ext2_reset_stats();
+    } else if (strcmp(word, "read") == 0 && str_next_word(rest, path, sizeof(path))) {
+        read_file(path);
+    } else {
+        print_str(FSSTAT_USAGE);
+    }
+}
+
+static const command_t fsstat_command = {
+    .name = "fsstat",
+    .short_desc = "Show file system statistics",
+    .usage = "fsstat [reset | read <path>]",
+    .long_desc = "Shows how many inodes and dentries are in use, the memory the RAM file system "
+                 "holds, and what path lookups cost. Paths resolved before are answered from "
+                 "the path cache; the rest are walked one dentry hash lookup per component. "
+                 "Removing anything empties the path cache. With a disk mounted it also shows "
+                 "how the page cache in front of it did and how the disk file system read: "
+                 "bytes handed out against bytes the disks read, file blocks read around the "
+                 "block cache or through it, and how often the per-file extent cache spared a "
+                 "block map walk. reset clears the counters. read reads a whole file and "
+                 "reports throughput and how much the disks read for it.",
+    .examples = "fsstat\nfsstat reset\nfsstat read /mnt/big",
+    .execute = CMD_fsstat
+};
+
+void CMD_init_fsstat() {
+    register_command(&fsstat_command);
+}
@@ -0,0 +1,3 @@
+#pragma once
+
+void CMD_init_fsstat();
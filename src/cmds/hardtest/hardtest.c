@@ -1,4 +1,5 @@
 #include "../../libs/pci.h"
+#include "../../libs/virtio.h"
 #include "../../libs/print.h"
 #include "hardtest.h"
 #include "../command_registry.h"
@@ -11,6 +12,19 @@ void CMD_hardtest() {
     } else {
         print_str("[-] The intel e1000 is not present.\n");
     }
+
+    if (pci_find_device(E1000_VENDOR_ID, E1000E_DEVICE_ID, &device)) {
+        print_str("[+] The intel e1000e is present.\n");
+    } else {
+        print_str("[-] The intel e1000e is not present.\n");
+    }
+
+    if (pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_DEVICE_ID, &device) ||
+        pci_find_device(VIRTIO_VENDOR_ID, VIRTIO_NET_TRANSITIONAL_ID, &device)) {
+        print_str("[+] A virtio-net card is present.\n");
+    } else {
+        print_str("[-] No virtio-net card is present.\n");
+    }
 }
 
 command_t CMD_hardtest_command = {
@@ -3,5 +3,8 @@
 // Define hardware info
 #define E1000_VENDOR_ID 0x8086  // Intel
 #define E1000_DEVICE_ID 0x100E  // 82540EM Gigabit Ethernet Controller
+#define E1000E_DEVICE_ID 0x10D3 // 82574L Gigabit Network Connection
+#define VIRTIO_NET_DEVICE_ID 0x1041        // Modern virtio-net
+#define VIRTIO_NET_TRANSITIONAL_ID 0x1000  // Transitional virtio-net
 
 void CMD_init_hardtest();
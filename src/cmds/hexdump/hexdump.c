@@ -0,0 +1,88 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/fs/vfs.h"
+#include "hexdump.h"
+
+#define HEXDUMP_CHUNK  (64 * 1024)     // Reads this large go straight from the disk
+#define HEXDUMP_USAGE  "Usage: hexdump <path> [offset] [length]\n"
+
+static uint8_t buffer[HEXDUMP_CHUNK];
+
+// One line: the offset, up to 16 bytes in hex and the printable ones
+static void print_line(uint64_t offset, const uint8_t* bytes, uint64_t n) {
+    for (int shift = offset >> 32 ? 56 : 24; shift >= 0; shift -= 8) print_hex(offset >> shift);
+    print_str(" ");
+    for (uint64_t i = 0; i < 16; i++) {
+        if (i == 8) print_char(' ');
+        print_char(' ');
+        if (i < n) {
+            print_hex(bytes[i]);
+        } else {
+            print_str("  ");
+        }
+    }
+    print_str("  |");
+    for (uint64_t i = 0; i < n; i++) {
+        print_char(bytes[i] >= 0x20 && bytes[i] < 0x7F ? bytes[i] : '.');
+    }
+    print_str("|\n");
+}
+
+static void CMD_hexdump(const char* args) {
+    char path[VFS_PATH_MAX];
+    char word[24];
+    uint64_t offset = 0;
+    uint64_t length = UINT64_MAX;
+
+    const char* rest = str_next_word(args, path, sizeof(path));
+    if (!rest) {
+        print_str(HEXDUMP_USAGE);
+        return;
+    }
+    if ((rest = str_next_word(rest, word, sizeof(word))) != NULL) {
+        if (!str_to_uint(word, &offset) ||
+            ((rest = str_next_word(rest, word, sizeof(word))) && !str_to_uint(word, &length))) {
+            print_str(HEXDUMP_USAGE);
+            return;
+        }
+    }
+
+    vfs_dentry_t* d;
+    vfs_error_t error = vfs_lookup(path, &d);
+    if (error == VFS_OK && d->inode->type == VFS_DIR) error = VFS_ERR_IS_DIR;
+    if (error != VFS_OK) {
+        print_str(path);
+        print_str(": ");
+        print_str(vfs_error_string(error));
+        print_str("\n");
+        return;
+    }
+
+    // Lines stay on 16 byte boundaries of the chunk, not of the file
+    while (length > 0) {
+        uint64_t want = length < HEXDUMP_CHUNK ? length : HEXDUMP_CHUNK;
+        uint64_t n = vfs_read(d->inode, offset, buffer, want);
+        for (uint64_t i = 0; i < n; i += 16) {
+            print_line(offset + i, buffer + i, n - i < 16 ? n - i : 16);
+        }
+        if (n < want) break;
+        offset += n;
+        length -= n;
+    }
+}
+
+static const command_t hexdump_command = {
+    .name = "hexdump",
+    .short_desc = "Print a file in hex",
+    .usage = "hexdump <path> [offset] [length]",
+    .long_desc = "Prints a file 16 bytes to a line, as hex and as text, starting at a byte "
+                 "offset and stopping after length bytes or at the end of the file. Offsets "
+                 "on the left are in hex.",
+    .examples = "hexdump /notes\nhexdump /mnt/kernel.bin 4096 256",
+    .execute = CMD_hexdump
+};
+
+void CMD_init_hexdump() {
+    register_command(&hexdump_command);
+}
@@ -0,0 +1,112 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/fs/initramfs.h"
+#include "initramfs.h"
+
+// Right align a number in a column
+static void print_column(uint64_t value, int width) {
+    int digits = 1;
+    for (uint64_t v = value; v >= 10; v /= 10) digits++;
+    for (int i = digits; i < width; i++) print_char(' ');
+    print_number(value);
+}
+
+static void list(void) {
+    initramfs_file_t file;
+
+    for (uint32_t i = 0; initramfs_get(i, &file); i++) {
+        bool dir = (file.mode & INITRAMFS_S_IFMT) == INITRAMFS_S_IFDIR;
+        print_str(dir ? "  d" : "  -");
+        print_column(file.size, 9);
+        print_str("  /");
+        print_str(file.path);
+        print_str("\n");
+    }
+}
+
+static void cat(const char* path) {
+    initramfs_file_t file;
+
+    if (!initramfs_find(path, &file)) {
+        print_str("No such file\n");
+        return;
+    }
+    if ((file.mode & INITRAMFS_S_IFMT) != INITRAMFS_S_IFREG) {
+        print_str("Not a file\n");
+        return;
+    }
+    for (uint32_t i = 0; i < file.size; i++) {
+        print_char(file.data[i]);
+    }
+    if (file.size && file.data[file.size - 1] != '\n') print_str("\n");
+}
+
+static void stats(void) {
+    const initramfs_stats_t* s = initramfs_get_stats();
+
+    print_number(initramfs_size());
+    print_str(" bytes, ");
+    print_number(initramfs_count());
+    print_str(" entries, indexed in ");
+    print_number(tsc_to_ns(s->index_cycles) / 1000);
+    print_str(" us\n");
+    if (s->packed_size) {
+        uint64_t ns = tsc_to_ns(s->unpack_cycles);
+        print_str("LZ4, ");
+        print_number(s->packed_size);
+        print_str(" bytes packed, unpacked in ");
+        print_number(ns / 1000);
+        print_str(" us");
+        if (ns) {
+            print_str(", ");
+            print_number(s->unpacked * 1000 / ns);
+            print_str(" MB/s");
+        }
+        print_str("\n");
+    }
+    print_number(s->lookups);
+    print_str(" lookups, ");
+    print_number(s->probes);
+    print_str(" entries compared\n");
+}
+
+static void CMD_initramfs(const char* args) {
+    char word[16];
+    char path[128];
+
+    if (!initramfs_present()) {
+        print_str("No initramfs was loaded\n");
+        return;
+    }
+
+    const char* rest = str_next_word(args, word, sizeof(word));
+    if (!rest || strcmp(word, "ls") == 0) {
+        list();
+    } else if (strcmp(word, "cat") == 0 && str_next_word(rest, path, sizeof(path))) {
+        cat(path);
+    } else if (strcmp(word, "stats") == 0) {
+        stats();
+    } else {
+        print_str("Usage: initramfs [ls | cat <path> | stats]\n");
+    }
+}
+
+static const command_t initramfs_command = {
+    .name = "initramfs",
+    .short_desc = "Look at the files GRUB loaded",
+    .usage = "initramfs [ls | cat <path> | stats]",
+    .long_desc = "The initramfs is a cpio archive built from the initramfs directory of the source "
+                 "tree and loaded by GRUB next to the kernel, LZ4 compressed if it was built with "
+                 "INITRAMFS_LZ4=1. Files are read where the archive lies in memory, a compressed "
+                 "one is unpacked as far as the first lookups need. ls lists every entry with its "
+                 "size, cat prints a file, stats shows how long indexing and unpacking the "
+                 "archive took and what lookups cost.",
+    .examples = "initramfs\ninitramfs cat /etc/motd\ninitramfs stats",
+    .execute = CMD_initramfs
+};
+
+void CMD_init_initramfs() {
+    register_command(&initramfs_command);
+}
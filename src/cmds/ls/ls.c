@@ -0,0 +1,73 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/fs/vfs.h"
+#include "ls.h"
+
+// Right align a number in a column
+static void print_column(uint64_t value, int width) {
+    int digits = 1;
+    for (uint64_t v = value; v >= 10; v /= 10) digits++;
+    for (int i = digits; i < width; i++) print_char(' ');
+    print_number(value);
+}
+
+// Directories in RAM show how many entries they have instead of a size,
+// directories on disk the size the file system gives them
+static void print_entry(const vfs_dentry_t* d) {
+    bool dir = d->inode->type == VFS_DIR;
+    print_str(dir ? "  d" : "  -");
+    print_column(dir && !d->inode->fs->lookup ? d->child_count : d->inode->size, 9);
+    print_str("  ");
+    print_str(d->name);
+    print_str(dir ? "/\n" : "\n");
+}
+
+static void CMD_ls(const char* args) {
+    char path[VFS_PATH_MAX];
+    char name[VFS_NAME_MAX + 1];
+
+    if (!str_next_word(args, path, sizeof(path))) strcpy(path, "/");
+
+    vfs_dentry_t* d;
+    vfs_error_t error = vfs_lookup(path, &d);
+    if (error != VFS_OK) {
+        print_str(vfs_error_string(error));
+        print_str("\n");
+        return;
+    }
+    if (d->inode->type != VFS_DIR) {
+        print_entry(d);
+        return;
+    }
+
+    uint64_t cookie = 0;
+    while (vfs_readdir(d, &cookie, name)) {
+        vfs_dentry_t* c;
+        error = vfs_lookup_at(d, name, &c);
+        if (error == VFS_OK) {
+            print_entry(c);
+        } else if (error != VFS_ERR_NOT_FOUND) {
+            print_str(name);
+            print_str(": ");
+            print_str(vfs_error_string(error));
+            print_str("\n");
+        }
+    }
+}
+
+static const command_t ls_command = {
+    .name = "ls",
+    .short_desc = "List a directory",
+    .usage = "ls [path]",
+    .long_desc = "Lists the entries of a directory, the root if no path is given. Directories "
+                 "in RAM list in the order their entries were created and show how many "
+                 "entries they hold; mounted disks list in directory order and show directory "
+                 "sizes in bytes. Files show their size in bytes.",
+    .examples = "ls\nls /tmp\nls /mnt",
+    .execute = CMD_ls
+};
+
+void CMD_init_ls() {
+    register_command(&ls_command);
+}
@@ -0,0 +1,201 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/random.h"
+#include "../../libs/memory.h"
+#include "../../libs/lz4.h"
+#include "../../libs/fs/initramfs.h"
+#include "lz4bench.h"
+
+#define LZ4BENCH_DEFAULT_MS   500      // Per pattern
+#define LZ4BENCH_MAX_MS       60000
+#define LZ4BENCH_SIZE         65536    // Output of each made up block
+#define LZ4BENCH_TAIL         16       // Literals that end a block
+
+// A block only needs more input than output when it is all literals, by
+// the bytes of that one length
+static uint8_t noise[LZ4BENCH_SIZE];
+static uint8_t block[LZ4BENCH_SIZE + LZ4BENCH_SIZE / 255 + 16];
+static uint8_t output[LZ4BENCH_SIZE];
+
+// Where the initramfs is unpacked to, kept for the next run
+static uint8_t* archive;
+static uint32_t archive_pages;
+
+typedef struct {
+    const char* name;
+    uint32_t literals;          // Before each match
+    uint32_t offset;            // 0 for literals only
+    uint32_t match;
+} pattern_t;
+
+static const pattern_t patterns[] = {
+    { "literals only",           0, 0, 0 },
+    { "short, 6 + 14 at 40",     6, 40, 14 },
+    { "long, 8 + 500 at 4096",   8, 4096, 500 },
+    { "run, offset 1",           1, 1, 4096 },
+    { "run, offset 3",           3, 3, 4096 },
+    { "run, offset 12",          12, 12, 4096 },
+};
+
+// n / 1000 with two decimals
+static void print_thousandths(uint64_t n) {
+    print_number(n / 1000);
+    print_str(".");
+    if (n % 1000 < 100) print_str("0");
+    print_number(n % 1000 / 10);
+}
+
+// Bytes past 15 of a length go on in bytes of 255
+static uint8_t* put_length(uint8_t* p, uint32_t n) {
+    for (; n >= 255; n -= 255) *p++ = 255;
+    *p++ = n;
+    return p;
+}
+
+static uint8_t* put_sequence(uint8_t* p, const uint8_t* literals, uint32_t count,
+                             uint32_t offset, uint32_t match) {
+    uint32_t extra = match ? match - 4 : 0;
+    *p++ = (count < 15 ? count : 15) << 4 | (extra < 15 ? extra : 15);
+    if (count >= 15) p = put_length(p, count - 15);
+    memcpy(p, literals, count);
+    p += count;
+    if (!match) return p;
+
+    p[0] = offset & 0xFF;
+    p[1] = offset >> 8;
+    p += 2;
+    if (extra >= 15) p = put_length(p, extra - 15);
+    return p;
+}
+
+// A block of the pattern's sequences that unpacks to LZ4BENCH_SIZE bytes.
+// The first sequence has enough literals for its match to reach back to.
+static size_t make_block(const pattern_t* pattern) {
+    uint8_t* p = block;
+    uint32_t out = 0;
+    uint32_t literals = pattern->offset > pattern->literals ? pattern->offset : pattern->literals;
+
+    while (pattern->match && out + literals + pattern->match <= LZ4BENCH_SIZE - LZ4BENCH_TAIL) {
+        p = put_sequence(p, noise + out, literals, pattern->offset, pattern->match);
+        out += literals + pattern->match;
+        literals = pattern->literals;
+    }
+    p = put_sequence(p, noise + out, LZ4BENCH_SIZE - out, 0, 0);
+    return p - block;
+}
+
+// Unpack over and over for ms milliseconds. Returns bytes per microsecond,
+// MB/s, or 0 if the data is broken.
+static uint64_t run(bool (*unpack)(const uint8_t* src, size_t len, size_t* out),
+                    const uint8_t* src, size_t len, uint64_t ms, size_t* produced) {
+    uint64_t bytes = 0;
+    uint64_t start = rdtsc();
+    uint64_t end = start + ms * tsc_per_ms;
+    uint64_t now;
+
+    do {
+        if (!unpack(src, len, produced)) return 0;
+        bytes += *produced;
+        now = rdtsc();
+    } while (now < end);
+
+    uint64_t ns = tsc_to_ns(now - start);
+    return ns ? bytes * 1000 / ns : 0;
+}
+
+static bool unpack_block(const uint8_t* src, size_t len, size_t* out) {
+    return lz4_decompress_block(src, len, output, sizeof(output), out);
+}
+
+static bool unpack_frame(const uint8_t* src, size_t len, size_t* out) {
+    lz4_frame_t frame;
+    size_t produced;
+
+    if (lz4_frame_open(&frame, src, len) != LZ4_OK) return false;
+    do {
+        if (lz4_frame_next(&frame, archive, archive_pages * PAGE_SIZE, &produced) != LZ4_OK) {
+            return false;
+        }
+    } while (produced);
+    *out = frame.out_len;
+    return true;
+}
+
+static void report(const char* name, uint64_t mbps, size_t in, size_t out) {
+    print_str("  ");
+    print_str(name);
+    for (size_t i = strlen(name); i < 24; i++) print_char(' ');
+    if (!mbps) {
+        print_str("broken\n");
+        return;
+    }
+    print_thousandths(mbps);
+    print_str(" GB/s, ");
+    print_number(in);
+    print_str(" -> ");
+    print_number(out);
+    print_str(" bytes\n");
+}
+
+static void CMD_lz4bench(const char* args) {
+    char word[16];
+    uint64_t ms = LZ4BENCH_DEFAULT_MS;
+
+    if (str_next_word(args, word, sizeof(word))) {
+        if (!str_to_uint(word, &ms) || ms == 0 || ms > LZ4BENCH_MAX_MS) {
+            print_str("Usage: lz4bench [ms]\n");
+            return;
+        }
+    }
+
+    for (size_t i = 0; i < sizeof(noise); i += 4) {
+        uint32_t r = random_next();
+        memcpy(&noise[i], &r, 4);
+    }
+
+    print_str("Unpacking ");
+    print_number(LZ4BENCH_SIZE / 1024);
+    print_str(" KiB blocks, ");
+    print_number(ms);
+    print_str(" ms each\n");
+    for (size_t i = 0; i < sizeof(patterns) / sizeof(patterns[0]); i++) {
+        size_t len = make_block(&patterns[i]);
+        size_t out = 0;
+        report(patterns[i].name, run(unpack_block, block, len, ms, &out), len, out);
+    }
+
+    const uint8_t* packed;
+    uint32_t size;
+    if (!initramfs_get_packed(&packed, &size)) return;
+
+    uint32_t pages = (initramfs_size() + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages > archive_pages) {
+        archive = memory_alloc_pages(pages);
+        archive_pages = archive ? pages : 0;
+    }
+    if (!archive) {
+        print_str("  No memory to unpack the initramfs into\n");
+        return;
+    }
+    size_t out = 0;
+    report("initramfs frame", run(unpack_frame, packed, size, ms, &out), size, out);
+}
+
+static const command_t lz4bench_command = {
+    .name = "lz4bench",
+    .short_desc = "Measure LZ4 decompression speed",
+    .usage = "lz4bench [ms]",
+    .long_desc = "Unpacks made up LZ4 blocks of 64 KiB over and over, each for ms milliseconds "
+                 "(default 500), and reports GB/s of output: all literals, short sequences the "
+                 "decoder takes in one step, long matches, and runs of a repeated byte or of "
+                 "short patterns, whose matches overlap their output. An initramfs built with "
+                 "INITRAMFS_LZ4=1 is unpacked whole as well, into pages that stay allocated.",
+    .examples = "lz4bench\nlz4bench 2000",
+    .execute = CMD_lz4bench
+};
+
+void CMD_init_lz4bench() {
+    register_command(&lz4bench_command);
+}
@@ -0,0 +1,60 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/fs/vfs.h"
+#include "mkdir.h"
+
+// Create every directory on the way, the ones that exist are fine
+static vfs_error_t make_parents(char* path) {
+    for (char* p = path + 1; *p; p++) {
+        if (*p != '/' || p[-1] == '/') continue;
+        *p = '\0';
+        vfs_error_t error = vfs_create(path, VFS_DIR, NULL);
+        *p = '/';
+        if (error != VFS_OK && error != VFS_ERR_EXISTS) return error;
+    }
+    return VFS_OK;
+}
+
+static void CMD_mkdir(const char* args) {
+    char word[VFS_PATH_MAX];
+    bool parents = false;
+    const char* rest = str_next_word(args, word, sizeof(word));
+
+    if (rest && strcmp(word, "-p") == 0) {
+        parents = true;
+        rest = str_next_word(rest, word, sizeof(word));
+    }
+    if (!rest) {
+        print_str("Usage: mkdir [-p] <path>\n");
+        return;
+    }
+
+    vfs_error_t error = parents ? make_parents(word) : VFS_OK;
+    if (error == VFS_OK) error = vfs_create(word, VFS_DIR, NULL);
+    if (parents && error == VFS_ERR_EXISTS) {
+        vfs_dentry_t* d;
+        if (vfs_lookup(word, &d) == VFS_OK && d->inode->type == VFS_DIR) error = VFS_OK;
+    }
+    if (error != VFS_OK) {
+        print_str(word);
+        print_str(": ");
+        print_str(vfs_error_string(error));
+        print_str("\n");
+    }
+}
+
+static const command_t mkdir_command = {
+    .name = "mkdir",
+    .short_desc = "Create a directory",
+    .usage = "mkdir [-p] <path>",
+    .long_desc = "Creates a directory in the RAM file system. The parent has to exist, unless "
+                 "-p is given, which creates every missing directory on the way and doesn't "
+                 "mind if the directory is already there.",
+    .examples = "mkdir /tmp\nmkdir -p /a/b/c/d",
+    .execute = CMD_mkdir
+};
+
+void CMD_init_mkdir() {
+    register_command(&mkdir_command);
+}
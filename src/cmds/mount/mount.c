@@ -0,0 +1,82 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/block/blkdev.h"
+#include "../../libs/fs/vfs.h"
+#include "../../libs/fs/ext2.h"
+#include "mount.h"
+
+#define MOUNT_USAGE  "Usage: mount [<device> <path>]\n"
+
+static void list(void) {
+    blk_device_t* dev;
+    const char* path;
+    uint32_t block_size;
+    uint64_t blocks;
+    int i = 0;
+
+    for (; ext2_get_mount(i, &dev, &path, &block_size, &blocks); i++) {
+        print_str(dev->name);
+        print_str(" on ");
+        print_str(path);
+        print_str(" type ext2, ");
+        print_number(blocks * block_size / (1024 * 1024));
+        print_str(" MiB in ");
+        print_number(block_size);
+        print_str(" byte blocks, read only\n");
+    }
+    if (i == 0) print_str("Nothing mounted\n");
+}
+
+static void CMD_mount(const char* args) {
+    char name[16];
+    char path[VFS_PATH_MAX];
+
+    const char* rest = str_next_word(args, name, sizeof(name));
+    if (!rest) {
+        list();
+        return;
+    }
+    if (!str_next_word(rest, path, sizeof(path))) {
+        print_str(MOUNT_USAGE);
+        return;
+    }
+
+    blk_device_t* dev = blk_find_device(name);
+    if (!dev) {
+        print_str("No block device ");
+        print_str(name);
+        print_str("\n");
+        return;
+    }
+    if (!ext2_probe(dev)) {
+        print_str(name);
+        print_str(": no ext2 file system this driver can read\n");
+        return;
+    }
+
+    vfs_error_t error = vfs_create(path, VFS_DIR, NULL);
+    if (error == VFS_OK || error == VFS_ERR_EXISTS) error = ext2_mount(dev, path);
+    if (error != VFS_OK) {
+        print_str(path);
+        print_str(": ");
+        print_str(vfs_error_string(error));
+        print_str("\n");
+    }
+}
+
+static const command_t mount_command = {
+    .name = "mount",
+    .short_desc = "Mount a disk",
+    .usage = "mount [<device> <path>]",
+    .long_desc = "Mounts the ext2 file system on a block device, read only, on an empty "
+                 "directory of the RAM file system, which is created if it doesn't exist. "
+                 "Without arguments, lists what is mounted. Devices are named as blkbench "
+                 "lists them.",
+    .examples = "mount\nmount nvme /disk",
+    .execute = CMD_mount
+};
+
+void CMD_init_mount() {
+    register_command(&mount_command);
+}
@@ -0,0 +1,558 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/memory.h"
+#include "../../libs/fs/vfs.h"
+#include "../../libs/net/ethernet.h"
+#include "../../libs/net/ip.h"
+#include "../../libs/net/icmp.h"
+#include "../../libs/net/udp.h"
+#include "../../libs/net/tcp.h"
+#include "../../libs/net/offload.h"
+#include "../../libs/net/netstat.h"
+#include "netbench.h"
+
+#define NETBENCH_DEFAULT_COUNT  100000
+#define NETBENCH_DEFAULT_SIZE   64
+#define NETBENCH_MAX_COUNT      10000000
+#define NETBENCH_WINDOW         32       // Packets in flight, well below the loopback queue
+#define NETBENCH_UDP_PORT       9999
+#define NETBENCH_IDENTIFIER     0x4e42
+#define NETBENCH_TIMEOUT_MS     1000     // For the last packets after sending stopped
+#define NETBENCH_BULK_MB        64       // Default volume of the bulk run
+#define NETBENCH_MAX_BULK_MB    4096
+#define NETBENCH_TCP_CHUNK      65536    // Bytes per tcp_send call
+#define NETBENCH_FILE_CHUNK     65536    // Bytes per vfs_read of the read+send loop
+
+static volatile uint32_t delivered;
+static uint16_t payload_size;
+static udp_socket_t* udp_tx;
+
+static net_counters_t before[NET_LAYER_COUNT];
+static net_counters_t after[NET_LAYER_COUNT];
+static uint8_t tcp_chunk[NETBENCH_TCP_CHUNK];
+static uint8_t file_chunk[NETBENCH_FILE_CHUNK];
+
+// The file the sendfile runs serve over and over, where to, and how far
+// they got. The read+send loop keeps the part it read last in file_chunk.
+static vfs_inode_t* file;
+static uint32_t file_dest;
+static uint16_t file_port;
+static uint64_t file_offset;
+static uint64_t served;
+static uint64_t chunk_offset;
+static uint64_t chunk_len;
+
+static void icmp_reply(uint32_t src_ip, uint16_t identifier, uint16_t sequence,
+                       const uint8_t* payload, uint16_t payload_len) {
+    (void)src_ip;
+    (void)sequence;
+    (void)payload;
+    (void)payload_len;
+    if (identifier == NETBENCH_IDENTIFIER) delivered++;
+}
+
+static void udp_sink(udp_socket_t* sock, pbuf_t* packet, uint32_t src_ip, uint16_t src_port) {
+    (void)sock;
+    (void)packet;
+    (void)src_ip;
+    (void)src_port;
+    delivered++;
+}
+
+static bool send_icmp(uint32_t n) {
+    return icmp_send_echo_request(IP_LOOPBACK, NETBENCH_IDENTIFIER, n, payload_size);
+}
+
+static bool send_udp(uint32_t n) {
+    (void)n;
+    pbuf_t* p = pbuf_alloc(payload_size);
+    if (!p) return false;
+    bool sent = udp_sendto_pbuf(udp_tx, IP_LOOPBACK, NETBENCH_UDP_PORT, p);
+    pbuf_free(p);
+    return sent;
+}
+
+static void print_rate(uint64_t value, uint64_t ns, const char* unit) {
+    print_number(ns ? value * 1000000 / (ns / 1000) : 0);
+    print_str(unit);
+}
+
+// Cycles per byte, given in hundredths
+static void print_per_byte(uint64_t hundredths) {
+    print_number(hundredths / 100);
+    print_str(".");
+    if (hundredths % 100 < 10) print_char('0');
+    print_number(hundredths % 100);
+    print_str(" cycles/byte\n");
+}
+
+// Right align a number in a column
+static void print_column(uint64_t value, int width) {
+    int digits = 1;
+    for (uint64_t v = value; v >= 10; v /= 10) digits++;
+    for (int i = digits; i < width; i++) print_char(' ');
+    print_number(value);
+}
+
+// Packets and cycles of every layer between the before and after snapshots
+static void print_layers(uint64_t cycles) {
+    print_str("  layer    packets  cycles/pkt  share\n");
+    for (int layer = 0; layer < NET_LAYER_COUNT; layer++) {
+        const net_counters_t* a = &after[layer];
+        const net_counters_t* b = &before[layer];
+        uint64_t packets = (a->rx_packets - b->rx_packets) + (a->tx_packets - b->tx_packets);
+        uint64_t layer_cycles = a->cycles - b->cycles;
+        if (packets == 0 && layer_cycles == 0) continue;
+
+        const char* layer_name = net_layer_name(layer);
+        print_str("  ");
+        print_str(layer_name);
+        for (int i = strlen(layer_name); i < 5; i++) print_char(' ');
+        print_column(packets, 11);
+        print_column(packets ? layer_cycles / packets : 0, 12);
+        print_column(cycles ? layer_cycles * 100 / cycles : 0, 6);
+        print_str("%\n");
+    }
+}
+
+// Push count packets through the stack and back over loopback, keeping a
+// window in flight, and report the cost of every layer
+static void run(const char* name, bool (*send)(uint32_t), uint32_t count) {
+    uint32_t sent = 0;
+
+    delivered = 0;
+    net_stats_collect(before);
+    net_prof_enable(true);
+    uint64_t start = rdtsc();
+
+    // Out of buffers or a full window, let the receive side free some, and
+    // give up when nothing moved for a while
+    uint64_t deadline = tick_count + NETBENCH_TIMEOUT_MS;
+    while (sent < count && tick_count < deadline) {
+        if (sent - delivered < NETBENCH_WINDOW) {
+            if (send(sent)) {
+                sent++;
+                deadline = tick_count + NETBENCH_TIMEOUT_MS;
+                continue;
+            }
+        }
+        ethernet_poll(ETH_POLL_BUDGET);
+    }
+
+    deadline = tick_count + NETBENCH_TIMEOUT_MS;
+    while (delivered < sent && tick_count < deadline) {
+        ethernet_poll(ETH_POLL_BUDGET);
+    }
+
+    uint64_t cycles = rdtsc() - start;
+    net_prof_enable(false);
+    net_stats_collect(after);
+    uint64_t ns = tsc_to_ns(cycles);
+
+    uint64_t frames = after[NET_LAYER_LO].rx_packets - before[NET_LAYER_LO].rx_packets;
+    uint64_t bytes = after[NET_LAYER_LO].rx_bytes - before[NET_LAYER_LO].rx_bytes;
+
+    print_str(name);
+    print_str(": ");
+    print_number(sent);
+    print_str(" sent, ");
+    print_number(delivered);
+    print_str(" delivered, ");
+    print_number(frames);
+    print_str(" frames in ");
+    print_number(ns / 1000000);
+    print_str(" ms\n");
+    if (sent < count) {
+        print_str("  stalled, ");
+        print_number(count - sent);
+        print_str(" never sent\n");
+    }
+    print_str("  ");
+    print_rate(frames, ns, " frames/s, ");
+    print_rate(bytes, ns, " bytes/s, ");
+    print_number(frames ? cycles / frames : 0);
+    print_str(" cycles/frame\n");
+    print_layers(cycles);
+}
+
+// Volume in megabytes for the bulk runs, false if the argument is bad
+static bool parse_megabytes(const char* args, uint64_t* megabytes) {
+    char word[16];
+    *megabytes = NETBENCH_BULK_MB;
+    if (str_next_word(args, word, sizeof(word)) &&
+        (!str_to_uint(word, megabytes) || *megabytes == 0 || *megabytes > NETBENCH_MAX_BULK_MB)) {
+        print_str("Volume must be 1-4096 MB\n");
+        return false;
+    }
+    return true;
+}
+
+// Move a volume of data in datagrams that fill the loopback MTU, so runs
+// at different MTUs compare the per-packet cost against the bytes moved
+static void bulk(const char* args) {
+    uint64_t megabytes;
+    if (!parse_megabytes(args, &megabytes)) return;
+
+    uint16_t mtu = ip_route_mtu(IP_LOOPBACK);
+    payload_size = mtu - IP_HEADER_SIZE - sizeof(udp_header_t);
+    uint32_t count = (megabytes << 20) / payload_size;
+
+    udp_socket_t* sink = udp_socket();
+    udp_tx = udp_socket();
+    if (!sink || !udp_tx || !udp_bind(sink, NETBENCH_UDP_PORT)) {
+        print_str("No UDP sockets available\n");
+    } else {
+        print_str("MTU ");
+        print_number(mtu);
+        print_str(", ");
+        print_number(payload_size);
+        print_str(" byte datagrams\n");
+        udp_set_handler(sink, udp_sink);
+        run("bulk udp", send_udp, count);
+    }
+    if (sink) udp_close(sink);
+    if (udp_tx) udp_close(udp_tx);
+}
+
+// Stream a volume of data over a TCP connection to the discard service and
+// report the cycles per byte, which is what the segmentation offloads save
+static void tcp_bulk(const char* args) {
+    uint64_t megabytes;
+    if (!parse_megabytes(args, &megabytes)) return;
+
+    tcp_socket_t* sock = tcp_socket();
+    if (!sock) {
+        print_str("No TCP sockets available\n");
+        return;
+    }
+    if (tcp_connect(sock, IP_LOOPBACK, TCP_PORT_DISCARD, NETBENCH_TIMEOUT_MS) != 0) {
+        print_str("Could not connect to the discard service\n");
+        tcp_abort(sock);
+        return;
+    }
+
+    uint32_t offloads = net_offload_get();
+    print_str("MTU ");
+    print_number(ip_route_mtu(IP_LOOPBACK));
+    print_str(", gso ");
+    print_str((offloads & NET_OFFLOAD_GSO) ? "on" : "off");
+    print_str(", tso ");
+    print_str((offloads & NET_OFFLOAD_TSO) ? "on" : "off");
+    print_str(", gro ");
+    print_str((offloads & NET_OFFLOAD_GRO) ? "on" : "off");
+    print_str("\n");
+
+    uint64_t total = megabytes << 20;
+    uint64_t queued = 0;
+    net_stats_collect(before);
+    net_prof_enable(true);
+    uint64_t start = rdtsc();
+
+    while (queued < total) {
+        uint32_t length = total - queued < NETBENCH_TCP_CHUNK ? total - queued : NETBENCH_TCP_CHUNK;
+        int n = tcp_send(sock, tcp_chunk, length);
+        if (n <= 0) break;
+        queued += n;
+    }
+
+    // Done once the discard service acknowledged everything
+    tcp_conn_stats_t conn;
+    uint64_t deadline = tick_count + NETBENCH_TIMEOUT_MS;
+    tcp_get_conn_stats(sock, &conn);
+    while (conn.bytes_sent < queued && tick_count < deadline) {
+        ethernet_wait();
+        tcp_get_conn_stats(sock, &conn);
+    }
+
+    uint64_t cycles = rdtsc() - start;
+    net_prof_enable(false);
+    net_stats_collect(after);
+    uint64_t ns = tsc_to_ns(cycles);
+    tcp_close(sock);
+
+    uint64_t frames = after[NET_LAYER_LO].rx_packets - before[NET_LAYER_LO].rx_packets;
+    uint64_t per_byte = conn.bytes_sent ? cycles * 100 / conn.bytes_sent : 0;
+
+    print_str("bulk tcp: ");
+    print_number(conn.bytes_sent);
+    print_str(" bytes in ");
+    print_number(ns / 1000000);
+    print_str(" ms, ");
+    print_number(frames);
+    print_str(" frames\n  ");
+    print_rate(conn.bytes_sent, ns, " bytes/s, ");
+    print_per_byte(per_byte);
+    print_str("  ");
+    print_number(conn.retransmits);
+    print_str(" retransmits, ");
+    print_number(conn.fast_retransmits);
+    print_str(" fast retransmits, ");
+    print_number(conn.timeouts);
+    print_str(" timeouts\n");
+    print_layers(cycles);
+}
+
+// Bytes of the next datagram of the file. They end where a page of the
+// file does, as udp_sendfile cuts them, so both runs send the same packets.
+static uint16_t next_piece(void) {
+    uint64_t n = PAGE_SIZE - file_offset % PAGE_SIZE;
+    if (n > payload_size) n = payload_size;
+    if (n > file->size - file_offset) n = file->size - file_offset;
+    return n;
+}
+
+static void advance(uint16_t n) {
+    served += n;
+    file_offset += n;
+    if (file_offset == file->size) file_offset = 0;
+}
+
+// Read the file into a buffer and send datagrams out of it, which copies
+// every byte twice
+static bool send_read(void) {
+    uint16_t n = next_piece();
+    if (file_offset < chunk_offset || file_offset + n > chunk_offset + chunk_len) {
+        chunk_offset = file_offset;
+        chunk_len = vfs_read(file, file_offset, file_chunk, sizeof(file_chunk));
+        if (chunk_len < n) return false;
+    }
+    if (!udp_sendto(udp_tx, file_dest, file_port, file_chunk + (file_offset - chunk_offset), n)) {
+        return false;
+    }
+    advance(n);
+    return true;
+}
+
+static bool send_file(void) {
+    uint16_t n = next_piece();
+    if (udp_sendfile(udp_tx, file_dest, file_port, file, file_offset, n, payload_size) != n) {
+        return false;
+    }
+    advance(n);
+    return true;
+}
+
+// Serve the file with send until volume bytes went out. Over loopback a
+// window of datagrams stays in flight to the sink, to another host only the
+// card's ring holds them back. Returns the cycles per byte in hundredths.
+static uint64_t serve(const char* name, bool (*send)(void), uint64_t volume, bool remote) {
+    uint32_t sent = 0;
+
+    delivered = 0;
+    served = 0;
+    file_offset = 0;
+    chunk_len = 0;
+    net_stats_collect(before);
+    net_prof_enable(true);
+    uint64_t start = rdtsc();
+
+    // Out of buffers or ring slots, let the receive side or the card free
+    // some, and give up when nothing moved for a while
+    uint64_t deadline = tick_count + NETBENCH_TIMEOUT_MS;
+    while (served < volume && tick_count < deadline) {
+        if (remote || sent - delivered < NETBENCH_WINDOW) {
+            if (send()) {
+                sent++;
+                deadline = tick_count + NETBENCH_TIMEOUT_MS;
+                continue;
+            }
+        }
+        ethernet_poll(ETH_POLL_BUDGET);
+    }
+
+    deadline = tick_count + NETBENCH_TIMEOUT_MS;
+    while (!remote && delivered < sent && tick_count < deadline) {
+        ethernet_poll(ETH_POLL_BUDGET);
+    }
+
+    uint64_t cycles = rdtsc() - start;
+    net_prof_enable(false);
+    net_stats_collect(after);
+    uint64_t ns = tsc_to_ns(cycles);
+    uint64_t per_byte = served ? cycles * 100 / served : 0;
+    net_layer_t layer = remote ? NET_LAYER_NIC : NET_LAYER_LO;
+
+    print_str(name);
+    print_str(": ");
+    print_number(served);
+    print_str(" bytes in ");
+    print_number(ns / 1000000);
+    print_str(" ms, ");
+    print_number(after[layer].tx_packets - before[layer].tx_packets);
+    print_str(" frames");
+    if (!remote) {
+        print_str(", ");
+        print_number(delivered);
+        print_str(" delivered");
+    }
+    print_str("\n  ");
+    print_rate(served, ns, " bytes/s, ");
+    print_per_byte(per_byte);
+    print_layers(cycles);
+    return per_byte;
+}
+
+// Serve a file over and over, once with a read+send loop and once with
+// udp_sendfile, to the loopback sink or to the discard port of another host
+static void file_bench(const char* args) {
+    char path[VFS_PATH_MAX];
+    char word[16];
+    uint64_t megabytes = NETBENCH_BULK_MB;
+
+    file_dest = IP_LOOPBACK;
+    if ((args = str_next_word(args, path, sizeof(path))) == NULL) {
+        print_str("Usage: netbench sendfile <path> [megabytes] [address]\n");
+        return;
+    }
+    if ((args = str_next_word(args, word, sizeof(word))) != NULL) {
+        if (!str_to_uint(word, &megabytes) || megabytes == 0 || megabytes > NETBENCH_MAX_BULK_MB) {
+            print_str("Volume must be 1-4096 MB\n");
+            return;
+        }
+        if (str_next_word(args, word, sizeof(word)) && (file_dest = ip_str_to_addr(word)) == 0) {
+            print_str("Bad address\n");
+            return;
+        }
+    }
+
+    vfs_dentry_t* d;
+    vfs_error_t error = vfs_lookup(path, &d);
+    if (error == VFS_OK && d->inode->type == VFS_DIR) error = VFS_ERR_IS_DIR;
+    if (error != VFS_OK) {
+        print_str(path);
+        print_str(": ");
+        print_str(vfs_error_string(error));
+        print_str("\n");
+        return;
+    }
+    file = d->inode;
+    if (file->size == 0) {
+        print_str("The file is empty\n");
+        return;
+    }
+
+    bool remote = !ip_is_local(file_dest);
+    file_port = remote ? UDP_PORT_DISCARD : NETBENCH_UDP_PORT;
+    payload_size = ip_route_mtu(file_dest) - IP_HEADER_SIZE - sizeof(udp_header_t);
+
+    udp_socket_t* sink = remote ? NULL : udp_socket();
+    udp_tx = udp_socket();
+    if (!udp_tx || (!remote && (!sink || !udp_bind(sink, NETBENCH_UDP_PORT)))) {
+        print_str("No UDP sockets available\n");
+    } else {
+        if (sink) udp_set_handler(sink, udp_sink);
+        print_number(file->size);
+        print_str(" byte file on ");
+        print_str(file->fs->name);
+        print_str(", ");
+        print_number(payload_size);
+        print_str(" byte datagrams");
+        if (!file->fs->cached) print_str(", not page cached so sendfile copies it once");
+        print_str("\n");
+
+        uint64_t copied = serve("read+send", send_read, megabytes << 20, remote);
+        uint64_t attached = serve("sendfile", send_file, megabytes << 20, remote);
+        if (copied && attached) {
+            print_str("sendfile took ");
+            print_number(attached * 100 / copied);
+            print_str("% of the cycles per byte of read+send\n");
+        }
+    }
+    if (sink) udp_close(sink);
+    if (udp_tx) udp_close(udp_tx);
+}
+
+static void CMD_netbench(const char* args) {
+    char word[16];
+    const char* which = "all";
+    uint64_t count = NETBENCH_DEFAULT_COUNT;
+    uint64_t size = NETBENCH_DEFAULT_SIZE;
+    char type[12];
+
+    if ((args = str_next_word(args, type, sizeof(type))) != NULL) {
+        which = type;
+        if (strcmp(which, "bulk") == 0) {
+            bulk(args);
+            return;
+        }
+        if (strcmp(which, "tcp") == 0) {
+            tcp_bulk(args);
+            return;
+        }
+        if (strcmp(which, "sendfile") == 0) {
+            file_bench(args);
+            return;
+        }
+        if ((args = str_next_word(args, word, sizeof(word))) != NULL) {
+            if (!str_to_uint(word, &count) || count == 0 || count > NETBENCH_MAX_COUNT) {
+                print_str("Count must be 1-10000000\n");
+                return;
+            }
+            if (str_next_word(args, word, sizeof(word)) &&
+                (!str_to_uint(word, &size) || size > ICMP_ECHO_MAX_PAYLOAD)) {
+                print_str("Size must be 0-8972\n");
+                return;
+            }
+        }
+    }
+
+    bool icmp = strcmp(which, "icmp") == 0 || strcmp(which, "all") == 0;
+    bool udp = strcmp(which, "udp") == 0 || strcmp(which, "all") == 0;
+    if (!icmp && !udp) {
+        print_str("Usage: netbench [icmp|udp|all] [count] [size] | bulk [megabytes] | tcp [megabytes] | "
+                  "sendfile <path> [megabytes] [address]\n");
+        return;
+    }
+    payload_size = size;
+
+    if (icmp) {
+        icmp_set_echo_reply_handler(icmp_reply);
+        run("icmp echo", send_icmp, count);
+        icmp_set_echo_reply_handler(NULL);
+    }
+
+    if (udp) {
+        udp_socket_t* sink = udp_socket();
+        udp_tx = udp_socket();
+        if (!sink || !udp_tx || !udp_bind(sink, NETBENCH_UDP_PORT)) {
+            print_str("No UDP sockets available\n");
+        } else {
+            udp_set_handler(sink, udp_sink);
+            run("udp", send_udp, count);
+        }
+        if (sink) udp_close(sink);
+        if (udp_tx) udp_close(udp_tx);
+    }
+}
+
+static const command_t netbench_command = {
+    .name = "netbench",
+    .short_desc = "Benchmark the network stack over loopback",
+    .usage = "netbench [icmp|udp|all] [count] [size] | bulk [megabytes] | tcp [megabytes] | "
+             "sendfile <path> [megabytes] [address]",
+    .long_desc = "Sends count ICMP echo requests or UDP datagrams of size payload bytes (default 100000 "
+                 "of 64) to 127.0.0.1, keeping a few in flight, so every packet goes down and back up "
+                 "the whole stack without a network card. Reports frames and bytes per second, cycles "
+                 "per frame, and for every layer the packets it handled and the cycles it spent on "
+                 "each, not counting the layers it called. Sizes above 1472 need a larger loopback "
+                 "MTU. bulk sends megabytes of data (default 64) in UDP datagrams that fill the "
+                 "loopback MTU; compare runs after `route mtu lo 1500` and `route mtu lo 9000`. tcp streams "
+                 "megabytes (default 64) to the discard service and reports cycles per byte and the "
+                 "retransmits and timeouts of the connection; compare "
+                 "runs with the segmentation offloads switched off one by one with `offload`. "
+                 "sendfile serves the file at path over and over until megabytes (default 64) "
+                 "went out, in datagrams that fill the MTU without crossing a page of the file, "
+                 "to a local sink or to the discard port of address through the card. It runs "
+                 "once reading the file into a buffer and sending from it, and once with "
+                 "udp_sendfile, which attaches page cache pages to the packets for the card to "
+                 "read in place, and compares the cycles per byte.",
+    .examples = "netbench\nnetbench icmp\nnetbench udp 1000000 1400\nnetbench bulk 256\nnetbench tcp 256\n"
+                "netbench sendfile /mnt/big\nnetbench sendfile /mnt/big 256 10.0.2.2",
+    .execute = CMD_netbench
+};
+
+void CMD_init_netbench() {
+    register_command(&netbench_command);
+}
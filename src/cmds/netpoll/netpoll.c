@@ -0,0 +1,206 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/net/ethernet.h"
+#include "../../libs/net/ip.h"
+#include "../../libs/net/icmp.h"
+#include "netpoll.h"
+
+#define RTT_MAX_SAMPLES  1000
+#define RTT_IDENTIFIER   0x4e50
+#define RTT_TIMEOUT_MS   1000
+#define RTT_PAYLOAD      56
+
+static const char* mode_names[] = { "interrupt", "busy", "adaptive" };
+
+static uint64_t samples[RTT_MAX_SAMPLES];
+static volatile uint16_t reply_sequence;
+static volatile bool reply_seen;
+static volatile uint64_t reply_tsc;
+
+static void rtt_reply_handler(uint32_t src_ip, uint16_t identifier, uint16_t sequence,
+                              const uint8_t* payload, uint16_t payload_len) {
+    (void)src_ip;
+    (void)payload;
+    (void)payload_len;
+    if (identifier == RTT_IDENTIFIER && sequence == reply_sequence) {
+        reply_tsc = rdtsc();
+        reply_seen = true;
+    }
+}
+
+// One echo round trip in TSC cycles, 0 on timeout
+static uint64_t rtt_once(uint32_t dest, uint16_t sequence) {
+    reply_sequence = sequence;
+    reply_seen = false;
+
+    uint64_t deadline = tick_count + RTT_TIMEOUT_MS;
+    uint64_t start = rdtsc();
+    if (!icmp_send_echo_request(dest, RTT_IDENTIFIER, sequence, RTT_PAYLOAD)) return 0;
+    while (!reply_seen) {
+        if (tick_count >= deadline) return 0;
+        ethernet_wait();
+    }
+    return reply_tsc - start;
+}
+
+static void sort_samples(int count) {
+    for (int i = 1; i < count; i++) {
+        uint64_t value = samples[i];
+        int j = i - 1;
+        while (j >= 0 && samples[j] > value) {
+            samples[j + 1] = samples[j];
+            j--;
+        }
+        samples[j + 1] = value;
+    }
+}
+
+static void print_us(uint64_t cycles) {
+    uint64_t ns = tsc_to_ns(cycles);
+    print_number(ns / 1000);
+    print_str(".");
+    print_number((ns / 100) % 10);
+    print_str("us");
+}
+
+// Ping back to back in every mode and compare the latency percentiles
+static void measure_rtt(uint32_t dest, int count) {
+    eth_poll_mode_t saved_mode = ethernet_get_poll_mode();
+    uint16_t sequence = 0;
+
+    icmp_set_echo_reply_handler(rtt_reply_handler);
+    for (int mode = ETH_POLL_INTERRUPT; mode <= ETH_POLL_ADAPTIVE; mode++) {
+        ethernet_set_poll_mode(mode);
+
+        // Warm up the neighbor cache and, for adaptive, the rate estimate
+        for (int i = 0; i < 16; i++) {
+            rtt_once(dest, sequence++);
+        }
+
+        int received = 0;
+        uint64_t switches = ethernet_get_poll_stats()->mode_switches;
+        for (int i = 0; i < count; i++) {
+            uint64_t rtt = rtt_once(dest, sequence++);
+            if (rtt) samples[received++] = rtt;
+        }
+        switches = ethernet_get_poll_stats()->mode_switches - switches;
+
+        print_str(mode_names[mode]);
+        print_str(": ");
+        if (!received) {
+            print_str("no replies\n");
+            continue;
+        }
+        sort_samples(received);
+        print_str("p50 ");
+        print_us(samples[received / 2]);
+        print_str(" p99 ");
+        print_us(samples[(received * 99) / 100]);
+        print_str(" (");
+        print_number(received);
+        print_str("/");
+        print_number(count);
+        print_str(" replies");
+        if (mode == ETH_POLL_ADAPTIVE) {
+            print_str(", ");
+            print_number(switches);
+            print_str(" switches");
+        }
+        print_str(")\n");
+    }
+    icmp_set_echo_reply_handler(NULL);
+    ethernet_set_poll_mode(saved_mode);
+}
+
+static void show_status(void) {
+    const eth_poll_stats_t* stats = ethernet_get_poll_stats();
+
+    print_str("Mode: ");
+    print_str(mode_names[ethernet_get_poll_mode()]);
+    print_str(ethernet_polling() ? " (polling)" : " (sleeping)");
+    print_str(", poll time ");
+    print_number(ethernet_get_poll_duration());
+    print_str("us\n");
+
+    print_str("Interrupts: ");
+    print_number(stats->interrupts);
+    print_str("  Polls: ");
+    print_number(stats->polls);
+    print_str("  Hits: ");
+    print_number(stats->poll_hits);
+    print_str("\nPackets: ");
+    print_number(stats->packets);
+    print_str("  Mode switches: ");
+    print_number(stats->mode_switches);
+    print_str("\n");
+}
+
+static void CMD_netpoll(const char* args) {
+    char word[16];
+    char value[16];
+    uint64_t number;
+
+    if (!ethernet_get_driver()) {
+        print_str("No network card\n");
+        return;
+    }
+
+    args = str_next_word(args, word, sizeof(word));
+    if (!args) {
+        show_status();
+        return;
+    }
+
+    if (strcmp(word, "mode") == 0 && str_next_word(args, value, sizeof(value))) {
+        for (int mode = ETH_POLL_INTERRUPT; mode <= ETH_POLL_ADAPTIVE; mode++) {
+            if (strcmp(value, mode_names[mode]) == 0) {
+                ethernet_set_poll_mode(mode);
+                return;
+            }
+        }
+        print_str("Unknown mode, use interrupt, busy or adaptive\n");
+    } else if (strcmp(word, "time") == 0 && str_next_word(args, value, sizeof(value)) &&
+               str_to_uint(value, &number)) {
+        ethernet_set_poll_duration(number);
+        if (number > ETH_POLL_MAX_US) {
+            print_str("Limited to ");
+            print_number(ETH_POLL_MAX_US);
+            print_str("us\n");
+        }
+    } else if (strcmp(word, "reset") == 0) {
+        ethernet_reset_poll_stats();
+    } else if (strcmp(word, "rtt") == 0 && (args = str_next_word(args, value, sizeof(value)))) {
+        uint32_t dest = ip_str_to_addr(value);
+        uint64_t count = 100;
+        if (!dest) {
+            print_str("Bad address\n");
+            return;
+        }
+        if (str_next_word(args, word, sizeof(word)) && (!str_to_uint(word, &count) ||
+            count == 0 || count > RTT_MAX_SAMPLES)) {
+            print_str("Count must be 1-1000\n");
+            return;
+        }
+        measure_rtt(dest, count);
+    } else {
+        print_str("Usage: netpoll [mode <interrupt|busy|adaptive> | time <us> | reset | rtt <ip> [count]]\n");
+    }
+}
+
+static const command_t netpoll_command = {
+    .name = "netpoll",
+    .short_desc = "Configure receive busy polling",
+    .usage = "netpoll [mode <interrupt|busy|adaptive> | time <us> | reset | rtt <ip> [count]]",
+    .long_desc = "Without arguments, shows the receive polling mode and counters. "
+                 "In busy mode blocking network calls spin on the receive ring for the poll time "
+                 "before sleeping, adaptive mode does so only while the packet rate is high. "
+                 "rtt pings a host back to back in every mode and prints the p50 and p99 round trip times.",
+    .examples = "netpoll\nnetpoll mode adaptive\nnetpoll time 100\nnetpoll rtt 10.0.2.2 200",
+    .execute = CMD_netpoll
+};
+
+void CMD_init_netpoll() {
+    register_command(&netpoll_command);
+}
@@ -0,0 +1,227 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/keyboard.h"
+#include "../../libs/net/netstat.h"
+#include "../../libs/net/ethernet.h"
+#include "../../libs/net/e1000e.h"
+#include "../../libs/net/tcp.h"
+#include "netstat.h"
+
+#define NETSTAT_MAX_INTERVAL 60   // Seconds
+
+static net_counters_t totals[NET_LAYER_COUNT];
+static net_counters_t previous[NET_LAYER_COUNT];
+
+// Right align a number in a column
+static void print_column(uint64_t value, int width) {
+    int digits = 1;
+    for (uint64_t v = value; v >= 10; v /= 10) digits++;
+    for (int i = digits; i < width; i++) print_char(' ');
+    print_number(value);
+}
+
+static uint64_t drop_total(const net_counters_t* c) {
+    uint64_t sum = 0;
+    for (int i = 0; i < NET_DROP_COUNT; i++) sum += c->drops[i];
+    return sum;
+}
+
+// Print the counters, or with a base their change divided by seconds
+static void print_table(const net_counters_t* now, const net_counters_t* base, uint64_t seconds) {
+    print_str(base ? "layer   rx pkt/s  rx byte/s   tx pkt/s  tx byte/s  drop/s\n"
+                   : "layer     rx pkts   rx bytes    tx pkts   tx bytes   drops\n");
+
+    for (int layer = 0; layer < NET_LAYER_COUNT; layer++) {
+        const net_counters_t* c = &now[layer];
+        net_counters_t d = *c;
+        if (base) {
+            const uint64_t* a = (const uint64_t*)c;
+            const uint64_t* b = (const uint64_t*)&base[layer];
+            uint64_t* out = (uint64_t*)&d;
+            for (size_t i = 0; i < sizeof(net_counters_t) / sizeof(uint64_t); i++) {
+                out[i] = (a[i] - b[i]) / seconds;
+            }
+        }
+
+        const char* name = net_layer_name(layer);
+        print_str(name);
+        for (int i = strlen(name); i < 5; i++) print_char(' ');
+        print_column(d.rx_packets, 11);
+        print_column(d.rx_bytes, 11);
+        print_column(d.tx_packets, 11);
+        print_column(d.tx_bytes, 11);
+        print_column(drop_total(&d), 8);
+        print_str("\n");
+    }
+
+    // Reasons and events, only the non-zero ones
+    for (int layer = 0; layer < NET_LAYER_COUNT; layer++) {
+        const net_counters_t* c = &now[layer];
+        const net_counters_t* b = base ? &base[layer] : NULL;
+        bool first = true;
+
+        for (int i = 0; i < NET_DROP_COUNT + 3; i++) {
+            const char* label;
+            uint64_t value;
+            if (i < NET_DROP_COUNT) {
+                label = net_drop_name(i);
+                value = c->drops[i] - (b ? b->drops[i] : 0);
+            } else if (i == NET_DROP_COUNT) {
+                label = "ring-full events";
+                value = c->ring_full - (b ? b->ring_full : 0);
+            } else if (i == NET_DROP_COUNT + 1) {
+                label = "checksum errors";
+                value = c->csum_errors - (b ? b->csum_errors : 0);
+            } else {
+                label = "misses";
+                value = c->misses - (b ? b->misses : 0);
+            }
+            if (value == 0) continue;
+
+            if (first) {
+                print_str(net_layer_name(layer));
+                print_str(":");
+                first = false;
+            }
+            print_str(" ");
+            print_str(label);
+            print_str("=");
+            print_number(value / (b ? seconds : 1));
+        }
+        if (!first) print_str("\n");
+    }
+}
+
+// Receive side scaling queues of the e1000e
+static void print_queues(void) {
+    const eth_driver_t* driver = ethernet_get_driver();
+    if (!driver || strcmp(driver->name, "e1000e") != 0) {
+        print_str("The network card has a single queue\n");
+        return;
+    }
+
+    print_str(e1000e_msix() ? "Interrupts: MSI-X, one vector per queue\n"
+                            : "Interrupts: legacy line shared by the queues\n");
+    print_str("queue   rx pkts   rx bytes    tx pkts   tx bytes  interrupts\n");
+    for (int q = 0; q < E1000E_QUEUES; q++) {
+        const e1000e_queue_stats_t* s = e1000e_get_queue_stats(q);
+        print_column(q, 5);
+        print_column(s->rx_packets, 10);
+        print_column(s->rx_bytes, 11);
+        print_column(s->tx_packets, 11);
+        print_column(s->tx_bytes, 11);
+        print_column(s->interrupts, 12);
+        print_str("\n");
+    }
+}
+
+// Connection level counters of TCP, which the layer table doesn't show
+static void print_tcp(void) {
+    const tcp_stats_t* s = tcp_get_stats();
+    print_str("tcp: ");
+    print_number(s->retransmits);
+    print_str(" retransmits (");
+    print_number(s->fast_retransmits);
+    print_str(" fast), ");
+    print_number(s->timeouts);
+    print_str(" timeouts, ");
+    print_number(s->resets_sent);
+    print_str(" resets sent, ");
+    print_number(s->resets_received);
+    print_str(" received\n");
+    print_str("     ");
+    print_number(s->connections_opened);
+    print_str(" opened, ");
+    print_number(s->connections_accepted);
+    print_str(" accepted, ");
+    print_number(s->connections_dropped);
+    print_str(" dropped\n");
+}
+
+// Print rates every interval until count is reached or a key is pressed
+static void watch(uint64_t interval, uint64_t count) {
+    net_stats_collect(previous);
+
+    for (uint64_t n = 0; count == 0 || n < count; n++) {
+        uint64_t deadline = tick_count + interval * 1000;
+        while (tick_count < deadline) {
+            if (keyboard_is_key_available()) {
+                keyboard_read_nonblocking();
+                return;
+            }
+            __asm__ volatile("hlt");
+        }
+
+        net_stats_collect(totals);
+        print_str("\n");
+        print_table(totals, previous, interval);
+        memcpy(previous, totals, sizeof(previous));
+    }
+}
+
+static void CMD_netstat(const char* args) {
+    char word[16];
+    uint64_t interval = 1;
+    uint64_t count = 0;
+
+    args = str_next_word(args, word, sizeof(word));
+    if (!args) {
+        net_stats_collect(totals);
+        print_table(totals, NULL, 1);
+        print_tcp();
+        return;
+    }
+
+    if (strcmp(word, "reset") == 0) {
+        net_stats_reset();
+        e1000e_reset_queue_stats();
+        return;
+    }
+
+    if (strcmp(word, "-q") == 0) {
+        print_queues();
+        return;
+    }
+
+    if (strcmp(word, "-d") != 0) {
+        print_str("Usage: netstat [-d [interval] [count] | -q | reset]\n");
+        return;
+    }
+
+    if ((args = str_next_word(args, word, sizeof(word))) != NULL) {
+        if (!str_to_uint(word, &interval) || interval == 0 || interval > NETSTAT_MAX_INTERVAL) {
+            print_str("Interval must be 1-60 seconds\n");
+            return;
+        }
+        if (str_next_word(args, word, sizeof(word)) && !str_to_uint(word, &count)) {
+            print_str("Bad count\n");
+            return;
+        }
+    }
+
+    if (count == 0) {
+        print_str("Press any key to stop\n");
+    }
+    watch(interval, count);
+}
+
+static const command_t netstat_command = {
+    .name = "netstat",
+    .short_desc = "Show network counters for each layer",
+    .usage = "netstat [-d [interval] [count] | -q | reset]",
+    .long_desc = "Shows received and sent packets and bytes and dropped packets for the NIC, loopback, ethernet, "
+                 "ARP, IP, ICMP, UDP and TCP layers, followed by the drop reasons, ring-full events, "
+                 "checksum errors and ARP misses that are not zero, and the retransmits, timeouts, "
+                 "resets and connections of TCP. With -d it prints per second "
+                 "rates every interval seconds (default 1) instead, count times or until a key is "
+                 "pressed. -q shows the packets, bytes and interrupts of each receive queue "
+                 "of a multi-queue card (e1000e). reset zeroes the layer and queue counters.",
+    .examples = "netstat\nnetstat -d\nnetstat -d 5 3\nnetstat -q\nnetstat reset",
+    .execute = CMD_netstat
+};
+
+void CMD_init_netstat() {
+    register_command(&netstat_command);
+}
@@ -0,0 +1,88 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/net/offload.h"
+#include "offload.h"
+
+static const struct {
+    const char* name;
+    uint32_t bit;
+} features[] = {
+    { "tso", NET_OFFLOAD_TSO },
+    { "gso", NET_OFFLOAD_GSO },
+    { "gro", NET_OFFLOAD_GRO },
+};
+#define FEATURE_COUNT (sizeof(features) / sizeof(features[0]))
+
+static void print_counter(const char* name, uint64_t value) {
+    print_str("  ");
+    print_str(name);
+    for (int i = strlen(name); i < 14; i++) print_char(' ');
+    print_number(value);
+    print_str("\n");
+}
+
+static void show_status(void) {
+    uint32_t enabled = net_offload_get();
+    for (size_t i = 0; i < FEATURE_COUNT; i++) {
+        print_str(features[i].name);
+        print_str((enabled & features[i].bit) ? " on  " : " off  ");
+    }
+    print_str("\n");
+
+    const net_offload_stats_t* stats = net_offload_get_stats();
+    print_counter("tso packets", stats->tso_packets);
+    print_counter("gso packets", stats->gso_packets);
+    print_counter("gso segments", stats->gso_segments);
+    print_counter("gro packets", stats->gro_packets);
+    print_counter("gro segments", stats->gro_segments);
+    print_counter("gro flushes", stats->gro_flushes);
+}
+
+static void CMD_offload(const char* args) {
+    char word[16];
+    char value[8];
+
+    args = str_next_word(args, word, sizeof(word));
+    if (!args) {
+        show_status();
+        return;
+    }
+    if (strcmp(word, "reset") == 0) {
+        net_offload_reset_stats();
+        return;
+    }
+
+    for (size_t i = 0; i < FEATURE_COUNT; i++) {
+        if (strcmp(word, features[i].name) != 0 || !str_next_word(args, value, sizeof(value))) {
+            continue;
+        }
+        if (strcmp(value, "on") == 0) {
+            net_offload_set(net_offload_get() | features[i].bit);
+            return;
+        }
+        if (strcmp(value, "off") == 0) {
+            net_offload_set(net_offload_get() & ~features[i].bit);
+            return;
+        }
+    }
+    print_str("Usage: offload [tso|gso|gro on|off | reset]\n");
+}
+
+static const command_t offload_command = {
+    .name = "offload",
+    .short_desc = "Switch TCP segmentation offloads",
+    .usage = "offload [tso|gso|gro on|off | reset]",
+    .long_desc = "Without arguments, shows which offloads are on and their counters. "
+                 "gso lets TCP send super-packets of up to 64 KiB that travel down the stack as one "
+                 "packet. tso hands them to a device that segments them itself (e1000, virtio-net, "
+                 "loopback), otherwise they are segmented in software right before the driver. "
+                 "gro coalesces consecutive received segments of a TCP flow before they go up the "
+                 "stack. Compare `netbench tcp` with each of them off.",
+    .examples = "offload\noffload gso off\noffload tso off\noffload reset",
+    .execute = CMD_offload
+};
+
+void CMD_init_offload() {
+    register_command(&offload_command);
+}
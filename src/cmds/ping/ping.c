@@ -0,0 +1,308 @@
+#include "ping.h"
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/keyboard.h"
+#include "../../libs/interrupt.h"
+#include "../../libs/net/ethernet.h"
+#include "../../libs/net/ip.h"
+#include "../../libs/net/icmp.h"
+
+#define PING_DEFAULT_COUNT     4
+#define PING_DEFAULT_INTERVAL  1000   // ms
+#define PING_DEFAULT_SIZE      56
+#define PING_TIMEOUT_MS        1000   // Wait for late replies after the last request
+#define PING_SLOTS             256    // Requests tracked, older replies are ignored
+#define PING_FLOOD_WINDOW      8      // Requests in flight in flood mode
+#define PING_FLOOD_RESEND_MS   10     // Send anyway if nothing came back for this long
+#define PING_QUEUE_SIZE        32     // Replies waiting to be printed
+
+typedef struct {
+    uint16_t sequence;
+    uint16_t bytes;
+    uint64_t rtt_ns;
+} ping_reply_t;
+
+// State shared with the reply handler, which runs in the receive path
+static struct {
+    uint32_t dest;
+    uint16_t identifier;
+    uint16_t next_seq;                 // Sequence of the next request
+    uint64_t sent_tsc[PING_SLOTS];
+    bool answered[PING_SLOTS];
+
+    uint32_t received;
+    uint32_t duplicates;
+    uint64_t min_ns;
+    uint64_t max_ns;
+    uint64_t sum_ns;
+    uint64_t sum2;                     // Squares in units of 100 ns, so they don't overflow
+
+    ping_reply_t queue[PING_QUEUE_SIZE];
+    volatile uint32_t queue_head;
+    uint32_t queue_tail;
+} ping;
+
+static uint16_t ping_identifier = 0x5000;
+
+static void ping_reply(uint32_t src_ip, uint16_t identifier, uint16_t sequence,
+                       const uint8_t* payload, uint16_t payload_len) {
+    uint64_t now = rdtsc();
+    (void)payload;
+
+    if (src_ip != ping.dest || identifier != ping.identifier) return;
+
+    // Only requests that are still tracked, sequence numbers wrap
+    uint16_t age = ping.next_seq - sequence;
+    if (age == 0 || age > PING_SLOTS) return;
+
+    uint16_t slot = sequence % PING_SLOTS;
+    if (ping.answered[slot]) {
+        ping.duplicates++;
+        return;
+    }
+    ping.answered[slot] = true;
+
+    uint64_t rtt = tsc_to_ns(now - ping.sent_tsc[slot]);
+    if (ping.received == 0 || rtt < ping.min_ns) ping.min_ns = rtt;
+    if (rtt > ping.max_ns) ping.max_ns = rtt;
+    ping.sum_ns += rtt;
+    ping.sum2 += (rtt / 100) * (rtt / 100);
+    ping.received++;
+
+    // Printing is left to the command, drop lines it can't keep up with
+    if (ping.queue_head - ping.queue_tail < PING_QUEUE_SIZE) {
+        ping_reply_t* entry = &ping.queue[ping.queue_head % PING_QUEUE_SIZE];
+        entry->sequence = sequence;
+        entry->bytes = payload_len + sizeof(icmp_header_t);
+        entry->rtt_ns = rtt;
+        ping.queue_head++;
+    }
+}
+
+static bool ping_send(uint16_t size) {
+    uint16_t slot = ping.next_seq % PING_SLOTS;
+
+    uint64_t flags = irq_save();
+    ping.answered[slot] = false;
+    ping.sent_tsc[slot] = rdtsc();
+    uint16_t sequence = ping.next_seq++;
+    irq_restore(flags);
+
+    return icmp_send_echo_request(ping.dest, ping.identifier, sequence, size);
+}
+
+// Milliseconds with three decimals
+static void print_ms(uint64_t ns) {
+    uint64_t us = ns / 1000;
+    print_number(us / 1000);
+    print_char('.');
+    print_char('0' + (us / 100) % 10);
+    print_char('0' + (us / 10) % 10);
+    print_char('0' + us % 10);
+}
+
+static uint64_t isqrt(uint64_t value) {
+    uint64_t result = 0;
+    uint64_t bit = 1ULL << 62;
+
+    while (bit > value) bit >>= 2;
+    while (bit) {
+        if (value >= result + bit) {
+            value -= result + bit;
+            result = (result >> 1) + bit;
+        } else {
+            result >>= 1;
+        }
+        bit >>= 2;
+    }
+    return result;
+}
+
+static void print_queued_replies(void) {
+    while (ping.queue_tail != ping.queue_head) {
+        const ping_reply_t* entry = &ping.queue[ping.queue_tail % PING_QUEUE_SIZE];
+        print_number(entry->bytes);
+        print_str(" bytes from ");
+        print_ip(ntohl(ping.dest));
+        print_str(": icmp_seq=");
+        print_number(entry->sequence);
+        print_str(" time=");
+        print_ms(entry->rtt_ns);
+        print_str(" ms\n");
+        ping.queue_tail++;
+    }
+}
+
+static bool key_pressed(void) {
+    if (!keyboard_is_key_available()) return false;
+    keyboard_read_nonblocking();
+    return true;
+}
+
+static void print_summary(uint32_t sent, uint64_t elapsed_ns, bool flood) {
+    print_str("--- ");
+    print_ip(ntohl(ping.dest));
+    print_str(" ping statistics ---\n");
+    print_number(sent);
+    print_str(" packets transmitted, ");
+    print_number(ping.received);
+    print_str(" received, ");
+    if (ping.duplicates) {
+        print_str("+");
+        print_number(ping.duplicates);
+        print_str(" duplicates, ");
+    }
+    print_number(sent ? (uint64_t)(sent - ping.received) * 100 / sent : 0);
+    print_str("% packet loss, time ");
+    print_number(elapsed_ns / 1000000);
+    print_str("ms\n");
+
+    if (ping.received) {
+        uint64_t avg = ping.sum_ns / ping.received;
+        uint64_t mean = avg / 100;
+        uint64_t mean2 = ping.sum2 / ping.received;
+        uint64_t mdev = (mean2 > mean * mean ? isqrt(mean2 - mean * mean) : 0) * 100;
+
+        print_str("rtt min/avg/max/mdev = ");
+        print_ms(ping.min_ns);
+        print_char('/');
+        print_ms(avg);
+        print_char('/');
+        print_ms(ping.max_ns);
+        print_char('/');
+        print_ms(mdev);
+        print_str(" ms\n");
+    }
+
+    if (flood && elapsed_ns) {
+        print_number((uint64_t)sent * 1000000000 / elapsed_ns);
+        print_str(" requests/s sent, ");
+        print_number((uint64_t)ping.received * 1000000000 / elapsed_ns);
+        print_str(" replies/s received\n");
+    }
+}
+
+static void CMD_ping(const char* args) {
+    char word[20];
+    uint64_t count = PING_DEFAULT_COUNT;
+    uint64_t interval = PING_DEFAULT_INTERVAL;
+    uint64_t size = PING_DEFAULT_SIZE;
+    bool flood = false;
+    bool count_given = false;
+    uint32_t dest = 0;
+
+    while ((args = str_next_word(args, word, sizeof(word))) != NULL) {
+        uint64_t* option = NULL;
+        if (strcmp(word, "-f") == 0) {
+            flood = true;
+            continue;
+        } else if (strcmp(word, "-c") == 0) {
+            option = &count;
+            count_given = true;
+        } else if (strcmp(word, "-i") == 0) {
+            option = &interval;
+        } else if (strcmp(word, "-s") == 0) {
+            option = &size;
+        } else if ((dest = ip_str_to_addr(word)) == 0) {
+            print_str("Bad address: ");
+            print_str(word);
+            print_str("\n");
+            return;
+        }
+
+        if (option && (!(args = str_next_word(args, word, sizeof(word))) ||
+                       !str_to_uint(word, option))) {
+            print_str("Missing number after option\n");
+            return;
+        }
+    }
+
+    if (!dest) {
+        print_str("Usage: ping [-c count] [-i ms] [-s size] [-f] <ip-address>\n");
+        return;
+    }
+    if (size > ICMP_ECHO_MAX_PAYLOAD) {
+        print_str("Size is limited to ");
+        print_number(ICMP_ECHO_MAX_PAYLOAD);
+        print_str(" bytes\n");
+        return;
+    }
+    if (flood && !count_given) {
+        count = 0;
+    }
+
+    memset(&ping, 0, sizeof(ping));
+    ping.dest = dest;
+    ping.identifier = ping_identifier++;
+    icmp_set_echo_reply_handler(ping_reply);
+
+    print_str("PING ");
+    print_ip(ntohl(dest));
+    print_str(" ");
+    print_number(size);
+    print_str(" data bytes");
+    print_str(count ? "\n" : ", press any key to stop\n");
+
+    uint32_t sent = 0;
+    bool stopped = false;
+    uint64_t start = rdtsc();
+    uint64_t last_send = 0;
+
+    while (!stopped && (count == 0 || sent < count)) {
+        if (flood) {
+            // Keep a few requests in flight, and don't stall on lost ones
+            if (sent - ping.received >= PING_FLOOD_WINDOW &&
+                tick_count - last_send < PING_FLOOD_RESEND_MS) {
+                if (!ethernet_poll(ETH_POLL_BUDGET)) __asm__ volatile("pause");
+                stopped = key_pressed();
+                continue;
+            }
+        } else if (sent && tick_count - last_send < interval) {
+            print_queued_replies();
+            stopped = key_pressed();
+            if (!stopped) ethernet_wait();
+            continue;
+        }
+
+        last_send = tick_count;
+        if (ping_send(size)) {
+            sent++;
+        } else if (!flood) {
+            print_str("Failed to send request\n");
+            sent++;
+        }
+    }
+
+    // Give the last replies a chance
+    uint64_t deadline = tick_count + PING_TIMEOUT_MS;
+    while (!stopped && ping.received < sent && tick_count < deadline) {
+        print_queued_replies();
+        stopped = key_pressed();
+        if (!stopped) ethernet_wait();
+    }
+    uint64_t elapsed = tsc_to_ns(rdtsc() - start);
+    icmp_set_echo_reply_handler(NULL);
+
+    if (!flood) print_queued_replies();
+    print_summary(sent, elapsed, flood);
+}
+
+static const command_t ping_command = {
+    .name = "ping",
+    .short_desc = "Send ICMP echo requests and measure round trip times",
+    .usage = "ping [-c count] [-i ms] [-s size] [-f] <ip-address>",
+    .long_desc = "Sends ICMP echo requests, matches the replies by identifier and sequence number and "
+                 "prints the round trip time of each, measured with the TSC. Ends with min/avg/max/mdev "
+                 "and the packet loss. -c sets the number of requests (default 4), -i the interval in "
+                 "milliseconds (default 1000) and -s the payload size (default 56). -f floods: it keeps "
+                 "a few requests in flight without printing each reply and reports packets per second, "
+                 "until a key is pressed unless -c is given.",
+    .examples = "ping 10.0.2.2\nping -c 10 -i 200 10.0.2.2\nping -s 1400 10.0.2.2\nping -f -c 10000 10.0.2.2",
+    .execute = CMD_ping
+};
+
+void CMD_init_ping() {
+    register_command(&ping_command);
+}
@@ -0,0 +1,38 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/fs/vfs.h"
+#include "rm.h"
+
+static void CMD_rm(const char* args) {
+    char path[VFS_PATH_MAX];
+    const char* rest = args;
+
+    if (!str_next_word(rest, path, sizeof(path))) {
+        print_str("Usage: rm <path>...\n");
+        return;
+    }
+    while ((rest = str_next_word(rest, path, sizeof(path))) != NULL) {
+        vfs_error_t error = vfs_remove(path);
+        if (error != VFS_OK) {
+            print_str(path);
+            print_str(": ");
+            print_str(vfs_error_string(error));
+            print_str("\n");
+        }
+    }
+}
+
+static const command_t rm_command = {
+    .name = "rm",
+    .short_desc = "Remove files and empty directories",
+    .usage = "rm <path>...",
+    .long_desc = "Removes files and empty directories from the RAM file system. The pages of a "
+                 "removed file are kept by the file system for the next files.",
+    .examples = "rm /notes\nrm /tmp/a /tmp",
+    .execute = CMD_rm
+};
+
+void CMD_init_rm() {
+    register_command(&rm_command);
+}
@@ -0,0 +1,400 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/timer.h"
+#include "../../libs/random.h"
+#include "../../libs/net/ip.h"
+#include "../../libs/net/netif.h"
+#include "../../libs/net/route.h"
+#include "route.h"
+
+#define ROUTE_BENCH_DEFAULT    1000
+#define ROUTE_BENCH_LOOKUPS    100000
+#define ROUTE_BENCH_HOT        64        // Destinations in the cached run
+
+// Prefixes the benchmark added, so it can take exactly those out again
+static struct {
+    uint32_t prefix;
+    uint8_t length;
+} bench_routes[ROUTE_MAX];
+
+// "a.b.c.d/len", a bare address (/32) or "default" (0.0.0.0/0)
+static bool parse_prefix(const char* str, uint32_t* prefix, uint8_t* length) {
+    if (strcmp(str, "default") == 0) {
+        *prefix = 0;
+        *length = 0;
+        return true;
+    }
+
+    char addr[16];
+    size_t i = 0;
+    while (str[i] && str[i] != '/' && i < sizeof(addr) - 1) {
+        addr[i] = str[i];
+        i++;
+    }
+    addr[i] = '\0';
+
+    uint64_t len = 32;
+    if (str[i] == '/' && (!str_to_uint(str + i + 1, &len) || len > 32)) {
+        return false;
+    }
+    if (str[i] != '/' && str[i] != '\0') {
+        return false;
+    }
+
+    uint32_t ip = ip_str_to_addr(addr);
+    if (ip == 0 && strcmp(addr, "0.0.0.0") != 0) {
+        return false;
+    }
+    *prefix = ip & netif_length_to_mask(len);
+    *length = len;
+    return true;
+}
+
+static void print_prefix(uint32_t prefix, uint8_t length) {
+    if (length == 0) {
+        print_str("default");
+        return;
+    }
+    print_ip(ntohl(prefix));
+    print_str("/");
+    print_number(length);
+}
+
+static void print_route(const route_t* r) {
+    print_prefix(r->prefix, r->length);
+    if (r->gateway) {
+        print_str(" via ");
+        print_ip(ntohl(r->gateway));
+    }
+    print_str(" dev ");
+    print_str(r->netif->name);
+    if (r->mtu) {
+        print_str(" mtu ");
+        print_number(r->mtu);
+    }
+    print_str("\n");
+}
+
+static void list(void) {
+    netif_t* netif;
+    for (int i = 0; (netif = netif_get(i)) != NULL; i++) {
+        print_str(netif->name);
+        print_str(": ");
+        if (netif->addr) {
+            print_ip(ntohl(netif->addr));
+            print_str("/");
+            print_number(netif_mask_to_length(netif->netmask));
+        } else {
+            print_str("no address");
+        }
+        print_str(" mtu ");
+        print_number(netif->mtu);
+        print_str(netif->up ? "\n" : " down\n");
+    }
+
+    // Only the first few of a large table
+    int shown = 0;
+    for (int i = 0; i < ROUTE_MAX; i++) {
+        const route_t* r = route_get(i);
+        if (!r) continue;
+        if (shown++ == 32) {
+            print_str("... ");
+            print_number(route_get_stats()->routes - 32);
+            print_str(" more\n");
+            break;
+        }
+        print_route(r);
+    }
+}
+
+static void add(const char* args) {
+    char word[24];
+    uint32_t prefix, gateway = 0;
+    uint8_t length;
+    uint64_t mtu = 0;
+    netif_t* netif = NULL;
+
+    if (!(args = str_next_word(args, word, sizeof(word))) || !parse_prefix(word, &prefix, &length)) {
+        print_str("Usage: route add <prefix>/<length>|default [via <gateway>] [dev <interface>] [mtu <bytes>]\n");
+        return;
+    }
+
+    while ((args = str_next_word(args, word, sizeof(word))) != NULL) {
+        char value[24];
+        if (!(args = str_next_word(args, value, sizeof(value)))) {
+            print_str("Missing value for ");
+            print_str(word);
+            print_str("\n");
+            return;
+        }
+
+        if (strcmp(word, "via") == 0) {
+            if ((gateway = ip_str_to_addr(value)) == 0) {
+                print_str("Bad gateway address\n");
+                return;
+            }
+        } else if (strcmp(word, "dev") == 0) {
+            if (!(netif = netif_find(value))) {
+                print_str("No such interface\n");
+                return;
+            }
+        } else if (strcmp(word, "mtu") == 0) {
+            if (!str_to_uint(value, &mtu) || mtu < 68 || mtu > 65535) {
+                print_str("MTU must be 68-65535\n");
+                return;
+            }
+        } else {
+            print_str("Unknown option ");
+            print_str(word);
+            print_str("\n");
+            return;
+        }
+    }
+
+    // The gateway has to be on the link, which tells the interface too
+    if (gateway) {
+        const route_t* r = route_lookup(gateway);
+        if (!r || r->gateway) {
+            print_str("Gateway is not on a connected network\n");
+            return;
+        }
+        if (!netif) netif = r->netif;
+    }
+    if (!netif) {
+        print_str("Give a gateway or an interface\n");
+        return;
+    }
+
+    if (!route_add(prefix, length, gateway, netif, mtu)) {
+        print_str("Routing table full\n");
+    }
+}
+
+static void get(const char* addr) {
+    uint32_t dest = ip_str_to_addr(addr);
+    if (dest == 0) {
+        print_str("Bad address\n");
+        return;
+    }
+
+    if (ip_is_local(dest)) {
+        print_str("local, via lo\n");
+        return;
+    }
+    const route_t* r = route_lookup(dest);
+    if (!r) {
+        print_str("No route\n");
+        return;
+    }
+    print_route(r);
+    print_str("src ");
+    print_ip(ntohl(r->netif->addr));
+    print_str(" mtu ");
+    print_number(route_mtu(r));
+    print_str("\n");
+}
+
+static void set_address(const char* args) {
+    char name[NETIF_NAME_LEN + 1], value[24];
+    uint32_t addr;
+    uint8_t length;
+
+    args = str_next_word(args, name, sizeof(name));
+    netif_t* netif = args ? netif_find(name) : NULL;
+    if (!netif || !str_next_word(args, value, sizeof(value)) ||
+        !parse_prefix(value, &addr, &length)) {
+        print_str("Usage: route addr <interface> <address>/<length>\n");
+        return;
+    }
+
+    // parse_prefix clears the host bits, take the address as given
+    char ip[16];
+    size_t i = 0;
+    while (value[i] && value[i] != '/' && i < sizeof(ip) - 1) {
+        ip[i] = value[i];
+        i++;
+    }
+    ip[i] = '\0';
+    if (!netif_set_address(netif, ip_str_to_addr(ip), netif_length_to_mask(length))) {
+        print_str("Routing table full\n");
+    }
+}
+
+static void set_mtu(const char* args) {
+    char name[NETIF_NAME_LEN + 1], value[8];
+    uint64_t mtu;
+
+    args = str_next_word(args, name, sizeof(name));
+    netif_t* netif = args ? netif_find(name) : NULL;
+    if (!netif || !str_next_word(args, value, sizeof(value)) || !str_to_uint(value, &mtu)) {
+        print_str("Usage: route mtu <interface> <bytes>\n");
+        return;
+    }
+    if (mtu < NETIF_MIN_MTU || mtu > NETIF_MAX_MTU || !netif_set_mtu(netif, mtu)) {
+        print_str("The interface can't use that MTU\n");
+    }
+}
+
+static void print_stats(void) {
+    const route_stats_t* s = route_get_stats();
+    print_str("routes: ");
+    print_number(s->routes);
+    print_str("/");
+    print_number(ROUTE_MAX);
+    print_str(", tables below /16: ");
+    print_number(s->chunks);
+    print_str("/");
+    print_number(ROUTE_CHUNKS);
+    print_str("\nlookups: ");
+    print_number(s->lookups);
+    print_str(", cache hits: ");
+    print_number(s->cache_hits);
+    if (s->lookups) {
+        print_str(" (");
+        print_number(s->cache_hits * 100 / s->lookups);
+        print_str("%)");
+    }
+    print_str("\n");
+}
+
+static uint32_t random_addr(void) {
+    return (random_next() << 16) ^ random_next();
+}
+
+// Time lookups through a table with count extra random prefixes
+static void bench(uint64_t count) {
+    netif_t* lo = netif_find("lo");
+    uint32_t added = 0;
+
+    uint64_t start = rdtsc();
+    while (added < count) {
+        // Shaped roughly like an internet table: mostly /16 to /24, a few longer
+        uint8_t length = random_next() % 8 ? 16 + random_next() % 9 : 8 + random_next() % 25;
+        uint32_t prefix = random_addr() & netif_length_to_mask(length);
+
+        // Leave real routes alone, and keep out of 127/8 and the default
+        if (route_find(prefix, length) || IP_ADDR_PART1(prefix) == 127) continue;
+        if (!route_add(prefix, length, 0, lo, 0)) break;
+        bench_routes[added].prefix = prefix;
+        bench_routes[added].length = length;
+        added++;
+    }
+    uint64_t insert_cycles = rdtsc() - start;
+
+    volatile const route_t* sink;
+    start = rdtsc();
+    for (int i = 0; i < ROUTE_BENCH_LOOKUPS; i++) {
+        sink = route_lookup_lpm(random_addr());
+    }
+    uint64_t lpm_cycles = rdtsc() - start;
+
+    uint32_t hot[ROUTE_BENCH_HOT];
+    for (int i = 0; i < ROUTE_BENCH_HOT; i++) {
+        hot[i] = random_addr();
+    }
+    start = rdtsc();
+    for (int i = 0; i < ROUTE_BENCH_LOOKUPS; i++) {
+        sink = route_lookup(hot[i % ROUTE_BENCH_HOT]);
+    }
+    uint64_t cached_cycles = rdtsc() - start;
+    (void)sink;
+
+    print_str("Added ");
+    print_number(added);
+    print_str(" prefixes, ");
+    print_number(added ? insert_cycles / added : 0);
+    print_str(" cycles each, ");
+    print_number(route_get_stats()->chunks);
+    print_str(" tables below /16\n");
+    print_str("Lookup, random destinations: ");
+    print_number(lpm_cycles / ROUTE_BENCH_LOOKUPS);
+    print_str(" cycles (");
+    print_number(tsc_to_ns(lpm_cycles) / ROUTE_BENCH_LOOKUPS);
+    print_str(" ns)\n");
+    print_str("Lookup, 64 hot destinations through the cache: ");
+    print_number(cached_cycles / ROUTE_BENCH_LOOKUPS);
+    print_str(" cycles (");
+    print_number(tsc_to_ns(cached_cycles) / ROUTE_BENCH_LOOKUPS);
+    print_str(" ns)\n");
+
+    start = rdtsc();
+    for (uint32_t i = 0; i < added; i++) {
+        route_delete(bench_routes[i].prefix, bench_routes[i].length);
+    }
+    print_str("Removed them again, ");
+    print_number(added ? (rdtsc() - start) / added : 0);
+    print_str(" cycles each\n");
+}
+
+static void CMD_route(const char* args) {
+    char word[24];
+
+    args = str_next_word(args, word, sizeof(word));
+    if (!args) {
+        list();
+    } else if (strcmp(word, "add") == 0) {
+        add(args);
+    } else if (strcmp(word, "del") == 0) {
+        uint32_t prefix;
+        uint8_t length;
+        if (!str_next_word(args, word, sizeof(word)) || !parse_prefix(word, &prefix, &length)) {
+            print_str("Usage: route del <prefix>/<length>|default\n");
+        } else if (!route_delete(prefix, length)) {
+            print_str("No such route\n");
+        }
+    } else if (strcmp(word, "get") == 0) {
+        if (str_next_word(args, word, sizeof(word))) {
+            get(word);
+        } else {
+            print_str("Usage: route get <address>\n");
+        }
+    } else if (strcmp(word, "addr") == 0) {
+        set_address(args);
+    } else if (strcmp(word, "mtu") == 0) {
+        set_mtu(args);
+    } else if (strcmp(word, "stats") == 0) {
+        print_stats();
+        if (str_next_word(args, word, sizeof(word)) && strcmp(word, "reset") == 0) {
+            route_reset_stats();
+        }
+    } else if (strcmp(word, "bench") == 0) {
+        uint64_t count = ROUTE_BENCH_DEFAULT;
+        if (str_next_word(args, word, sizeof(word)) &&
+            (!str_to_uint(word, &count) || count > ROUTE_MAX - route_get_stats()->routes)) {
+            print_str("Count must fit in the free routing table slots\n");
+            return;
+        }
+        bench(count);
+    } else {
+        print_str("Usage: route [add|del|get|addr|mtu|stats|bench] ...\n");
+    }
+}
+
+static const command_t route_command = {
+    .name = "route",
+    .short_desc = "Show and change interfaces and the routing table",
+    .usage = "route [add <prefix>/<length>|default [via <gateway>] [dev <interface>] [mtu <bytes>] | "
+             "del <prefix>/<length> | get <address> | addr <interface> <address>/<length> | "
+             "mtu <interface> <bytes> | "
+             "stats [reset] | bench [count]]",
+    .long_desc = "Without arguments lists the interfaces with their addresses and MTUs, then the routes. "
+                 "add creates a route or changes an existing one; without dev the interface is the "
+                 "one the gateway is reachable on, mtu caps the packet size below the interface's. "
+                 "del removes a route. get shows the route, source address and MTU used for a "
+                 "destination. addr sets an interface's address, replacing the route to its subnet. "
+                 "mtu sets an interface's MTU (68-9000); above 1500 the card needs jumbo frame "
+                 "support (e1000, e1000e), lo takes any. "
+                 "stats shows the table size and how many lookups the destination cache answered. "
+                 "bench adds count random prefixes (default 1000), times lookups with and without "
+                 "the cache and removes them again.",
+    .examples = "route\nroute add 192.168.1.0/24 via 10.0.2.2 mtu 1400\nroute add default via 10.0.2.2\n"
+                "route del 192.168.1.0/24\nroute get 8.8.8.8\nroute addr eth0 10.0.2.15/24\n"
+                "route mtu eth0 9000\n"
+                "route stats\nroute bench 4000",
+    .execute = CMD_route
+};
+
+void CMD_init_route() {
+    register_command(&route_command);
+}
@@ -0,0 +1,80 @@
+#include "../command_registry.h"
+#include "../../libs/print.h"
+#include "../../libs/string.h"
+#include "../../libs/fs/vfs.h"
+#include "write.h"
+
+#define WRITE_USAGE  "Usage: write [-a | -o <offset>] <path> [text]\n"
+
+static void print_error(const char* path, vfs_error_t error) {
+    print_str(path);
+    print_str(": ");
+    print_str(vfs_error_string(error));
+    print_str("\n");
+}
+
+// Write a line of text to a file, which is created if it doesn't exist. The
+// file is replaced, appended to with -a, or overwritten at an offset with
+// -o, which leaves a hole if the offset is past the end.
+static void CMD_write(const char* args) {
+    char path[VFS_PATH_MAX];
+    char word[24];
+    bool append = false;
+    bool at_offset = false;
+    uint64_t offset = 0;
+
+    const char* rest = str_next_word(args, word, sizeof(word));
+    if (rest && strcmp(word, "-a") == 0) {
+        append = true;
+        rest = str_next_word(rest, word, sizeof(word));
+    } else if (rest && strcmp(word, "-o") == 0) {
+        if (!(rest = str_next_word(rest, word, sizeof(word))) || !str_to_uint(word, &offset)) {
+            print_str(WRITE_USAGE);
+            return;
+        }
+        at_offset = true;
+    } else {
+        // That was the path
+        rest = args;
+    }
+    if (!(rest = str_next_word(rest, path, sizeof(path)))) {
+        print_str(WRITE_USAGE);
+        return;
+    }
+    while (*rest == ' ') rest++;
+
+    vfs_dentry_t* d;
+    vfs_error_t error = vfs_lookup(path, &d);
+    if (error == VFS_ERR_NOT_FOUND) error = vfs_create(path, VFS_FILE, &d);
+    if (error == VFS_OK && d->inode->type == VFS_DIR) error = VFS_ERR_IS_DIR;
+    if (error == VFS_OK && !d->inode->fs->write) error = VFS_ERR_READ_ONLY;
+    if (error == VFS_OK && !append && !at_offset) error = vfs_truncate(d->inode, 0);
+    if (error != VFS_OK) {
+        print_error(path, error);
+        return;
+    }
+    if (append) offset = d->inode->size;
+
+    uint64_t len = strlen(rest);
+    uint64_t written = vfs_write(d->inode, offset, rest, len);
+    if (written == len) written += vfs_write(d->inode, offset + len, "\n", 1);
+    if (written < len + 1) {
+        print_error(path, VFS_ERR_NO_SPACE);
+    }
+}
+
+static const command_t write_command = {
+    .name = "write",
+    .short_desc = "Write a line to a file",
+    .usage = "write [-a | -o <offset>] <path> [text]",
+    .long_desc = "Writes the rest of the line and a newline to a file in the RAM file system, "
+                 "creating it if needed. The file is replaced unless -a appends to it or -o "
+                 "writes at a byte offset. Writing past the end leaves a hole that takes no "
+                 "memory and reads as zeros.",
+    .examples = "write /notes hello\nwrite -a /notes more\nwrite -o 1000000 /sparse end",
+    .execute = CMD_write
+};
+
+void CMD_init_write() {
+    register_command(&write_command);
+}
@@ -49,6 +49,22 @@ global isr44
 global isr45
 global isr46
 global isr47
+global isr48
+global isr49
+global isr50
+global isr51
+global isr52
+global isr53
+global isr54
+global isr55
+global isr56
+global isr57
+global isr58
+global isr59
+global isr60
+global isr61
+global isr62
+global isr63
 
 ; Reference to C handler function
 extern isr_handler
@@ -120,6 +136,24 @@ ISR_NOERRCODE 45  ; FPU / Coprocessor
 ISR_NOERRCODE 46  ; Primary ATA Hard Disk
 ISR_NOERRCODE 47  ; Secondary ATA Hard Disk
 
+; Message signalled interrupts, delivered through the local APIC
+ISR_NOERRCODE 48
+ISR_NOERRCODE 49
+ISR_NOERRCODE 50
+ISR_NOERRCODE 51
+ISR_NOERRCODE 52
+ISR_NOERRCODE 53
+ISR_NOERRCODE 54
+ISR_NOERRCODE 55
+ISR_NOERRCODE 56
+ISR_NOERRCODE 57
+ISR_NOERRCODE 58
+ISR_NOERRCODE 59
+ISR_NOERRCODE 60
+ISR_NOERRCODE 61
+ISR_NOERRCODE 62
+ISR_NOERRCODE 63  ; Local APIC spurious interrupt
+
 ; Common stub for handling interrupts
 isr_common_stub:
     ; Save all registers
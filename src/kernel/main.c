@@ -3,13 +3,55 @@
 #include "../libs/interrupt.h"
 #include "../libs/keyboard.h"
 #include "../cmds/command_registry.h"
-// #include "../libs/net/ethernet.h"
-// #include "../libs/net/ip.h"
-// #include "../libs/net/icmp.h"
-// #include "../libs/types.h"
+#include "../libs/net/ethernet.h"
+#include "../libs/net/ip.h"
+#include "../libs/net/netif.h"
+#include "../libs/net/route.h"
+#include "../libs/net/arp.h"
+#include "../libs/net/icmp.h"
+#include "../libs/net/udp.h"
+#include "../libs/net/tcp.h"
+#include "../libs/block/blkdev.h"
+#include "../libs/block/bcache.h"
+#include "../libs/multiboot.h"
+#include "../libs/memory.h"
+#include "../libs/fs/initramfs.h"
+#include "../libs/fs/vfs.h"
+#include "../libs/fs/tmpfs.h"
+#include "../libs/fs/ext2.h"
+#include "../libs/fs/pcache.h"
 #include "cli.h"
 #include "panic.h"
 
+#define LOOPBACK_CHECK_ID    0x4c43
+#define LOOPBACK_CHECK_MS    100
+
+static volatile bool loopback_replied;
+
+static void loopback_reply(uint32_t src_ip, uint16_t identifier, uint16_t sequence,
+                           const uint8_t* payload, uint16_t payload_len) {
+    (void)src_ip;
+    (void)sequence;
+    (void)payload;
+    (void)payload_len;
+    if (identifier == LOOPBACK_CHECK_ID) loopback_replied = true;
+}
+
+// Ping 127.0.0.1 once. The echo goes down and back up every layer without
+// a card, so a stack that can't answer itself shows at boot.
+static bool loopback_check(void) {
+    loopback_replied = false;
+    icmp_set_echo_reply_handler(loopback_reply);
+    if (icmp_send_echo_request(IP_LOOPBACK, LOOPBACK_CHECK_ID, 0, 56)) {
+        uint64_t deadline = tick_count + LOOPBACK_CHECK_MS;
+        while (!loopback_replied && tick_count < deadline) {
+            ethernet_poll(ETH_POLL_BUDGET);
+        }
+    }
+    icmp_set_echo_reply_handler(NULL);
+    return loopback_replied;
+}
+
 void kernel_main(uint32_t multiboot_magic, void* multiboot_info) {
     print_clear();
     // print_set_color(PRINT_COLOR_WHITE, PRINT_COLOR_BLACK);
@@ -21,6 +63,7 @@ void kernel_main(uint32_t multiboot_magic, void* multiboot_info) {
         timer_init,
         keyboard_init,
         enable_interrupts,
+        timer_calibrate_tsc,
         initialize_command_registry
     };
 
@@ -31,22 +74,87 @@ void kernel_main(uint32_t multiboot_magic, void* multiboot_info) {
     }
     print_str("] Done\n");
 
+    if (multiboot_init(multiboot_magic, multiboot_info) && memory_init()) {
+        print_str("Memory: ");
+        print_number(memory_total() / (1024 * 1024));
+        print_str(" MiB, ");
+        print_number(memory_free() / (1024 * 1024));
+        print_str(" MiB free\n");
+    } else {
+        print_str("No memory map from the boot loader\n");
+    }
 
+    // Only finds the module, the archive is unpacked and indexed when it is
+    // first used
+    if (initramfs_init()) {
+        print_str("initramfs: ");
+        print_number(initramfs_size() / 1024);
+        print_str(" KiB");
+        if (initramfs_get_stats()->packed_size) {
+            print_str(", ");
+            print_number(initramfs_get_stats()->packed_size / 1024);
+            print_str(" KiB packed");
+        }
+        print_str("\n");
+    }
+
+    // The root file system lives in RAM and starts out empty
+    vfs_init(&tmpfs_ops);
 
-    // Network support comming in 2030 - ploszukiwacz
-    // print_str("Checking for network hardware...");
-    //     bool net_available = false;
+    // The stack comes up either way, without a card it only has loopback
+    print_str("Checking for network hardware...");
+    bool net_available = ethernet_init();
+    ip_init();
+    netif_t* eth0 = netif_find("eth0");
+    if (eth0) {
+        // QEMU user networking defaults
+        netif_set_address(eth0, IP_ADDR(10, 0, 2, 15), IP_ADDR(255, 255, 255, 0));
+        route_add(0, 0, IP_ADDR(10, 0, 2, 2), eth0, 0);
+    }
+    arp_init();
+    icmp_init();
+    udp_init();
+    udp_services_init();
+    tcp_init();
+    tcp_services_init();
+    print_str(net_available ? "initialized\n" : "not detected, loopback only\n");
+    if (!loopback_check()) {
+        print_str("Loopback does not answer ICMP echo requests\n");
+    }
 
-    //     // Set a short timeout for network detection
-    //     uint64_t start_time = tick_count;
-    //     net_available = ethernet_init();
-    //     if (!net_available) {
-    //         print_str("not detected\n");
-    //     } else {
-    //         ip_init(0xC0A80164);  // 192.168.1.100
-    //         icmp_init();
-    //         print_str("initialized\n");
-    //     }
+    print_str("Checking for disks...");
+    if (blk_init()) {
+        for (int i = 0; i < blk_device_count(); i++) {
+            print_str(" ");
+            print_str(blk_get_device(i)->name);
+        }
+        print_str("\n");
+    } else {
+        print_str("none\n");
+    }
+    if (bcache_init()) {
+        print_str("Block cache: ");
+        print_number((uint64_t)bcache_size() * BCACHE_BLOCK_SIZE / (1024 * 1024));
+        print_str(" MiB\n");
+        if (pcache_init()) {
+            print_str("Page cache: ");
+            print_number((uint64_t)pcache_size() * PAGE_SIZE / (1024 * 1024));
+            print_str(" MiB\n");
+        }
+
+        // The first disk with an ext2 file system shows up under /mnt
+        for (int i = 0; i < blk_device_count(); i++) {
+            blk_device_t* dev = blk_get_device(i);
+            if (!ext2_probe(dev)) continue;
+            vfs_create("/mnt", VFS_DIR, NULL);
+            if (ext2_mount(dev, "/mnt") == VFS_OK) {
+                print_str("ext2 on ");
+                print_str(dev->name);
+                print_str(" mounted on /mnt\n");
+                break;
+            }
+        }
+    }
 
     // Initialize and run the command line interface
     cli_init();
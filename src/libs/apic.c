@@ -0,0 +1,68 @@
+#include "apic.h"
+#include "interrupt.h"
+#include "paging.h"
+
+#define IA32_APIC_BASE_MSR   0x1B
+#define APIC_BASE_ENABLE     (1 << 11)
+#define SVR_ENABLE           (1 << 8)
+#define LVT_EXTINT           (7 << 8)
+#define LVT_NMI              (4 << 8)
+
+static volatile uint32_t* lapic = 0;
+
+static inline uint64_t rdmsr(uint32_t msr) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t msr, uint64_t value) {
+    __asm__ volatile("wrmsr" : : "c"(msr), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic[reg / 4] = value;
+}
+
+bool lapic_init(void) {
+    uint32_t edx, unused;
+
+    // CPUID.1:EDX bit 9 says there is a local APIC
+    __asm__ volatile("cpuid" : "=a"(unused), "=b"(unused), "=c"(unused), "=d"(edx) : "a"(1), "c"(0));
+    if (!(edx & (1 << 9))) {
+        return false;
+    }
+
+    uint64_t base_msr = rdmsr(IA32_APIC_BASE_MSR);
+    uint64_t base = base_msr & 0xFFFFFF000ULL;
+    if (!paging_map_mmio(base, 4096)) {
+        return false;
+    }
+    wrmsr(IA32_APIC_BASE_MSR, base_msr | APIC_BASE_ENABLE);
+    lapic = (volatile uint32_t*)base;
+
+    // Keep the PIC working: its output comes in as ExtINT on LINT0
+    lapic_write(LAPIC_REG_LINT0, LVT_EXTINT);
+    lapic_write(LAPIC_REG_LINT1, LVT_NMI);
+    lapic_write(LAPIC_REG_TPR, 0);
+    lapic_write(LAPIC_REG_SVR, SVR_ENABLE | SPURIOUS_VECTOR);
+    return true;
+}
+
+bool lapic_enabled(void) {
+    return lapic != 0;
+}
+
+uint8_t lapic_id(void) {
+    return lapic ? lapic_read(LAPIC_REG_ID) >> 24 : 0;
+}
+
+void lapic_eoi(void) {
+    if (lapic) {
+        lapic_write(LAPIC_REG_EOI, 0);
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define LAPIC_DEFAULT_BASE 0xFEE00000
+
+// Local APIC registers
+#define LAPIC_REG_ID       0x020
+#define LAPIC_REG_TPR      0x080
+#define LAPIC_REG_EOI      0x0B0
+#define LAPIC_REG_SVR      0x0F0
+#define LAPIC_REG_LINT0    0x350
+#define LAPIC_REG_LINT1    0x360
+
+// MSI address and data layout (x86)
+#define MSI_ADDRESS(apic_id)  (LAPIC_DEFAULT_BASE | ((uint32_t)(apic_id) << 12))
+#define MSI_DATA(vector)      ((uint32_t)(vector))   // Fixed delivery, edge triggered
+
+// Enable the local APIC so message signalled interrupts are accepted. The
+// 8259 keeps working through LINT0 in virtual wire mode.
+bool lapic_init(void);
+
+// Whether lapic_init succeeded
+bool lapic_enabled(void);
+
+// APIC ID of the running CPU, the MSI destination for it
+uint8_t lapic_id(void);
+
+// Signal the end of an interrupt delivered through the local APIC
+void lapic_eoi(void);
@@ -0,0 +1,490 @@
+#include "ahci.h"
+#include "blkdev.h"
+#include "../pci.h"
+#include "../apic.h"
+#include "../interrupt.h"
+#include "../string.h"
+#include "../timer.h"
+
+#define barrier() __asm__ volatile("" : : : "memory")
+
+// HBA registers
+#define HBA_CAP         0x00
+#define HBA_GHC         0x04
+#define HBA_IS          0x08
+#define HBA_PI          0x0C
+
+#define CAP_NCS(cap)    ((((cap) >> 8) & 0x1F) + 1)   // Command slots per port
+#define CAP_SNCQ        (1u << 30)
+
+#define GHC_IE          (1 << 1)
+#define GHC_AE          (1u << 31)
+
+// Port registers, relative to the port's block
+#define PORT_BASE(p)    (0x100 + (p) * 0x80)
+#define PX_CLB          0x00
+#define PX_CLBU         0x04
+#define PX_FB           0x08
+#define PX_FBU          0x0C
+#define PX_IS           0x10
+#define PX_IE           0x14
+#define PX_CMD          0x18
+#define PX_TFD          0x20
+#define PX_SIG          0x24
+#define PX_SSTS         0x28
+#define PX_SCTL         0x2C
+#define PX_SERR         0x30
+#define PX_SACT         0x34
+#define PX_CI           0x38
+
+#define PXCMD_ST        (1 << 0)
+#define PXCMD_FRE       (1 << 4)
+#define PXCMD_FR        (1 << 14)
+#define PXCMD_CR        (1 << 15)
+
+// Interrupt causes: a register FIS for plain commands, a set device bits
+// FIS for NCQ completions, and the errors
+#define PXIS_DHRS       (1 << 0)
+#define PXIS_SDBS       (1 << 3)
+#define PXIS_IFS        (1 << 27)
+#define PXIS_HBDS       (1 << 28)
+#define PXIS_HBFS       (1 << 29)
+#define PXIS_TFES       (1 << 30)
+#define PXIS_ERRORS     (PXIS_IFS | PXIS_HBDS | PXIS_HBFS | PXIS_TFES)
+
+#define TFD_DRQ         0x08
+#define TFD_BSY         0x80
+
+#define SCTL_DET_MASK   0xF
+#define SCTL_DET_INIT   1      // COMRESET while set
+
+#define SSTS_DET(s)     ((s) & 0xF)
+#define SSTS_IPM(s)     (((s) >> 8) & 0xF)
+#define DET_PRESENT     3      // Device there and communication established
+#define IPM_ACTIVE      1
+#define SIG_ATA         0x00000101
+
+// ATA commands
+#define ATA_IDENTIFY        0xEC
+#define ATA_READ_DMA_EXT    0x25
+#define ATA_WRITE_DMA_EXT   0x35
+#define ATA_READ_FPDMA      0x60
+#define ATA_WRITE_FPDMA     0x61
+#define ATA_READ_LOG_EXT    0x2F
+
+#define ATA_LOG_NCQ_ERROR   0x10
+
+#define FIS_TYPE_H2D    0x27
+#define FIS_H2D_CMD     0x80   // The FIS carries a command
+#define ATA_DEV_LBA     0x40
+
+#define FIS_H2D_SIZE    20
+#define TIMEOUT_MS      1000
+
+// Command list entry
+typedef struct {
+    uint16_t flags;        // FIS length in dwords, write, prefetch
+    uint16_t prdtl;        // Scatter gather entries
+    volatile uint32_t prdbc;
+    uint64_t ctba;         // Command table
+    uint32_t reserved[4];
+} __attribute__((packed)) cmd_header_t;
+
+#define CMDH_WRITE      (1 << 6)
+
+// Physical region descriptor
+typedef struct {
+    uint64_t dba;
+    uint32_t reserved;
+    uint32_t dbc;          // Byte count minus one
+} __attribute__((packed)) prd_t;
+
+typedef struct {
+    uint8_t cfis[64];
+    uint8_t acmd[16];
+    uint8_t reserved[48];
+    prd_t prdt[AHCI_MAX_PRDS];
+} __attribute__((packed)) cmd_table_t;
+
+static cmd_header_t cmd_list[AHCI_MAX_SLOTS] __attribute__((aligned(1024)));
+static uint8_t rx_fis[256] __attribute__((aligned(256)));
+static cmd_table_t cmd_tables[AHCI_MAX_SLOTS] __attribute__((aligned(128)));
+static uint16_t identify[256];
+static uint8_t ncq_log[AHCI_SECTOR_SIZE];
+
+static struct {
+    bool present;
+    uint64_t abar;
+    pci_device_t device;
+    int port_num;            // Port the disk is on
+    uint32_t port;           // and its register block
+    bool ncq;
+    bool irq;                // Completions are signalled by an interrupt
+    uint32_t free;           // Slots not in use
+    uint32_t queued;         // Slots built but not issued until the next kick
+    uint32_t active;         // Slots issued and not yet completed
+    blk_request_t* requests[AHCI_MAX_SLOTS];
+} ahci;
+
+static bool ahci_submit(blk_request_t* req);
+static void ahci_kick(void);
+static void ahci_wait(void);
+
+static blk_device_t ahci_dev = {
+    .name = "ahci",
+    .submit = ahci_submit,
+    .kick = ahci_kick,
+    .wait = ahci_wait,
+};
+
+static inline uint32_t hba_read(uint32_t reg) {
+    return *(volatile uint32_t*)(ahci.abar + reg);
+}
+
+static inline void hba_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(ahci.abar + reg) = value;
+}
+
+static inline uint32_t port_read(uint32_t reg) {
+    return hba_read(ahci.port + reg);
+}
+
+static inline void port_write(uint32_t reg, uint32_t value) {
+    hba_write(ahci.port + reg, value);
+}
+
+// Spin until the bits are clear in a port register. Works with interrupts
+// off, error recovery runs in the interrupt handler.
+static bool wait_clear(uint32_t reg, uint32_t bits, uint32_t ms) {
+    uint64_t end = rdtsc() + ms * tsc_per_ms;
+    while (port_read(reg) & bits) {
+        if (rdtsc() > end) return false;
+        __asm__ volatile("pause");
+    }
+    return true;
+}
+
+static bool stop_port(void) {
+    port_write(PX_CMD, port_read(PX_CMD) & ~PXCMD_ST);
+    if (!wait_clear(PX_CMD, PXCMD_CR, 500)) return false;
+    port_write(PX_CMD, port_read(PX_CMD) & ~PXCMD_FRE);
+    return wait_clear(PX_CMD, PXCMD_FR, 500);
+}
+
+static bool start_port(void) {
+    if (!wait_clear(PX_TFD, TFD_BSY | TFD_DRQ, TIMEOUT_MS)) return false;
+    port_write(PX_CMD, port_read(PX_CMD) | PXCMD_FRE);
+    port_write(PX_CMD, port_read(PX_CMD) | PXCMD_ST);
+    return true;
+}
+
+// Point the port at our command list and FIS area
+static bool setup_port(void) {
+    if (!stop_port()) return false;
+
+    memset(cmd_list, 0, sizeof(cmd_list));
+    memset(rx_fis, 0, sizeof(rx_fis));
+    for (int i = 0; i < AHCI_MAX_SLOTS; i++) {
+        cmd_list[i].ctba = (uint64_t)&cmd_tables[i];
+    }
+    port_write(PX_CLB, (uint64_t)cmd_list & 0xFFFFFFFF);
+    port_write(PX_CLBU, (uint64_t)cmd_list >> 32);
+    port_write(PX_FB, (uint64_t)rx_fis & 0xFFFFFFFF);
+    port_write(PX_FBU, (uint64_t)rx_fis >> 32);
+
+    port_write(PX_SERR, 0xFFFFFFFF);
+    port_write(PX_IS, 0xFFFFFFFF);
+    return start_port();
+}
+
+// Fill in the command FIS and the scatter gather list of a slot
+static void build_command(int slot, uint8_t command, uint64_t lba, uint32_t count,
+                          bool write, const blk_sg_t* sg, int sg_count) {
+    cmd_header_t* header = &cmd_list[slot];
+    cmd_table_t* table = &cmd_tables[slot];
+    uint8_t* fis = table->cfis;
+
+    memset(fis, 0, FIS_H2D_SIZE);
+    fis[0] = FIS_TYPE_H2D;
+    fis[1] = FIS_H2D_CMD;
+    fis[2] = command;
+    fis[4] = lba;
+    fis[5] = lba >> 8;
+    fis[6] = lba >> 16;
+    fis[8] = lba >> 24;
+    fis[9] = lba >> 32;
+    fis[10] = lba >> 40;
+
+    if (command == ATA_READ_FPDMA || command == ATA_WRITE_FPDMA) {
+        // NCQ moves the count to the features and puts the tag in the count
+        fis[3] = count;
+        fis[11] = count >> 8;
+        fis[12] = slot << 3;
+        fis[7] = ATA_DEV_LBA;
+    } else if (command != ATA_IDENTIFY) {
+        fis[12] = count;
+        fis[13] = count >> 8;
+        fis[7] = ATA_DEV_LBA;
+    }
+
+    for (int i = 0; i < sg_count; i++) {
+        table->prdt[i].dba = (uint64_t)sg[i].addr;
+        table->prdt[i].reserved = 0;
+        table->prdt[i].dbc = sg[i].len - 1;
+    }
+
+    header->flags = (FIS_H2D_SIZE / 4) | (write ? CMDH_WRITE : 0);
+    header->prdtl = sg_count;
+    header->prdbc = 0;
+}
+
+// Reset the link, for a disk that stays busy after an error
+static void comreset(void) {
+    port_write(PX_SCTL, (port_read(PX_SCTL) & ~SCTL_DET_MASK) | SCTL_DET_INIT);
+    uint64_t end = rdtsc() + tsc_per_ms;   // At least 1 ms
+    while (rdtsc() < end) __asm__ volatile("pause");
+    port_write(PX_SCTL, port_read(PX_SCTL) & ~SCTL_DET_MASK);
+
+    end = rdtsc() + TIMEOUT_MS * tsc_per_ms;
+    while (SSTS_DET(port_read(PX_SSTS)) != DET_PRESENT && rdtsc() < end) {
+        __asm__ volatile("pause");
+    }
+    port_write(PX_SERR, 0xFFFFFFFF);
+}
+
+// After an NCQ error the disk aborts every queued command until its NCQ
+// error log is read, which takes a plain command
+static void read_ncq_log(int slot) {
+    blk_sg_t sg = { ncq_log, sizeof(ncq_log) };
+
+    build_command(slot, ATA_READ_LOG_EXT, ATA_LOG_NCQ_ERROR, 1, false, &sg, 1);
+    barrier();
+    port_write(PX_CI, 1u << slot);
+    wait_clear(PX_CI, 1u << slot, TIMEOUT_MS);
+    port_write(PX_IS, 0xFFFFFFFF);
+    hba_write(HBA_IS, 1u << ahci.port_num);
+}
+
+// Get the port going again after an error. Stopping it clears CI and
+// SACT. slot belongs to a failed command and is borrowed for the log read,
+// -1 if none failed. Commands not issued yet stay queued.
+static void recover(int slot) {
+    stop_port();
+    port_write(PX_SERR, 0xFFFFFFFF);
+    port_write(PX_IS, 0xFFFFFFFF);
+
+    // A reset also clears the disk's NCQ error state
+    bool reset = port_read(PX_TFD) & (TFD_BSY | TFD_DRQ);
+    if (reset) comreset();
+    if (!start_port()) return;
+    if (!reset && ahci.ncq && slot >= 0) read_ncq_log(slot);
+}
+
+// Complete the slots in mask, returns how many there were
+static int finish(uint32_t mask, bool ok) {
+    int count = 0;
+    for (; mask; count++) {
+        int i = __builtin_ctz(mask);
+        mask &= mask - 1;
+
+        blk_request_t* req = ahci.requests[i];
+        ahci.active &= ~(1u << i);
+        ahci.free |= 1u << i;
+
+        // The slot is free again, so the callback can submit the next command
+        blk_complete(req, ok);
+    }
+    return count;
+}
+
+// Complete what the disk finished, interrupts off. Returns how many.
+static int reap(void) {
+    if (!ahci.present) return 0;
+
+    uint32_t is = port_read(PX_IS);
+    port_write(PX_IS, is);
+    hba_write(HBA_IS, 1u << ahci.port_num);
+
+    // Plain commands are done when their CI bit clears, queued ones when
+    // the disk clears their SACT bit
+    uint32_t pending = port_read(PX_CI);
+    if (ahci.ncq) pending |= port_read(PX_SACT);
+    uint32_t done = ahci.active & ~pending;
+
+    // Those finished before the error, the rest failed or were aborted
+    // with it. NCQ aborts them all, the log says which one failed but they
+    // are failed together.
+    if (is & PXIS_ERRORS) {
+        uint32_t failed = ahci.active & pending;
+        recover(failed ? __builtin_ctz(failed) : -1);
+        return finish(done, true) + finish(failed, false);
+    }
+    return finish(done, true);
+}
+
+static void ahci_isr(void) {
+    ahci_dev.stats.interrupts++;
+    reap();
+}
+
+// Copy an IDENTIFY string, which has the two bytes of every word swapped
+static void identify_string(char* out, int first_word, int words) {
+    int len = 0;
+    for (int i = 0; i < words; i++) {
+        out[len++] = identify[first_word + i] >> 8;
+        out[len++] = identify[first_word + i] & 0xFF;
+    }
+    while (len > 0 && out[len - 1] == ' ') len--;
+    out[len] = '\0';
+}
+
+static bool identify_device(void) {
+    blk_sg_t sg = { identify, sizeof(identify) };
+
+    build_command(0, ATA_IDENTIFY, 0, 0, false, &sg, 1);
+    barrier();
+    port_write(PX_CI, 1);
+    if (!wait_clear(PX_CI, 1, TIMEOUT_MS) || (port_read(PX_IS) & PXIS_TFES)) {
+        return false;
+    }
+    port_write(PX_IS, 0xFFFFFFFF);
+
+    // 48 bit LBA (word 83 bit 10) has its own sector count
+    if (identify[83] & (1 << 10)) {
+        ahci_dev.sectors = identify[100] | ((uint64_t)identify[101] << 16) |
+                           ((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+    } else {
+        ahci_dev.sectors = identify[60] | ((uint32_t)identify[61] << 16);
+    }
+    identify_string(ahci_dev.model, 27, 20);
+    return ahci_dev.sectors != 0;
+}
+
+// Find a port with a SATA disk on it and set it up
+static bool find_disk(void) {
+    uint32_t implemented = hba_read(HBA_PI);
+
+    for (int p = 0; p < AHCI_MAX_PORTS; p++) {
+        if (!(implemented & (1u << p))) continue;
+
+        ahci.port_num = p;
+        ahci.port = PORT_BASE(p);
+        uint32_t ssts = port_read(PX_SSTS);
+        if (SSTS_DET(ssts) != DET_PRESENT || SSTS_IPM(ssts) != IPM_ACTIVE) continue;
+        if (!setup_port()) continue;
+        if (port_read(PX_SIG) == SIG_ATA && identify_device()) return true;
+        stop_port();
+    }
+    return false;
+}
+
+// MSI through the local APIC, else the PIC line, else nothing and the
+// callers poll
+static void setup_interrupts(void) {
+    ahci_dev.msi = false;
+    ahci.irq = false;
+
+    if (lapic_enabled() && pci_find_capability(&ahci.device, PCI_CAP_MSI, 0)) {
+        int vector = interrupt_alloc_vector();
+        if (vector >= 0) {
+            register_interrupt_handler(vector, ahci_isr);
+            ahci_dev.msi = pci_msi_enable(&ahci.device, vector, lapic_id());
+            ahci.irq = ahci_dev.msi;
+        }
+    }
+    if (!ahci.irq && ahci.device.interrupt_line < 16) {
+        register_interrupt_handler(IRQ_BASE + ahci.device.interrupt_line, ahci_isr);
+        pic_unmask_irq(ahci.device.interrupt_line);
+        ahci.irq = true;
+    }
+
+    port_write(PX_IS, 0xFFFFFFFF);
+    hba_write(HBA_IS, 0xFFFFFFFF);
+    port_write(PX_IE, PXIS_DHRS | PXIS_SDBS | PXIS_ERRORS);
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_IE);
+}
+
+bool ahci_init(void) {
+    memset(&ahci, 0, sizeof(ahci));
+    if (!pci_find_class(AHCI_CLASS, AHCI_SUBCLASS, AHCI_PROG_IF, &ahci.device)) {
+        return false;
+    }
+
+    // ABAR is BAR 5
+    ahci.abar = pci_map_bar(&ahci.device, 5);
+    if (!ahci.abar) return false;
+    pci_enable_bus_mastering(&ahci.device);
+
+    hba_write(HBA_GHC, hba_read(HBA_GHC) | GHC_AE);
+    hba_write(HBA_GHC, hba_read(HBA_GHC) & ~GHC_IE);
+    if (!find_disk()) return false;
+
+    // Queue as deep as both the HBA and the disk go
+    uint32_t cap = hba_read(HBA_CAP);
+    uint32_t depth = CAP_NCS(cap);
+    ahci.ncq = (cap & CAP_SNCQ) && (identify[76] & (1 << 8));
+    if (ahci.ncq && (uint32_t)(identify[75] & 0x1F) + 1 < depth) {
+        depth = (identify[75] & 0x1F) + 1;
+    }
+    ahci.free = depth == 32 ? 0xFFFFFFFF : (1u << depth) - 1;
+
+    ahci_dev.queue_depth = depth;
+    ahci_dev.queues = 1;
+    ahci_dev.max_sectors = BLK_MAX_SECTORS;
+    ahci_dev.max_segments = AHCI_MAX_PRDS;
+    ahci_dev.max_segment = AHCI_MAX_PRD_BYTES;
+    ahci_dev.dma_align = 2;
+    ahci_dev.features = ahci.ncq ? "NCQ" : "no NCQ";
+
+    setup_interrupts();
+    ahci.present = true;
+    blk_register(&ahci_dev);
+    return true;
+}
+
+// Build the command in a free slot, it goes to the disk with the next kick
+static bool ahci_submit(blk_request_t* req) {
+    uint64_t flags = irq_save();
+    if (!ahci.free) {
+        irq_restore(flags);
+        return false;
+    }
+    int slot = __builtin_ctz(ahci.free);
+    ahci.free &= ~(1u << slot);
+
+    uint8_t command = ahci.ncq ? (req->write ? ATA_WRITE_FPDMA : ATA_READ_FPDMA)
+                               : (req->write ? ATA_WRITE_DMA_EXT : ATA_READ_DMA_EXT);
+    build_command(slot, command, req->lba, req->count, req->write, req->sg, req->sg_count);
+    ahci.requests[slot] = req;
+    ahci.queued |= 1u << slot;
+
+    irq_restore(flags);
+    return true;
+}
+
+// Issue every queued command with one write to CI
+static void ahci_kick(void) {
+    uint64_t flags = irq_save();
+    uint32_t slots = ahci.queued;
+    ahci.queued = 0;
+    ahci.active |= slots;
+
+    // The command tables have to be in memory before the HBA sees the bits
+    if (slots) {
+        barrier();
+        if (ahci.ncq) port_write(PX_SACT, slots);
+        port_write(PX_CI, slots);
+    }
+    irq_restore(flags);
+}
+
+static void ahci_wait(void) {
+    uint64_t flags = irq_save();
+    if (reap() == 0 && ahci.irq && (flags & (1 << 9))) {
+        // sti only takes effect after hlt, so the interrupt can't come in
+        // between
+        __asm__ volatile("sti; hlt");
+        return;
+    }
+    irq_restore(flags);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "../types.h"
+
+// AHCI SATA host controller (ICH9 on QEMU -machine q35). The first disk
+// found gets all command slots the HBA has, queued with NCQ when both ends
+// support it, every command moving its data by DMA through a scatter
+// gather list and completing with an MSI. Commands queued between two kicks
+// are issued with one write to the command issue register.
+#define AHCI_CLASS          0x01
+#define AHCI_SUBCLASS       0x06
+#define AHCI_PROG_IF        0x01
+
+#define AHCI_MAX_PORTS      32
+#define AHCI_MAX_SLOTS      32
+#define AHCI_MAX_PRDS       8       // Scatter gather entries per command
+#define AHCI_MAX_PRD_BYTES  (4 * 1024 * 1024)
+#define AHCI_SECTOR_SIZE    512
+
+// Find the controller and bring up the first disk on it as block device
+// "ahci", false if there is none. Interrupts are set up too: MSI if there
+// is a local APIC, else the PIC line, else commands complete when polled.
+bool ahci_init(void);
@@ -0,0 +1,676 @@
+#include "bcache.h"
+#include "../memory.h"
+#include "../interrupt.h"
+#include "../string.h"
+#include "../timer.h"
+
+#define BCACHE_MAX_IO   32      // Requests in flight
+
+// Buffer flags
+#define BUF_VALID       (1 << 0)   // data holds the block
+#define BUF_DIRTY       (1 << 1)
+#define BUF_BUSY        (1 << 2)   // Being read or written
+#define BUF_RA          (1 << 3)   // Read ahead and not asked for yet
+#define BUF_RA_MARK     (1 << 4)   // Asking for it starts the next read-ahead window
+
+// Lists a buffer header is on. Free headers have no block, A1in and Am
+// hold cached blocks, A1out only remembers blocks evicted from A1in.
+enum { LIST_NONE, LIST_FREE, LIST_A1IN, LIST_AM, LIST_A1OUT, LIST_COUNT };
+
+typedef struct {
+    bcache_buf_t* head;        // Newest
+    bcache_buf_t* tail;        // Oldest
+    uint32_t count;
+} list_t;
+
+// One read or write of adjacent blocks
+typedef struct {
+    blk_request_t req;
+    bcache_buf_t* bufs[BLK_MAX_SEGMENTS];
+    uint8_t count;
+    uint64_t start;
+} io_t;
+
+// Sequential read detection, one per device
+typedef struct {
+    blk_device_t* dev;
+    uint64_t next;             // Block a sequential reader asks for next
+    uint64_t ra_next;          // First block past the last read-ahead window
+    uint32_t window;           // Read-ahead size, 0 while the reader jumps around
+} stream_t;
+
+// Everything below is changed with interrupts off: completions and the
+// flusher run in interrupt handlers
+static struct {
+    uint32_t blocks;
+    bcache_buf_t** hash;
+    uint32_t hash_mask;
+    uint8_t** free_frames;     // Stack of unused block frames
+    uint32_t free_frame_count;
+    list_t lists[LIST_COUNT];
+    bcache_buf_t* dirty_head;  // Oldest
+    bcache_buf_t* dirty_tail;
+    uint32_t dirty;
+    uint32_t writing;          // Blocks being written back
+    uint64_t write_failures;
+    uint32_t kin;              // A1in share before Am is evicted from
+    uint32_t kout;             // Blocks A1out remembers
+    uint32_t background;       // Dirty blocks the flusher leaves alone
+    uint32_t limit;            // Dirty blocks writers wait at
+    io_t ios[BCACHE_MAX_IO];
+    uint32_t io_free;
+    stream_t streams[BLK_MAX_DEVICES];
+    bcache_stats_t stats;
+} cache;
+
+static inline uint32_t hash_of(blk_device_t* dev, uint64_t block) {
+    uint64_t h = (block ^ ((uint64_t)dev >> 4)) * 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) & cache.hash_mask;
+}
+
+static bcache_buf_t* lookup(blk_device_t* dev, uint64_t block) {
+    for (bcache_buf_t* b = cache.hash[hash_of(dev, block)]; b; b = b->hash_next) {
+        if (b->block == block && b->dev == dev) return b;
+    }
+    return NULL;
+}
+
+static void hash_add(bcache_buf_t* b) {
+    bcache_buf_t** bucket = &cache.hash[hash_of(b->dev, b->block)];
+    b->hash_next = *bucket;
+    *bucket = b;
+}
+
+static void hash_remove(bcache_buf_t* b) {
+    bcache_buf_t** p = &cache.hash[hash_of(b->dev, b->block)];
+    while (*p && *p != b) p = &(*p)->hash_next;
+    if (*p) *p = b->hash_next;
+}
+
+static void list_push(int id, bcache_buf_t* b) {
+    list_t* l = &cache.lists[id];
+    b->list = id;
+    b->prev = NULL;
+    b->next = l->head;
+    if (l->head) l->head->prev = b; else l->tail = b;
+    l->head = b;
+    l->count++;
+}
+
+static void list_remove(bcache_buf_t* b) {
+    list_t* l = &cache.lists[b->list];
+    if (b->prev) b->prev->next = b->next; else l->head = b->next;
+    if (b->next) b->next->prev = b->prev; else l->tail = b->prev;
+    l->count--;
+    b->list = LIST_NONE;
+}
+
+// Newest at the tail, the flusher writes from the head
+static void dirty_append(bcache_buf_t* b) {
+    b->flags |= BUF_DIRTY;
+    b->dirty_tick = tick_count;
+    b->dirty_next = NULL;
+    b->dirty_prev = cache.dirty_tail;
+    if (cache.dirty_tail) cache.dirty_tail->dirty_next = b; else cache.dirty_head = b;
+    cache.dirty_tail = b;
+    cache.dirty++;
+}
+
+// Back at the head with the time it had, for writes that couldn't start
+static void dirty_restore(bcache_buf_t* b) {
+    b->flags |= BUF_DIRTY;
+    b->dirty_prev = NULL;
+    b->dirty_next = cache.dirty_head;
+    if (cache.dirty_head) cache.dirty_head->dirty_prev = b; else cache.dirty_tail = b;
+    cache.dirty_head = b;
+    cache.dirty++;
+}
+
+static void dirty_remove(bcache_buf_t* b) {
+    if (b->dirty_prev) b->dirty_prev->dirty_next = b->dirty_next; else cache.dirty_head = b->dirty_next;
+    if (b->dirty_next) b->dirty_next->dirty_prev = b->dirty_prev; else cache.dirty_tail = b->dirty_prev;
+    b->flags &= ~BUF_DIRTY;
+    cache.dirty--;
+}
+
+// Drop a header's block altogether, it becomes free
+static void forget(bcache_buf_t* b) {
+    hash_remove(b);
+    if (b->list != LIST_NONE) list_remove(b);
+    b->flags = 0;
+    list_push(LIST_FREE, b);
+}
+
+// Take the frame of a cached block. Blocks leaving A1in are remembered on
+// A1out, so asking for them again soon gets them onto Am.
+static uint8_t* evict(bcache_buf_t* b) {
+    uint8_t* frame = b->data;
+    bool from_a1in = b->list == LIST_A1IN;
+
+    if (b->flags & BUF_RA) cache.stats.ra_wasted++;
+    cache.stats.evictions++;
+    b->data = NULL;
+
+    if (from_a1in) {
+        list_remove(b);
+        b->flags = 0;
+        list_push(LIST_A1OUT, b);
+        if (cache.lists[LIST_A1OUT].count > cache.kout) {
+            forget(cache.lists[LIST_A1OUT].tail);
+        }
+    } else {
+        forget(b);
+    }
+    return frame;
+}
+
+static inline bool evictable(const bcache_buf_t* b) {
+    return b->refs == 0 && !(b->flags & (BUF_BUSY | BUF_DIRTY));
+}
+
+// A frame for a new block: a free one, else the oldest evictable block of
+// A1in while it is over its share, else the least recently used one of Am.
+// blocked tells whether dirty or busy blocks are all that is in the way.
+static uint8_t* reclaim(bool* blocked) {
+    if (cache.free_frame_count) {
+        return cache.free_frames[--cache.free_frame_count];
+    }
+
+    int first = cache.lists[LIST_A1IN].count > cache.kin ? LIST_A1IN : LIST_AM;
+    int order[2] = { first, first == LIST_A1IN ? LIST_AM : LIST_A1IN };
+    for (int i = 0; i < 2; i++) {
+        for (bcache_buf_t* b = cache.lists[order[i]].tail; b; b = b->prev) {
+            if (evictable(b)) return evict(b);
+            if (blocked && b->refs == 0) *blocked = true;
+        }
+    }
+    return NULL;
+}
+
+// Put a block into a frame, on Am if A1out remembered it, else on A1in
+static bcache_buf_t* insert(blk_device_t* dev, uint64_t block, uint8_t* frame) {
+    bcache_buf_t* b = lookup(dev, block);
+
+    if (b) {
+        list_remove(b);
+        list_push(LIST_AM, b);
+        cache.stats.ghost_hits++;
+    } else {
+        b = cache.lists[LIST_FREE].head;
+        list_remove(b);
+        b->dev = dev;
+        b->block = block;
+        hash_add(b);
+        list_push(LIST_A1IN, b);
+    }
+    b->data = frame;
+    b->flags = 0;
+    b->refs = 0;
+    return b;
+}
+
+// A failed read leaves nothing worth keeping
+static void drop(bcache_buf_t* b) {
+    cache.free_frames[cache.free_frame_count++] = b->data;
+    b->data = NULL;
+    forget(b);
+}
+
+// A cached block was asked for: Am keeps its blocks in LRU order, A1in is
+// a FIFO and doesn't care
+static void touch(bcache_buf_t* b) {
+    if (b->list == LIST_AM && cache.lists[LIST_AM].head != b) {
+        list_remove(b);
+        list_push(LIST_AM, b);
+    }
+}
+
+// Let completions in while the caller waits, interrupts are off again after
+static void wait_dev(blk_device_t* dev, uint64_t flags) {
+    irq_restore(flags);
+    blk_wait(dev);
+    irq_save();
+}
+
+// Wait for any request of ours to complete
+static void wait_io(uint64_t flags) {
+    uint32_t busy = ~cache.io_free & ((1ULL << BCACHE_MAX_IO) - 1);
+    if (busy) {
+        wait_dev(cache.ios[__builtin_ctz(busy)].req.dev, flags);
+    }
+}
+
+static io_t* io_alloc(void) {
+    if (!cache.io_free) return NULL;
+    int i = __builtin_ctz(cache.io_free);
+    cache.io_free &= ~(1u << i);
+    cache.ios[i].count = 0;
+    return &cache.ios[i];
+}
+
+static void io_done(blk_request_t* req) {
+    io_t* io = req->ctx;
+
+    for (int i = 0; i < io->count; i++) {
+        bcache_buf_t* b = io->bufs[i];
+        b->flags &= ~BUF_BUSY;
+        if (!req->write) {
+            if (req->ok) b->flags |= BUF_VALID;
+            continue;
+        }
+
+        cache.writing--;
+        if (req->ok) {
+            cache.stats.writebacks++;
+        } else if (!(b->flags & BUF_DIRTY)) {
+            // Keep it until a later write works
+            dirty_append(b);
+        }
+    }
+
+    if (!req->ok) {
+        cache.stats.errors++;
+        if (req->write) cache.write_failures++;
+    }
+    if (req->write) {
+        uint64_t latency = rdtsc() - io->start;
+        cache.stats.write_ios++;
+        cache.stats.wb_latency_sum += latency;
+        if (latency > cache.stats.wb_latency_max) cache.stats.wb_latency_max = latency;
+    }
+    cache.io_free |= 1u << (io - cache.ios);
+}
+
+// Hand an I/O of busy blocks to their device. Waits for room in the queue
+// if may_wait, else gives up.
+static bool io_submit(io_t* io, bool write, bool may_wait, uint64_t flags) {
+    blk_device_t* dev = io->bufs[0]->dev;
+    blk_request_t* req = &io->req;
+
+    req->dev = dev;
+    req->write = write;
+    req->lba = io->bufs[0]->block * BCACHE_BLOCK_SECTORS;
+    req->count = io->count * BCACHE_BLOCK_SECTORS;
+    for (int i = 0; i < io->count; i++) {
+        req->sg[i] = (blk_sg_t){ io->bufs[i]->data, BCACHE_BLOCK_SIZE };
+    }
+    req->sg_count = io->count;
+    req->done = io_done;
+    req->ctx = io;
+    io->start = rdtsc();
+
+    while (!blk_submit(dev, req)) {
+        if (!may_wait) return false;
+        blk_kick(dev);
+        wait_dev(dev, flags);
+    }
+    return true;
+}
+
+// Read busy blocks, given in ascending order, with as few requests as
+// they allow and one kick
+static void read_blocks(blk_device_t* dev, bcache_buf_t** bufs, int count, uint64_t flags) {
+    int i = 0;
+
+    while (i < count) {
+        io_t* io;
+        while ((io = io_alloc()) == NULL) {
+            blk_kick(dev);
+            wait_io(flags);
+        }
+        do {
+            io->bufs[io->count++] = bufs[i++];
+        } while (i < count && io->count < dev->max_segments &&
+                 (uint32_t)(io->count + 1) * BCACHE_BLOCK_SECTORS <= dev->max_sectors &&
+                 bufs[i]->block == bufs[i - 1]->block + 1);
+        io_submit(io, false, true, flags);
+    }
+    blk_kick(dev);
+}
+
+// Start writing back dirty blocks of dev (any device if NULL), oldest
+// first: those dirty longer than the expiry time, and more until no more
+// than keep are dirty. Dirty blocks following one go in the same request.
+// Without may_wait, as from the timer, a full queue ends it early.
+static void write_dirty(blk_device_t* dev, uint32_t keep, bool may_wait, uint64_t flags) {
+    blk_device_t* kick[BLK_MAX_DEVICES];
+    int kick_count = 0;
+
+    while (1) {
+        // Blocks dirtied again while they are written stay on the list
+        bcache_buf_t* b = cache.dirty_head;
+        while (b && ((b->flags & BUF_BUSY) || (dev && b->dev != dev))) {
+            b = b->dirty_next;
+        }
+        if (!b) break;
+        bool expired = tick_count - b->dirty_tick >= BCACHE_DIRTY_EXPIRE_MS;
+        if (!expired && cache.dirty <= keep) break;
+
+        io_t* io = io_alloc();
+        if (!io) {
+            if (!may_wait) break;
+            for (int i = 0; i < kick_count; i++) blk_kick(kick[i]);
+            wait_io(flags);
+            continue;
+        }
+
+        bcache_buf_t* next = b;
+        do {
+            dirty_remove(next);
+            next->flags |= BUF_BUSY;
+            io->bufs[io->count++] = next;
+            next = lookup(b->dev, next->block + 1);
+        } while (next && next->data && io->count < b->dev->max_segments &&
+                 (uint32_t)(io->count + 1) * BCACHE_BLOCK_SECTORS <= b->dev->max_sectors &&
+                 (next->flags & (BUF_DIRTY | BUF_BUSY)) == BUF_DIRTY);
+        cache.writing += io->count;
+
+        if (!io_submit(io, true, may_wait, flags)) {
+            for (int i = io->count - 1; i >= 0; i--) {
+                io->bufs[i]->flags &= ~BUF_BUSY;
+                dirty_restore(io->bufs[i]);
+            }
+            cache.writing -= io->count;
+            cache.io_free |= 1u << (io - cache.ios);
+            break;
+        }
+
+        int i = 0;
+        while (i < kick_count && kick[i] != b->dev) i++;
+        if (i == kick_count) kick[kick_count++] = b->dev;
+    }
+
+    for (int i = 0; i < kick_count; i++) blk_kick(kick[i]);
+}
+
+// Runs from the timer interrupt
+static void flusher(void) {
+    if (cache.dirty) {
+        write_dirty(NULL, cache.background, false, 0);
+    }
+}
+
+// reclaim, writing back and waiting for I/O while busy or dirty blocks
+// are in the way. NULL if every block is referenced.
+static uint8_t* reclaim_wait(uint64_t flags) {
+    while (1) {
+        bool blocked = false;
+        uint8_t* frame = reclaim(&blocked);
+        if (frame || !blocked) return frame;
+
+        write_dirty(NULL, 0, true, flags);
+        wait_io(flags);
+    }
+}
+
+static stream_t* stream_for(blk_device_t* dev) {
+    for (int i = 0; i < BLK_MAX_DEVICES; i++) {
+        stream_t* s = &cache.streams[i];
+        if (s->dev == dev) return s;
+        if (!s->dev) {
+            s->dev = dev;
+            return s;
+        }
+    }
+    return &cache.streams[0];
+}
+
+// Take frames for the blocks of [start, start + count) that aren't cached,
+// and mark the first one so reaching it starts the next window. Read-ahead
+// only takes what can be had without waiting. Returns the busy buffers.
+static int readahead(stream_t* s, uint64_t start, uint32_t count, bcache_buf_t** out) {
+    uint64_t end = s->dev->sectors / BCACHE_BLOCK_SECTORS;
+    int n = 0;
+
+    if (start + count < end) end = start + count;
+    for (uint64_t block = start; block < end; block++) {
+        bcache_buf_t* b = lookup(s->dev, block);
+        if (b && b->data) continue;
+
+        uint8_t* frame = reclaim(NULL);
+        if (!frame) break;
+        b = insert(s->dev, block, frame);
+        b->flags = BUF_BUSY | BUF_RA;
+        out[n++] = b;
+        cache.stats.ra_blocks++;
+    }
+
+    bcache_buf_t* mark = lookup(s->dev, start);
+    if (mark && mark->data) mark->flags |= BUF_RA_MARK;
+    if (end > s->ra_next) s->ra_next = end;
+    return n;
+}
+
+static bool cacheable(blk_device_t* dev, uint64_t block) {
+    return cache.blocks && dev->max_segment >= BCACHE_BLOCK_SIZE &&
+           dev->max_sectors >= BCACHE_BLOCK_SECTORS &&
+           block < dev->sectors / BCACHE_BLOCK_SECTORS;
+}
+
+bcache_buf_t* bcache_read(blk_device_t* dev, uint64_t block) {
+    bcache_buf_t* reads[1 + BCACHE_RA_MAX];
+    int n = 0;
+
+    if (!cacheable(dev, block)) return NULL;
+
+    uint64_t flags = irq_save();
+    stream_t* s = stream_for(dev);
+    bool sequential = block == s->next;
+    s->next = block + 1;
+    cache.stats.lookups++;
+
+    bcache_buf_t* b = lookup(dev, block);
+    if (b && b->data && !(b->flags & (BUF_VALID | BUF_BUSY))) {
+        // Read ahead and failed, try again
+        drop(b);
+        b = NULL;
+    }
+
+    if (b && b->data) {
+        cache.stats.hits++;
+        touch(b);
+        if (b->flags & BUF_RA) {
+            b->flags &= ~BUF_RA;
+            cache.stats.ra_used++;
+        }
+        if (b->flags & BUF_RA_MARK) {
+            // The reader caught up with the window, start the next, larger one
+            b->flags &= ~BUF_RA_MARK;
+            if (sequential && s->window) {
+                s->window = s->window * 2 > BCACHE_RA_MAX ? BCACHE_RA_MAX : s->window * 2;
+                uint64_t start = s->ra_next > block + 1 ? s->ra_next : block + 1;
+                n = readahead(s, start, s->window, reads);
+            }
+        }
+        b->refs++;
+    } else {
+        uint8_t* frame = reclaim_wait(flags);
+        if (!frame) {
+            irq_restore(flags);
+            return NULL;
+        }
+        b = insert(dev, block, frame);
+        b->flags = BUF_BUSY;
+        b->refs = 1;
+        reads[n++] = b;
+        cache.stats.reads++;
+
+        // Sequential misses open a window that grows as long as it is used
+        if (!sequential) {
+            s->window = 0;
+        } else if (!s->window) {
+            s->window = BCACHE_RA_MIN;
+        } else {
+            s->window = s->window * 2 > BCACHE_RA_MAX ? BCACHE_RA_MAX : s->window * 2;
+        }
+        if (s->window) {
+            n += readahead(s, block + 1, s->window, reads + 1);
+        }
+    }
+    if (n) read_blocks(dev, reads, n, flags);
+
+    while (b->flags & BUF_BUSY) {
+        wait_dev(dev, flags);
+    }
+    if (!(b->flags & BUF_VALID)) {
+        if (--b->refs == 0) drop(b);
+        b = NULL;
+    }
+    irq_restore(flags);
+    return b;
+}
+
+bcache_buf_t* bcache_get(blk_device_t* dev, uint64_t block) {
+    if (!cacheable(dev, block)) return NULL;
+
+    uint64_t flags = irq_save();
+    cache.stats.lookups++;
+
+    bcache_buf_t* b = lookup(dev, block);
+    if (b && b->data) {
+        cache.stats.hits++;
+        touch(b);
+        b->flags &= ~BUF_RA;
+        b->refs++;
+        while (b->flags & BUF_BUSY) {
+            wait_dev(dev, flags);
+        }
+    } else {
+        uint8_t* frame = reclaim_wait(flags);
+        if (!frame) {
+            irq_restore(flags);
+            return NULL;
+        }
+        b = insert(dev, block, frame);
+        b->refs = 1;
+    }
+
+    // A failed read ahead counts as never read
+    if (!(b->flags & BUF_VALID)) {
+        memset(b->data, 0, BCACHE_BLOCK_SIZE);
+        b->flags |= BUF_VALID;
+    }
+    irq_restore(flags);
+    return b;
+}
+
+void bcache_dirty(bcache_buf_t* buf) {
+    // Nothing would ever write it
+    if (buf->dev->read_only) return;
+
+    uint64_t flags = irq_save();
+    if (!(buf->flags & BUF_DIRTY)) {
+        dirty_append(buf);
+    }
+
+    // Past the limit the writer pays: it starts writing back down to the
+    // background ratio and waits until half of that distance is done
+    if (cache.dirty > cache.limit) {
+        uint64_t start = rdtsc();
+        uint32_t resume = cache.background + (cache.limit - cache.background) / 2;
+
+        cache.stats.throttled++;
+        write_dirty(NULL, cache.background, true, flags);
+        while (cache.dirty + cache.writing > resume && cache.writing) {
+            wait_io(flags);
+        }
+        cache.stats.throttle_cycles += rdtsc() - start;
+    }
+    irq_restore(flags);
+}
+
+void bcache_release(bcache_buf_t* buf) {
+    uint64_t flags = irq_save();
+    if (buf->refs) buf->refs--;
+    irq_restore(flags);
+}
+
+static bool has_dirty(blk_device_t* dev) {
+    for (bcache_buf_t* b = cache.dirty_head; b; b = b->dirty_next) {
+        if (!dev || b->dev == dev) return true;
+    }
+    return false;
+}
+
+bool bcache_sync(blk_device_t* dev) {
+    uint64_t flags = irq_save();
+    uint64_t failures = cache.write_failures;
+    bool ok = true;
+
+    while (1) {
+        write_dirty(dev, 0, true, flags);
+        // Failed blocks stay dirty, going around again would never end
+        if (cache.write_failures != failures) {
+            ok = false;
+            break;
+        }
+        if (!cache.writing && !has_dirty(dev)) break;
+        wait_io(flags);
+    }
+    irq_restore(flags);
+    return ok;
+}
+
+bool bcache_init(void) {
+    uint64_t per_block = BCACHE_BLOCK_SIZE + sizeof(bcache_buf_t) * 3 / 2 + 2 * sizeof(void*);
+    uint64_t blocks = memory_free() / BCACHE_MEMORY_SHARE / per_block;
+    if (blocks < BCACHE_MIN_BLOCKS) return false;
+    if (blocks > BCACHE_MAX_BLOCKS) blocks = BCACHE_MAX_BLOCKS;
+
+    // A1out remembers half as many blocks as are cached, plus a spare
+    // header for the block coming in
+    uint32_t kout = blocks / 2;
+    uint32_t headers = blocks + kout + 1;
+    uint32_t buckets = 1;
+    while (buckets < blocks) buckets <<= 1;
+
+    uint8_t* frames = memory_alloc_pages(blocks);
+    bcache_buf_t* bufs = memory_alloc_pages((headers * sizeof(bcache_buf_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    cache.hash = memory_alloc_pages((buckets * sizeof(void*) + PAGE_SIZE - 1) / PAGE_SIZE);
+    cache.free_frames = memory_alloc_pages((blocks * sizeof(void*) + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!frames || !bufs || !cache.hash || !cache.free_frames) {
+        return false;
+    }
+
+    cache.hash_mask = buckets - 1;
+    for (uint32_t i = 0; i < blocks; i++) {
+        cache.free_frames[i] = frames + (uint64_t)i * BCACHE_BLOCK_SIZE;
+    }
+    cache.free_frame_count = blocks;
+    for (uint32_t i = 0; i < headers; i++) {
+        list_push(LIST_FREE, &bufs[i]);
+    }
+
+    cache.kin = blocks / 4;
+    cache.kout = kout;
+    cache.background = blocks * BCACHE_DIRTY_BACKGROUND / 100;
+    cache.limit = blocks * BCACHE_DIRTY_LIMIT / 100;
+    cache.io_free = (1ULL << BCACHE_MAX_IO) - 1;
+    cache.blocks = blocks;
+    return timer_register_periodic(flusher, BCACHE_FLUSH_INTERVAL_MS);
+}
+
+uint32_t bcache_size(void) {
+    return cache.blocks;
+}
+
+void bcache_counts(uint32_t* resident, uint32_t* dirty, uint32_t* a1in, uint32_t* am,
+                   uint32_t* a1out) {
+    uint64_t flags = irq_save();
+    *resident = cache.blocks - cache.free_frame_count;
+    *dirty = cache.dirty;
+    *a1in = cache.lists[LIST_A1IN].count;
+    *am = cache.lists[LIST_AM].count;
+    *a1out = cache.lists[LIST_A1OUT].count;
+    irq_restore(flags);
+}
+
+const bcache_stats_t* bcache_get_stats(void) {
+    return &cache.stats;
+}
+
+void bcache_reset_stats(void) {
+    uint64_t flags = irq_save();
+    memset(&cache.stats, 0, sizeof(cache.stats));
+    irq_restore(flags);
+}
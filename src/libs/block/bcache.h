@@ -0,0 +1,97 @@
+#pragma once
+
+#include "../types.h"
+#include "blkdev.h"
+
+// Block buffer cache between the block devices and whatever reads them.
+// Blocks are looked up by (device, block) in a hash table and replaced
+// with 2Q: a block comes in on a FIFO (A1in) and only gets on the LRU list
+// (Am) when it is asked for again after falling off it, which the ghost
+// list A1out remembers, so one pass over a large file can't push out the
+// working set. Sequential readers get read-ahead that doubles every time
+// they use it up. Writes stay in the cache; a flusher on the timer writes
+// back blocks that were dirty too long or everything above the background
+// ratio, and writers wait when the hard limit is reached.
+#define BCACHE_BLOCK_SIZE         4096
+#define BCACHE_BLOCK_SECTORS      (BCACHE_BLOCK_SIZE / BLK_SECTOR_SIZE)
+
+#define BCACHE_MEMORY_SHARE       4       // The cache gets 1/4 of free memory at boot
+#define BCACHE_MIN_BLOCKS         64
+#define BCACHE_MAX_BLOCKS         65536
+
+#define BCACHE_RA_MIN             4       // Blocks of the first read-ahead window
+#define BCACHE_RA_MAX             64
+
+#define BCACHE_DIRTY_BACKGROUND   10      // Percent of the cache, the flusher starts
+#define BCACHE_DIRTY_LIMIT        40      // Percent of the cache, writers wait
+#define BCACHE_DIRTY_EXPIRE_MS    3000    // Dirty blocks older than this are written
+#define BCACHE_FLUSH_INTERVAL_MS  500
+
+// A cached block. Only dev, block and data are for users, and data only
+// while they hold a reference.
+typedef struct bcache_buf bcache_buf_t;
+struct bcache_buf {
+    blk_device_t* dev;
+    uint64_t block;
+    uint8_t* data;               // NULL while the block is only remembered in A1out
+
+    bcache_buf_t* hash_next;
+    bcache_buf_t* prev;          // On one of the 2Q lists
+    bcache_buf_t* next;
+    bcache_buf_t* dirty_prev;    // On the dirty list, oldest first
+    bcache_buf_t* dirty_next;
+    uint64_t dirty_tick;         // tick_count when it became dirty
+    volatile uint16_t flags;
+    uint8_t list;
+    uint16_t refs;
+};
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t ghost_hits;         // Misses A1out remembered, they go to Am
+    uint64_t reads;              // Blocks read because they were asked for
+    uint64_t ra_blocks;          // Blocks read ahead
+    uint64_t ra_used;            // of them asked for before they were evicted
+    uint64_t ra_wasted;          // evicted without being asked for
+    uint64_t evictions;
+    uint64_t writebacks;         // Blocks written back
+    uint64_t write_ios;          // Requests they took, adjacent blocks go together
+    uint64_t wb_latency_sum;     // Write-back requests, submitted until done, TSC cycles
+    uint64_t wb_latency_max;
+    uint64_t throttled;          // Writes that waited for the dirty limit
+    uint64_t throttle_cycles;
+    uint64_t errors;             // Failed reads and writes, failed writes stay dirty
+} bcache_stats_t;
+
+// Size the cache from the memory left at boot. False if there is none.
+bool bcache_init(void);
+
+// Blocks the cache holds, 0 before bcache_init
+uint32_t bcache_size(void);
+
+// Blocks currently cached, dirty, on A1in, on Am and remembered on A1out
+void bcache_counts(uint32_t* resident, uint32_t* dirty, uint32_t* a1in, uint32_t* am,
+                   uint32_t* a1out);
+
+// Block of BCACHE_BLOCK_SIZE bytes with a reference held, read from the
+// device if it isn't cached. NULL past the end of the device, on a read
+// error, or when every cached block is referenced.
+bcache_buf_t* bcache_read(blk_device_t* dev, uint64_t block);
+
+// Same without reading, for callers that overwrite the whole block. The
+// data is zeroed if the block wasn't cached.
+bcache_buf_t* bcache_get(blk_device_t* dev, uint64_t block);
+
+// The caller changed the data. May wait for write-back when too much of
+// the cache is dirty, so never call it from an interrupt handler.
+void bcache_dirty(bcache_buf_t* buf);
+
+void bcache_release(bcache_buf_t* buf);
+
+// Write back every dirty block of dev (all devices if NULL) and wait for it.
+// False if a write failed.
+bool bcache_sync(blk_device_t* dev);
+
+const bcache_stats_t* bcache_get_stats(void);
+void bcache_reset_stats(void);
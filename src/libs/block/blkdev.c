@@ -0,0 +1,193 @@
+#include "blkdev.h"
+#include "ahci.h"
+#include "virtio_blk.h"
+#include "nvme.h"
+#include "../interrupt.h"
+#include "../string.h"
+
+#define SYNC_CHUNK_SECTORS  2048    // Per request of blk_read and blk_write
+#define SYNC_DEPTH          8       // Their requests in flight at once
+
+static blk_device_t* devices[BLK_MAX_DEVICES];
+static int device_count = 0;
+
+// Disk drivers, each registers the disks it finds
+static bool (*const drivers[])(void) = {
+    ahci_init,
+    virtio_blk_init,
+    nvme_init,
+};
+
+bool blk_init(void) {
+    for (size_t i = 0; i < sizeof(drivers) / sizeof(drivers[0]); i++) {
+        drivers[i]();
+    }
+    return device_count > 0;
+}
+
+void blk_register(blk_device_t* dev) {
+    if (device_count < BLK_MAX_DEVICES) {
+        devices[device_count++] = dev;
+    }
+}
+
+int blk_device_count(void) {
+    return device_count;
+}
+
+blk_device_t* blk_get_device(int index) {
+    if (index < 0 || index >= device_count) return NULL;
+    return devices[index];
+}
+
+blk_device_t* blk_find_device(const char* name) {
+    for (int i = 0; i < device_count; i++) {
+        if (strcmp(devices[i]->name, name) == 0) return devices[i];
+    }
+    return NULL;
+}
+
+bool blk_valid(blk_device_t* dev, const blk_request_t* req) {
+    if (req->count == 0 || req->count > dev->max_sectors || req->lba + req->count > dev->sectors ||
+        req->sg_count < 1 || req->sg_count > dev->max_segments || !req->done ||
+        (req->write && dev->read_only)) {
+        return false;
+    }
+    uint64_t bytes = 0;
+    for (int i = 0; i < req->sg_count; i++) {
+        uint64_t addr = (uint64_t)req->sg[i].addr;
+        uint32_t len = req->sg[i].len;
+        if (len == 0 || (len & 1) || len > dev->max_segment ||
+            (dev->dma_align && addr % dev->dma_align)) {
+            return false;
+        }
+        if (dev->dma_boundary && ((i > 0 && addr % dev->dma_boundary) ||
+                                  (i < req->sg_count - 1 && (addr + len) % dev->dma_boundary))) {
+            return false;
+        }
+        bytes += len;
+    }
+    return bytes == (uint64_t)req->count * BLK_SECTOR_SIZE;
+}
+
+bool blk_submit(blk_device_t* dev, blk_request_t* req) {
+    if (!blk_valid(dev, req)) return false;
+
+    req->dev = dev;
+    if (!dev->submit(req)) {
+        dev->stats.busy++;
+        return false;
+    }
+    return true;
+}
+
+void blk_kick(blk_device_t* dev) {
+    dev->stats.kicks++;
+    dev->kick();
+}
+
+void blk_wait(blk_device_t* dev) {
+    dev->wait();
+}
+
+void blk_complete(blk_request_t* req, bool ok) {
+    blk_stats_t* stats = &req->dev->stats;
+
+    if (!ok) {
+        stats->errors++;
+    } else if (req->write) {
+        stats->writes++;
+        stats->sectors_written += req->count;
+    } else {
+        stats->reads++;
+        stats->sectors_read += req->count;
+    }
+    req->ok = ok;
+    req->done(req);
+}
+
+// The requests of one blk_read or blk_write
+typedef struct {
+    blk_request_t requests[SYNC_DEPTH];
+    volatile uint32_t busy;          // In flight
+    volatile bool failed;
+} sync_t;
+
+static void sync_done(blk_request_t* req) {
+    sync_t* sync = req->ctx;
+    if (!req->ok) sync->failed = true;
+    sync->busy &= ~(1u << (req - sync->requests));
+}
+
+// Split the transfer into chunks and keep SYNC_DEPTH of them in flight, so
+// the disk always has the next one when a chunk finishes
+static bool transfer(blk_device_t* dev, bool write, uint64_t lba, uint32_t count, void* buffer) {
+    uint32_t chunk = dev->max_sectors < SYNC_CHUNK_SECTORS ? dev->max_sectors : SYNC_CHUNK_SECTORS;
+    uint32_t all = (1u << SYNC_DEPTH) - 1;
+    uint8_t* p = buffer;
+    sync_t sync;
+
+    sync.busy = 0;
+    sync.failed = false;
+    while ((count > 0 && !sync.failed) || sync.busy) {
+        bool submitted = false;
+        while (count > 0 && !sync.failed && sync.busy != all) {
+            int i = __builtin_ctz(~sync.busy);
+            uint32_t n = count < chunk ? count : chunk;
+            blk_request_t* req = &sync.requests[i];
+            *req = (blk_request_t){
+                .write = write,
+                .lba = lba,
+                .count = n,
+                .sg = { { p, n * BLK_SECTOR_SIZE } },
+                .sg_count = 1,
+                .done = sync_done,
+                .ctx = &sync,
+            };
+            if (!blk_valid(dev, req)) {
+                sync.failed = true;
+                break;
+            }
+
+            uint64_t flags = irq_save();
+            sync.busy |= 1u << i;
+            irq_restore(flags);
+            if (!blk_submit(dev, req)) {
+                // The queue is full, it drains by itself
+                flags = irq_save();
+                sync.busy &= ~(1u << i);
+                irq_restore(flags);
+                break;
+            }
+            submitted = true;
+            lba += n;
+            count -= n;
+            p += n * BLK_SECTOR_SIZE;
+        }
+
+        if (submitted || !sync.busy) blk_kick(dev);
+        if (sync.busy || (count > 0 && !sync.failed)) blk_wait(dev);
+    }
+    return !sync.failed;
+}
+
+bool blk_read(blk_device_t* dev, uint64_t lba, uint32_t count, void* buffer) {
+    return transfer(dev, false, lba, count, buffer);
+}
+
+bool blk_write(blk_device_t* dev, uint64_t lba, uint32_t count, const void* buffer) {
+    return transfer(dev, true, lba, count, (void*)buffer);
+}
+
+bool blk_set_polled(blk_device_t* dev, bool polled) {
+    if (polled == dev->polled) return true;
+    if (!dev->set_polled || !dev->set_polled(polled)) return false;
+    dev->polled = polled;
+    return true;
+}
+
+void blk_reset_stats(blk_device_t* dev) {
+    uint64_t flags = irq_save();
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    irq_restore(flags);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include "../types.h"
+
+// Block devices. Every disk driver fills in a blk_device_t and registers
+// it, consumers only see the requests below. Requests are asynchronous:
+// blk_submit queues one with the driver, blk_kick starts everything queued
+// since the last kick in one go (one doorbell or notification per batch),
+// and the done callback runs when the device finished it.
+#define BLK_MAX_DEVICES     4
+#define BLK_MAX_SEGMENTS    8       // Scatter gather pieces per request
+#define BLK_SECTOR_SIZE     512
+#define BLK_MAX_SECTORS     0xFFFF  // Per request
+
+// One piece of a transfer, physically contiguous and an even number of bytes
+typedef struct {
+    void* addr;
+    uint32_t len;
+} blk_sg_t;
+
+typedef struct blk_request blk_request_t;
+typedef struct blk_device blk_device_t;
+
+struct blk_request {
+    bool write;
+    uint64_t lba;                    // First sector
+    uint32_t count;                  // Sectors, the segments add up to this
+    blk_sg_t sg[BLK_MAX_SEGMENTS];
+    uint8_t sg_count;
+    void (*done)(blk_request_t* req);   // In interrupt context unless polled
+    void* ctx;                       // For the caller
+    bool ok;                         // Set before done is called
+    blk_device_t* dev;               // Set by blk_submit
+};
+
+typedef struct {
+    uint64_t reads;
+    uint64_t writes;
+    uint64_t sectors_read;
+    uint64_t sectors_written;
+    uint64_t errors;           // Requests the device failed
+    uint64_t busy;             // Submissions turned away, the queue was full
+    uint64_t kicks;            // Batches started
+    uint64_t interrupts;       // Completion interrupts taken
+} blk_stats_t;
+
+struct blk_device {
+    const char* name;
+    char model[41];
+    uint64_t sectors;
+    uint32_t queue_depth;      // Requests one CPU can have in flight at once
+    uint32_t queues;           // Hardware queues behind them
+    uint32_t max_sectors;      // Per request, at most BLK_MAX_SECTORS
+    uint8_t max_segments;      // Scatter gather pieces per request
+    uint32_t max_segment;      // Largest piece in bytes
+    uint32_t dma_align;        // Pieces start on a multiple of this, 0 for anywhere
+    // Pieces after the first start on a multiple of this and pieces before
+    // the last end on one, so they chain into pages. 0 for no such rule.
+    uint32_t dma_boundary;
+    bool read_only;
+    bool msi;                  // Completions come by MSI or MSI-X
+    bool polled;               // blk_wait spins on the queues, interrupts are off
+    const char* features;      // Short description for listings
+
+    // Queue a request. False if it is malformed or the queue is full.
+    bool (*submit)(blk_request_t* req);
+    // Start the requests queued since the last call
+    void (*kick)(void);
+    // Halt until the next completion interrupt, or poll once without one
+    void (*wait)(void);
+    // Switch between interrupts and polling, NULL if only interrupts work
+    bool (*set_polled)(bool polled);
+
+    blk_stats_t stats;
+};
+
+// Find and initialize the disk drivers. Returns false if there is no disk.
+bool blk_init(void);
+
+// Called by drivers for every disk they bring up
+void blk_register(blk_device_t* dev);
+
+int blk_device_count(void);
+blk_device_t* blk_get_device(int index);
+
+// Registered device by name, NULL if there is none
+blk_device_t* blk_find_device(const char* name);
+
+// Whether a request fits the device and its segments add up
+bool blk_valid(blk_device_t* dev, const blk_request_t* req);
+
+// Queue a request, see above. Checks it against the device first, so for a
+// valid request false means the queue is full.
+bool blk_submit(blk_device_t* dev, blk_request_t* req);
+
+void blk_kick(blk_device_t* dev);
+
+void blk_wait(blk_device_t* dev);
+
+// Called by drivers when a request finished, counts it and calls done
+void blk_complete(blk_request_t* req, bool ok);
+
+// Read or write count sectors into one buffer and wait for it. Large
+// transfers go out as several requests at once.
+bool blk_read(blk_device_t* dev, uint64_t lba, uint32_t count, void* buffer);
+bool blk_write(blk_device_t* dev, uint64_t lba, uint32_t count, const void* buffer);
+
+// Have completions reaped by blk_wait instead of interrupts, which saves
+// the interrupt latency at the cost of a busy CPU. False if the device
+// can't.
+bool blk_set_polled(blk_device_t* dev, bool polled);
+
+void blk_reset_stats(blk_device_t* dev);
@@ -0,0 +1,529 @@
+#include "nvme.h"
+#include "blkdev.h"
+#include "../pci.h"
+#include "../apic.h"
+#include "../interrupt.h"
+#include "../memory.h"
+#include "../string.h"
+#include "../timer.h"
+
+#define barrier() __asm__ volatile("" : : : "memory")
+
+// Controller registers
+#define REG_CAP         0x00
+#define REG_VS          0x08
+#define REG_INTMS       0x0C
+#define REG_INTMC       0x10
+#define REG_CC          0x14
+#define REG_CSTS        0x1C
+#define REG_AQA         0x24
+#define REG_ASQ         0x28
+#define REG_ACQ         0x30
+#define REG_DOORBELLS   0x1000
+
+#define CAP_MQES(cap)   ((cap) & 0xFFFF)               // Queue entries minus one
+#define CAP_TO(cap)     (((cap) >> 24) & 0xFF)         // Ready timeout, 500 ms units
+#define CAP_DSTRD(cap)  (((cap) >> 32) & 0xF)          // Doorbell stride, 4 << DSTRD
+#define CAP_CSS_NVM     (1ULL << 37)
+#define CAP_MPSMIN(cap) (((cap) >> 48) & 0xF)          // Smallest page, 4K << MPSMIN
+
+#define CC_EN           (1 << 0)
+#define CC_IOSQES       (6 << 16)      // 64 byte submission entries
+#define CC_IOCQES       (4 << 20)      // 16 byte completion entries
+#define CSTS_RDY        (1 << 0)
+#define CSTS_CFS        (1 << 1)       // Fatal controller error
+
+// Admin commands
+#define ADMIN_CREATE_SQ     0x01
+#define ADMIN_CREATE_CQ     0x05
+#define ADMIN_IDENTIFY      0x06
+#define ADMIN_SET_FEATURES  0x09
+
+#define IDENTIFY_NAMESPACE  0
+#define IDENTIFY_CONTROLLER 1
+#define FEATURE_QUEUES      0x07
+
+#define QUEUE_CONTIGUOUS    (1 << 0)
+#define CQ_IRQ_ENABLED      (1 << 1)
+
+// NVM commands
+#define NVM_WRITE       0x01
+#define NVM_READ        0x02
+
+// Identify data
+#define ID_CTRL_MODEL   24     // 40 ASCII characters, padded with spaces
+#define ID_CTRL_MDTS    77     // Largest transfer, 4K << MDTS, 0 for no limit
+#define ID_NS_NSZE      0      // Namespace size in blocks
+#define ID_NS_FLBAS     26     // Low 4 bits pick the block format in use
+#define ID_NS_LBAF      128    // Block formats, 4 bytes each
+
+#define PRP_ENTRIES     (NVME_MAX_TRANSFER / PAGE_SIZE)   // List entries per command
+#define TIMEOUT_MS      1000
+
+typedef struct {
+    uint32_t cdw0;         // Opcode, command id in the upper half
+    uint32_t nsid;
+    uint64_t reserved;
+    uint64_t mptr;
+    uint64_t prp1;
+    uint64_t prp2;
+    uint32_t cdw10;
+    uint32_t cdw11;
+    uint32_t cdw12;
+    uint32_t cdw13;
+    uint32_t cdw14;
+    uint32_t cdw15;
+} __attribute__((packed)) sqe_t;
+
+typedef struct {
+    uint32_t result;
+    uint32_t reserved;
+    uint16_t sq_head;
+    uint16_t sq_id;
+    uint16_t cid;
+    uint16_t status;       // Phase tag in bit 0
+} __attribute__((packed)) cqe_t;
+
+// A submission queue and the completion queue it completes to. The slot a
+// command takes is also its command id. There are fewer slots than queue
+// entries, so the submission queue can never overflow.
+typedef struct {
+    uint16_t id;
+    uint16_t size;                   // Entries in each queue
+    sqe_t* sq;
+    volatile cqe_t* cq;
+    volatile uint32_t* sq_doorbell;
+    volatile uint32_t* cq_doorbell;
+    uint16_t sq_tail;                // Next entry to fill
+    uint16_t sq_kicked;              // Tail the controller was told about
+    uint16_t cq_head;
+    uint16_t phase;                  // Phase tag of new completions
+    uint64_t free;                   // Slots not in use
+    blk_request_t* requests[NVME_SLOTS];
+    uint64_t* prp_lists;             // PRP_ENTRIES per slot
+} queue_t;
+
+static queue_t admin;
+static queue_t queues[NVME_MAX_QUEUES];
+
+static struct {
+    bool present;
+    uint64_t regs;
+    uint32_t stride;                 // Between doorbells
+    pci_device_t device;
+    bool irq;                        // Completions are signalled by an interrupt
+    int queue_count;
+    pci_msix_t msix;
+    bool msix_enabled;
+    char features[16];
+} nvme;
+
+static bool nvme_submit(blk_request_t* req);
+static void nvme_kick(void);
+static void nvme_wait(void);
+static bool nvme_set_polled(bool polled);
+
+static blk_device_t nvme_dev = {
+    .name = "nvme",
+    .submit = nvme_submit,
+    .kick = nvme_kick,
+    .wait = nvme_wait,
+    .set_polled = nvme_set_polled,
+};
+
+static inline uint32_t reg_read(uint32_t reg) {
+    return *(volatile uint32_t*)(nvme.regs + reg);
+}
+
+static inline void reg_write(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(nvme.regs + reg) = value;
+}
+
+static inline uint64_t reg_read64(uint32_t reg) {
+    return reg_read(reg) | ((uint64_t)reg_read(reg + 4) << 32);
+}
+
+static inline void reg_write64(uint32_t reg, uint64_t value) {
+    reg_write(reg, value & 0xFFFFFFFF);
+    reg_write(reg + 4, value >> 32);
+}
+
+// The queue of the CPU we run on, so CPUs never share a queue
+static queue_t* cpu_queue(void) {
+    int cpu = lapic_enabled() ? lapic_id() : 0;
+    return &queues[cpu % nvme.queue_count];
+}
+
+// Memory for both queues of a pair, and the doorbells
+static bool alloc_queue(queue_t* q, uint16_t id, uint16_t size) {
+    q->id = id;
+    q->size = size;
+    q->sq = memory_alloc_pages((size * sizeof(sqe_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    q->cq = memory_alloc_pages((size * sizeof(cqe_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!q->sq || !q->cq) return false;
+    q->sq_doorbell = (volatile uint32_t*)(nvme.regs + REG_DOORBELLS + (2 * id) * nvme.stride);
+    q->cq_doorbell = (volatile uint32_t*)(nvme.regs + REG_DOORBELLS + (2 * id + 1) * nvme.stride);
+    q->sq_tail = 0;
+    q->sq_kicked = 0;
+    q->cq_head = 0;
+    q->phase = 1;
+    return true;
+}
+
+static inline void advance_cq(queue_t* q) {
+    if (++q->cq_head == q->size) {
+        q->cq_head = 0;
+        q->phase ^= 1;
+    }
+}
+
+// Run an admin command and spin for its completion, only used while
+// setting up
+static bool admin_command(sqe_t* cmd, uint32_t* result) {
+    uint16_t cid = admin.sq_tail;
+    cmd->cdw0 |= (uint32_t)cid << 16;
+    admin.sq[admin.sq_tail] = *cmd;
+    admin.sq_tail = (admin.sq_tail + 1) % admin.size;
+    barrier();
+    *admin.sq_doorbell = admin.sq_tail;
+
+    uint64_t end = rdtsc() + TIMEOUT_MS * tsc_per_ms;
+    volatile cqe_t* cqe = &admin.cq[admin.cq_head];
+    while ((cqe->status & 1) != admin.phase) {
+        if (rdtsc() > end) return false;
+        __asm__ volatile("pause");
+    }
+    barrier();
+    bool ok = cqe->cid == cid && (cqe->status >> 1) == 0;
+    if (result) *result = cqe->result;
+
+    advance_cq(&admin);
+    *admin.cq_doorbell = admin.cq_head;
+    return ok;
+}
+
+static bool identify(uint32_t cns, uint32_t nsid, void* page) {
+    sqe_t cmd = {
+        .cdw0 = ADMIN_IDENTIFY,
+        .nsid = nsid,
+        .prp1 = (uint64_t)page,
+        .cdw10 = cns,
+    };
+    return admin_command(&cmd, NULL);
+}
+
+// Spin until CSTS.RDY is what we want, the controller says how long it takes
+static bool wait_ready(bool ready, uint64_t cap) {
+    uint64_t ms = (CAP_TO(cap) ? CAP_TO(cap) : 1) * 500;
+    uint64_t end = rdtsc() + ms * tsc_per_ms;
+
+    while (((reg_read(REG_CSTS) & CSTS_RDY) != 0) != ready) {
+        if ((reg_read(REG_CSTS) & CSTS_CFS) || rdtsc() > end) return false;
+        __asm__ volatile("pause");
+    }
+    return true;
+}
+
+// Reset the controller and start it with our admin queue
+static bool enable(uint64_t cap) {
+    if (reg_read(REG_CC) & CC_EN) {
+        reg_write(REG_CC, reg_read(REG_CC) & ~CC_EN);
+    }
+    if (!wait_ready(false, cap)) return false;
+
+    if (!alloc_queue(&admin, 0, NVME_ADMIN_ENTRIES)) return false;
+    reg_write(REG_AQA, ((NVME_ADMIN_ENTRIES - 1) << 16) | (NVME_ADMIN_ENTRIES - 1));
+    reg_write64(REG_ASQ, (uint64_t)admin.sq);
+    reg_write64(REG_ACQ, (uint64_t)admin.cq);
+
+    // NVM command set, 4K pages, round robin arbitration
+    reg_write(REG_CC, CC_IOCQES | CC_IOSQES | CC_EN);
+    return wait_ready(true, cap);
+}
+
+// Model and size of namespace 1, and the largest transfer
+static bool identify_namespace(void) {
+    uint8_t* page = memory_alloc_pages(1);
+    if (!page || !identify(IDENTIFY_CONTROLLER, 0, page)) return false;
+
+    int len = 40;
+    memcpy(nvme_dev.model, page + ID_CTRL_MODEL, len);
+    while (len > 0 && nvme_dev.model[len - 1] == ' ') len--;
+    nvme_dev.model[len] = '\0';
+
+    uint64_t max = NVME_MAX_TRANSFER;
+    uint8_t mdts = page[ID_CTRL_MDTS];
+    if (mdts && mdts < 32 && ((uint64_t)PAGE_SIZE << mdts) < max) max = (uint64_t)PAGE_SIZE << mdts;
+    nvme_dev.max_sectors = max / BLK_SECTOR_SIZE;
+
+    memset(page, 0, PAGE_SIZE);
+    if (!identify(IDENTIFY_NAMESPACE, 1, page)) return false;
+    nvme_dev.sectors = *(uint64_t*)(page + ID_NS_NSZE);
+
+    // The block layer counts in 512 byte sectors
+    uint8_t format = page[ID_NS_FLBAS] & 0xF;
+    uint8_t lbads = page[ID_NS_LBAF + format * 4 + 2];
+    return nvme_dev.sectors != 0 && (1u << lbads) == BLK_SECTOR_SIZE;
+}
+
+// Ask for a queue pair per CPU, the controller may give fewer
+static void negotiate_queues(void) {
+    sqe_t cmd = {
+        .cdw0 = ADMIN_SET_FEATURES,
+        .cdw10 = FEATURE_QUEUES,
+        .cdw11 = ((NVME_MAX_QUEUES - 1) << 16) | (NVME_MAX_QUEUES - 1),
+    };
+    uint32_t result;
+
+    nvme.queue_count = 1;
+    if (admin_command(&cmd, &result)) {
+        int sqs = (result & 0xFFFF) + 1;
+        int cqs = (result >> 16) + 1;
+        nvme.queue_count = sqs < cqs ? sqs : cqs;
+        if (nvme.queue_count > NVME_MAX_QUEUES) nvme.queue_count = NVME_MAX_QUEUES;
+    }
+}
+
+static bool create_queue(queue_t* q, uint16_t vector) {
+    sqe_t cq = {
+        .cdw0 = ADMIN_CREATE_CQ,
+        .prp1 = (uint64_t)q->cq,
+        .cdw10 = ((uint32_t)(q->size - 1) << 16) | q->id,
+        .cdw11 = ((uint32_t)vector << 16) | CQ_IRQ_ENABLED | QUEUE_CONTIGUOUS,
+    };
+    sqe_t sq = {
+        .cdw0 = ADMIN_CREATE_SQ,
+        .prp1 = (uint64_t)q->sq,
+        .cdw10 = ((uint32_t)(q->size - 1) << 16) | q->id,
+        .cdw11 = ((uint32_t)q->id << 16) | QUEUE_CONTIGUOUS,
+    };
+    return admin_command(&cq, NULL) && admin_command(&sq, NULL);
+}
+
+// Complete what the controller finished on a queue, interrupts off. The
+// head doorbell is written once for all of them. Returns how many.
+static int reap(queue_t* q) {
+    int count = 0;
+
+    while ((q->cq[q->cq_head].status & 1) == q->phase) {
+        barrier();
+        volatile cqe_t* cqe = &q->cq[q->cq_head];
+        uint16_t slot = cqe->cid;
+        bool ok = (cqe->status >> 1) == 0;
+        advance_cq(q);
+
+        if (slot < NVME_SLOTS && !(q->free & (1ULL << slot))) {
+            // The slot is free again, so the callback can submit the next command
+            blk_request_t* req = q->requests[slot];
+            q->free |= 1ULL << slot;
+            blk_complete(req, ok);
+        }
+        count++;
+    }
+    if (count) *q->cq_doorbell = q->cq_head;
+    return count;
+}
+
+static int reap_all(void) {
+    int count = 0;
+    for (int i = 0; i < nvme.queue_count; i++) {
+        count += reap(&queues[i]);
+    }
+    return count;
+}
+
+static void queue_isr(int index) {
+    nvme_dev.stats.interrupts++;
+    reap(&queues[index]);
+}
+
+static void queue0_isr(void) { queue_isr(0); }
+static void queue1_isr(void) { queue_isr(1); }
+static void queue2_isr(void) { queue_isr(2); }
+static void queue3_isr(void) { queue_isr(3); }
+
+// Pin based interrupts are one line for every queue
+static void intx_isr(void) {
+    nvme_dev.stats.interrupts++;
+    reap_all();
+}
+
+// MSI-X entry n goes with I/O queue n, entry 0 with the admin queue, which
+// is only polled and stays masked
+static bool setup_msix(void) {
+    static const isr_t queue_isrs[NVME_MAX_QUEUES] = {
+        queue0_isr, queue1_isr, queue2_isr, queue3_isr
+    };
+
+    if (!lapic_enabled() || !pci_msix_init(&nvme.device, &nvme.msix)) return false;
+    if (nvme.msix.table_size < nvme.queue_count + 1) {
+        if (nvme.msix.table_size < 2) return false;
+        nvme.queue_count = nvme.msix.table_size - 1;
+    }
+
+    int vectors[NVME_MAX_QUEUES];
+    for (int i = 0; i < nvme.queue_count; i++) {
+        vectors[i] = interrupt_alloc_vector();
+        if (vectors[i] < 0) return false;
+    }
+    for (int i = 0; i < nvme.queue_count; i++) {
+        register_interrupt_handler(vectors[i], queue_isrs[i]);
+        pci_msix_set_vector(&nvme.msix, i + 1, vectors[i], lapic_id());
+    }
+    pci_msix_enable(&nvme.msix, true);
+    return true;
+}
+
+bool nvme_init(void) {
+    memset(&nvme, 0, sizeof(nvme));
+    if (!pci_find_class(NVME_CLASS, NVME_SUBCLASS, NVME_PROG_IF, &nvme.device)) {
+        return false;
+    }
+    nvme.regs = pci_map_bar(&nvme.device, 0);
+    if (!nvme.regs) return false;
+    pci_enable_bus_mastering(&nvme.device);
+
+    uint64_t cap = reg_read64(REG_CAP);
+    if (!(cap & CAP_CSS_NVM) || CAP_MPSMIN(cap) != 0) return false;
+    nvme.stride = 4 << CAP_DSTRD(cap);
+    if (!enable(cap) || !identify_namespace()) return false;
+
+    negotiate_queues();
+    nvme.msix_enabled = setup_msix();
+    nvme.irq = nvme.msix_enabled;
+    if (!nvme.msix_enabled && nvme.device.interrupt_line < 16) {
+        register_interrupt_handler(IRQ_BASE + nvme.device.interrupt_line, intx_isr);
+        pic_unmask_irq(nvme.device.interrupt_line);
+        nvme.irq = true;
+    }
+
+    uint16_t size = NVME_QUEUE_ENTRIES;
+    if (CAP_MQES(cap) + 1 < size) size = CAP_MQES(cap) + 1;
+    uint32_t depth = size - 1 < NVME_SLOTS ? size - 1 : NVME_SLOTS;
+    for (int i = 0; i < nvme.queue_count; i++) {
+        queue_t* q = &queues[i];
+        if (!alloc_queue(q, i + 1, size)) return false;
+        q->prp_lists = memory_alloc_pages(
+            (NVME_SLOTS * PRP_ENTRIES * sizeof(uint64_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+        if (!q->prp_lists || !create_queue(q, nvme.msix_enabled ? i + 1 : 0)) return false;
+        q->free = depth == 64 ? ~0ULL : (1ULL << depth) - 1;
+    }
+
+    // PRPs name pages, the first may start anywhere dword aligned and the
+    // rest are whole
+    nvme_dev.queue_depth = depth;
+    nvme_dev.queues = nvme.queue_count;
+    nvme_dev.max_segments = BLK_MAX_SEGMENTS;
+    nvme_dev.max_segment = nvme_dev.max_sectors * BLK_SECTOR_SIZE;
+    nvme_dev.dma_align = 4;
+    nvme_dev.dma_boundary = PAGE_SIZE;
+    nvme_dev.msi = nvme.msix_enabled;
+    nvme_dev.polled = !nvme.irq;
+
+    uint32_t vs = reg_read(REG_VS);
+    char* p = nvme.features;
+    strcpy(p, "NVMe ");
+    p += 5;
+    *p++ = '0' + ((vs >> 16) % 10);
+    *p++ = '.';
+    *p++ = '0' + ((vs >> 8) & 0xFF) % 10;
+    *p = '\0';
+    nvme_dev.features = nvme.features;
+
+    nvme.present = true;
+    blk_register(&nvme_dev);
+    return true;
+}
+
+// The data as a PRP list: the first entry may have an offset, the others
+// are whole pages, and dma_boundary made the segments line up with that.
+// Two entries fit in the command, more go in the slot's list.
+static void build_prps(queue_t* q, int slot, const blk_request_t* req, sqe_t* cmd) {
+    uint64_t* list = &q->prp_lists[slot * PRP_ENTRIES];
+    int n = 0;
+
+    for (int i = 0; i < req->sg_count; i++) {
+        uint64_t addr = (uint64_t)req->sg[i].addr;
+        uint64_t end = addr + req->sg[i].len;
+        for (uint64_t p = addr; p < end; p = (p & ~(uint64_t)(PAGE_SIZE - 1)) + PAGE_SIZE) {
+            if (n == 0) {
+                cmd->prp1 = p;
+            } else {
+                list[n - 1] = p;
+            }
+            n++;
+        }
+    }
+    if (n == 2) {
+        cmd->prp2 = list[0];
+    } else if (n > 2) {
+        cmd->prp2 = (uint64_t)list;
+    }
+}
+
+// Put the command on this CPU's submission queue, the controller hears of
+// it with the next kick
+static bool nvme_submit(blk_request_t* req) {
+    uint64_t flags = irq_save();
+    queue_t* q = cpu_queue();
+    if (!q->free) {
+        irq_restore(flags);
+        return false;
+    }
+    int slot = __builtin_ctzll(q->free);
+    q->free &= ~(1ULL << slot);
+
+    sqe_t* cmd = &q->sq[q->sq_tail];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->cdw0 = (req->write ? NVM_WRITE : NVM_READ) | ((uint32_t)slot << 16);
+    cmd->nsid = 1;
+    cmd->cdw10 = req->lba & 0xFFFFFFFF;
+    cmd->cdw11 = req->lba >> 32;
+    cmd->cdw12 = req->count - 1;
+    build_prps(q, slot, req, cmd);
+
+    q->requests[slot] = req;
+    q->sq_tail = (q->sq_tail + 1) % q->size;
+    irq_restore(flags);
+    return true;
+}
+
+// One doorbell write for everything queued since the last kick
+static void nvme_kick(void) {
+    uint64_t flags = irq_save();
+    queue_t* q = cpu_queue();
+    if (q->sq_tail != q->sq_kicked) {
+        // The commands have to be in memory before the controller looks
+        barrier();
+        *q->sq_doorbell = q->sq_tail;
+        q->sq_kicked = q->sq_tail;
+    }
+    irq_restore(flags);
+}
+
+static void nvme_wait(void) {
+    uint64_t flags = irq_save();
+    if (nvme.present && reap(cpu_queue()) == 0 && !nvme_dev.polled && (flags & (1 << 9))) {
+        // sti only takes effect after hlt, so the interrupt can't come in
+        // between
+        __asm__ volatile("sti; hlt");
+        return;
+    }
+    irq_restore(flags);
+}
+
+// Mask the queues' vectors, or the pin, so only blk_wait takes completions
+static bool nvme_set_polled(bool polled) {
+    if (!nvme.irq) return polled;
+
+    uint64_t flags = irq_save();
+    if (nvme.msix_enabled) {
+        for (int i = 0; i < nvme.queue_count; i++) {
+            pci_msix_mask(&nvme.msix, i + 1, polled);
+        }
+    } else {
+        reg_write(polled ? REG_INTMS : REG_INTMC, 1);
+    }
+    irq_restore(flags);
+    return true;
+}
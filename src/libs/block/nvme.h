@@ -0,0 +1,24 @@
+#pragma once
+
+#include "../types.h"
+
+// NVMe controller on PCIe (QEMU -device nvme). Next to the admin queue
+// there is one I/O submission and completion queue pair per CPU, so
+// submitting never touches another CPU's queue, and every completion queue
+// has its own MSI-X vector. Commands queued between two kicks reach the
+// controller with one submission doorbell write, and the completions taken
+// in one go are acknowledged with one completion doorbell write. Polled
+// mode masks the vectors and takes completions in blk_wait instead.
+#define NVME_CLASS          0x01
+#define NVME_SUBCLASS       0x08
+#define NVME_PROG_IF        0x02
+
+#define NVME_MAX_QUEUES     4       // I/O queue pairs
+#define NVME_QUEUE_ENTRIES  128     // Per queue, fewer if the controller says so
+#define NVME_ADMIN_ENTRIES  16
+#define NVME_SLOTS          64      // Commands in flight per queue
+#define NVME_MAX_TRANSFER   (256 * 1024)   // Per command, less if MDTS says so
+
+// Bring up namespace 1 of the first controller as block device "nvme",
+// false if there is none or its sectors aren't 512 bytes
+bool nvme_init(void);
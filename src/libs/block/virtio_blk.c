@@ -0,0 +1,293 @@
+#include "virtio_blk.h"
+#include "blkdev.h"
+#include "../virtio.h"
+#include "../pci.h"
+#include "../apic.h"
+#include "../interrupt.h"
+#include "../string.h"
+
+// Device feature bits
+#define VIRTIO_BLK_F_SIZE_MAX   (1ULL << 1)    // size_max limits one segment
+#define VIRTIO_BLK_F_SEG_MAX    (1ULL << 2)    // seg_max limits segments per request
+#define VIRTIO_BLK_F_RO         (1ULL << 5)
+#define VIRTIO_BLK_F_MQ         (1ULL << 12)   // num_queues is valid
+
+// Device configuration offsets
+#define CFG_CAPACITY    0      // 512 byte sectors, 64 bit
+#define CFG_SIZE_MAX    8
+#define CFG_SEG_MAX     12
+#define CFG_NUM_QUEUES  34
+
+#define VIRTIO_BLK_T_IN     0
+#define VIRTIO_BLK_T_OUT    1
+#define VIRTIO_BLK_S_OK     0
+
+typedef struct {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t sector;
+} __attribute__((packed)) virtio_blk_hdr_t;
+
+// Everything a request needs besides its data: the header, the status byte
+// the device writes last, and the indirect table describing all of it
+typedef struct {
+    virtq_desc_t table[BLK_MAX_SEGMENTS + 2] __attribute__((aligned(16)));
+    virtio_blk_hdr_t hdr;
+    volatile uint8_t status;
+    blk_request_t* req;
+} slot_t;
+
+typedef struct {
+    virtq_t vq;
+    slot_t slots[VIRTIO_BLK_SLOTS];
+    uint64_t free;           // Slots not in use
+} queue_t;
+
+static queue_t queues[VIRTIO_BLK_MAX_QUEUES];
+
+static struct {
+    virtio_device_t dev;
+    bool present;
+    bool indirect;
+    bool irq;                // Completions are signalled by an interrupt
+    int queue_count;
+    pci_msix_t msix;
+    char features[48];
+} vblk;
+
+static bool virtio_blk_submit(blk_request_t* req);
+static void virtio_blk_kick(void);
+static void virtio_blk_wait(void);
+
+static blk_device_t virtio_dev = {
+    .name = "virtio",
+    .submit = virtio_blk_submit,
+    .kick = virtio_blk_kick,
+    .wait = virtio_blk_wait,
+};
+
+// The queue of the CPU we run on, so CPUs never share a ring
+static queue_t* cpu_queue(void) {
+    int cpu = lapic_enabled() ? lapic_id() : 0;
+    return &queues[cpu % vblk.queue_count];
+}
+
+// Complete what the device finished on a queue, interrupts off. Interrupts
+// stay suppressed while the used ring is drained, and re-enabling them
+// tells whether more completed meanwhile. Returns how many.
+static int reap(queue_t* q) {
+    int count = 0;
+
+    do {
+        virtq_disable_interrupts(&q->vq);
+        slot_t* s;
+        while ((s = virtq_get_buf(&q->vq, NULL)) != NULL) {
+            blk_request_t* req = s->req;
+            bool ok = s->status == VIRTIO_BLK_S_OK;
+
+            // The slot is free again, so the callback can submit the next request
+            q->free |= 1ULL << (s - q->slots);
+            blk_complete(req, ok);
+            count++;
+        }
+    } while (!virtq_enable_interrupts(&q->vq));
+    return count;
+}
+
+static int reap_all(void) {
+    int count = 0;
+    for (int i = 0; i < vblk.queue_count; i++) {
+        count += reap(&queues[i]);
+    }
+    return count;
+}
+
+static void queue_isr(int index) {
+    virtio_dev.stats.interrupts++;
+    reap(&queues[index]);
+}
+
+static void queue0_isr(void) { queue_isr(0); }
+static void queue1_isr(void) { queue_isr(1); }
+static void queue2_isr(void) { queue_isr(2); }
+static void queue3_isr(void) { queue_isr(3); }
+
+// INTx is one line for all queues, reading the ISR status acknowledges it
+static void intx_isr(void) {
+    if (virtio_read_isr(&vblk.dev) & 1) {
+        virtio_dev.stats.interrupts++;
+        reap_all();
+    }
+}
+
+// One MSI-X vector per queue, all aimed at this CPU for now. Needs an entry
+// per queue in the table, the configuration change vector is left unused.
+static bool setup_msix(void) {
+    static const isr_t queue_isrs[VIRTIO_BLK_MAX_QUEUES] = {
+        queue0_isr, queue1_isr, queue2_isr, queue3_isr
+    };
+
+    if (!lapic_enabled() || !pci_msix_init(&vblk.dev.pci, &vblk.msix) ||
+        vblk.msix.table_size < vblk.queue_count) {
+        return false;
+    }
+
+    int vectors[VIRTIO_BLK_MAX_QUEUES];
+    for (int i = 0; i < vblk.queue_count; i++) {
+        vectors[i] = interrupt_alloc_vector();
+        if (vectors[i] < 0) return false;
+    }
+    for (int i = 0; i < vblk.queue_count; i++) {
+        register_interrupt_handler(vectors[i], queue_isrs[i]);
+        pci_msix_set_vector(&vblk.msix, i, vectors[i], lapic_id());
+    }
+    pci_msix_enable(&vblk.msix, true);
+    return true;
+}
+
+static void append(char* out, const char* s) {
+    size_t len = strlen(out);
+    if (len) {
+        strcpy(out + len, ", ");
+        len += 2;
+    }
+    strcpy(out + len, s);
+}
+
+bool virtio_blk_init(void) {
+    memset(&vblk, 0, sizeof(vblk));
+    if (!virtio_pci_init(&vblk.dev, VIRTIO_BLK_DEVICE_ID, VIRTIO_BLK_TRANSITIONAL_ID)) {
+        return false;
+    }
+
+    uint64_t wanted = VIRTIO_BLK_F_SIZE_MAX | VIRTIO_BLK_F_SEG_MAX | VIRTIO_BLK_F_RO |
+                      VIRTIO_BLK_F_MQ | VIRTIO_F_INDIRECT_DESC | VIRTIO_F_EVENT_IDX;
+    if (!virtio_negotiate(&vblk.dev, wanted) || !vblk.dev.device_cfg) {
+        return false;
+    }
+    volatile uint8_t* cfg = vblk.dev.device_cfg;
+    uint64_t features = vblk.dev.features;
+
+    virtio_dev.sectors = *(volatile uint32_t*)(cfg + CFG_CAPACITY) |
+                         ((uint64_t)*(volatile uint32_t*)(cfg + CFG_CAPACITY + 4) << 32);
+    virtio_dev.read_only = (features & VIRTIO_BLK_F_RO) != 0;
+    virtio_dev.max_sectors = BLK_MAX_SECTORS;
+    virtio_dev.max_segment = 0xFFFFFFFF;
+    if (features & VIRTIO_BLK_F_SIZE_MAX) {
+        virtio_dev.max_segment = *(volatile uint32_t*)(cfg + CFG_SIZE_MAX);
+    }
+
+    // The header and the status byte take two of the device's segments
+    virtio_dev.max_segments = BLK_MAX_SEGMENTS;
+    if (features & VIRTIO_BLK_F_SEG_MAX) {
+        uint32_t seg_max = *(volatile uint32_t*)(cfg + CFG_SEG_MAX);
+        if (seg_max < 3) return false;
+        if (seg_max - 2 < virtio_dev.max_segments) virtio_dev.max_segments = seg_max - 2;
+    }
+
+    vblk.queue_count = 1;
+    if (features & VIRTIO_BLK_F_MQ) {
+        vblk.queue_count = *(volatile uint16_t*)(cfg + CFG_NUM_QUEUES);
+        if (vblk.queue_count < 1) vblk.queue_count = 1;
+        if (vblk.queue_count > VIRTIO_BLK_MAX_QUEUES) vblk.queue_count = VIRTIO_BLK_MAX_QUEUES;
+    }
+    vblk.indirect = (features & VIRTIO_F_INDIRECT_DESC) != 0;
+
+    // Interrupts before the queues, their vectors are set along with them
+    bool msix = setup_msix();
+    for (int i = 0; i < vblk.queue_count; i++) {
+        queue_t* q = &queues[i];
+        uint16_t entry = msix ? i : VIRTIO_MSI_NO_VECTOR;
+        if (!virtio_setup_queue_vector(&vblk.dev, &q->vq, i, entry)) {
+            return false;
+        }
+
+        // Without indirect tables a request of one segment takes three descriptors
+        uint32_t depth = vblk.indirect ? q->vq.size : q->vq.size / 3;
+        if (depth > VIRTIO_BLK_SLOTS) depth = VIRTIO_BLK_SLOTS;
+        if (i == 0 || depth < virtio_dev.queue_depth) virtio_dev.queue_depth = depth;
+    }
+    for (int i = 0; i < vblk.queue_count; i++) {
+        uint32_t depth = virtio_dev.queue_depth;
+        queues[i].free = depth == 64 ? ~0ULL : (1ULL << depth) - 1;
+    }
+
+    virtio_dev.msi = msix;
+    vblk.irq = msix;
+    if (!msix && vblk.dev.pci.interrupt_line < 16) {
+        register_interrupt_handler(IRQ_BASE + vblk.dev.pci.interrupt_line, intx_isr);
+        pic_unmask_irq(vblk.dev.pci.interrupt_line);
+        vblk.irq = true;
+    }
+
+    virtio_dev.queues = vblk.queue_count;
+    strcpy(virtio_dev.model, "virtio-blk");
+    if (vblk.indirect) append(vblk.features, "indirect");
+    if (features & VIRTIO_F_EVENT_IDX) append(vblk.features, "event idx");
+    if (virtio_dev.read_only) append(vblk.features, "read only");
+    virtio_dev.features = vblk.features;
+
+    virtio_driver_ok(&vblk.dev);
+    vblk.present = true;
+    blk_register(&virtio_dev);
+    return true;
+}
+
+// Put the request on this CPU's queue, the device hears of it with the
+// next kick
+static bool virtio_blk_submit(blk_request_t* req) {
+    uint64_t flags = irq_save();
+    queue_t* q = cpu_queue();
+    if (!q->free) {
+        irq_restore(flags);
+        return false;
+    }
+    int i = __builtin_ctzll(q->free);
+    slot_t* s = &q->slots[i];
+
+    s->hdr.type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+    s->hdr.reserved = 0;
+    s->hdr.sector = req->lba;
+    s->status = 0xFF;
+    s->req = req;
+
+    // Header, data, status. The device reads the data of a write and
+    // writes that of a read.
+    virtq_buf_t bufs[BLK_MAX_SEGMENTS + 2];
+    int n = 0;
+    bufs[n++] = (virtq_buf_t){ (uint64_t)&s->hdr, sizeof(s->hdr) };
+    for (int j = 0; j < req->sg_count; j++) {
+        bufs[n++] = (virtq_buf_t){ (uint64_t)req->sg[j].addr, req->sg[j].len };
+    }
+    bufs[n++] = (virtq_buf_t){ (uint64_t)&s->status, 1 };
+    uint16_t out = req->write ? n - 1 : 1;
+
+    bool added = vblk.indirect ? virtq_add_indirect(&q->vq, s->table, bufs, out, n - out, s)
+                               : virtq_add_buf(&q->vq, bufs, out, n - out, s);
+    if (added) {
+        q->free &= ~(1ULL << i);
+    }
+    irq_restore(flags);
+    return added;
+}
+
+// One notification per queue for everything added since the last kick,
+// and none at all if the device is still working through its ring
+static void virtio_blk_kick(void) {
+    uint64_t flags = irq_save();
+    for (int i = 0; i < vblk.queue_count; i++) {
+        virtq_kick(&queues[i].vq);
+    }
+    irq_restore(flags);
+}
+
+static void virtio_blk_wait(void) {
+    uint64_t flags = irq_save();
+    if (vblk.present && reap_all() == 0 && vblk.irq && (flags & (1 << 9))) {
+        // sti only takes effect after hlt, so the interrupt can't come in
+        // between
+        __asm__ volatile("sti; hlt");
+        return;
+    }
+    irq_restore(flags);
+}
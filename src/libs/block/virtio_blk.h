@@ -0,0 +1,19 @@
+#pragma once
+
+#include "../types.h"
+
+// virtio-blk over the modern PCI transport (QEMU -drive if=virtio). Every
+// request takes one ring descriptor pointing at an indirect table, so a
+// queue holds as many requests as it has descriptors. With VIRTIO_BLK_F_MQ
+// there is one virtqueue per CPU, each completing through its own MSI-X
+// vector, and EVENT_IDX keeps both notifications and interrupts down to
+// one per batch.
+#define VIRTIO_BLK_DEVICE_ID        0x1042
+#define VIRTIO_BLK_TRANSITIONAL_ID  0x1001
+
+#define VIRTIO_BLK_MAX_QUEUES   4
+#define VIRTIO_BLK_SLOTS        64      // Requests in flight per queue
+
+// Bring up the first virtio-blk device as block device "virtio", false if
+// there is none
+bool virtio_blk_init(void);
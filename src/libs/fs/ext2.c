@@ -0,0 +1,558 @@
+#include "ext2.h"
+#include "../block/bcache.h"
+#include "../string.h"
+
+#define SUPERBLOCK_OFFSET   1024
+#define EXT2_MAGIC          0xEF53
+#define ROOT_INO            2
+#define N_DIRECT            12      // Block pointers in the inode itself
+#define N_POINTERS          15      // and the single, double and triple indirect ones
+
+#define INCOMPAT_FILETYPE   0x0002  // Directory entries say what they point to
+
+#define MODE_TYPE           0xF000
+#define MODE_DIR            0x4000
+#define MODE_FILE           0x8000
+
+#define FT_FILE             1
+#define FT_DIR              2
+
+typedef struct {
+    uint32_t inodes_count;
+    uint32_t blocks_count;
+    uint32_t r_blocks_count;
+    uint32_t free_blocks_count;
+    uint32_t free_inodes_count;
+    uint32_t first_data_block;
+    uint32_t log_block_size;        // Block size is 1024 << this
+    uint32_t log_frag_size;
+    uint32_t blocks_per_group;
+    uint32_t frags_per_group;
+    uint32_t inodes_per_group;
+    uint32_t mtime;
+    uint32_t wtime;
+    uint16_t mnt_count;
+    uint16_t max_mnt_count;
+    uint16_t magic;
+    uint16_t state;
+    uint16_t errors;
+    uint16_t minor_rev_level;
+    uint32_t lastcheck;
+    uint32_t checkinterval;
+    uint32_t creator_os;
+    uint32_t rev_level;             // 0 has fixed 128 byte inodes
+    uint16_t def_resuid;
+    uint16_t def_resgid;
+    uint32_t first_ino;
+    uint16_t inode_size;
+    uint16_t block_group_nr;
+    uint32_t feature_compat;
+    uint32_t feature_incompat;      // Features a reader has to know
+    uint32_t feature_ro_compat;     // Only writers have to know these
+} __attribute__((packed)) super_t;
+
+typedef struct {
+    uint32_t block_bitmap;
+    uint32_t inode_bitmap;
+    uint32_t inode_table;
+    uint16_t free_blocks_count;
+    uint16_t free_inodes_count;
+    uint16_t used_dirs_count;
+    uint16_t pad;
+    uint8_t reserved[12];
+} __attribute__((packed)) group_desc_t;
+
+typedef struct {
+    uint16_t mode;
+    uint16_t uid;
+    uint32_t size;
+    uint32_t atime;
+    uint32_t ctime;
+    uint32_t mtime;
+    uint32_t dtime;
+    uint16_t gid;
+    uint16_t links_count;
+    uint32_t blocks;
+    uint32_t flags;
+    uint32_t osd1;
+    uint32_t block[N_POINTERS];
+    uint32_t generation;
+    uint32_t file_acl;
+    uint32_t size_high;             // Of regular files in revision 1
+    uint32_t faddr;
+    uint8_t osd2[12];
+} __attribute__((packed)) disk_inode_t;
+
+typedef struct {
+    uint32_t inode;                 // 0 for an unused entry
+    uint16_t rec_len;               // To the next entry
+    uint8_t name_len;
+    uint8_t file_type;              // With INCOMPAT_FILETYPE
+    char name[];
+} __attribute__((packed)) dirent_t;
+
+typedef struct {
+    blk_device_t* dev;
+    uint32_t block_size;
+    uint32_t sectors_per_block;
+    uint32_t per_block;             // Block pointers in an indirect block
+    uint32_t inodes_count;
+    uint32_t inodes_per_group;
+    uint32_t inode_size;
+    uint32_t groups;
+    uint32_t first_data_block;
+    uint64_t blocks;
+    bool filetype;
+    uint64_t sectors_base;          // dev sectors_read at the last stats reset
+    char path[VFS_PATH_MAX];
+} mount_t;
+
+// File blocks logical on are disk blocks physical on, or holes if physical is 0
+typedef struct {
+    uint32_t logical;
+    uint32_t physical;
+    uint32_t count;                 // 0 for an empty slot
+} extent_t;
+
+// An inode's data, the copy of its block pointers and what was mapped of them
+typedef struct node node_t;
+struct node {
+    mount_t* mount;
+    uint32_t block[N_POINTERS];
+    extent_t extents[EXT2_EXTENTS];
+    uint32_t next_extent;           // Slot the next extent replaces
+    node_t* next_free;
+};
+
+static struct {
+    mount_t mounts[EXT2_MAX_MOUNTS];
+    int mount_count;
+    node_t nodes[EXT2_MAX_NODES];
+    node_t* free_nodes;
+    bool ready;
+    ext2_stats_t stats;
+} ext2;
+
+static uint64_t ext2_read(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len);
+static void ext2_evict(vfs_inode_t* inode);
+static vfs_error_t ext2_lookup(vfs_inode_t* dir, const char* name, size_t len, vfs_inode_t* inode);
+static bool ext2_readdir(vfs_inode_t* dir, uint64_t* cookie, char* name);
+
+static const vfs_fs_ops_t ext2_ops = {
+    .name = "ext2",
+    .cached = true,
+    .read = ext2_read,
+    .evict = ext2_evict,
+    .lookup = ext2_lookup,
+    .readdir = ext2_readdir,
+};
+
+static node_t* alloc_node(mount_t* m) {
+    node_t* node = ext2.free_nodes;
+    if (!node) return NULL;
+    ext2.free_nodes = node->next_free;
+    memset(node, 0, sizeof(node_t));
+    node->mount = m;
+    return node;
+}
+
+static void free_node(node_t* node) {
+    node->next_free = ext2.free_nodes;
+    ext2.free_nodes = node;
+}
+
+// File system block b, borrowed from the block cache. NULL past the end of
+// the file system or on a read error.
+static const uint8_t* get_block(mount_t* m, uint32_t b, bcache_buf_t** buf) {
+    uint64_t byte = (uint64_t)b * m->block_size;
+    *buf = b < m->blocks ? bcache_read(m->dev, byte / BCACHE_BLOCK_SIZE) : NULL;
+    if (!*buf) {
+        ext2.stats.errors++;
+        return NULL;
+    }
+    return (*buf)->data + byte % BCACHE_BLOCK_SIZE;
+}
+
+// Whether this driver can read a file system with that superblock
+static bool supported(const super_t* sb) {
+    if (sb->magic != EXT2_MAGIC || sb->log_block_size > 2) return false;
+    if (sb->feature_incompat & ~INCOMPAT_FILETYPE) return false;
+    if (!sb->inodes_per_group || !sb->blocks_per_group || !sb->inodes_count) return false;
+    if (sb->first_data_block >= sb->blocks_count) return false;
+    if (sb->rev_level > 0) {
+        uint32_t size = sb->inode_size;
+        if (size < sizeof(disk_inode_t) || size > (1024u << sb->log_block_size) || (size & (size - 1))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool ext2_probe(blk_device_t* dev) {
+    bcache_buf_t* buf = bcache_read(dev, 0);
+    if (!buf) return false;
+    bool ok = supported((const super_t*)(buf->data + SUPERBLOCK_OFFSET));
+    bcache_release(buf);
+    return ok;
+}
+
+// Copy the block pointers of inode ino into node, with its mode and size
+static bool read_inode(mount_t* m, uint32_t ino, node_t* node, uint16_t* mode, uint64_t* size) {
+    if (ino == 0 || ino > m->inodes_count) return false;
+    uint32_t group = (ino - 1) / m->inodes_per_group;
+    uint32_t index = (ino - 1) % m->inodes_per_group;
+    if (group >= m->groups) return false;
+
+    // The descriptor table starts in the block after the superblock
+    bcache_buf_t* buf;
+    uint64_t desc = (uint64_t)group * sizeof(group_desc_t);
+    const uint8_t* data = get_block(m, m->first_data_block + 1 + desc / m->block_size, &buf);
+    if (!data) return false;
+    uint32_t table = ((const group_desc_t*)(data + desc % m->block_size))->inode_table;
+    bcache_release(buf);
+
+    uint64_t at = (uint64_t)index * m->inode_size;
+    data = get_block(m, table + at / m->block_size, &buf);
+    if (!data) return false;
+    const disk_inode_t* inode = (const disk_inode_t*)(data + at % m->block_size);
+    *mode = inode->mode;
+    *size = inode->size;
+    if ((inode->mode & MODE_TYPE) == MODE_FILE) *size |= (uint64_t)inode->size_high << 32;
+    memcpy(node->block, inode->block, sizeof(node->block));
+    bcache_release(buf);
+
+    ext2.stats.meta_blocks += 2;
+    return true;
+}
+
+// Disk block of file block index, 0 for a hole, and in *run how many file
+// blocks from there on are contiguous on the disk (or holes), at least 1.
+// The answer comes from the extent cache when it can. False on a read
+// error or a broken block map.
+static bool map(node_t* node, uint32_t index, uint32_t* physical, uint32_t* run) {
+    for (int i = 0; i < EXT2_EXTENTS; i++) {
+        extent_t* e = &node->extents[i];
+        if (e->count && index - e->logical < e->count) {
+            uint32_t skip = index - e->logical;
+            *physical = e->physical ? e->physical + skip : 0;
+            *run = e->count - skip;
+            ext2.stats.extent_hits++;
+            return true;
+        }
+    }
+    ext2.stats.extent_misses++;
+
+    // Find the pointer array holding index and its position in it. span is
+    // how many file blocks one pointer covers at the current level.
+    mount_t* m = node->mount;
+    const uint32_t* ptrs = node->block;
+    uint32_t entries = N_DIRECT;
+    uint64_t i = index;
+    bcache_buf_t* buf = NULL;
+    if (i >= N_DIRECT) {
+        i -= N_DIRECT;
+        uint32_t depth = 1;
+        uint64_t span = m->per_block;
+        while (i >= span) {
+            i -= span;
+            span *= m->per_block;
+            if (++depth > 3) return false;
+        }
+
+        uint32_t ptr = node->block[N_DIRECT - 1 + depth];
+        entries = m->per_block;
+        while (true) {
+            if (!ptr) {
+                // Nothing under this pointer is mapped
+                if (buf) bcache_release(buf);
+                *physical = 0;
+                *run = span - i;
+                goto remember;
+            }
+            if (buf) bcache_release(buf);
+            ptrs = (const uint32_t*)get_block(m, ptr, &buf);
+            if (!ptrs) return false;
+            ext2.stats.meta_blocks++;
+
+            span /= m->per_block;
+            if (span == 1) break;
+            ptr = ptrs[i / span];
+            i %= span;
+        }
+    }
+
+    // The run ends where the pointer array does
+    uint32_t first = ptrs[i];
+    uint32_t n = 1;
+    if (first) {
+        while (i + n < entries && ptrs[i + n] == first + n) n++;
+    } else {
+        while (i + n < entries && !ptrs[i + n]) n++;
+    }
+    if (buf) bcache_release(buf);
+    if (first && (first >= m->blocks || n > m->blocks - first)) {
+        ext2.stats.errors++;
+        return false;
+    }
+    *physical = first;
+    *run = n;
+
+remember:
+    node->extents[node->next_extent] = (extent_t){ index, *physical, *run };
+    node->next_extent = (node->next_extent + 1) % EXT2_EXTENTS;
+    return true;
+}
+
+static uint64_t ext2_read(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len) {
+    node_t* node = inode->data;
+    mount_t* m = node->mount;
+    uint32_t bs = m->block_size;
+    uint32_t align = m->dev->dma_align ? m->dev->dma_align : 1;
+    uint8_t* out = buffer;
+    uint64_t done = 0;
+
+    while (done < len && offset / bs <= UINT32_MAX) {
+        uint32_t in_block = offset % bs;
+        uint32_t physical, run;
+        if (!map(node, offset / bs, &physical, &run)) break;
+        uint64_t n = (uint64_t)run * bs - in_block;
+        if (n > len - done) n = len - done;
+
+        if (!physical) {
+            memset(out + done, 0, n);
+            ext2.stats.hole_blocks += (in_block + n + bs - 1) / bs;
+        } else if (in_block == 0 && n >= EXT2_DIRECT_MIN && (uint64_t)(out + done) % align == 0) {
+            // Whole blocks of the run straight from the disk, a partial
+            // block at the end goes through the cache next time around
+            uint32_t blocks = n / bs;
+            if (!blk_read(m->dev, (uint64_t)physical * m->sectors_per_block,
+                          blocks * m->sectors_per_block, out + done)) {
+                ext2.stats.errors++;
+                break;
+            }
+            n = (uint64_t)blocks * bs;
+            ext2.stats.direct_blocks += blocks;
+            ext2.stats.direct_reads++;
+        } else {
+            if (n > bs - in_block) n = bs - in_block;
+            bcache_buf_t* buf;
+            const uint8_t* data = get_block(m, physical, &buf);
+            if (!data) break;
+            memcpy(out + done, data + in_block, n);
+            bcache_release(buf);
+            ext2.stats.cached_blocks++;
+        }
+        done += n;
+        offset += n;
+    }
+    ext2.stats.bytes += done;
+    return done;
+}
+
+static void ext2_evict(vfs_inode_t* inode) {
+    free_node(inode->data);
+}
+
+// The directory entry at byte pos of a directory block, NULL if it is broken
+static const dirent_t* entry_at(mount_t* m, const uint8_t* block, uint32_t pos) {
+    if (pos + sizeof(dirent_t) > m->block_size) return NULL;
+    const dirent_t* e = (const dirent_t*)(block + pos);
+    if (e->rec_len < sizeof(dirent_t) || e->rec_len % 4 || e->rec_len > m->block_size - pos ||
+        e->name_len > e->rec_len - sizeof(dirent_t)) {
+        ext2.stats.errors++;
+        return NULL;
+    }
+    return e;
+}
+
+// Whether the entry is one the VFS shows: not free, not "." or "..", a
+// file or directory when the entry says, and a name that fits
+static bool visible(mount_t* m, const dirent_t* e) {
+    if (!e->inode || e->name_len == 0 || e->name_len > VFS_NAME_MAX) return false;
+    if (e->name[0] == '.' && (e->name_len == 1 || (e->name_len == 2 && e->name[1] == '.'))) return false;
+    return !m->filetype || e->file_type == FT_FILE || e->file_type == FT_DIR;
+}
+
+// Scan the directory for name, block by block
+static vfs_error_t find_entry(vfs_inode_t* dir, const char* name, size_t len, uint32_t* ino) {
+    node_t* node = dir->data;
+    mount_t* m = node->mount;
+    uint64_t blocks = (dir->size + m->block_size - 1) / m->block_size;
+    ext2.stats.dir_lookups++;
+
+    for (uint64_t index = 0; index < blocks;) {
+        uint32_t physical, run;
+        if (!map(node, index, &physical, &run)) return VFS_ERR_IO;
+        for (uint32_t i = 0; i < run && index < blocks; i++, index++) {
+            if (!physical) continue;
+            bcache_buf_t* buf;
+            const uint8_t* data = get_block(m, physical + i, &buf);
+            if (!data) return VFS_ERR_IO;
+            ext2.stats.dir_blocks++;
+            ext2.stats.meta_blocks++;
+
+            const dirent_t* e;
+            for (uint32_t pos = 0; (e = entry_at(m, data, pos)); pos += e->rec_len) {
+                if (visible(m, e) && e->name_len == len && memcmp(e->name, name, len) == 0) {
+                    *ino = e->inode;
+                    bcache_release(buf);
+                    return VFS_OK;
+                }
+            }
+            bcache_release(buf);
+        }
+    }
+    return VFS_ERR_NOT_FOUND;
+}
+
+static vfs_error_t ext2_lookup(vfs_inode_t* dir, const char* name, size_t len, vfs_inode_t* inode) {
+    node_t* parent = dir->data;
+    uint32_t ino;
+    vfs_error_t error = find_entry(dir, name, len, &ino);
+    if (error != VFS_OK) return error;
+
+    node_t* node = alloc_node(parent->mount);
+    if (!node) return VFS_ERR_NO_SPACE;
+    uint16_t mode;
+    uint64_t size;
+    if (!read_inode(parent->mount, ino, node, &mode, &size)) {
+        free_node(node);
+        return VFS_ERR_IO;
+    }
+    if ((mode & MODE_TYPE) != MODE_FILE && (mode & MODE_TYPE) != MODE_DIR) {
+        // Links, devices and the like aren't shown
+        free_node(node);
+        return VFS_ERR_NOT_FOUND;
+    }
+
+    inode->type = (mode & MODE_TYPE) == MODE_DIR ? VFS_DIR : VFS_FILE;
+    inode->size = size;
+    inode->data = node;
+    return VFS_OK;
+}
+
+// The cookie is the byte offset of the next entry in the directory
+static bool ext2_readdir(vfs_inode_t* dir, uint64_t* cookie, char* name) {
+    node_t* node = dir->data;
+    mount_t* m = node->mount;
+
+    while (*cookie < dir->size && *cookie / m->block_size <= UINT32_MAX) {
+        uint32_t pos = *cookie % m->block_size;
+        uint32_t physical, run;
+        if (!map(node, *cookie / m->block_size, &physical, &run)) return false;
+        if (!physical) {
+            *cookie += (uint64_t)run * m->block_size - pos;
+            continue;
+        }
+
+        bcache_buf_t* buf;
+        const uint8_t* data = get_block(m, physical, &buf);
+        if (!data) return false;
+        const dirent_t* e = entry_at(m, data, pos);
+        if (!e) {
+            // Give up on the rest of the block
+            bcache_release(buf);
+            *cookie += m->block_size - pos;
+            continue;
+        }
+        *cookie += e->rec_len;
+        bool found = visible(m, e);
+        if (found) {
+            memcpy(name, e->name, e->name_len);
+            name[e->name_len] = '\0';
+        }
+        bcache_release(buf);
+        if (found) return true;
+    }
+    return false;
+}
+
+vfs_error_t ext2_mount(blk_device_t* dev, const char* path) {
+    if (!ext2.ready) {
+        for (int i = EXT2_MAX_NODES - 1; i >= 0; i--) free_node(&ext2.nodes[i]);
+        ext2.ready = true;
+    }
+    if (ext2.mount_count == EXT2_MAX_MOUNTS) return VFS_ERR_NO_SPACE;
+    if (strlen(path) >= VFS_PATH_MAX) return VFS_ERR_INVALID;
+    for (int i = 0; i < ext2.mount_count; i++) {
+        if (ext2.mounts[i].dev == dev) return VFS_ERR_EXISTS;
+    }
+
+    bcache_buf_t* buf = bcache_read(dev, 0);
+    if (!buf) return VFS_ERR_IO;
+    const super_t* sb = (const super_t*)(buf->data + SUPERBLOCK_OFFSET);
+    if (!supported(sb)) {
+        bcache_release(buf);
+        return VFS_ERR_INVALID;
+    }
+
+    mount_t* m = &ext2.mounts[ext2.mount_count];
+    memset(m, 0, sizeof(mount_t));
+    m->dev = dev;
+    m->block_size = 1024u << sb->log_block_size;
+    m->sectors_per_block = m->block_size / BLK_SECTOR_SIZE;
+    m->per_block = m->block_size / sizeof(uint32_t);
+    m->inodes_count = sb->inodes_count;
+    m->inodes_per_group = sb->inodes_per_group;
+    m->inode_size = sb->rev_level > 0 ? sb->inode_size : sizeof(disk_inode_t);
+    m->first_data_block = sb->first_data_block;
+    m->groups = (sb->blocks_count - sb->first_data_block + sb->blocks_per_group - 1) /
+                sb->blocks_per_group;
+    m->filetype = sb->feature_incompat & INCOMPAT_FILETYPE;
+
+    // Blocks past the end of the device would read as errors anyway
+    uint64_t dev_blocks = dev->sectors / m->sectors_per_block;
+    m->blocks = sb->blocks_count < dev_blocks ? sb->blocks_count : dev_blocks;
+    bcache_release(buf);
+    m->sectors_base = dev->stats.sectors_read;
+    strcpy(m->path, path);
+
+    node_t* root = alloc_node(m);
+    if (!root) return VFS_ERR_NO_SPACE;
+    uint16_t mode;
+    uint64_t size;
+    vfs_error_t error = VFS_ERR_IO;
+    if (read_inode(m, ROOT_INO, root, &mode, &size)) {
+        error = (mode & MODE_TYPE) == MODE_DIR ? vfs_mount(path, &ext2_ops, root, size)
+                                               : VFS_ERR_INVALID;
+    }
+    if (error != VFS_OK) {
+        free_node(root);
+        return error;
+    }
+    ext2.mount_count++;
+    return VFS_OK;
+}
+
+bool ext2_get_mount(int index, blk_device_t** dev, const char** path, uint32_t* block_size,
+                    uint64_t* blocks) {
+    if (index < 0 || index >= ext2.mount_count) return false;
+    mount_t* m = &ext2.mounts[index];
+    *dev = m->dev;
+    *path = m->path;
+    *block_size = m->block_size;
+    *blocks = m->blocks;
+    return true;
+}
+
+const ext2_stats_t* ext2_get_stats(void) {
+    return &ext2.stats;
+}
+
+uint64_t ext2_device_bytes(void) {
+    uint64_t sectors = 0;
+    for (int i = 0; i < ext2.mount_count; i++) {
+        mount_t* m = &ext2.mounts[i];
+        // blk_reset_stats may have reset the device since
+        if (m->dev->stats.sectors_read < m->sectors_base) m->sectors_base = 0;
+        sectors += m->dev->stats.sectors_read - m->sectors_base;
+    }
+    return sectors * BLK_SECTOR_SIZE;
+}
+
+void ext2_reset_stats(void) {
+    memset(&ext2.stats, 0, sizeof(ext2.stats));
+    for (int i = 0; i < ext2.mount_count; i++) {
+        ext2.mounts[i].sectors_base = ext2.mounts[i].dev->stats.sectors_read;
+    }
+}
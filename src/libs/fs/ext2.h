@@ -0,0 +1,51 @@
+#pragma once
+
+#include "../types.h"
+#include "../block/blkdev.h"
+#include "vfs.h"
+
+// Read only ext2, mounted on a directory of the RAM root. File contents
+// are read through the page cache, metadata and single page fills go
+// through the block cache. Every inode remembers the last few extents it
+// mapped, runs of file blocks that lie one after another on the disk, so a
+// sequential reader walks the indirect blocks once per run instead of once
+// per block. Reads that cover a long run go from the disk straight into the
+// caller's buffer in large requests, without copying through the block
+// cache. Names found in directories stay in the VFS dentry
+// cache, so a directory is scanned once per name.
+#define EXT2_MAX_MOUNTS     4
+#define EXT2_MAX_NODES      VFS_MAX_INODES
+#define EXT2_EXTENTS        4                   // Remembered per inode
+#define EXT2_DIRECT_MIN     (16 * 1024)         // Bytes of a run read around the cache
+
+typedef struct {
+    uint64_t bytes;             // File data handed to readers
+    uint64_t cached_blocks;     // File blocks read through the block cache
+    uint64_t direct_blocks;     // File blocks read straight into the reader's buffer
+    uint64_t direct_reads;      // Requests those took
+    uint64_t hole_blocks;       // File blocks that read as zeros
+    uint64_t meta_blocks;       // Inode, indirect and directory blocks looked at
+    uint64_t extent_hits;       // File blocks found in the extent cache
+    uint64_t extent_misses;     // Block map walks
+    uint64_t dir_lookups;       // Names searched for in directories
+    uint64_t dir_blocks;        // Directory blocks those scanned
+    uint64_t errors;            // Failed reads and broken metadata
+} ext2_stats_t;
+
+// Whether dev has an ext2 file system this driver can read
+bool ext2_probe(blk_device_t* dev);
+
+// Mount the file system on dev at path, an empty directory
+vfs_error_t ext2_mount(blk_device_t* dev, const char* path);
+
+// What is mounted where, false past the last mount
+bool ext2_get_mount(int index, blk_device_t** dev, const char** path, uint32_t* block_size,
+                    uint64_t* blocks);
+
+const ext2_stats_t* ext2_get_stats(void);
+
+// Bytes the mounted devices read since the last reset, by anyone. Against
+// the bytes in the stats this is the read amplification.
+uint64_t ext2_device_bytes(void);
+
+void ext2_reset_stats(void);
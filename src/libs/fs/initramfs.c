@@ -0,0 +1,271 @@
+#include "initramfs.h"
+#include "../lz4.h"
+#include "../multiboot.h"
+#include "../memory.h"
+#include "../string.h"
+#include "../timer.h"
+
+#define CPIO_MAGIC        "070701"
+#define CPIO_HEADER_SIZE  110
+#define CPIO_TRAILER      "TRAILER!!!"
+
+// Fields of the newc header, 8 hex digits each after the magic
+#define CPIO_MODE         1
+#define CPIO_FILESIZE     6
+#define CPIO_NAMESIZE     11
+
+typedef struct {
+    initramfs_file_t file;
+    uint16_t path_len;
+    int16_t next;              // Next entry in the bucket, -1 at the end
+} entry_t;
+
+static struct {
+    const uint8_t* start;      // The archive, once unpacked if it was compressed
+    uint32_t size;
+    bool indexed;
+    uint32_t count;
+
+    // Unpacking and indexing go together a block at a time, so a lookup
+    // only unpacks the archive up to the entry it is after
+    const uint8_t* packed;     // The LZ4 frame in the module, NULL if it is plain cpio
+    lz4_frame_t frame;
+    uint32_t avail;            // Bytes of the archive there are so far
+    uint32_t parsed;           // Offset of the next header
+    bool complete;             // Everything is indexed that will be
+    entry_t entries[INITRAMFS_MAX_FILES];
+    int16_t buckets[INITRAMFS_HASH_SIZE];
+    initramfs_stats_t stats;
+} ramfs;
+
+bool initramfs_init(void) {
+    const multiboot_tag_module_t* found = NULL;
+
+    for (const multiboot_tag_t* tag = multiboot_find_tag(MULTIBOOT_TAG_MODULE, NULL); tag;
+         tag = multiboot_find_tag(MULTIBOOT_TAG_MODULE, tag)) {
+        const multiboot_tag_module_t* module = (const multiboot_tag_module_t*)tag;
+        if (strcmp(module->cmdline, "initramfs") == 0) {
+            found = module;
+            break;
+        }
+        if (!found) found = module;
+    }
+
+    // It has to be in the identity mapped memory to be read in place
+    if (!found || found->mod_end <= found->mod_start || found->mod_end > MEMORY_MAPPED_LIMIT) {
+        return false;
+    }
+    const uint8_t* start = (const uint8_t*)(uint64_t)found->mod_start;
+    uint32_t size = found->mod_end - found->mod_start;
+
+    // A compressed archive needs its size up front, lz4 --content-size
+    // writes it, to be unpacked into one piece
+    if (lz4_frame_open(&ramfs.frame, start, size) == LZ4_OK) {
+        if (ramfs.frame.content_size == 0 || ramfs.frame.content_size > memory_free()) return false;
+        ramfs.packed = start;
+        ramfs.size = ramfs.frame.content_size;
+        ramfs.stats.packed_size = size;
+        return true;
+    }
+
+    ramfs.start = start;
+    ramfs.size = size;
+    ramfs.avail = size;
+    return true;
+}
+
+bool initramfs_present(void) {
+    return ramfs.start != NULL || ramfs.packed != NULL;
+}
+
+uint32_t initramfs_size(void) {
+    return ramfs.size;
+}
+
+// FNV-1a
+static uint32_t hash_path(const char* path, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)path[i]) * 16777619u;
+    }
+    return h & (INITRAMFS_HASH_SIZE - 1);
+}
+
+static bool parse_hex(const uint8_t* p, uint32_t* value) {
+    uint32_t v = 0;
+    for (int i = 0; i < 8; i++) {
+        uint8_t c = p[i];
+        if (c >= '0' && c <= '9') {
+            v = (v << 4) | (c - '0');
+        } else if (c >= 'a' && c <= 'f') {
+            v = (v << 4) | (c - 'a' + 10);
+        } else if (c >= 'A' && c <= 'F') {
+            v = (v << 4) | (c - 'A' + 10);
+        } else {
+            return false;
+        }
+    }
+    *value = v;
+    return true;
+}
+
+static inline uint32_t align4(uint32_t n) {
+    return (n + 3) & ~3u;
+}
+
+// Walk the headers from where the last call stopped, jumping over the
+// file contents, up to the first entry that isn't all there yet. Stops for
+// good at the trailer or at the first thing that doesn't look like a
+// header.
+static void index_available(void) {
+    uint64_t start = rdtsc();
+    uint32_t offset = ramfs.parsed;
+
+    while (offset + CPIO_HEADER_SIZE <= ramfs.avail) {
+        const uint8_t* header = ramfs.start + offset;
+        uint32_t mode, filesize, namesize;
+        if (ramfs.count == INITRAMFS_MAX_FILES || memcmp(header, CPIO_MAGIC, 6) != 0 ||
+            !parse_hex(header + 6 + CPIO_MODE * 8, &mode) ||
+            !parse_hex(header + 6 + CPIO_FILESIZE * 8, &filesize) ||
+            !parse_hex(header + 6 + CPIO_NAMESIZE * 8, &namesize)) {
+            ramfs.complete = true;
+            break;
+        }
+
+        // The name includes its NUL, the data starts 4 byte aligned after it
+        const char* name = (const char*)header + CPIO_HEADER_SIZE;
+        uint32_t data_offset = align4(offset + CPIO_HEADER_SIZE + namesize);
+        if (namesize == 0 || data_offset > ramfs.size || filesize > ramfs.size - data_offset) {
+            ramfs.complete = true;
+            break;
+        }
+        if (data_offset + filesize > ramfs.avail) break;
+        if (name[namesize - 1] != '\0' || strcmp(name, CPIO_TRAILER) == 0) {
+            ramfs.complete = true;
+            break;
+        }
+
+        // find . puts ./ in front of everything and lists . itself
+        size_t len = namesize - 1;
+        if (len >= 2 && name[0] == '.' && name[1] == '/') {
+            name += 2;
+            len -= 2;
+        }
+        while (len && name[0] == '/') {
+            name++;
+            len--;
+        }
+
+        if (len > 0 && len <= 0xFFFF && !(len == 1 && name[0] == '.')) {
+            entry_t* e = &ramfs.entries[ramfs.count];
+            e->file.path = name;
+            e->file.data = ramfs.start + data_offset;
+            e->file.size = filesize;
+            e->file.mode = mode;
+            e->path_len = len;
+
+            uint32_t bucket = hash_path(name, len);
+            e->next = ramfs.buckets[bucket];
+            ramfs.buckets[bucket] = ramfs.count++;
+        }
+        offset = align4(data_offset + filesize);
+    }
+    if (ramfs.avail == ramfs.size) ramfs.complete = true;
+
+    ramfs.parsed = offset;
+    ramfs.stats.files = ramfs.count;
+    ramfs.stats.index_cycles += rdtsc() - start;
+}
+
+// Unpack the next block, if the archive is compressed, and index what it
+// completed. False once everything is indexed.
+static bool index_more(void) {
+    if (ramfs.complete) return false;
+
+    if (ramfs.packed) {
+        uint64_t start = rdtsc();
+        size_t produced;
+        if (lz4_frame_next(&ramfs.frame, (uint8_t*)ramfs.start, ramfs.size, &produced) != LZ4_OK ||
+            produced == 0) {
+            // Whatever came before a broken block still counts
+            ramfs.complete = true;
+        }
+        ramfs.avail += produced;
+        ramfs.stats.unpacked = ramfs.avail;
+        ramfs.stats.unpack_cycles += rdtsc() - start;
+    }
+
+    index_available();
+    return true;
+}
+
+static bool ensure_index(void) {
+    if (!initramfs_present()) return false;
+    if (ramfs.indexed) return true;
+
+    ramfs.indexed = true;
+    for (int i = 0; i < INITRAMFS_HASH_SIZE; i++) {
+        ramfs.buckets[i] = -1;
+    }
+    if (ramfs.packed) {
+        ramfs.start = memory_alloc_pages((ramfs.size + PAGE_SIZE - 1) / PAGE_SIZE);
+        if (!ramfs.start) {
+            ramfs.packed = NULL;
+            return false;
+        }
+    }
+    return true;
+}
+
+bool initramfs_find(const char* path, initramfs_file_t* file) {
+    if (!ensure_index()) return false;
+
+    while (*path == '/') path++;
+    size_t len = strlen(path);
+    while (len && path[len - 1] == '/') len--;
+
+    ramfs.stats.lookups++;
+    // Not there yet may mean not unpacked yet. Entries go on the front of
+    // their bucket, so each pass stops at the ones the last one compared.
+    uint32_t bucket = hash_path(path, len);
+    int16_t seen = -1;
+    do {
+        for (int16_t i = ramfs.buckets[bucket]; i != seen; i = ramfs.entries[i].next) {
+            const entry_t* e = &ramfs.entries[i];
+            ramfs.stats.probes++;
+            if (e->path_len == len && memcmp(e->file.path, path, len) == 0) {
+                *file = e->file;
+                return true;
+            }
+        }
+        seen = ramfs.buckets[bucket];
+    } while (index_more());
+    return false;
+}
+
+uint32_t initramfs_count(void) {
+    if (!ensure_index()) return 0;
+    while (index_more()) {
+    }
+    return ramfs.count;
+}
+
+bool initramfs_get(uint32_t index, initramfs_file_t* file) {
+    if (!ensure_index()) return false;
+    while (index >= ramfs.count && index_more()) {
+    }
+    if (index >= ramfs.count) return false;
+    *file = ramfs.entries[index].file;
+    return true;
+}
+
+bool initramfs_get_packed(const uint8_t** data, uint32_t* size) {
+    if (!ramfs.packed) return false;
+    *data = ramfs.packed;
+    *size = ramfs.stats.packed_size;
+    return true;
+}
+
+const initramfs_stats_t* initramfs_get_stats(void) {
+    return &ramfs.stats;
+}
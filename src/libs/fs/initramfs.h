@@ -0,0 +1,59 @@
+#pragma once
+
+#include "../types.h"
+
+// The initramfs, a cpio archive (newc format) GRUB loads as a multiboot2
+// module. It is read where it lies: names and file contents are pointers
+// into the module, nothing is copied. The path index is built on the first
+// lookup, so booting costs the same however large the archive is.
+//
+// The archive may also come as an LZ4 frame that states its size. It is
+// then unpacked on first use as well, one block at a time into pages of
+// its own, and each block's entries are indexed right after it, so a
+// lookup stops unpacking once it found its entry.
+#define INITRAMFS_MAX_FILES   1024
+#define INITRAMFS_HASH_SIZE   1024    // Buckets, a power of two
+
+// Mode bits of cpio entries
+#define INITRAMFS_S_IFMT      0170000
+#define INITRAMFS_S_IFDIR     0040000
+#define INITRAMFS_S_IFREG     0100000
+
+typedef struct {
+    const char* path;          // Without a leading slash, NUL terminated
+    const uint8_t* data;
+    uint32_t size;
+    uint32_t mode;
+} initramfs_file_t;
+
+typedef struct {
+    uint32_t files;
+    uint64_t index_cycles;     // Building the index, TSC
+    uint32_t packed_size;      // Of the LZ4 frame, 0 for a plain archive
+    uint32_t unpacked;         // Bytes of it unpacked so far
+    uint64_t unpack_cycles;
+    uint64_t lookups;
+    uint64_t probes;           // Entries compared by them
+} initramfs_stats_t;
+
+// Find the module, the one whose command line is "initramfs" or else the
+// first. False if there is none.
+bool initramfs_init(void);
+
+bool initramfs_present(void);
+
+// Size of the archive in bytes, unpacked
+uint32_t initramfs_size(void);
+
+// Look up a path, with or without a leading slash. False if there is no
+// such entry or the archive is broken.
+bool initramfs_find(const char* path, initramfs_file_t* file);
+
+// Entries in archive order, for listing
+uint32_t initramfs_count(void);
+bool initramfs_get(uint32_t index, initramfs_file_t* file);
+
+// The LZ4 frame as the module holds it, false for a plain archive
+bool initramfs_get_packed(const uint8_t** data, uint32_t* size);
+
+const initramfs_stats_t* initramfs_get_stats(void);
@@ -0,0 +1,305 @@
+#include "pcache.h"
+#include "../memory.h"
+#include "../interrupt.h"
+#include "../string.h"
+#include "../timer.h"
+
+// Everything below is changed with interrupts off: network drivers release
+// the pages they sent from their interrupt handlers
+static struct {
+    uint32_t pages;
+    pcache_page_t** hash;
+    uint32_t hash_mask;
+    pcache_page_t* free;         // Linked through hash_next
+    pcache_page_t* lru_head;     // Least recently used
+    pcache_page_t* lru_tail;
+    uint32_t resident;
+    uint32_t held;               // Pages with refs
+    pcache_stats_t stats;
+} cache;
+
+static inline uint32_t hash_of(const vfs_inode_t* inode, uint64_t index) {
+    uint64_t h = (((uint64_t)inode->ino << 32) ^ index) * 0x9E3779B97F4A7C15ULL;
+    return (h >> 32) & cache.hash_mask;
+}
+
+static pcache_page_t* lookup(vfs_inode_t* inode, uint64_t index) {
+    for (pcache_page_t* p = cache.hash[hash_of(inode, index)]; p; p = p->hash_next) {
+        if (p->index == index && p->inode == inode) return p;
+    }
+    return NULL;
+}
+
+static void lru_remove(pcache_page_t* p) {
+    if (p->lru_prev) {
+        p->lru_prev->lru_next = p->lru_next;
+    } else {
+        cache.lru_head = p->lru_next;
+    }
+    if (p->lru_next) {
+        p->lru_next->lru_prev = p->lru_prev;
+    } else {
+        cache.lru_tail = p->lru_prev;
+    }
+    p->lru_prev = p->lru_next = NULL;
+}
+
+static void lru_append(pcache_page_t* p) {
+    p->lru_prev = cache.lru_tail;
+    p->lru_next = NULL;
+    if (cache.lru_tail) {
+        cache.lru_tail->lru_next = p;
+    } else {
+        cache.lru_head = p;
+    }
+    cache.lru_tail = p;
+}
+
+// Put a filled page in the hash table, on its file's list and at the end
+// of the LRU list
+static void insert(pcache_page_t* p) {
+    pcache_page_t** bucket = &cache.hash[hash_of(p->inode, p->index)];
+    p->hash_next = *bucket;
+    *bucket = p;
+
+    p->file_prev = NULL;
+    p->file_next = p->inode->pages;
+    if (p->file_next) p->file_next->file_prev = p;
+    p->inode->pages = p;
+
+    lru_append(p);
+    cache.resident++;
+}
+
+// Take a page off every list. It keeps its inode until it is freed.
+static void unlink_page(pcache_page_t* p) {
+    pcache_page_t** prev = &cache.hash[hash_of(p->inode, p->index)];
+    while (*prev != p) prev = &(*prev)->hash_next;
+    *prev = p->hash_next;
+
+    if (p->file_prev) {
+        p->file_prev->file_next = p->file_next;
+    } else {
+        p->inode->pages = p->file_next;
+    }
+    if (p->file_next) p->file_next->file_prev = p->file_prev;
+
+    lru_remove(p);
+    cache.resident--;
+}
+
+static void free_page(pcache_page_t* p) {
+    p->inode = NULL;
+    p->hash_next = cache.free;
+    cache.free = p;
+}
+
+// A page for new contents: a free one, or the least recently used one that
+// nobody holds. NULL when every page is referenced.
+static pcache_page_t* take_page(void) {
+    pcache_page_t* p = cache.free;
+    if (p) {
+        cache.free = p->hash_next;
+        return p;
+    }
+    for (p = cache.lru_head; p; p = p->lru_next) {
+        if (p->refs == 0) {
+            unlink_page(p);
+            cache.stats.evictions++;
+            return p;
+        }
+    }
+    return NULL;
+}
+
+bool pcache_init(void) {
+    uint64_t per_page = PAGE_SIZE + sizeof(pcache_page_t) + sizeof(void*);
+    uint64_t pages = memory_free() / PCACHE_MEMORY_SHARE / per_page;
+    if (pages < PCACHE_MIN_PAGES) return false;
+    if (pages > PCACHE_MAX_PAGES) pages = PCACHE_MAX_PAGES;
+
+    uint32_t buckets = 1;
+    while (buckets < pages) buckets <<= 1;
+
+    uint8_t* frames = memory_alloc_pages(pages);
+    pcache_page_t* headers = memory_alloc_pages((pages * sizeof(pcache_page_t) + PAGE_SIZE - 1) / PAGE_SIZE);
+    cache.hash = memory_alloc_pages((buckets * sizeof(void*) + PAGE_SIZE - 1) / PAGE_SIZE);
+    if (!frames || !headers || !cache.hash) {
+        return false;
+    }
+
+    cache.hash_mask = buckets - 1;
+    for (uint32_t i = pages; i-- > 0;) {
+        headers[i].data = frames + (uint64_t)i * PAGE_SIZE;
+        free_page(&headers[i]);
+    }
+    cache.pages = pages;
+    return true;
+}
+
+uint32_t pcache_size(void) {
+    return cache.pages;
+}
+
+void pcache_counts(uint32_t* resident, uint32_t* held) {
+    *resident = cache.resident;
+    *held = cache.held;
+}
+
+pcache_page_t* pcache_get(vfs_inode_t* inode, uint64_t index) {
+    if (!cache.pages || index >= (inode->size + PAGE_SIZE - 1) / PAGE_SIZE) return NULL;
+
+    uint64_t flags = irq_save();
+    cache.stats.lookups++;
+    pcache_page_t* p = lookup(inode, index);
+    if (p) {
+        cache.stats.hits++;
+        if (p->refs++ == 0) cache.held++;
+        lru_remove(p);
+        lru_append(p);
+        irq_restore(flags);
+        return p;
+    }
+    p = take_page();
+    if (p) {
+        p->refs = 1;
+        cache.held++;
+    }
+    irq_restore(flags);
+    if (!p) return NULL;
+
+    // Filled with interrupts on, the file system may wait for the disk. The
+    // page is on no list meanwhile, so nobody finds it half read.
+    uint64_t offset = index * PAGE_SIZE;
+    uint64_t want = inode->size - offset < PAGE_SIZE ? inode->size - offset : PAGE_SIZE;
+    uint64_t start = rdtsc();
+    uint64_t got = inode->fs->read(inode, offset, p->data, want);
+    uint64_t cycles = rdtsc() - start;
+
+    flags = irq_save();
+    if (got != want) {
+        cache.stats.errors++;
+        p->refs = 0;
+        cache.held--;
+        free_page(p);
+        p = NULL;
+    } else {
+        cache.stats.fills++;
+        cache.stats.fill_cycles += cycles;
+        p->inode = inode;
+        p->index = index;
+        p->len = got;
+        insert(p);
+    }
+    irq_restore(flags);
+    return p;
+}
+
+void pcache_ref(pcache_page_t* page) {
+    uint64_t flags = irq_save();
+    if (page->refs++ == 0) cache.held++;
+    irq_restore(flags);
+}
+
+void pcache_release(pcache_page_t* page) {
+    uint64_t flags = irq_save();
+    if (--page->refs == 0) {
+        cache.held--;
+
+        // Its file dropped it while it was held
+        if (!page->inode) free_page(page);
+    }
+    irq_restore(flags);
+}
+
+// Whether page index of the file is cached, without using it
+static bool cached(vfs_inode_t* inode, uint64_t index) {
+    uint64_t flags = irq_save();
+    bool found = lookup(inode, index) != NULL;
+    irq_restore(flags);
+    return found;
+}
+
+// Keep a copy of a page the caller read itself. False when every page is held.
+static bool fill_from(vfs_inode_t* inode, uint64_t index, const uint8_t* data) {
+    uint64_t flags = irq_save();
+    pcache_page_t* p = take_page();
+    irq_restore(flags);
+    if (!p) return false;
+
+    memcpy(p->data, data, PAGE_SIZE);
+    flags = irq_save();
+    cache.stats.direct_pages++;
+    p->inode = inode;
+    p->index = index;
+    p->len = PAGE_SIZE;
+    insert(p);
+    irq_restore(flags);
+    return true;
+}
+
+uint64_t pcache_read(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len) {
+    uint8_t* out = buffer;
+    uint64_t done = 0;
+
+    while (done < len) {
+        uint64_t index = offset / PAGE_SIZE;
+        uint32_t in_page = offset % PAGE_SIZE;
+
+        // A long run of whole pages that aren't cached is one request to
+        // the file system, which can take it from the disk in large pieces
+        uint64_t whole = in_page || !cache.pages ? 0 : (len - done) / PAGE_SIZE;
+        uint64_t run = 0;
+        while (run < whole && !cached(inode, index + run)) run++;
+        if (run * PAGE_SIZE >= PCACHE_DIRECT_MIN) {
+            uint64_t got = inode->fs->read(inode, offset, out + done, run * PAGE_SIZE);
+            for (uint64_t i = 0; i < got / PAGE_SIZE; i++) {
+                if (!fill_from(inode, index + i, out + done + i * PAGE_SIZE)) break;
+            }
+            done += got;
+            offset += got;
+            if (got < run * PAGE_SIZE) break;
+            continue;
+        }
+
+        pcache_page_t* p = pcache_get(inode, index);
+        if (!p) {
+            // Every page is held or the fill failed, the file system reads
+            // the rest on its own
+            cache.stats.bypassed++;
+            return done + inode->fs->read(inode, offset, out + done, len - done);
+        }
+
+        uint64_t n = p->len > in_page ? p->len - in_page : 0;
+        if (n > len - done) n = len - done;
+        memcpy(out + done, p->data + in_page, n);
+        pcache_release(p);
+        if (n == 0) break;
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+void pcache_invalidate(vfs_inode_t* inode) {
+    uint64_t flags = irq_save();
+    while (inode->pages) {
+        pcache_page_t* p = inode->pages;
+        unlink_page(p);
+        cache.stats.invalidated++;
+        if (p->refs) {
+            p->inode = NULL;
+        } else {
+            free_page(p);
+        }
+    }
+    irq_restore(flags);
+}
+
+const pcache_stats_t* pcache_get_stats(void) {
+    return &cache.stats;
+}
+
+void pcache_reset_stats(void) {
+    memset(&cache.stats, 0, sizeof(cache.stats));
+}
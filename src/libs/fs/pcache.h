@@ -0,0 +1,76 @@
+#pragma once
+
+#include "../types.h"
+#include "vfs.h"
+
+// Page cache of file contents, between the VFS and the disk file systems
+// that ask for it. Pages are found by (inode, page of the file) in a hash
+// table and replaced least recently used first. Every inode keeps a list
+// of its pages, so all of them go at once when the file changes or the
+// inode is freed. A page stays where it is while someone holds a
+// reference, even after its file dropped it, so the network stack can
+// point a NIC descriptor straight at it and let go once the frame is sent.
+// A read that misses a long run of pages asks the file system for all of
+// them at once, into the reader's buffer, and the cache keeps copies.
+#define PCACHE_MEMORY_SHARE   4       // The cache gets 1/4 of free memory when it starts
+#define PCACHE_MIN_PAGES      64
+#define PCACHE_MAX_PAGES      65536
+#define PCACHE_DIRECT_MIN     (16 * 1024)     // Bytes of missing pages read in one go
+
+// A cached page of a file. Only data and len are for users, and only
+// while they hold a reference.
+typedef struct pcache_page pcache_page_t;
+struct pcache_page {
+    vfs_inode_t* inode;          // NULL while free, or once its file dropped it
+    uint64_t index;              // Page of the file, offset / PAGE_SIZE
+    uint8_t* data;
+    uint32_t len;                // Bytes of the file in data, short only at the end
+
+    pcache_page_t* hash_next;    // Also links the free pages
+    pcache_page_t* lru_prev;     // Least recently used first
+    pcache_page_t* lru_next;
+    pcache_page_t* file_prev;    // On the inode's list
+    pcache_page_t* file_next;
+    uint16_t refs;
+};
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t hits;
+    uint64_t fills;              // Pages read from the file system
+    uint64_t fill_cycles;        // TSC spent on those
+    uint64_t direct_pages;       // Pages read into a reader's buffer and copied in
+    uint64_t evictions;
+    uint64_t invalidated;        // Pages dropped because their file changed or went away
+    uint64_t bypassed;           // Reads that went around the cache, every page was held
+    uint64_t errors;             // Fills the file system came up short on
+} pcache_stats_t;
+
+// Size the cache from the memory left. False if there is too little.
+bool pcache_init(void);
+
+// Pages the cache holds, 0 before pcache_init
+uint32_t pcache_size(void);
+
+// Pages with file contents, and pages somebody holds a reference on
+void pcache_counts(uint32_t* resident, uint32_t* held);
+
+// Page index of the file with a reference held, read from the file system
+// if it isn't cached. NULL past the end of the file, on a read error, or
+// when every page is referenced.
+pcache_page_t* pcache_get(vfs_inode_t* inode, uint64_t index);
+
+// Another reference, and dropping one. Both are safe in interrupt handlers.
+void pcache_ref(pcache_page_t* page);
+void pcache_release(pcache_page_t* page);
+
+// Copy file contents through the cache, for vfs_read. Reads stop at the
+// end of the file.
+uint64_t pcache_read(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len);
+
+// Drop every page of the file. Pages still referenced are freed by the
+// last release.
+void pcache_invalidate(vfs_inode_t* inode);
+
+const pcache_stats_t* pcache_get_stats(void);
+void pcache_reset_stats(void);
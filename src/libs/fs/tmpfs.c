@@ -0,0 +1,194 @@
+#include "tmpfs.h"
+#include "../memory.h"
+#include "../string.h"
+
+// An inode's data is the root node and data_info the height of the tree,
+// 0 while the file has no pages. A node at level 1 points to data pages.
+static struct {
+    void* free;                     // Free pages, linked through their first word
+    tmpfs_stats_t stats;
+} tmpfs;
+
+static uint64_t tmpfs_read(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len);
+static uint64_t tmpfs_write(vfs_inode_t* inode, uint64_t offset, const void* buffer, uint64_t len);
+static bool tmpfs_truncate(vfs_inode_t* inode, uint64_t size);
+static void tmpfs_evict(vfs_inode_t* inode);
+
+const vfs_fs_ops_t tmpfs_ops = {
+    .name = "tmpfs",
+    .read = tmpfs_read,
+    .write = tmpfs_write,
+    .truncate = tmpfs_truncate,
+    .evict = tmpfs_evict,
+};
+
+static void free_page(void* page) {
+    *(void**)page = tmpfs.free;
+    tmpfs.free = page;
+    tmpfs.stats.free_pages++;
+}
+
+// A zeroed page, from the free list or a few more from the boot allocator
+static void* alloc_page(void) {
+    if (!tmpfs.free) {
+        for (size_t count = TMPFS_GROW_PAGES; count > 0 && !tmpfs.free; count /= 2) {
+            uint8_t* pages = memory_alloc_pages(count);
+            for (size_t i = 0; pages && i < count; i++) {
+                free_page(pages + i * PAGE_SIZE);
+            }
+        }
+        if (!tmpfs.free) return NULL;
+    }
+    void* page = tmpfs.free;
+    tmpfs.free = *(void**)page;
+    tmpfs.stats.free_pages--;
+    memset(page, 0, PAGE_SIZE);
+    return page;
+}
+
+// Pages a tree of this height covers
+static inline uint64_t capacity(uint32_t height) {
+    return height ? 1ULL << (9 * height) : 0;
+}
+
+// Make the tree tall enough for index by putting new roots on top
+static bool grow(vfs_inode_t* inode, uint64_t index) {
+    if (index >= capacity(TMPFS_MAX_HEIGHT)) return false;
+
+    if (!inode->data) {
+        uint32_t height = 1;
+        while (index >= capacity(height)) height++;
+        if (!(inode->data = alloc_page())) return false;
+        tmpfs.stats.nodes++;
+        inode->data_info = height;
+        return true;
+    }
+    while (index >= capacity(inode->data_info)) {
+        void** root = alloc_page();
+        if (!root) return false;
+        tmpfs.stats.nodes++;
+        root[0] = inode->data;
+        inode->data = root;
+        inode->data_info++;
+    }
+    return true;
+}
+
+// The data page at index, NULL for a hole. With create, missing nodes and
+// the page are made, and NULL means out of memory.
+static uint8_t* find_page(vfs_inode_t* inode, uint64_t index, bool create) {
+    tmpfs.stats.page_lookups++;
+    if (index >= capacity(inode->data_info) && (!create || !grow(inode, index))) {
+        if (!create) tmpfs.stats.holes++;
+        return NULL;
+    }
+
+    void** node = inode->data;
+    for (uint32_t level = inode->data_info; level > 0; level--) {
+        void** slot = &node[(index >> (9 * (level - 1))) & (TMPFS_FANOUT - 1)];
+        if (!*slot) {
+            if (!create) {
+                tmpfs.stats.holes++;
+                return NULL;
+            }
+            if (!(*slot = alloc_page())) return NULL;
+            if (level > 1) {
+                tmpfs.stats.nodes++;
+            } else {
+                tmpfs.stats.pages++;
+            }
+        }
+        node = *slot;
+    }
+    return (uint8_t*)node;
+}
+
+static uint64_t tmpfs_read(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len) {
+    uint8_t* out = buffer;
+    uint64_t done = 0;
+
+    while (done < len) {
+        uint64_t in_page = offset % PAGE_SIZE;
+        uint64_t n = PAGE_SIZE - in_page;
+        if (n > len - done) n = len - done;
+
+        uint8_t* page = find_page(inode, offset / PAGE_SIZE, false);
+        if (page) {
+            memcpy(out + done, page + in_page, n);
+        } else {
+            memset(out + done, 0, n);
+        }
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+static uint64_t tmpfs_write(vfs_inode_t* inode, uint64_t offset, const void* buffer, uint64_t len) {
+    const uint8_t* in = buffer;
+    uint64_t done = 0;
+
+    while (done < len) {
+        uint64_t in_page = offset % PAGE_SIZE;
+        uint64_t n = PAGE_SIZE - in_page;
+        if (n > len - done) n = len - done;
+
+        uint8_t* page = find_page(inode, offset / PAGE_SIZE, true);
+        if (!page) break;
+        memcpy(page + in_page, in + done, n);
+        done += n;
+        offset += n;
+    }
+    return done;
+}
+
+// Free every page from index first on, and the nodes left without any
+static void free_from(void** node, uint32_t level, uint64_t base, uint64_t first) {
+    uint64_t span = 1ULL << (9 * (level - 1));
+
+    for (uint64_t i = 0; i < TMPFS_FANOUT; i++) {
+        void** child = node[i];
+        uint64_t child_base = base + i * span;
+        if (!child || child_base + span <= first) continue;
+
+        if (level > 1) free_from(child, level - 1, child_base, first);
+        if (child_base >= first) {
+            free_page(child);
+            node[i] = NULL;
+            if (level > 1) {
+                tmpfs.stats.nodes--;
+            } else {
+                tmpfs.stats.pages--;
+            }
+        }
+    }
+}
+
+static bool tmpfs_truncate(vfs_inode_t* inode, uint64_t size) {
+    uint64_t first = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    if (inode->data) {
+        free_from(inode->data, inode->data_info, 0, first);
+        if (first == 0) {
+            free_page(inode->data);
+            tmpfs.stats.nodes--;
+            inode->data = NULL;
+            inode->data_info = 0;
+        }
+    }
+
+    // Growing the file again must read zeros past the old end
+    if (size % PAGE_SIZE) {
+        uint8_t* page = find_page(inode, size / PAGE_SIZE, false);
+        if (page) memset(page + size % PAGE_SIZE, 0, PAGE_SIZE - size % PAGE_SIZE);
+    }
+    return true;
+}
+
+static void tmpfs_evict(vfs_inode_t* inode) {
+    tmpfs_truncate(inode, 0);
+}
+
+const tmpfs_stats_t* tmpfs_get_stats(void) {
+    return &tmpfs.stats;
+}
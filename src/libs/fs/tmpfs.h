@@ -0,0 +1,26 @@
+#pragma once
+
+#include "../types.h"
+#include "vfs.h"
+
+// File system in RAM. A file is a radix tree of 4 KiB pages: every node is
+// a page of 512 pointers, so a file of up to 1 GiB is at most two levels
+// deep and any offset is found in a fixed number of steps. Pages that were
+// never written don't exist and read as zeros, which makes sparse files
+// free. Pages come from the boot allocator a few at a time and go on a
+// free list when files shrink, to be used again by tmpfs.
+#define TMPFS_FANOUT        512     // Pointers per node
+#define TMPFS_MAX_HEIGHT    3       // Files up to 512 GiB
+#define TMPFS_GROW_PAGES    16      // Taken from the boot allocator at once
+
+typedef struct {
+    uint32_t pages;                 // Holding file data
+    uint32_t nodes;                 // Holding pointers
+    uint32_t free_pages;            // Taken from the boot allocator but unused
+    uint64_t page_lookups;          // Tree walks for reads and writes
+    uint64_t holes;                 // of them that found no page
+} tmpfs_stats_t;
+
+extern const vfs_fs_ops_t tmpfs_ops;
+
+const tmpfs_stats_t* tmpfs_get_stats(void);
@@ -0,0 +1,468 @@
+#include "vfs.h"
+#include "pcache.h"
+#include "../string.h"
+#include "../timer.h"
+
+typedef struct {
+    uint32_t generation;            // Valid while it matches vfs.generation
+    uint16_t len;
+    char path[VFS_PATH_MAX];
+    vfs_dentry_t* dentry;
+} path_entry_t;
+
+static struct {
+    vfs_inode_t inodes[VFS_MAX_INODES];
+    vfs_dentry_t dentries[VFS_MAX_DENTRIES];
+    uint16_t free_inodes[VFS_MAX_INODES];   // Stack of free inode indexes
+    uint32_t free_inode_count;
+    vfs_dentry_t* free_dentries;            // Linked through hash_next
+    uint32_t dentry_count;
+    vfs_dentry_t* buckets[VFS_DENTRY_HASH];
+    vfs_dentry_t* root;
+    vfs_dentry_t* lru_head;                 // Cached dentries, least recently used first
+    vfs_dentry_t* lru_tail;
+
+    // Removing anything bumps the generation, which drops the whole path
+    // cache at once. Creating never makes a cached path wrong.
+    path_entry_t path_cache[VFS_PATH_CACHE];
+    uint32_t generation;
+    vfs_stats_t stats;
+} vfs;
+
+// FNV-1a
+static uint32_t hash_name(const char* name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h = (h ^ (uint8_t)name[i]) * 16777619u;
+    }
+    return h;
+}
+
+static inline uint32_t bucket_of(const vfs_dentry_t* parent, const char* name, size_t len) {
+    uint32_t index = parent - vfs.dentries;
+    return (hash_name(name, len) ^ (index * 0x9E3779B1u)) & (VFS_DENTRY_HASH - 1);
+}
+
+static vfs_inode_t* alloc_inode(vfs_type_t type, const vfs_fs_ops_t* fs) {
+    if (vfs.free_inode_count == 0) return NULL;
+    vfs_inode_t* inode = &vfs.inodes[vfs.free_inodes[--vfs.free_inode_count]];
+    inode->type = type;
+    inode->nlink = 1;
+    inode->size = 0;
+    inode->fs = fs;
+    inode->data = NULL;
+    inode->data_info = 0;
+    inode->pages = NULL;
+    return inode;
+}
+
+static void free_inode(vfs_inode_t* inode) {
+    inode->nlink = 0;
+    vfs.free_inodes[vfs.free_inode_count++] = inode - vfs.inodes;
+}
+
+static vfs_dentry_t* alloc_dentry(void) {
+    vfs_dentry_t* d = vfs.free_dentries;
+    if (!d) return NULL;
+    vfs.free_dentries = d->hash_next;
+    memset(d, 0, sizeof(*d));
+    vfs.dentry_count++;
+    return d;
+}
+
+static void free_dentry(vfs_dentry_t* d) {
+    d->inode = NULL;
+    d->hash_next = vfs.free_dentries;
+    vfs.free_dentries = d;
+    vfs.dentry_count--;
+}
+
+void vfs_init(const vfs_fs_ops_t* root_fs) {
+    memset(&vfs, 0, sizeof(vfs));
+    for (uint32_t i = 0; i < VFS_MAX_INODES; i++) {
+        vfs.inodes[i].ino = i + 1;
+        vfs.free_inodes[i] = VFS_MAX_INODES - 1 - i;
+    }
+    vfs.free_inode_count = VFS_MAX_INODES;
+    for (int i = VFS_MAX_DENTRIES - 1; i >= 0; i--) {
+        vfs.dentries[i].hash_next = vfs.free_dentries;
+        vfs.free_dentries = &vfs.dentries[i];
+    }
+    vfs.generation = 1;
+
+    vfs.root = alloc_dentry();
+    vfs.root->inode = alloc_inode(VFS_DIR, root_fs);
+    vfs.root->parent = vfs.root;
+    vfs.root->name[0] = '/';
+    vfs.root->name_len = 1;
+}
+
+vfs_dentry_t* vfs_root(void) {
+    return vfs.root;
+}
+
+static void lru_remove(vfs_dentry_t* d) {
+    if (d->lru_prev) {
+        d->lru_prev->lru_next = d->lru_next;
+    } else {
+        vfs.lru_head = d->lru_next;
+    }
+    if (d->lru_next) {
+        d->lru_next->lru_prev = d->lru_prev;
+    } else {
+        vfs.lru_tail = d->lru_prev;
+    }
+}
+
+static void lru_append(vfs_dentry_t* d) {
+    d->lru_prev = vfs.lru_tail;
+    d->lru_next = NULL;
+    if (vfs.lru_tail) {
+        vfs.lru_tail->lru_next = d;
+    } else {
+        vfs.lru_head = d;
+    }
+    vfs.lru_tail = d;
+}
+
+static void touch(vfs_dentry_t* d) {
+    if (d->cached && d != vfs.lru_tail) {
+        lru_remove(d);
+        lru_append(d);
+    }
+}
+
+// Put a new dentry in the hash table and on its parent's list
+static void link(vfs_dentry_t* parent, vfs_dentry_t* d) {
+    d->parent = parent;
+    uint32_t bucket = bucket_of(parent, d->name, d->name_len);
+    d->hash_next = vfs.buckets[bucket];
+    vfs.buckets[bucket] = d;
+
+    d->sibling_next = parent->children;
+    if (parent->children) parent->children->sibling_prev = d;
+    parent->children = d;
+    parent->child_count++;
+    if (d->cached) lru_append(d);
+}
+
+// Take a dentry without children out of the tree and free it, and its
+// inode with the last name
+static void drop(vfs_dentry_t* d) {
+    vfs_dentry_t* parent = d->parent;
+    vfs_dentry_t** prev = &vfs.buckets[bucket_of(parent, d->name, d->name_len)];
+    while (*prev != d) prev = &(*prev)->hash_next;
+    *prev = d->hash_next;
+
+    if (d->sibling_prev) {
+        d->sibling_prev->sibling_next = d->sibling_next;
+    } else {
+        parent->children = d->sibling_next;
+    }
+    if (d->sibling_next) d->sibling_next->sibling_prev = d->sibling_prev;
+    parent->child_count--;
+    if (d->cached) lru_remove(d);
+
+    vfs_inode_t* inode = d->inode;
+    if (--inode->nlink == 0) {
+        if (inode->fs->evict) inode->fs->evict(inode);
+        if (inode->pages) pcache_invalidate(inode);
+        free_inode(inode);
+    }
+    free_dentry(d);
+
+    // Cached paths may lead to the dentry or through it
+    if (++vfs.generation == 0) {
+        memset(vfs.path_cache, 0, sizeof(vfs.path_cache));
+        vfs.generation = 1;
+    }
+    vfs.stats.invalidations++;
+}
+
+// Drop the least recently used cached dentry that has no children, but
+// not keep. False if there is none.
+static bool reclaim(const vfs_dentry_t* keep) {
+    for (vfs_dentry_t* d = vfs.lru_head; d; d = d->lru_next) {
+        if (d->child_count == 0 && d != keep) {
+            drop(d);
+            vfs.stats.evictions++;
+            return true;
+        }
+    }
+    return false;
+}
+
+// The entry called name in dir, from the hash table
+static vfs_dentry_t* d_lookup(vfs_dentry_t* dir, const char* name, size_t len) {
+    vfs.stats.components++;
+    for (vfs_dentry_t* d = vfs.buckets[bucket_of(dir, name, len)]; d; d = d->hash_next) {
+        vfs.stats.probes++;
+        if (d->parent == dir && d->name_len == len && memcmp(d->name, name, len) == 0) {
+            return d;
+        }
+    }
+    return NULL;
+}
+
+// Ask the file system of dir about a name the hash table doesn't know and
+// remember the answer
+static vfs_error_t fs_lookup(vfs_dentry_t* dir, const char* name, size_t len,
+                             vfs_dentry_t** dentry) {
+    const vfs_fs_ops_t* fs = dir->inode->fs;
+    if (!fs->lookup) return VFS_ERR_NOT_FOUND;
+    vfs.stats.fs_lookups++;
+
+    vfs_dentry_t* d;
+    while ((d = alloc_dentry()) == NULL) {
+        if (!reclaim(dir)) return VFS_ERR_NO_SPACE;
+    }
+    while ((d->inode = alloc_inode(VFS_FILE, fs)) == NULL) {
+        if (!reclaim(dir)) {
+            free_dentry(d);
+            return VFS_ERR_NO_SPACE;
+        }
+    }
+
+    vfs_error_t error = fs->lookup(dir->inode, name, len, d->inode);
+    if (error != VFS_OK) {
+        free_inode(d->inode);
+        free_dentry(d);
+        return error;
+    }
+    memcpy(d->name, name, len);
+    d->name[len] = '\0';
+    d->name_len = len;
+    d->cached = true;
+    link(dir, d);
+    *dentry = d;
+    return VFS_OK;
+}
+
+// Component by component from the root
+static vfs_error_t walk(const char* path, size_t len, vfs_dentry_t** dentry) {
+    vfs_dentry_t* d = vfs.root;
+    size_t i = 0;
+
+    while (i < len) {
+        while (i < len && path[i] == '/') i++;
+        if (i == len) break;
+        size_t start = i;
+        while (i < len && path[i] != '/') i++;
+        size_t n = i - start;
+
+        if (d->inode->type != VFS_DIR) return VFS_ERR_NOT_DIR;
+        if (n == 1 && path[start] == '.') continue;
+        if (n == 2 && path[start] == '.' && path[start + 1] == '.') {
+            d = d->parent;
+            continue;
+        }
+        if (n > VFS_NAME_MAX) return VFS_ERR_INVALID;
+        vfs_dentry_t* next = d_lookup(d, path + start, n);
+        if (!next) {
+            vfs_error_t error = fs_lookup(d, path + start, n, &next);
+            if (error != VFS_OK) return error;
+        }
+        touch(next);
+        d = next;
+    }
+    *dentry = d;
+    return VFS_OK;
+}
+
+// path without leading or trailing slashes
+static vfs_error_t lookup(const char* path, size_t len, vfs_dentry_t** dentry) {
+    uint64_t start = rdtsc();
+    vfs.stats.lookups++;
+
+    path_entry_t* e = NULL;
+    if (len > 0 && len < VFS_PATH_MAX) {
+        e = &vfs.path_cache[hash_name(path, len) & (VFS_PATH_CACHE - 1)];
+        if (e->generation == vfs.generation && e->len == len && memcmp(e->path, path, len) == 0) {
+            *dentry = e->dentry;
+            touch(e->dentry);
+            vfs.stats.cache_hits++;
+            vfs.stats.hit_cycles += rdtsc() - start;
+            return VFS_OK;
+        }
+    }
+
+    vfs_error_t error = walk(path, len, dentry);
+    if (error == VFS_OK && e) {
+        e->generation = vfs.generation;
+        e->len = len;
+        memcpy(e->path, path, len);
+        e->dentry = *dentry;
+    }
+    vfs.stats.walks++;
+    vfs.stats.walk_cycles += rdtsc() - start;
+    return error;
+}
+
+static const char* trim(const char* path, size_t* len) {
+    while (*path == '/') path++;
+    size_t n = strlen(path);
+    while (n && path[n - 1] == '/') n--;
+    *len = n;
+    return path;
+}
+
+vfs_error_t vfs_lookup(const char* path, vfs_dentry_t** dentry) {
+    size_t len;
+    path = trim(path, &len);
+    return lookup(path, len, dentry);
+}
+
+vfs_error_t vfs_create(const char* path, vfs_type_t type, vfs_dentry_t** dentry) {
+    size_t len;
+    path = trim(path, &len);
+    if (len == 0) return VFS_ERR_EXISTS;
+
+    // Split off the last component, the parent goes through the path cache
+    size_t slash = len;
+    while (slash && path[slash - 1] != '/') slash--;
+    const char* name = path + slash;
+    size_t name_len = len - slash;
+    size_t parent_len = slash;
+    while (parent_len && path[parent_len - 1] == '/') parent_len--;
+
+    if (name_len > VFS_NAME_MAX || (name_len == 1 && name[0] == '.') ||
+        (name_len == 2 && name[0] == '.' && name[1] == '.')) {
+        return VFS_ERR_INVALID;
+    }
+
+    vfs_dentry_t* parent;
+    vfs_error_t error = lookup(path, parent_len, &parent);
+    if (error != VFS_OK) return error;
+    if (parent->inode->type != VFS_DIR) return VFS_ERR_NOT_DIR;
+    if (!parent->inode->fs->write) return VFS_ERR_READ_ONLY;
+    if (d_lookup(parent, name, name_len)) return VFS_ERR_EXISTS;
+
+    vfs_dentry_t* d = alloc_dentry();
+    if (!d) return VFS_ERR_NO_SPACE;
+    d->inode = alloc_inode(type, parent->inode->fs);
+    if (!d->inode) {
+        free_dentry(d);
+        return VFS_ERR_NO_SPACE;
+    }
+    memcpy(d->name, name, name_len);
+    d->name[name_len] = '\0';
+    d->name_len = name_len;
+    link(parent, d);
+
+    if (dentry) *dentry = d;
+    return VFS_OK;
+}
+
+vfs_error_t vfs_remove(const char* path) {
+    vfs_dentry_t* d;
+    vfs_error_t error = vfs_lookup(path, &d);
+    if (error != VFS_OK) return error;
+    if (d == vfs.root) return VFS_ERR_INVALID;
+    if (!d->inode->fs->write) return VFS_ERR_READ_ONLY;
+    if (d->child_count) return VFS_ERR_NOT_EMPTY;
+
+    drop(d);
+    return VFS_OK;
+}
+
+vfs_error_t vfs_lookup_at(vfs_dentry_t* dir, const char* name, vfs_dentry_t** dentry) {
+    size_t len = strlen(name);
+    if (dir->inode->type != VFS_DIR) return VFS_ERR_NOT_DIR;
+    if (len == 0 || len > VFS_NAME_MAX) return VFS_ERR_INVALID;
+
+    vfs_dentry_t* d = d_lookup(dir, name, len);
+    if (!d) {
+        vfs_error_t error = fs_lookup(dir, name, len, &d);
+        if (error != VFS_OK) return error;
+    }
+    touch(d);
+    *dentry = d;
+    return VFS_OK;
+}
+
+bool vfs_readdir(vfs_dentry_t* dir, uint64_t* cookie, char* name) {
+    vfs_inode_t* inode = dir->inode;
+    if (inode->type != VFS_DIR) return false;
+    if (inode->fs->readdir) return inode->fs->readdir(inode, cookie, name);
+
+    // New entries go to the front of the list
+    if (*cookie >= dir->child_count) return false;
+    vfs_dentry_t* d = dir->children;
+    for (uint64_t i = dir->child_count - 1 - *cookie; i > 0; i--) {
+        d = d->sibling_next;
+    }
+    memcpy(name, d->name, d->name_len + 1);
+    (*cookie)++;
+    return true;
+}
+
+vfs_error_t vfs_mount(const char* path, const vfs_fs_ops_t* fs, void* root_data,
+                      uint64_t root_size) {
+    vfs_dentry_t* d;
+    vfs_error_t error = vfs_lookup(path, &d);
+    if (error != VFS_OK) return error;
+    if (d->inode->type != VFS_DIR) return VFS_ERR_NOT_DIR;
+    if (d == vfs.root || d->covered || d->inode->fs->lookup) return VFS_ERR_INVALID;
+    if (d->child_count) return VFS_ERR_NOT_EMPTY;
+
+    vfs_inode_t* root = alloc_inode(VFS_DIR, fs);
+    if (!root) return VFS_ERR_NO_SPACE;
+    root->data = root_data;
+    root->size = root_size;
+    d->covered = d->inode;
+    d->inode = root;
+    return VFS_OK;
+}
+
+uint64_t vfs_read(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len) {
+    if (inode->type != VFS_FILE || offset >= inode->size) return 0;
+    if (len > inode->size - offset) len = inode->size - offset;
+    if (inode->fs->cached) return pcache_read(inode, offset, buffer, len);
+    return inode->fs->read(inode, offset, buffer, len);
+}
+
+uint64_t vfs_write(vfs_inode_t* inode, uint64_t offset, const void* buffer, uint64_t len) {
+    if (inode->type != VFS_FILE || !inode->fs->write || offset + len < offset) return 0;
+    if (inode->pages) pcache_invalidate(inode);
+    uint64_t written = inode->fs->write(inode, offset, buffer, len);
+    if (written && offset + written > inode->size) inode->size = offset + written;
+    return written;
+}
+
+vfs_error_t vfs_truncate(vfs_inode_t* inode, uint64_t size) {
+    if (inode->type != VFS_FILE) return VFS_ERR_IS_DIR;
+    if (!inode->fs->truncate) return VFS_ERR_READ_ONLY;
+    if (inode->pages) pcache_invalidate(inode);
+    if (!inode->fs->truncate(inode, size)) return VFS_ERR_NO_SPACE;
+    inode->size = size;
+    return VFS_OK;
+}
+
+void vfs_counts(uint32_t* inodes, uint32_t* dentries) {
+    *inodes = VFS_MAX_INODES - vfs.free_inode_count;
+    *dentries = vfs.dentry_count;
+}
+
+const char* vfs_error_string(vfs_error_t error) {
+    switch (error) {
+        case VFS_OK:            return "Success";
+        case VFS_ERR_NOT_FOUND: return "No such file or directory";
+        case VFS_ERR_EXISTS:    return "Already exists";
+        case VFS_ERR_NOT_DIR:   return "Not a directory";
+        case VFS_ERR_IS_DIR:    return "Is a directory";
+        case VFS_ERR_NOT_EMPTY: return "Directory not empty";
+        case VFS_ERR_NO_SPACE:  return "No space left";
+        case VFS_ERR_INVALID:   return "Invalid name";
+        case VFS_ERR_READ_ONLY: return "Read only file system";
+        case VFS_ERR_IO:        return "I/O error";
+    }
+    return "Unknown error";
+}
+
+const vfs_stats_t* vfs_get_stats(void) {
+    return &vfs.stats;
+}
+
+void vfs_reset_stats(void) {
+    memset(&vfs.stats, 0, sizeof(vfs.stats));
+}
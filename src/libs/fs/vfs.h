@@ -0,0 +1,146 @@
+#pragma once
+
+#include "../types.h"
+
+// The file tree. Every file and directory has an inode holding what it is
+// and a dentry giving it a name under its parent. Dentries are found by
+// hashing (parent, name) into one table, so a directory is never scanned to
+// look a name up, whatever its size. Whole paths that resolved before are
+// remembered in a path cache, so looking a deep path up again is one hash
+// and one compare instead of a hash lookup per component. The file
+// contents belong to the file system the inode is on.
+//
+// The root is in RAM, where the dentries are the directories. Disk file
+// systems are mounted on empty directories of it; there a name that isn't
+// in the hash table yet is asked of the file system, and the dentry made
+// for the answer stays as a cache of it. Cached dentries are dropped,
+// least recently used first, when dentries or inodes run out.
+#define VFS_NAME_MAX        59      // Bytes of one name, without the NUL
+#define VFS_PATH_MAX        256
+#define VFS_MAX_INODES      1024
+#define VFS_MAX_DENTRIES    1024
+#define VFS_DENTRY_HASH     1024    // Buckets, a power of two
+#define VFS_PATH_CACHE      256     // Entries, a power of two
+
+typedef enum {
+    VFS_FILE = 1,
+    VFS_DIR,
+} vfs_type_t;
+
+typedef enum {
+    VFS_OK = 0,
+    VFS_ERR_NOT_FOUND,
+    VFS_ERR_EXISTS,
+    VFS_ERR_NOT_DIR,        // A component on the way is a file
+    VFS_ERR_IS_DIR,
+    VFS_ERR_NOT_EMPTY,
+    VFS_ERR_NO_SPACE,       // Out of inodes, dentries or file system memory
+    VFS_ERR_INVALID,        // Bad name, too long, or the root
+    VFS_ERR_READ_ONLY,
+    VFS_ERR_IO,             // The disk failed or the file system is broken
+} vfs_error_t;
+
+typedef struct vfs_inode vfs_inode_t;
+
+// What a file system does with file contents. Reads and writes return the
+// bytes they moved, a write comes up short when the file system is full.
+// File systems without write are read only. Reads of cached file systems
+// go through the page cache, which calls read to fill whole pages.
+typedef struct {
+    const char* name;
+    bool cached;
+    uint64_t (*read)(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len);
+    uint64_t (*write)(vfs_inode_t* inode, uint64_t offset, const void* buffer, uint64_t len);
+    bool (*truncate)(vfs_inode_t* inode, uint64_t size);
+    void (*evict)(vfs_inode_t* inode);      // The last name is gone, free the contents
+
+    // Disk file systems only. lookup fills in inode for the entry called
+    // name in dir. readdir copies the name of the entry at *cookie (0 for
+    // the first) and moves the cookie past it, false after the last.
+    vfs_error_t (*lookup)(vfs_inode_t* dir, const char* name, size_t len, vfs_inode_t* inode);
+    bool (*readdir)(vfs_inode_t* dir, uint64_t* cookie, char* name);
+} vfs_fs_ops_t;
+
+struct vfs_inode {
+    uint32_t ino;
+    vfs_type_t type;
+    uint32_t nlink;                 // 0 while the inode is free
+    uint64_t size;
+    const vfs_fs_ops_t* fs;
+    void* data;                     // For the file system
+    uint32_t data_info;
+    struct pcache_page* pages;      // Cached contents, for the page cache
+};
+
+typedef struct vfs_dentry vfs_dentry_t;
+struct vfs_dentry {
+    char name[VFS_NAME_MAX + 1];
+    uint8_t name_len;
+    vfs_inode_t* inode;             // NULL while the dentry is free
+    vfs_dentry_t* parent;           // The root is its own parent
+    vfs_dentry_t* hash_next;
+
+    // Directories keep their entries on a list for listing them, lookups
+    // never walk it
+    vfs_dentry_t* children;
+    vfs_dentry_t* sibling_prev;
+    vfs_dentry_t* sibling_next;
+    uint32_t child_count;
+
+    bool cached;                    // Made from a disk lookup, may be dropped
+    vfs_dentry_t* lru_prev;         // On the cached list, least recently used first
+    vfs_dentry_t* lru_next;
+    vfs_inode_t* covered;           // The directory a mount hides, NULL if none
+};
+
+typedef struct {
+    uint64_t lookups;               // Paths resolved, found or not
+    uint64_t cache_hits;            // found in the path cache
+    uint64_t hit_cycles;            // TSC spent on those
+    uint64_t walks;                 // Lookups that went component by component
+    uint64_t walk_cycles;
+    uint64_t components;            // Dentry hash lookups the walks did
+    uint64_t probes;                // Dentries compared by them
+    uint64_t fs_lookups;            // Names not in the hash table, asked of the file system
+    uint64_t evictions;             // Cached dentries dropped for room
+    uint64_t invalidations;         // Times a removal emptied the path cache
+} vfs_stats_t;
+
+// Mount the root on the given file system
+void vfs_init(const vfs_fs_ops_t* root_fs);
+
+vfs_dentry_t* vfs_root(void);
+
+// Resolve an absolute path; a missing leading slash means the same. "."
+// and ".." work, trailing slashes are ignored.
+vfs_error_t vfs_lookup(const char* path, vfs_dentry_t** dentry);
+
+// Create a file or directory whose parent already exists. dentry may be NULL.
+vfs_error_t vfs_create(const char* path, vfs_type_t type, vfs_dentry_t** dentry);
+
+// Remove a file or an empty directory, and free the contents
+vfs_error_t vfs_remove(const char* path);
+
+// One name in a directory, without going through the path cache
+vfs_error_t vfs_lookup_at(vfs_dentry_t* dir, const char* name, vfs_dentry_t** dentry);
+
+// Names in a directory one at a time, oldest first in RAM. Start with
+// *cookie 0, false after the last. name has room for VFS_NAME_MAX + 1.
+bool vfs_readdir(vfs_dentry_t* dir, uint64_t* cookie, char* name);
+
+// Put a file system with its root directory on an empty directory in RAM
+vfs_error_t vfs_mount(const char* path, const vfs_fs_ops_t* fs, void* root_data,
+                      uint64_t root_size);
+
+// File contents, reads stop at the end of the file
+uint64_t vfs_read(vfs_inode_t* inode, uint64_t offset, void* buffer, uint64_t len);
+uint64_t vfs_write(vfs_inode_t* inode, uint64_t offset, const void* buffer, uint64_t len);
+vfs_error_t vfs_truncate(vfs_inode_t* inode, uint64_t size);
+
+// Inodes and dentries in use
+void vfs_counts(uint32_t* inodes, uint32_t* dentries);
+
+const char* vfs_error_string(vfs_error_t error);
+
+const vfs_stats_t* vfs_get_stats(void);
+void vfs_reset_stats(void);
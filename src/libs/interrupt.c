@@ -1,6 +1,7 @@
 #include "interrupt.h"
 #include "port.h"
 #include "pic.h"
+#include "apic.h"
 
 #define IDT_ENTRIES 256
 
@@ -60,6 +61,22 @@ extern void isr44();
 extern void isr45();
 extern void isr46();
 extern void isr47();
+extern void isr48();
+extern void isr49();
+extern void isr50();
+extern void isr51();
+extern void isr52();
+extern void isr53();
+extern void isr54();
+extern void isr55();
+extern void isr56();
+extern void isr57();
+extern void isr58();
+extern void isr59();
+extern void isr60();
+extern void isr61();
+extern void isr62();
+extern void isr63();
 
 // Function to set an entry in the IDT
 static void idt_set_gate(uint8_t num, uint64_t base, uint16_t selector, uint8_t flags) {
@@ -135,6 +152,24 @@ void idt_init() {
     idt_set_gate(46, (uint64_t)isr46, 0x08, 0x8E);
     idt_set_gate(47, (uint64_t)isr47, 0x08, 0x8E);
 
+    // Message signalled interrupts (48-62) and the APIC spurious vector (63)
+    idt_set_gate(48, (uint64_t)isr48, 0x08, 0x8E);
+    idt_set_gate(49, (uint64_t)isr49, 0x08, 0x8E);
+    idt_set_gate(50, (uint64_t)isr50, 0x08, 0x8E);
+    idt_set_gate(51, (uint64_t)isr51, 0x08, 0x8E);
+    idt_set_gate(52, (uint64_t)isr52, 0x08, 0x8E);
+    idt_set_gate(53, (uint64_t)isr53, 0x08, 0x8E);
+    idt_set_gate(54, (uint64_t)isr54, 0x08, 0x8E);
+    idt_set_gate(55, (uint64_t)isr55, 0x08, 0x8E);
+    idt_set_gate(56, (uint64_t)isr56, 0x08, 0x8E);
+    idt_set_gate(57, (uint64_t)isr57, 0x08, 0x8E);
+    idt_set_gate(58, (uint64_t)isr58, 0x08, 0x8E);
+    idt_set_gate(59, (uint64_t)isr59, 0x08, 0x8E);
+    idt_set_gate(60, (uint64_t)isr60, 0x08, 0x8E);
+    idt_set_gate(61, (uint64_t)isr61, 0x08, 0x8E);
+    idt_set_gate(62, (uint64_t)isr62, 0x08, 0x8E);
+    idt_set_gate(63, (uint64_t)isr63, 0x08, 0x8E);
+
     // Load the IDT
     __asm__ volatile("lidt %0" : : "m"(idtr));
 }
@@ -162,6 +197,24 @@ void pic_remap() {
     port_byte_out(PIC2_DATA, 0xFF); // All IRQs on PIC2 masked
 }
 
+// Let a PIC line through, IRQ 8-15 also need the cascade line on the master
+void pic_unmask_irq(uint8_t irq) {
+    if (irq < 8) {
+        port_byte_out(PIC1_DATA, port_byte_in(PIC1_DATA) & ~(1 << irq));
+    } else if (irq < 16) {
+        port_byte_out(PIC2_DATA, port_byte_in(PIC2_DATA) & ~(1 << (irq - 8)));
+        port_byte_out(PIC1_DATA, port_byte_in(PIC1_DATA) & ~(1 << 2));
+    }
+}
+
+void pic_mask_irq(uint8_t irq) {
+    if (irq < 8) {
+        port_byte_out(PIC1_DATA, port_byte_in(PIC1_DATA) | (1 << irq));
+    } else if (irq < 16) {
+        port_byte_out(PIC2_DATA, port_byte_in(PIC2_DATA) | (1 << (irq - 8)));
+    }
+}
+
 // Initialize interrupts
 void interrupt_init() {
     // Initialize IDT
@@ -169,6 +222,10 @@ void interrupt_init() {
 
     // Remap PICs
     pic_remap();
+
+    // Message signalled interrupts need the local APIC, without one devices
+    // stay on their PIC lines
+    lapic_init();
 }
 
 // Register an interrupt handler
@@ -176,6 +233,15 @@ void register_interrupt_handler(uint8_t n, isr_t handler) {
     interrupt_handlers[n] = handler;
 }
 
+int interrupt_alloc_vector(void) {
+    static uint8_t next_vector = MSI_VECTOR_BASE;
+
+    if (next_vector >= MSI_VECTOR_BASE + MSI_VECTOR_COUNT) {
+        return -1;
+    }
+    return next_vector++;
+}
+
 // Enable interrupts
 void enable_interrupts() {
     __asm__ volatile("sti");
@@ -196,6 +262,9 @@ void isr_handler(uint64_t interrupt_number) {
         }
         // Always send EOI to master PIC (IRQ0-7 and cascaded IRQ8-15)
         port_byte_out(PIC1_COMMAND, PIC_EOI);
+    } else if (interrupt_number >= MSI_VECTOR_BASE &&
+               interrupt_number < MSI_VECTOR_BASE + MSI_VECTOR_COUNT) {
+        lapic_eoi();
     }
 
     // Then call the handler
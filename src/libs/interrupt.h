@@ -27,8 +27,40 @@ void interrupt_init();
 // Register a handler for a specific interrupt
 void register_interrupt_handler(uint8_t n, isr_t handler);
 
+// PIC lines are delivered at vector IRQ_BASE + irq
+#define IRQ_BASE 32
+
+// Vectors handed out for message signalled interrupts. The one after them
+// is the local APIC's spurious vector.
+#define MSI_VECTOR_BASE   48
+#define MSI_VECTOR_COUNT  15
+#define SPURIOUS_VECTOR   63
+
+// Reserve a vector for an MSI or MSI-X interrupt, -1 when they are used up
+int interrupt_alloc_vector(void);
+
+// Unmask a PIC line (0-15), they all start masked except the timer and keyboard
+void pic_unmask_irq(uint8_t irq);
+
+// Mask a PIC line again
+void pic_mask_irq(uint8_t irq);
+
 // Enable interrupts
 void enable_interrupts();
 
 // Disable interrupts
 void disable_interrupts();
+
+// Disable interrupts and return the previous RFLAGS so they can be restored
+static inline uint64_t irq_save(void) {
+    uint64_t flags;
+    __asm__ volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enable interrupts if they were enabled when irq_save was called
+static inline void irq_restore(uint64_t flags) {
+    if (flags & (1 << 9)) {
+        __asm__ volatile("sti" : : : "memory");
+    }
+}
@@ -0,0 +1,307 @@
+#include "ioring.h"
+#include "interrupt.h"
+#include "string.h"
+#include "timer.h"
+
+#define barrier() __asm__ volatile("" : : : "memory")
+
+#define MASK (IORING_ENTRIES - 1)
+
+static ioring_t rings[IORING_MAX_RINGS];
+
+ioring_t* ioring_create(void) {
+    for (int i = 0; i < IORING_MAX_RINGS; i++) {
+        ioring_t* ring = &rings[i];
+        if (ring->used) continue;
+
+        memset(ring, 0, sizeof(ioring_t));
+        ring->used = true;
+        for (int j = IORING_ENTRIES - 1; j >= 0; j--) {
+            ring->slots[j].ring = ring;
+            ring->slots[j].next = ring->free;
+            ring->free = &ring->slots[j];
+        }
+        return ring;
+    }
+    return NULL;
+}
+
+bool ioring_destroy(ioring_t* ring) {
+    if (ring->inflight) return false;
+    ring->used = false;
+    return true;
+}
+
+ioring_sqe_t* ioring_get_sqe(ioring_t* ring) {
+    if (ring->sq_tail - ring->sq_head == IORING_ENTRIES) return NULL;
+    ioring_sqe_t* sqe = &ring->sq[ring->sq_tail++ & MASK];
+    memset(sqe, 0, sizeof(ioring_sqe_t));
+    return sqe;
+}
+
+// The ring's slot for a registered block device, -1 for anything else
+static int device_index(ioring_t* ring, blk_device_t* dev) {
+    bool registered = false;
+    for (int i = 0; i < blk_device_count(); i++) {
+        if (blk_get_device(i) == dev) registered = true;
+    }
+    if (!registered) return -1;
+
+    int i = 0;
+    while (ring->devices[i] && ring->devices[i] != dev) i++;
+    ring->devices[i] = dev;
+    return i;
+}
+
+// In interrupt context, or in the owner's blk_wait for polled devices,
+// where an interrupt of another device can break in. Interrupts stay off
+// while the entry goes on the done queue so the two don't overlap.
+static void request_done(blk_request_t* req) {
+    ioring_slot_t* slot = req->ctx;
+    ioring_t* ring = slot->ring;
+    slot->result = req->ok ? (int32_t)(req->count * BLK_SECTOR_SIZE) : IORING_ERR_IO;
+
+    uint64_t flags = irq_save();
+    ring->done[ring->done_tail & MASK] = slot - ring->slots;
+    barrier();
+    ring->done_tail++;
+    irq_restore(flags);
+}
+
+// Put the result on the CQ and free the slot. ioring_submit made sure
+// there is room.
+static void post(ioring_t* ring, ioring_slot_t* slot, int32_t result) {
+    ioring_cqe_t* cqe = &ring->cq[ring->cq_tail++ & MASK];
+    cqe->user_data = slot->sqe.user_data;
+    cqe->result = result;
+    ring->stats.completed++;
+    if (result == IORING_ERR_CANCELED) ring->stats.canceled++;
+
+    slot->next = ring->free;
+    ring->free = slot;
+    ring->inflight--;
+}
+
+static void queue_busy(ioring_t* ring, ioring_slot_t* slot) {
+    slot->next = NULL;
+    if (ring->busy_tail) {
+        ring->busy_tail->next = slot;
+    } else {
+        ring->busy_head = slot;
+    }
+    ring->busy_tail = slot;
+}
+
+// Start an operation. False if it finished on the spot, with the result
+// in *result.
+static bool start(ioring_t* ring, ioring_slot_t* slot, int32_t* result) {
+    ioring_sqe_t* sqe = &slot->sqe;
+
+    switch (sqe->op) {
+        case IORING_OP_NOP:
+            *result = 0;
+            return false;
+
+        case IORING_OP_READ:
+        case IORING_OP_WRITE: {
+            blk_device_t* dev = sqe->target;
+            int i = device_index(ring, dev);
+            blk_request_t* req = &slot->req;
+            *req = (blk_request_t){
+                .write = sqe->op == IORING_OP_WRITE,
+                .lba = sqe->off,
+                .count = sqe->len,
+                .sg = { { sqe->addr, sqe->len * BLK_SECTOR_SIZE } },
+                .sg_count = 1,
+                .done = request_done,
+                .ctx = slot,
+            };
+            if (i < 0 || !blk_valid(dev, req)) break;
+
+            ring->device_inflight[i]++;
+            if (blk_submit(dev, req)) {
+                ring->device_kick[i] = true;
+            } else {
+                ring->stats.busy++;
+                queue_busy(ring, slot);
+            }
+            return true;
+        }
+
+        case IORING_OP_SENDTO:
+            if (!sqe->target || sqe->len > UINT16_MAX) break;
+            *result = udp_sendto(sqe->target, sqe->off, sqe->port, sqe->addr, sqe->len)
+                          ? (int32_t)sqe->len
+                          : IORING_ERR_IO;
+            return false;
+
+        case IORING_OP_TIMEOUT:
+            slot->deadline = tick_count + sqe->len;
+            slot->next = ring->timers;
+            ring->timers = slot;
+            return true;
+    }
+
+    *result = IORING_ERR_INVALID;
+    return false;
+}
+
+// Complete an operation and go on with its chain: start the next one if
+// this one succeeded, cancel the rest if it failed
+static void finish(ioring_t* ring, ioring_slot_t* slot, int32_t result) {
+    while (true) {
+        ioring_slot_t* next = slot->link;
+        post(ring, slot, result);
+        if (!next) return;
+
+        slot = next;
+        if (result < 0) {
+            result = IORING_ERR_CANCELED;
+        } else {
+            ring->stats.linked++;
+            if (start(ring, slot, &result)) return;
+        }
+    }
+}
+
+// One kick per device for everything queued since the last
+static void kick(ioring_t* ring) {
+    for (int i = 0; i < BLK_MAX_DEVICES; i++) {
+        if (!ring->device_kick[i]) continue;
+        ring->device_kick[i] = false;
+        blk_kick(ring->devices[i]);
+        ring->stats.kicks++;
+    }
+}
+
+uint32_t ioring_submit(ioring_t* ring) {
+    uint32_t taken = 0;
+
+    while (ring->sq_head != ring->sq_tail) {
+        // The chain ends at the first entry without IORING_LINK, or with
+        // the SQ
+        uint32_t len = 1;
+        while (ring->sq_head + len != ring->sq_tail &&
+               (ring->sq[(ring->sq_head + len - 1) & MASK].flags & IORING_LINK)) {
+            len++;
+        }
+        if (ring->inflight + len + (ring->cq_tail - ring->cq_head) > IORING_ENTRIES) break;
+
+        ioring_slot_t* head = NULL;
+        ioring_slot_t** prev = &head;
+        for (uint32_t i = 0; i < len; i++) {
+            ioring_slot_t* slot = ring->free;
+            ring->free = slot->next;
+            slot->sqe = ring->sq[ring->sq_head++ & MASK];
+            slot->link = NULL;
+            *prev = slot;
+            prev = &slot->link;
+        }
+        ring->inflight += len;
+        if (ring->inflight > ring->stats.max_inflight) ring->stats.max_inflight = ring->inflight;
+        taken += len;
+
+        int32_t result;
+        if (!start(ring, head, &result)) finish(ring, head, result);
+    }
+
+    if (taken) {
+        ring->stats.submitted += taken;
+        ring->stats.submit_calls++;
+    }
+    kick(ring);
+    return taken;
+}
+
+// Move finished operations to the CQ, start what they were linked to and
+// retry requests that found their device queue full
+static void process(ioring_t* ring) {
+    while (ring->done_head != ring->done_tail) {
+        barrier();
+        ioring_slot_t* slot = &ring->slots[ring->done[ring->done_head & MASK]];
+        ring->done_head++;
+        ring->device_inflight[device_index(ring, slot->sqe.target)]--;
+        finish(ring, slot, slot->result);
+    }
+
+    for (ioring_slot_t** link = &ring->timers; *link;) {
+        ioring_slot_t* slot = *link;
+        if (tick_count >= slot->deadline) {
+            *link = slot->next;
+            finish(ring, slot, 0);
+        } else {
+            link = &slot->next;
+        }
+    }
+
+    ioring_slot_t* slot = ring->busy_head;
+    ring->busy_head = ring->busy_tail = NULL;
+    while (slot) {
+        ioring_slot_t* next = slot->next;
+        blk_device_t* dev = slot->sqe.target;
+        if (blk_submit(dev, &slot->req)) {
+            ring->device_kick[device_index(ring, dev)] = true;
+        } else {
+            queue_busy(ring, slot);
+        }
+        slot = next;
+    }
+
+    kick(ring);
+}
+
+uint32_t ioring_poll(ioring_t* ring) {
+    process(ring);
+    return ring->cq_tail - ring->cq_head;
+}
+
+uint32_t ioring_wait(ioring_t* ring, uint32_t count) {
+    while (true) {
+        process(ring);
+        uint32_t ready = ring->cq_tail - ring->cq_head;
+        if (ready >= count || ring->inflight == 0) return ready;
+        ring->stats.waits++;
+
+        // Polled devices only complete when asked. Otherwise any interrupt
+        // may have finished something, the timer's included.
+        blk_device_t* halt = NULL;
+        bool polled = false;
+        for (int i = 0; i < BLK_MAX_DEVICES; i++) {
+            if (!ring->device_inflight[i]) continue;
+            if (ring->devices[i]->polled) {
+                blk_wait(ring->devices[i]);
+                polled = true;
+            } else {
+                halt = ring->devices[i];
+            }
+        }
+        if (polled) continue;
+        if (halt) {
+            blk_wait(halt);
+        } else {
+            __asm__ volatile("sti; hlt");
+        }
+    }
+}
+
+ioring_cqe_t* ioring_peek_cqe(ioring_t* ring) {
+    if (ring->cq_head == ring->cq_tail) return NULL;
+    return &ring->cq[ring->cq_head & MASK];
+}
+
+void ioring_cqe_seen(ioring_t* ring) {
+    ring->cq_head++;
+}
+
+uint32_t ioring_inflight(const ioring_t* ring) {
+    return ring->inflight;
+}
+
+const char* ioring_error_string(int32_t result) {
+    switch (result) {
+        case IORING_ERR_IO:       return "I/O error";
+        case IORING_ERR_CANCELED: return "Canceled";
+        case IORING_ERR_INVALID:  return "Invalid operation";
+        default:                  return result < 0 ? "Unknown error" : "Success";
+    }
+}
@@ -0,0 +1,138 @@
+#pragma once
+
+#include "types.h"
+#include "block/blkdev.h"
+#include "net/udp.h"
+
+// Asynchronous I/O through a pair of rings, after io_uring. The owner of a
+// ring queues operations on the submission ring (SQ), hands them all to
+// the devices with one ioring_submit, and later takes the results off the
+// completion ring (CQ), so one caller can keep many disk requests, sends
+// and timers going without waiting on any of them. An entry with
+// IORING_LINK starts the next one only after it succeeded; when it fails,
+// the rest of its chain completes with IORING_ERR_CANCELED.
+//
+// Devices finish requests in interrupt handlers, which only put the
+// operation on the ring's done queue, a single producer single consumer
+// ring that needs no lock. Everything else, moving results to the CQ,
+// starting linked operations and kicking the devices, happens in the
+// owner's calls. An operation only leaves the SQ while the CQ is sure to
+// have room for its result, so completions are never dropped.
+#define IORING_MAX_RINGS    4
+#define IORING_ENTRIES      128     // Per ring, SQ and CQ alike, a power of two up to 256
+
+typedef enum {
+    IORING_OP_NOP,
+    IORING_OP_READ,         // len sectors at off of the block device target into addr
+    IORING_OP_WRITE,        // The same the other way
+    IORING_OP_SENDTO,       // len bytes at addr as a datagram from the UDP socket target
+                            // to IP address off, port port
+    IORING_OP_TIMEOUT,      // Completes with 0 after len milliseconds
+} ioring_op_t;
+
+#define IORING_LINK         0x01    // The next entry waits for this one
+
+typedef enum {
+    IORING_ERR_IO = -1,             // The device or the network stack failed it
+    IORING_ERR_CANCELED = -2,       // An earlier operation of the chain failed
+    IORING_ERR_INVALID = -3,        // Unknown op, or it doesn't fit the device
+} ioring_error_t;
+
+typedef struct {
+    uint8_t op;
+    uint8_t flags;
+    uint16_t port;
+    uint32_t len;
+    uint64_t off;
+    void* addr;
+    void* target;
+    uint64_t user_data;             // Handed back in the completion
+} ioring_sqe_t;
+
+typedef struct {
+    uint64_t user_data;
+    int32_t result;                 // Bytes moved, 0 for NOP and TIMEOUT, or an ioring_error_t
+} ioring_cqe_t;
+
+typedef struct {
+    uint64_t submitted;             // Operations taken off the SQ
+    uint64_t submit_calls;          // ioring_submit calls that took any
+    uint64_t completed;             // Results put on the CQ
+    uint64_t linked;                // Operations started by the one before them
+    uint64_t canceled;
+    uint64_t busy;                  // Requests a full device queue turned away for a while
+    uint64_t kicks;                 // Device kicks, one per device per pass
+    uint64_t waits;                 // Times ioring_wait halted or polled a device
+    uint32_t max_inflight;
+} ioring_stats_t;
+
+typedef struct ioring ioring_t;
+typedef struct ioring_slot ioring_slot_t;
+struct ioring_slot {
+    ioring_t* ring;
+    ioring_sqe_t sqe;
+    blk_request_t req;
+    ioring_slot_t* link;            // Next operation of the chain
+    ioring_slot_t* next;            // On the free, busy or timer list
+    uint64_t deadline;              // tick_count a timeout completes at
+    int32_t result;
+};
+
+struct ioring {
+    bool used;
+
+    ioring_sqe_t sq[IORING_ENTRIES];
+    uint32_t sq_head;               // Next entry ioring_submit takes
+    uint32_t sq_tail;               // Next entry ioring_get_sqe hands out
+    ioring_cqe_t cq[IORING_ENTRIES];
+    uint32_t cq_head;               // Next result for the owner
+    uint32_t cq_tail;
+
+    // Finished operations, filled by the done callbacks
+    uint8_t done[IORING_ENTRIES];
+    volatile uint32_t done_head;
+    volatile uint32_t done_tail;
+
+    ioring_slot_t slots[IORING_ENTRIES];
+    ioring_slot_t* free;
+    uint32_t inflight;              // Slots in use
+    ioring_slot_t* busy_head;       // Waiting for room in a device queue
+    ioring_slot_t* busy_tail;
+    ioring_slot_t* timers;
+    blk_device_t* devices[BLK_MAX_DEVICES];     // With requests in flight or to kick
+    uint32_t device_inflight[BLK_MAX_DEVICES];
+    bool device_kick[BLK_MAX_DEVICES];
+
+    ioring_stats_t stats;
+};
+
+// A free ring, NULL if all are taken
+ioring_t* ioring_create(void);
+
+// Give the ring back, false while it still has operations
+bool ioring_destroy(ioring_t* ring);
+
+// The next SQ entry, zeroed, or NULL while the SQ is full
+ioring_sqe_t* ioring_get_sqe(ioring_t* ring);
+
+// Start the queued entries that fit, kicking every device once. Returns
+// how many it took; the rest stay queued until results are taken off the
+// CQ. A chain is only taken whole.
+uint32_t ioring_submit(ioring_t* ring);
+
+// Collect finished operations without blocking. Returns the results on the
+// CQ.
+uint32_t ioring_poll(ioring_t* ring);
+
+// Collect finished operations until at least count results are on the CQ
+// or nothing is left in flight. Returns the results on the CQ.
+uint32_t ioring_wait(ioring_t* ring, uint32_t count);
+
+// The oldest result, NULL if there is none. ioring_cqe_seen drops it.
+ioring_cqe_t* ioring_peek_cqe(ioring_t* ring);
+void ioring_cqe_seen(ioring_t* ring);
+
+// Operations submitted and not yet on the CQ
+uint32_t ioring_inflight(const ioring_t* ring);
+
+const char* ioring_error_string(int32_t result);
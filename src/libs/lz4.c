@@ -0,0 +1,326 @@
+#include "lz4.h"
+#include "string.h"
+
+#define MIN_MATCH           4
+#define WILD                8           // Bytes one copy step moves
+#define SLACK               (2 * WILD)  // Room past a copy the fast paths need
+#define SHORT_IN            16          // Input a short sequence reads, its offset included
+#define SHORT_OUT           32          // Output it writes, 16 literal and 18 match bytes
+
+// Frame descriptor
+#define FLG_VERSION_MASK    0xC0
+#define FLG_VERSION         0x40
+#define FLG_BLOCK_INDEP     0x20
+#define FLG_BLOCK_CHECKSUM  0x10
+#define FLG_CONTENT_SIZE    0x08
+#define FLG_CONTENT_CHECKSUM 0x04
+#define FLG_DICT_ID         0x01
+#define BLOCK_UNCOMPRESSED  0x80000000u
+
+#define SKIPPABLE_MAGIC     0x184D2A50  // Low four bits are free
+#define SKIPPABLE_MASK      0xFFFFFFF0
+
+#define XXH_PRIME1          2654435761u
+#define XXH_PRIME2          2246822519u
+#define XXH_PRIME3          3266489917u
+#define XXH_PRIME4          668265263u
+#define XXH_PRIME5          374761393u
+
+// Unaligned loads and stores the compiler turns into single moves, even
+// without builtins
+static inline uint32_t load32(const uint8_t* p) {
+    uint32_t v;
+    __builtin_memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint16_t load16(const uint8_t* p) {
+    uint16_t v;
+    __builtin_memcpy(&v, p, 2);
+    return v;
+}
+
+static inline void copy8(uint8_t* dst, const uint8_t* src) {
+    __builtin_memcpy(dst, src, 8);
+}
+
+// Copy 16 bytes at a time up to end or at most 15 bytes past it. The
+// second half reads what the first wrote when the two overlap by 8 to 15.
+static inline void wildcopy(uint8_t* dst, const uint8_t* src, uint8_t* end) {
+    do {
+        copy8(dst, src);
+        copy8(dst + WILD, src + WILD);
+        dst += 2 * WILD;
+        src += 2 * WILD;
+    } while (dst < end);
+}
+
+// A length nibble of 15 goes on in bytes of 255 until a smaller one
+static inline bool read_length(const uint8_t** ip, const uint8_t* iend, size_t* length) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+// Decompress one block from src to op, matches may reach back to base.
+// *end is where the output ends.
+static bool decode(const uint8_t* src, size_t len, uint8_t* base, uint8_t* op, uint8_t* oend,
+                   uint8_t** end) {
+    // Spread a match closer than 8 bytes: after the first 8 bytes the
+    // source is at least 8 behind the output
+    static const uint8_t inc[8] = { 0, 1, 2, 1, 0, 4, 4, 4 };
+    static const int8_t dec[8] = { 0, 0, 0, -1, -4, 1, 2, 3 };
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+
+        // Most sequences are short: up to 14 literals and a match of up to
+        // 18 bytes at least 8 back. Away from both ends that takes three
+        // fixed copies and no length checks.
+        size_t lit = token >> 4;
+        if (lit < 15 && (token & 15) < 15 && iend - ip >= SHORT_IN && oend - op >= SHORT_OUT) {
+            copy8(op, ip);
+            copy8(op + 8, ip + 8);
+            op += lit;
+            ip += lit;
+
+            size_t offset = load16(ip);
+            size_t mlen = (token & 15) + MIN_MATCH;
+            if (offset >= WILD && offset <= (size_t)(op - base)) {
+                const uint8_t* match = op - offset;
+                copy8(op, match);
+                copy8(op + 8, match + 8);
+                __builtin_memcpy(op + 16, match + 16, 2);
+                op += mlen;
+                ip += 2;
+                continue;
+            }
+            // Close or broken matches take the long way, with the
+            // literals already done
+            lit = 0;
+        }
+
+        if (lit == 15 && !read_length(&ip, iend, &lit)) return false;
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return false;
+        if (lit) {
+            if ((size_t)(iend - ip) >= lit + SLACK && (size_t)(oend - op) >= lit + SLACK) {
+                wildcopy(op, ip, op + lit);
+            } else {
+                memcpy(op, ip, lit);
+            }
+            ip += lit;
+            op += lit;
+        }
+
+        // The last sequence has only literals
+        if (ip == iend) break;
+
+        if (iend - ip < 2) return false;
+        size_t offset = load16(ip);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - base)) return false;
+
+        size_t mlen = token & 15;
+        if (mlen == 15 && !read_length(&ip, iend, &mlen)) return false;
+        mlen += MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return false;
+
+        const uint8_t* match = op - offset;
+        uint8_t* mend = op + mlen;
+        if ((size_t)(oend - op) >= mlen + SLACK) {
+            if (offset < WILD) {
+                op[0] = match[0];
+                op[1] = match[1];
+                op[2] = match[2];
+                op[3] = match[3];
+                match += inc[offset];
+                __builtin_memcpy(op + 4, match, 4);
+                match -= dec[offset];
+            } else {
+                copy8(op, match);
+                match += WILD;
+            }
+            op += WILD;
+            if (op < mend && op - match == WILD) {
+                // Offsets 1, 2, 4 and 8 repeat every 8 bytes: store the
+                // same register over and over rather than read back what
+                // was just written
+                uint64_t v;
+                __builtin_memcpy(&v, match, 8);
+                do {
+                    __builtin_memcpy(op, &v, 8);
+                    op += WILD;
+                } while (op < mend);
+            } else if (op < mend) {
+                wildcopy(op, match, mend);
+            }
+        } else {
+            // Near the end of the buffer, exactly
+            while (op < mend) *op++ = *match++;
+        }
+        op = mend;
+    }
+
+    *end = op;
+    return true;
+}
+
+bool lz4_decompress_block(const void* src, size_t src_len, void* dst, size_t dst_cap,
+                          size_t* out_len) {
+    uint8_t* end;
+    if (!decode(src, src_len, dst, dst, (uint8_t*)dst + dst_cap, &end)) return false;
+    *out_len = end - (uint8_t*)dst;
+    return true;
+}
+
+static inline uint32_t rotl(uint32_t x, int r) {
+    return (x << r) | (x >> (32 - r));
+}
+
+static inline uint32_t xxh_round(uint32_t acc, uint32_t input) {
+    return rotl(acc + input * XXH_PRIME2, 13) * XXH_PRIME1;
+}
+
+uint32_t lz4_xxh32(const void* data, size_t len, uint32_t seed) {
+    const uint8_t* p = data;
+    const uint8_t* end = p + len;
+    uint32_t h;
+
+    if (len >= 16) {
+        uint32_t v1 = seed + XXH_PRIME1 + XXH_PRIME2;
+        uint32_t v2 = seed + XXH_PRIME2;
+        uint32_t v3 = seed;
+        uint32_t v4 = seed - XXH_PRIME1;
+        do {
+            v1 = xxh_round(v1, load32(p));
+            v2 = xxh_round(v2, load32(p + 4));
+            v3 = xxh_round(v3, load32(p + 8));
+            v4 = xxh_round(v4, load32(p + 12));
+            p += 16;
+        } while (end - p >= 16);
+        h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+    } else {
+        h = seed + XXH_PRIME5;
+    }
+    h += (uint32_t)len;
+
+    for (; end - p >= 4; p += 4) {
+        h = rotl(h + load32(p) * XXH_PRIME3, 17) * XXH_PRIME4;
+    }
+    for (; p < end; p++) {
+        h = rotl(h + *p * XXH_PRIME5, 11) * XXH_PRIME1;
+    }
+
+    h ^= h >> 15;
+    h *= XXH_PRIME2;
+    h ^= h >> 13;
+    h *= XXH_PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+lz4_error_t lz4_frame_open(lz4_frame_t* frame, const void* src, size_t src_len) {
+    const uint8_t* p = src;
+    size_t pos = 0;
+
+    memset(frame, 0, sizeof(lz4_frame_t));
+    while (src_len - pos >= 8 && (load32(p + pos) & SKIPPABLE_MASK) == SKIPPABLE_MAGIC) {
+        uint32_t size = load32(p + pos + 4);
+        if (size > src_len - pos - 8) return LZ4_ERR_FORMAT;
+        pos += 8 + size;
+    }
+    if (src_len - pos < 7 || load32(p + pos) != LZ4_MAGIC) return LZ4_ERR_FORMAT;
+
+    const uint8_t* desc = p + pos + 4;
+    uint8_t flg = desc[0];
+    uint8_t bd = desc[1];
+    size_t desc_len = 2 + (flg & FLG_CONTENT_SIZE ? 8 : 0);
+    if ((flg & FLG_VERSION_MASK) != FLG_VERSION || (flg & FLG_DICT_ID)) return LZ4_ERR_UNSUPPORTED;
+    uint32_t block_code = (bd >> 4) & 7;
+    if (block_code < 4) return LZ4_ERR_FORMAT;
+    if (src_len - pos < 4 + desc_len + 1) return LZ4_ERR_FORMAT;
+    if (((lz4_xxh32(desc, desc_len, 0) >> 8) & 0xFF) != desc[desc_len]) return LZ4_ERR_CHECKSUM;
+
+    frame->src = p;
+    frame->src_len = src_len;
+    frame->pos = pos + 4 + desc_len + 1;
+    frame->block_max = 1u << (2 * block_code + 8);
+    frame->block_checksum = flg & FLG_BLOCK_CHECKSUM;
+    frame->content_checksum = flg & FLG_CONTENT_CHECKSUM;
+    if (flg & FLG_CONTENT_SIZE) {
+        __builtin_memcpy(&frame->content_size, desc + 2, 8);
+    }
+    return LZ4_OK;
+}
+
+lz4_error_t lz4_frame_next(lz4_frame_t* frame, void* out, size_t out_cap, size_t* produced) {
+    const uint8_t* p = frame->src;
+    uint8_t* base = out;
+    *produced = 0;
+    if (frame->done) return LZ4_OK;
+
+    if (frame->src_len - frame->pos < 4) return LZ4_ERR_FORMAT;
+    uint32_t header = load32(p + frame->pos);
+    frame->pos += 4;
+
+    if (header == 0) {
+        // The end mark, then the checksum of everything
+        frame->done = true;
+        if (frame->content_size && frame->out_len != frame->content_size) return LZ4_ERR_FORMAT;
+        if (!frame->content_checksum) return LZ4_OK;
+        if (frame->src_len - frame->pos < 4) return LZ4_ERR_FORMAT;
+        uint32_t sum = load32(p + frame->pos);
+        frame->pos += 4;
+        return lz4_xxh32(base, frame->out_len, 0) == sum ? LZ4_OK : LZ4_ERR_CHECKSUM;
+    }
+
+    uint32_t size = header & ~BLOCK_UNCOMPRESSED;
+    size_t trailer = frame->block_checksum ? 4 : 0;
+    if (size > frame->block_max || size + trailer > frame->src_len - frame->pos) {
+        return LZ4_ERR_FORMAT;
+    }
+    const uint8_t* block = p + frame->pos;
+    if (frame->block_checksum && lz4_xxh32(block, size, 0) != load32(block + size)) {
+        return LZ4_ERR_CHECKSUM;
+    }
+
+    uint8_t* op = base + frame->out_len;
+    size_t room = out_cap - frame->out_len;
+    size_t n;
+    if (header & BLOCK_UNCOMPRESSED) {
+        if (size > room) return LZ4_ERR_SPACE;
+        memcpy(op, block, size);
+        n = size;
+    } else {
+        // A block never grows past block_max, so running out of room
+        // before that means the buffer is too small
+        uint8_t* end;
+        size_t cap = room < frame->block_max ? room : frame->block_max;
+        if (!decode(block, size, base, op, op + cap, &end)) {
+            return cap < frame->block_max ? LZ4_ERR_SPACE : LZ4_ERR_FORMAT;
+        }
+        n = end - op;
+    }
+
+    frame->pos += size + trailer;
+    frame->out_len += n;
+    *produced = n;
+    return LZ4_OK;
+}
+
+const char* lz4_error_string(lz4_error_t error) {
+    switch (error) {
+        case LZ4_OK:              return "Success";
+        case LZ4_ERR_FORMAT:      return "Not LZ4 or broken";
+        case LZ4_ERR_UNSUPPORTED: return "Unsupported LZ4 feature";
+        case LZ4_ERR_CHECKSUM:    return "Checksum mismatch";
+        case LZ4_ERR_SPACE:       return "Output buffer too small";
+        default:                  return "Unknown error";
+    }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "types.h"
+
+// LZ4 decompression, of raw blocks and of frames as the lz4 tool writes
+// them. Sequences are copied 8 bytes at a time and allowed to run a few
+// bytes past their end while the output has room to spare, which the next
+// sequence overwrites; only the last bytes of a buffer are copied exactly.
+// Matches closer than 8 bytes behind the output are spread out to 8 first,
+// so a run of one repeated byte also copies 8 at a time.
+#define LZ4_MAGIC           0x184D2204
+#define LZ4_WINDOW          65536       // Matches reach this far back
+
+typedef enum {
+    LZ4_OK = 0,
+    LZ4_ERR_FORMAT,         // Not LZ4, or a broken block
+    LZ4_ERR_UNSUPPORTED,    // A dictionary, or a version this doesn't know
+    LZ4_ERR_CHECKSUM,
+    LZ4_ERR_SPACE,          // The output buffer is too small
+} lz4_error_t;
+
+// A frame being decompressed block by block into one output buffer, so
+// blocks that depend on the ones before them find their matches
+typedef struct {
+    const uint8_t* src;
+    size_t src_len;
+    size_t pos;                 // Next block header in src
+    size_t out_len;             // Decompressed so far
+    uint64_t content_size;      // From the header, 0 if it doesn't say
+    uint32_t block_max;
+    bool block_checksum;
+    bool content_checksum;
+    bool done;
+} lz4_frame_t;
+
+// Decompress one block into dst. False if it is broken or doesn't fit.
+bool lz4_decompress_block(const void* src, size_t src_len, void* dst, size_t dst_cap,
+                          size_t* out_len);
+
+// Read the frame header at src, after any skippable frames
+lz4_error_t lz4_frame_open(lz4_frame_t* frame, const void* src, size_t src_len);
+
+// Decompress the next block to the end of out, which stays the same for the
+// whole frame. *produced is 0 after the last block.
+lz4_error_t lz4_frame_next(lz4_frame_t* frame, void* out, size_t out_cap, size_t* produced);
+
+// Checksum of the frame format
+uint32_t lz4_xxh32(const void* data, size_t len, uint32_t seed);
+
+const char* lz4_error_string(lz4_error_t error);
@@ -0,0 +1,111 @@
+#include "memory.h"
+#include "multiboot.h"
+#include "string.h"
+
+// End of the kernel image including .bss, from the linker script
+extern char _kernel_end[];
+
+#define MAX_RESERVED  8
+
+// What the boot loader put in RAM that we still use
+typedef struct {
+    uint64_t start;
+    uint64_t end;
+} range_t;
+
+static range_t reserved[MAX_RESERVED];
+static int reserved_count = 0;
+
+static uint64_t total = 0;
+static uint64_t next_free = 0;   // Allocations are carved from [next_free, limit)
+static uint64_t limit = 0;
+
+static inline uint64_t page_up(uint64_t addr) {
+    return (addr + PAGE_SIZE - 1) & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+static inline uint64_t page_down(uint64_t addr) {
+    return addr & ~(uint64_t)(PAGE_SIZE - 1);
+}
+
+// Keep [start, end) as the pool if it is larger than what we have
+static void consider(uint64_t start, uint64_t end) {
+    start = page_up(start);
+    end = page_down(end);
+    if (end > start && end - start > limit - next_free) {
+        next_free = start;
+        limit = end;
+    }
+}
+
+// Consider [start, end) less the reserved ranges from first on
+static void add_free(uint64_t start, uint64_t end, int first) {
+    for (int i = first; i < reserved_count; i++) {
+        if (reserved[i].end > start && reserved[i].start < end) {
+            add_free(start, reserved[i].start, i + 1);
+            add_free(reserved[i].end, end, i + 1);
+            return;
+        }
+    }
+    consider(start, end);
+}
+
+static void reserve(uint64_t start, uint64_t end) {
+    if (end > start && reserved_count < MAX_RESERVED) {
+        reserved[reserved_count++] = (range_t){ start, end };
+    }
+}
+
+bool memory_init(void) {
+    const multiboot_tag_mmap_t* mmap = (const multiboot_tag_mmap_t*)
+        multiboot_find_tag(MULTIBOOT_TAG_MMAP, 0);
+    if (!mmap || mmap->entry_size < sizeof(multiboot_mmap_entry_t)) {
+        return false;
+    }
+
+    uint64_t info_start, info_end;
+    multiboot_info_range(&info_start, &info_end);
+    reserve(info_start, info_end);
+    for (const multiboot_tag_t* tag = multiboot_find_tag(MULTIBOOT_TAG_MODULE, 0); tag;
+         tag = multiboot_find_tag(MULTIBOOT_TAG_MODULE, tag)) {
+        const multiboot_tag_module_t* module = (const multiboot_tag_module_t*)tag;
+        reserve(module->mod_start, module->mod_end);
+    }
+    uint64_t kernel_end = (uint64_t)_kernel_end;
+
+    const uint8_t* p = (const uint8_t*)mmap + sizeof(*mmap);
+    const uint8_t* end = (const uint8_t*)mmap + mmap->size;
+    for (; p + mmap->entry_size <= end; p += mmap->entry_size) {
+        const multiboot_mmap_entry_t* e = (const multiboot_mmap_entry_t*)p;
+        if (e->type != MULTIBOOT_MEMORY_AVAILABLE) continue;
+        total += e->length;
+
+        // Only above the kernel and below what is mapped, and around the
+        // multiboot information and modules, which are still read later
+        uint64_t start = e->base > kernel_end ? e->base : kernel_end;
+        uint64_t stop = e->base + e->length;
+        if (stop > MEMORY_MAPPED_LIMIT) stop = MEMORY_MAPPED_LIMIT;
+        if (start < stop) add_free(start, stop, 0);
+    }
+    return limit > next_free;
+}
+
+uint64_t memory_total(void) {
+    return total;
+}
+
+uint64_t memory_free(void) {
+    return limit - next_free;
+}
+
+void* memory_alloc_pages(size_t count) {
+    uint64_t bytes = (uint64_t)count * PAGE_SIZE;
+    if (count == 0 || bytes > limit - next_free) {
+        return NULL;
+    }
+
+    void* pages = (void*)next_free;
+    next_free += bytes;
+    memset(pages, 0, bytes);
+    return pages;
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Physical memory. The multiboot memory map tells how much RAM there is;
+// what lies after the kernel image in the identity mapped first GiB, less
+// the multiboot information and the modules, is handed out in pages for
+// tables sized at boot. Nothing is ever freed.
+#define PAGE_SIZE           4096
+#define MEMORY_MAPPED_LIMIT (1ULL << 30)    // What the boot page tables map
+
+// Read the memory map, needs multiboot_init first. False without one.
+bool memory_init(void);
+
+// Usable RAM in bytes according to the memory map
+uint64_t memory_total(void);
+
+// Bytes that memory_alloc_pages can still hand out
+uint64_t memory_free(void);
+
+// count contiguous zeroed pages, NULL if there isn't that much left
+void* memory_alloc_pages(size_t count);
@@ -0,0 +1,38 @@
+#include "multiboot.h"
+
+static const uint8_t* info = 0;
+static uint32_t info_size = 0;
+
+bool multiboot_init(uint32_t magic, void* boot_info) {
+    if (magic != MULTIBOOT2_MAGIC || !boot_info) {
+        return false;
+    }
+    info = boot_info;
+    info_size = *(const uint32_t*)info;
+    return true;
+}
+
+const multiboot_tag_t* multiboot_find_tag(uint32_t type, const multiboot_tag_t* prev) {
+    if (!info) return 0;
+
+    // Tags start after the total size and a reserved word
+    uint32_t offset = 8;
+    if (prev) {
+        offset = (const uint8_t*)prev - info + ((prev->size + 7) & ~7u);
+    }
+
+    while (offset + sizeof(multiboot_tag_t) <= info_size) {
+        const multiboot_tag_t* tag = (const multiboot_tag_t*)(info + offset);
+        if (tag->type == MULTIBOOT_TAG_END || tag->size < sizeof(multiboot_tag_t)) {
+            break;
+        }
+        if (tag->type == type) return tag;
+        offset += (tag->size + 7) & ~7u;
+    }
+    return 0;
+}
+
+void multiboot_info_range(uint64_t* start, uint64_t* end) {
+    *start = (uint64_t)info;
+    *end = (uint64_t)info + info_size;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// The multiboot2 information structure the boot loader leaves us: a list
+// of tags, each 8 byte aligned
+#define MULTIBOOT2_MAGIC            0x36D76289
+
+#define MULTIBOOT_TAG_END           0
+#define MULTIBOOT_TAG_MODULE        3
+#define MULTIBOOT_TAG_BASIC_MEMINFO 4
+#define MULTIBOOT_TAG_MMAP          6
+
+#define MULTIBOOT_MEMORY_AVAILABLE  1
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;             // Including this header
+} __attribute__((packed)) multiboot_tag_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint32_t entry_size;
+    uint32_t entry_version;
+} __attribute__((packed)) multiboot_tag_mmap_t;
+
+typedef struct {
+    uint32_t type;
+    uint32_t size;
+    uint32_t mod_start;        // Physical range the module was loaded to
+    uint32_t mod_end;
+    char cmdline[];            // What follows the path in grub.cfg
+} __attribute__((packed)) multiboot_tag_module_t;
+
+typedef struct {
+    uint64_t base;
+    uint64_t length;
+    uint32_t type;
+    uint32_t reserved;
+} __attribute__((packed)) multiboot_mmap_entry_t;
+
+// Remember the information structure if magic says it is one. Everything
+// below returns nothing until this succeeded.
+bool multiboot_init(uint32_t magic, void* info);
+
+// Next tag of a type after prev, or the first one if prev is NULL. NULL
+// when there are no more.
+const multiboot_tag_t* multiboot_find_tag(uint32_t type, const multiboot_tag_t* prev);
+
+// Physical range of the information structure, start == end without one
+void multiboot_info_range(uint64_t* start, uint64_t* end);
@@ -0,0 +1,435 @@
+#include "arp.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "netstat.h"
+#include "../interrupt.h"
+#include "../timer.h"
+#include "../string.h"
+
+typedef struct arp_entry {
+    struct arp_entry* hash_next;  // Next entry in the bucket, or in the free list
+    struct arp_entry* live_prev;  // On the list of entries in use, which the timer walks
+    struct arp_entry* live_next;
+    uint32_t ip;
+    uint8_t mac[6];
+    uint8_t state;                // arp_state_t
+    uint8_t probes;               // Requests sent in the current state
+    uint64_t updated;             // Tick of the last state change or confirmation
+    uint64_t last_used;           // Tick a packet was last sent through the entry
+    uint64_t next_probe;          // Tick the next request is due
+    pbuf_t* queue_head;           // Packets waiting for the address, linked by next
+    pbuf_t* queue_tail;
+    uint8_t queue_len;
+} arp_entry_t;
+
+static arp_entry_t entries[ARP_MAX_ENTRIES];
+static arp_entry_t* buckets[ARP_HASH_SIZE];
+static arp_entry_t* free_entries = NULL;
+static arp_entry_t* live_entries = NULL;
+static uint32_t entry_count = 0;
+static uint32_t evict_hand = 0;   // Where the search for an entry to evict resumes
+static uint32_t queued_total = 0;
+static uint32_t request_tokens = ARP_REQUEST_BURST * 1000;  // In thousandths
+
+static const uint8_t broadcast_mac[6] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
+
+static inline uint32_t arp_hash(uint32_t ip) {
+    return (ip * 2654435761u) >> (32 - ARP_HASH_BITS);
+}
+
+static arp_entry_t* arp_find(uint32_t ip) {
+    for (arp_entry_t* e = buckets[arp_hash(ip)]; e; e = e->hash_next) {
+        if (e->ip == ip) {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+static void drop_queue(arp_entry_t* e) {
+    while (e->queue_head) {
+        pbuf_t* p = e->queue_head;
+        e->queue_head = p->next;
+        p->next = NULL;
+        pbuf_free(p);
+        queued_total--;
+        net_stat_drop(NET_LAYER_ARP, NET_DROP_UNRESOLVED);
+    }
+    e->queue_tail = NULL;
+    e->queue_len = 0;
+}
+
+static void arp_destroy(arp_entry_t* e) {
+    arp_entry_t** link = &buckets[arp_hash(e->ip)];
+    while (*link && *link != e) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = e->hash_next;
+    }
+
+    if (e->live_prev) {
+        e->live_prev->live_next = e->live_next;
+    } else {
+        live_entries = e->live_next;
+    }
+    if (e->live_next) e->live_next->live_prev = e->live_prev;
+
+    drop_queue(e);
+    e->state = ARP_STATE_FREE;
+    e->hash_next = free_entries;
+    free_entries = e;
+    entry_count--;
+}
+
+// Make room when the cache is full. Entries nobody is waiting on and that
+// are not known to be reachable go first, then anything.
+static void arp_evict(void) {
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t n = 0; n < ARP_MAX_ENTRIES; n++) {
+            arp_entry_t* e = &entries[evict_hand];
+            evict_hand = (evict_hand + 1) % ARP_MAX_ENTRIES;
+
+            if (e->state == ARP_STATE_FREE) continue;
+            if (pass == 0 && (e->state == ARP_STATE_REACHABLE || e->state == ARP_STATE_INCOMPLETE)) continue;
+
+            arp_destroy(e);
+            return;
+        }
+    }
+}
+
+static arp_entry_t* arp_create(uint32_t ip, arp_state_t state) {
+    if (!free_entries) {
+        arp_evict();
+    }
+
+    arp_entry_t* e = free_entries;
+    free_entries = e->hash_next;
+
+    uint32_t bucket = arp_hash(ip);
+    memset(e, 0, sizeof(*e));
+    e->ip = ip;
+    e->state = state;
+    e->updated = tick_count;
+    e->last_used = tick_count;
+    e->hash_next = buckets[bucket];
+    buckets[bucket] = e;
+    e->live_next = live_entries;
+    if (live_entries) live_entries->live_prev = e;
+    live_entries = e;
+    entry_count++;
+    return e;
+}
+
+// Send the packets that were waiting for this entry to resolve
+static void flush_queue(arp_entry_t* e) {
+    while (e->queue_head) {
+        pbuf_t* p = e->queue_head;
+        e->queue_head = p->next;
+        p->next = NULL;
+        queued_total--;
+
+        ethernet_send_pbuf(p, e->mac, ETH_TYPE_IP);
+        pbuf_free(p);
+    }
+    e->queue_tail = NULL;
+    e->queue_len = 0;
+}
+
+static bool queue_packet(arp_entry_t* e, pbuf_t* p) {
+    // Drop the oldest packet of this neighbor rather than the newest
+    if (e->queue_len >= ARP_QUEUE_LEN) {
+        pbuf_t* oldest = e->queue_head;
+        e->queue_head = oldest->next;
+        oldest->next = NULL;
+        pbuf_free(oldest);
+        e->queue_len--;
+        queued_total--;
+        net_stat_drop(NET_LAYER_ARP, NET_DROP_QUEUE_FULL);
+    }
+
+    if (queued_total >= ARP_QUEUE_TOTAL) {
+        net_stat_drop(NET_LAYER_ARP, NET_DROP_QUEUE_FULL);
+        return false;
+    }
+
+    pbuf_ref(p);
+    p->next = NULL;
+    if (e->queue_tail) {
+        e->queue_tail->next = p;
+    } else {
+        e->queue_head = p;
+    }
+    e->queue_tail = p;
+    e->queue_len++;
+    queued_total++;
+    return true;
+}
+
+// Store a confirmed mapping and release anything waiting on it
+static void arp_confirm(arp_entry_t* e, const uint8_t mac[6]) {
+    memcpy(e->mac, mac, 6);
+    e->state = ARP_STATE_REACHABLE;
+    e->probes = 0;
+    e->updated = tick_count;
+    flush_queue(e);
+}
+
+static void send_arp(uint16_t oper, const uint8_t* dest_mac, const uint8_t* target_mac, uint32_t target_ip) {
+    pbuf_t* p = pbuf_alloc(sizeof(arp_packet_t));
+    if (!p) {
+        net_stat_drop(NET_LAYER_ARP, NET_DROP_NO_BUFFER);
+        return;
+    }
+    arp_packet_t* arp = (arp_packet_t*)p->data;
+
+    arp->htype = htons(ARP_HTYPE_ETHERNET);
+    arp->ptype = htons(ARP_PTYPE_IPV4);
+    arp->hlen = 6;
+    arp->plen = 4;
+    arp->oper = htons(oper);
+
+    ethernet_get_mac_address(arp->sha);
+    arp->spa = ip_get_address();
+    if (target_mac) {
+        memcpy(arp->tha, target_mac, 6);
+    } else {
+        memset(arp->tha, 0, 6);
+    }
+    arp->tpa = target_ip;
+
+    if (ethernet_send_pbuf(p, dest_mac, ETH_TYPE_ARP)) {
+        net_stat_tx(NET_LAYER_ARP, sizeof(arp_packet_t));
+    }
+    pbuf_free(p);
+}
+
+static void arp_input(pbuf_t* packet) {
+    if (packet->len < sizeof(arp_packet_t)) {
+        net_stat_drop(NET_LAYER_ARP, NET_DROP_TRUNCATED);
+        return;
+    }
+    net_stat_rx(NET_LAYER_ARP, packet->len);
+
+    const arp_packet_t* arp = (const arp_packet_t*)packet->data;
+
+    // Check if this is IPv4 over Ethernet
+    if (arp->htype != htons(ARP_HTYPE_ETHERNET) ||
+        arp->ptype != htons(ARP_PTYPE_IPV4) ||
+        arp->hlen != 6 ||
+        arp->plen != 4) {
+        net_stat_drop(NET_LAYER_ARP, NET_DROP_MALFORMED);
+        return;
+    }
+
+    uint32_t our_ip = ip_get_address();
+    bool for_us = arp->tpa == our_ip && our_ip != 0;
+
+    uint64_t flags = irq_save();
+
+    // Refresh what we know about the sender. New entries are only created
+    // when the packet was meant for us, so broadcast chatter can't fill the cache.
+    arp_entry_t* e = arp_find(arp->spa);
+    if (!e && for_us) {
+        e = arp_create(arp->spa, ARP_STATE_REACHABLE);
+    }
+    if (e) {
+        arp_confirm(e, arp->sha);
+    }
+
+    irq_restore(flags);
+
+    // If this is a request for our IP, send a reply
+    if (arp->oper == htons(ARP_OP_REQUEST) && for_us) {
+        send_arp(ARP_OP_REPLY, arp->sha, arp->sha, arp->spa);
+    }
+}
+
+static void arp_receive(pbuf_t* packet, const eth_frame_t* frame) {
+    (void)frame;
+    net_prof_enter(NET_LAYER_ARP);
+    arp_input(packet);
+    net_prof_exit();
+}
+
+// Age entries and retransmit requests. Only the entries in use are
+// visited, so a nearly empty cache costs next to nothing.
+static void arp_timer(void) {
+    uint64_t now = tick_count;
+
+    request_tokens += ARP_REQUEST_RATE * ARP_TIMER_INTERVAL;
+    if (request_tokens > ARP_REQUEST_BURST * 1000) {
+        request_tokens = ARP_REQUEST_BURST * 1000;
+    }
+
+    arp_entry_t* next;
+    for (arp_entry_t* e = live_entries; e; e = next) {
+        // Read first, the entry may be destroyed below
+        next = e->live_next;
+
+        switch (e->state) {
+        case ARP_STATE_INCOMPLETE:
+            if (now < e->next_probe) break;
+            if (e->probes >= ARP_MAX_PROBES) {
+                // Nobody answered, drop the waiting packets and hold off for a while
+                drop_queue(e);
+                e->state = ARP_STATE_FAILED;
+                e->updated = now;
+            } else {
+                send_arp(ARP_OP_REQUEST, broadcast_mac, NULL, e->ip);
+                e->probes++;
+                e->next_probe = now + ARP_RETRANS_TIME;
+            }
+            break;
+
+        case ARP_STATE_REACHABLE:
+            if (now - e->updated >= ARP_REACHABLE_TIME) {
+                e->state = ARP_STATE_STALE;
+                e->updated = now;
+            }
+            break;
+
+        case ARP_STATE_STALE:
+            if (now - e->last_used >= ARP_STALE_TIME) {
+                arp_destroy(e);
+            }
+            break;
+
+        case ARP_STATE_PROBE:
+            if (now < e->next_probe) break;
+            if (e->probes >= ARP_MAX_PROBES) {
+                arp_destroy(e);
+            } else {
+                send_arp(ARP_OP_REQUEST, e->mac, e->mac, e->ip);
+                e->probes++;
+                e->next_probe = now + ARP_RETRANS_TIME;
+            }
+            break;
+
+        case ARP_STATE_FAILED:
+            if (now - e->updated >= ARP_FAILED_HOLD) {
+                arp_destroy(e);
+            }
+            break;
+        }
+    }
+}
+
+void arp_init(void) {
+    memset(entries, 0, sizeof(entries));
+    memset(buckets, 0, sizeof(buckets));
+
+    free_entries = NULL;
+    for (int i = ARP_MAX_ENTRIES - 1; i >= 0; i--) {
+        entries[i].hash_next = free_entries;
+        free_entries = &entries[i];
+    }
+    live_entries = NULL;
+    entry_count = 0;
+    queued_total = 0;
+
+    ethernet_register_callback(ETH_TYPE_ARP, arp_receive);
+    timer_register_periodic(arp_timer, ARP_TIMER_INTERVAL);
+}
+
+void arp_send_request(uint32_t target_ip) {
+    send_arp(ARP_OP_REQUEST, broadcast_mac, NULL, target_ip);
+}
+
+void arp_update(uint32_t ip, const uint8_t mac[6]) {
+    uint64_t flags = irq_save();
+
+    arp_entry_t* e = arp_find(ip);
+    if (!e) {
+        e = arp_create(ip, ARP_STATE_REACHABLE);
+    }
+    arp_confirm(e, mac);
+
+    irq_restore(flags);
+}
+
+bool arp_lookup(uint32_t ip, uint8_t mac[6]) {
+    uint64_t flags = irq_save();
+
+    arp_entry_t* e = arp_find(ip);
+    bool found = e && (e->state == ARP_STATE_REACHABLE ||
+                       e->state == ARP_STATE_STALE ||
+                       e->state == ARP_STATE_PROBE);
+    if (found) {
+        memcpy(mac, e->mac, 6);
+    }
+
+    irq_restore(flags);
+    return found;
+}
+
+static bool arp_resolve_output(pbuf_t* packet, uint32_t ip) {
+    uint64_t flags = irq_save();
+
+    arp_entry_t* e = arp_find(ip);
+    if (!e || e->state == ARP_STATE_INCOMPLETE) {
+        NET_STAT_INC(NET_LAYER_ARP, misses);
+    }
+    if (!e) {
+        // Limit requests for new addresses so a flood of sends to unknown
+        // hosts can't flood the link with broadcasts
+        if (request_tokens < 1000) {
+            irq_restore(flags);
+            net_stat_drop(NET_LAYER_ARP, NET_DROP_UNRESOLVED);
+            return false;
+        }
+        request_tokens -= 1000;
+
+        e = arp_create(ip, ARP_STATE_INCOMPLETE);
+        e->probes = 1;
+        e->next_probe = tick_count + ARP_RETRANS_TIME;
+        bool queued = queue_packet(e, packet);
+        irq_restore(flags);
+
+        arp_send_request(ip);
+        return queued;
+    }
+
+    uint8_t mac[6];
+    switch (e->state) {
+    case ARP_STATE_INCOMPLETE: {
+        // A request is already out, the retransmit timer takes care of the rest
+        bool queued = queue_packet(e, packet);
+        irq_restore(flags);
+        return queued;
+    }
+
+    case ARP_STATE_FAILED:
+        irq_restore(flags);
+        net_stat_drop(NET_LAYER_ARP, NET_DROP_UNRESOLVED);
+        return false;
+
+    case ARP_STATE_STALE:
+        // Still usable, but start confirming the address in the background
+        e->state = ARP_STATE_PROBE;
+        e->probes = 0;
+        e->next_probe = tick_count;
+        break;
+
+    default:
+        break;
+    }
+
+    e->last_used = tick_count;
+    memcpy(mac, e->mac, 6);
+    irq_restore(flags);
+
+    return ethernet_send_pbuf(packet, mac, ETH_TYPE_IP);
+}
+
+bool arp_output(pbuf_t* packet, uint32_t ip) {
+    net_prof_enter(NET_LAYER_ARP);
+    bool sent = arp_resolve_output(packet, ip);
+    net_prof_exit();
+    return sent;
+}
+
+uint32_t arp_entry_count(void) {
+    return entry_count;
+}
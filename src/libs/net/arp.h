@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "e1000.h"  // For e1000_get_mac_address
+#include "../string.h"  // For memcpy
+#include "pbuf.h"
+
+bool arp_lookup(uint32_t ip, uint8_t mac[6]);
+
+#define ARP_HTYPE_ETHERNET 1
+#define ARP_PTYPE_IPV4    0x0800
+
+#define ARP_OP_REQUEST    1
+#define ARP_OP_REPLY      2
+
+// Neighbor cache sizing
+#define ARP_HASH_BITS     10
+#define ARP_HASH_SIZE     (1 << ARP_HASH_BITS)
+#define ARP_MAX_ENTRIES   4096
+
+// Neighbor cache timing, in milliseconds
+#define ARP_TIMER_INTERVAL  250     // How often entries are aged
+#define ARP_REACHABLE_TIME  30000   // A reply keeps an entry reachable this long
+#define ARP_STALE_TIME      600000  // Unused stale entries are dropped after this
+#define ARP_RETRANS_TIME    1000    // Gap between requests for the same address
+#define ARP_MAX_PROBES      3       // Requests sent before giving up
+#define ARP_FAILED_HOLD     5000    // Unresolvable addresses aren't retried for this long
+
+// Packets waiting for resolution
+#define ARP_QUEUE_LEN     8         // Per neighbor, the oldest packet is dropped first
+#define ARP_QUEUE_TOTAL   64        // Across all neighbors
+
+// Requests for new addresses, token bucket
+#define ARP_REQUEST_RATE  50        // Requests per second
+#define ARP_REQUEST_BURST 10
+
+typedef enum {
+    ARP_STATE_FREE = 0,
+    ARP_STATE_INCOMPLETE,   // Request sent, waiting for the reply
+    ARP_STATE_REACHABLE,    // Confirmed recently
+    ARP_STATE_STALE,        // Usable, but confirm again on next use
+    ARP_STATE_PROBE,        // Used while stale, unicast requests sent to confirm
+    ARP_STATE_FAILED        // No reply, packets are dropped until the hold time ends
+} arp_state_t;
+
+typedef struct {
+    uint16_t htype;           // Hardware type
+    uint16_t ptype;           // Protocol type
+    uint8_t  hlen;            // Hardware address length
+    uint8_t  plen;            // Protocol address length
+    uint16_t oper;            // Operation
+    uint8_t  sha[6];          // Sender hardware address
+    uint32_t spa;             // Sender protocol address
+    uint8_t  tha[6];          // Target hardware address
+    uint32_t tpa;             // Target protocol address
+} __attribute__((packed)) arp_packet_t;
+
+// Initialize ARP subsystem
+void arp_init(void);
+
+// Send an ARP request
+void arp_send_request(uint32_t target_ip);
+
+// Update ARP cache with new mapping
+void arp_update(uint32_t ip, const uint8_t mac[6]);
+
+// Look up MAC address for IP
+bool arp_lookup(uint32_t ip, uint8_t mac[6]);
+
+// Send an IP packet to a neighbor on the link. If the address is not resolved
+// yet the packet is queued (with its own reference) and sent as soon as the
+// reply arrives. Returns false if the packet was dropped.
+bool arp_output(pbuf_t* packet, uint32_t ip);
+
+// Entries currently in the cache
+uint32_t arp_entry_count(void);
@@ -0,0 +1,352 @@
+#include "bpf.h"
+#include "bpf_jit.h"
+#include "../interrupt.h"
+#include "../timer.h"
+#include "../string.h"
+
+static bpf_filter_t filters[BPF_MAX_FILTERS];
+static uint32_t attached = 0;
+
+// Whether an opcode is one the interpreter and the JIT know
+static bool valid_code(uint16_t code) {
+    switch (code) {
+    case BPF_LD | BPF_W | BPF_ABS:
+    case BPF_LD | BPF_H | BPF_ABS:
+    case BPF_LD | BPF_B | BPF_ABS:
+    case BPF_LD | BPF_W | BPF_IND:
+    case BPF_LD | BPF_H | BPF_IND:
+    case BPF_LD | BPF_B | BPF_IND:
+    case BPF_LD | BPF_W | BPF_LEN:
+    case BPF_LD | BPF_IMM:
+    case BPF_LD | BPF_MEM:
+    case BPF_LDX | BPF_W | BPF_IMM:
+    case BPF_LDX | BPF_W | BPF_MEM:
+    case BPF_LDX | BPF_W | BPF_LEN:
+    case BPF_LDX | BPF_B | BPF_MSH:
+    case BPF_ST:
+    case BPF_STX:
+    case BPF_ALU | BPF_NEG:
+    case BPF_JMP | BPF_JA:
+    case BPF_RET | BPF_K:
+    case BPF_RET | BPF_A:
+    case BPF_MISC | BPF_TAX:
+    case BPF_MISC | BPF_TXA:
+        return true;
+    }
+
+    uint16_t op = BPF_OP(code);
+    if (BPF_CLASS(code) == BPF_ALU && (code & ~(0xf0 | BPF_X)) == BPF_ALU) {
+        return op <= BPF_RSH || op == BPF_MOD || op == BPF_XOR;
+    }
+    if (BPF_CLASS(code) == BPF_JMP && (code & ~(0xf0 | BPF_X)) == BPF_JMP) {
+        return op >= BPF_JEQ && op <= BPF_JSET;
+    }
+    return false;
+}
+
+bool bpf_verify(const bpf_insn_t* prog, uint32_t len, const char** error) {
+    // Scratch words stored on every path into an instruction. Jumps only go
+    // forward, so one pass in order sees all predecessors first.
+    static uint16_t stored[BPF_MAXINSNS];
+
+    if (len == 0 || len > BPF_MAXINSNS) {
+        *error = "program must have 1-256 instructions";
+        return false;
+    }
+    for (uint32_t i = 0; i < len; i++) {
+        stored[i] = 0xFFFF;
+    }
+    stored[0] = 0;
+
+    for (uint32_t i = 0; i < len; i++) {
+        const bpf_insn_t* insn = &prog[i];
+        uint16_t code = insn->code;
+        uint16_t mem = stored[i];
+
+        if (!valid_code(code)) {
+            *error = "unknown opcode";
+            return false;
+        }
+
+        switch (BPF_CLASS(code)) {
+        case BPF_LD:
+        case BPF_LDX:
+            if (BPF_MODE(code) == BPF_MEM) {
+                if (insn->k >= BPF_MEMWORDS) {
+                    *error = "scratch memory index out of range";
+                    return false;
+                }
+                if (!(mem & (1 << insn->k))) {
+                    *error = "scratch memory loaded before it is stored";
+                    return false;
+                }
+            }
+            break;
+        case BPF_ST:
+        case BPF_STX:
+            if (insn->k >= BPF_MEMWORDS) {
+                *error = "scratch memory index out of range";
+                return false;
+            }
+            mem |= 1 << insn->k;
+            break;
+        case BPF_ALU:
+            if (BPF_SRC(code) == BPF_K && insn->k == 0 &&
+                (BPF_OP(code) == BPF_DIV || BPF_OP(code) == BPF_MOD)) {
+                *error = "division by zero";
+                return false;
+            }
+            if (BPF_SRC(code) == BPF_K && insn->k >= 32 &&
+                (BPF_OP(code) == BPF_LSH || BPF_OP(code) == BPF_RSH)) {
+                *error = "shift by 32 or more";
+                return false;
+            }
+            break;
+        case BPF_JMP:
+            if (BPF_OP(code) == BPF_JA) {
+                if (insn->k >= len - i - 1) {
+                    *error = "jump out of the program";
+                    return false;
+                }
+                stored[i + 1 + insn->k] &= mem;
+                continue;  // Nothing falls through
+            }
+            if (i + 1 + insn->jt >= len || i + 1 + insn->jf >= len) {
+                *error = "jump out of the program";
+                return false;
+            }
+            stored[i + 1 + insn->jt] &= mem;
+            stored[i + 1 + insn->jf] &= mem;
+            continue;
+        case BPF_RET:
+            continue;
+        }
+
+        if (i + 1 == len) {
+            *error = "program does not end in RET";
+            return false;
+        }
+        stored[i + 1] &= mem;
+    }
+    return true;
+}
+
+// Load size bytes in network byte order at offset, false past the end
+static inline bool load(const uint8_t* packet, uint32_t length, uint64_t offset,
+                        uint32_t size, uint32_t* value) {
+    if (offset + size > length) return false;
+
+    const uint8_t* p = packet + offset;
+    if (size == 4) {
+        *value = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+    } else if (size == 2) {
+        *value = ((uint32_t)p[0] << 8) | p[1];
+    } else {
+        *value = p[0];
+    }
+    return true;
+}
+
+static inline uint32_t load_size(uint16_t code) {
+    return BPF_SIZE(code) == BPF_W ? 4 : BPF_SIZE(code) == BPF_H ? 2 : 1;
+}
+
+uint32_t bpf_run(const bpf_insn_t* prog, const uint8_t* packet, uint32_t length) {
+    uint32_t a = 0;
+    uint32_t x = 0;
+    uint32_t mem[BPF_MEMWORDS];
+
+    for (const bpf_insn_t* pc = prog; ; pc++) {
+        uint32_t k = pc->k;
+        uint16_t code = pc->code;
+
+        switch (BPF_CLASS(code)) {
+        case BPF_LD:
+            switch (BPF_MODE(code)) {
+            case BPF_ABS:
+                if (!load(packet, length, k, load_size(code), &a)) return 0;
+                break;
+            case BPF_IND:
+                if (!load(packet, length, (uint64_t)x + k, load_size(code), &a)) return 0;
+                break;
+            case BPF_LEN:
+                a = length;
+                break;
+            case BPF_IMM:
+                a = k;
+                break;
+            case BPF_MEM:
+                a = mem[k];
+                break;
+            }
+            break;
+
+        case BPF_LDX:
+            switch (BPF_MODE(code)) {
+            case BPF_IMM:
+                x = k;
+                break;
+            case BPF_MEM:
+                x = mem[k];
+                break;
+            case BPF_LEN:
+                x = length;
+                break;
+            case BPF_MSH:
+                // IP header length from the version/IHL byte
+                if (!load(packet, length, k, 1, &x)) return 0;
+                x = (x & 0x0F) << 2;
+                break;
+            }
+            break;
+
+        case BPF_ST:
+            mem[k] = a;
+            break;
+
+        case BPF_STX:
+            mem[k] = x;
+            break;
+
+        case BPF_ALU: {
+            uint32_t operand = BPF_SRC(code) == BPF_X ? x : k;
+            switch (BPF_OP(code)) {
+            case BPF_ADD: a += operand; break;
+            case BPF_SUB: a -= operand; break;
+            case BPF_MUL: a *= operand; break;
+            case BPF_OR:  a |= operand; break;
+            case BPF_AND: a &= operand; break;
+            case BPF_XOR: a ^= operand; break;
+            case BPF_LSH: a <<= operand & 31; break;   // The shift count is masked like on x86
+            case BPF_RSH: a >>= operand & 31; break;
+            case BPF_NEG: a = -a; break;
+            case BPF_DIV:
+                if (operand == 0) return 0;
+                a /= operand;
+                break;
+            case BPF_MOD:
+                if (operand == 0) return 0;
+                a %= operand;
+                break;
+            }
+            break;
+        }
+
+        case BPF_JMP: {
+            if (BPF_OP(code) == BPF_JA) {
+                pc += k;
+                break;
+            }
+            uint32_t operand = BPF_SRC(code) == BPF_X ? x : k;
+            bool taken = false;
+            switch (BPF_OP(code)) {
+            case BPF_JEQ:  taken = a == operand; break;
+            case BPF_JGT:  taken = a > operand; break;
+            case BPF_JGE:  taken = a >= operand; break;
+            case BPF_JSET: taken = (a & operand) != 0; break;
+            }
+            pc += taken ? pc->jt : pc->jf;
+            break;
+        }
+
+        case BPF_RET:
+            return BPF_RVAL(code) == BPF_A ? a : k;
+
+        case BPF_MISC:
+            if (BPF_MISCOP(code) == BPF_TAX) {
+                x = a;
+            } else {
+                a = x;
+            }
+            break;
+        }
+    }
+}
+
+int bpf_attach(const bpf_insn_t* prog, uint32_t len, bool use_jit, const char** error) {
+    if (!bpf_verify(prog, len, error)) return -1;
+
+    int id = -1;
+    for (int i = 0; i < BPF_MAX_FILTERS && id < 0; i++) {
+        if (!filters[i].used) id = i;
+    }
+    if (id < 0) {
+        *error = "all filter slots are in use";
+        return -1;
+    }
+
+    // The slot is not in use, so nothing runs its code while it is compiled
+    bpf_filter_t* f = &filters[id];
+    memset(f, 0, sizeof(*f));
+    memcpy(f->insns, prog, len * sizeof(bpf_insn_t));
+    f->len = len;
+    f->jit = bpf_jit_compile(f->insns, len, id);
+    f->use_jit = use_jit && f->jit;
+
+    uint64_t flags = irq_save();
+    f->used = true;
+    attached++;
+    irq_restore(flags);
+    return id;
+}
+
+bool bpf_detach(int id) {
+    if (id < 0 || id >= BPF_MAX_FILTERS || !filters[id].used) return false;
+
+    uint64_t flags = irq_save();
+    filters[id].used = false;
+    attached--;
+    irq_restore(flags);
+    return true;
+}
+
+bool bpf_set_jit(int id, bool use_jit) {
+    if (id < 0 || id >= BPF_MAX_FILTERS || !filters[id].used) return false;
+    if (use_jit && !filters[id].jit) return false;
+    filters[id].use_jit = use_jit;
+    return true;
+}
+
+const bpf_filter_t* bpf_get_filter(int id) {
+    if (id < 0 || id >= BPF_MAX_FILTERS || !filters[id].used) return NULL;
+    return &filters[id];
+}
+
+void bpf_reset_stats(void) {
+    uint64_t flags = irq_save();
+    for (int i = 0; i < BPF_MAX_FILTERS; i++) {
+        bpf_filter_t* f = &filters[i];
+        f->packets = f->dropped = 0;
+        f->interp_runs = f->interp_cycles = 0;
+        f->jit_runs = f->jit_cycles = 0;
+    }
+    irq_restore(flags);
+}
+
+bool bpf_filter_frame(const pbuf_t* p) {
+    if (!attached) return true;
+
+    for (int i = 0; i < BPF_MAX_FILTERS; i++) {
+        bpf_filter_t* f = &filters[i];
+        if (!f->used) continue;
+
+        uint64_t start = rdtsc();
+        uint32_t result;
+        if (f->use_jit) {
+            result = f->jit(p->data, p->len);
+            f->jit_cycles += rdtsc() - start;
+            f->jit_runs++;
+        } else {
+            result = bpf_run(f->insns, p->data, p->len);
+            f->interp_cycles += rdtsc() - start;
+            f->interp_runs++;
+        }
+
+        f->packets++;
+        if (result == 0) {
+            f->dropped++;
+            return false;
+        }
+    }
+    return true;
+}
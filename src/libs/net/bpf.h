@@ -0,0 +1,126 @@
+#pragma once
+
+#include "../types.h"
+#include "pbuf.h"
+
+// Classic BPF packet filters. Programs use the encoding of <linux/filter.h>
+// and tcpdump -dd, so existing filters can be loaded as they are. Attached
+// filters see every received frame from the ethernet header on, before GRO
+// and the protocol demux, and a frame is dropped as soon as one returns 0.
+#define BPF_MAXINSNS     256     // Instructions per program
+#define BPF_MEMWORDS     16      // Scratch memory words M[]
+#define BPF_MAX_FILTERS  8
+
+// Instruction classes
+#define BPF_CLASS(code)  ((code) & 0x07)
+#define BPF_LD           0x00
+#define BPF_LDX          0x01
+#define BPF_ST           0x02
+#define BPF_STX          0x03
+#define BPF_ALU          0x04
+#define BPF_JMP          0x05
+#define BPF_RET          0x06
+#define BPF_MISC         0x07
+
+// Load size
+#define BPF_SIZE(code)   ((code) & 0x18)
+#define BPF_W            0x00
+#define BPF_H            0x08
+#define BPF_B            0x10
+
+// Load mode
+#define BPF_MODE(code)   ((code) & 0xe0)
+#define BPF_IMM          0x00
+#define BPF_ABS          0x20
+#define BPF_IND          0x40
+#define BPF_MEM          0x60
+#define BPF_LEN          0x80
+#define BPF_MSH          0xa0
+
+// ALU and jump operations
+#define BPF_OP(code)     ((code) & 0xf0)
+#define BPF_ADD          0x00
+#define BPF_SUB          0x10
+#define BPF_MUL          0x20
+#define BPF_DIV          0x30
+#define BPF_OR           0x40
+#define BPF_AND          0x50
+#define BPF_LSH          0x60
+#define BPF_RSH          0x70
+#define BPF_NEG          0x80
+#define BPF_MOD          0x90
+#define BPF_XOR          0xa0
+#define BPF_JA           0x00
+#define BPF_JEQ          0x10
+#define BPF_JGT          0x20
+#define BPF_JGE          0x30
+#define BPF_JSET         0x40
+
+// Operand source, constant k or register X
+#define BPF_SRC(code)    ((code) & 0x08)
+#define BPF_K            0x00
+#define BPF_X            0x08
+
+// Return value source
+#define BPF_RVAL(code)   ((code) & 0x18)
+#define BPF_A            0x10
+
+// Register moves
+#define BPF_MISCOP(code) ((code) & 0xf8)
+#define BPF_TAX          0x00
+#define BPF_TXA          0x80
+
+typedef struct {
+    uint16_t code;
+    uint8_t jt;          // Instructions to skip when the condition holds
+    uint8_t jf;          // and when it doesn't
+    uint32_t k;
+} bpf_insn_t;
+
+// A compiled program, called with the frame and its length
+typedef uint32_t (*bpf_jit_func_t)(const uint8_t* packet, uint32_t length);
+
+typedef struct {
+    bool used;
+    bool use_jit;            // Run the compiled code rather than the interpreter
+    uint16_t len;
+    bpf_insn_t insns[BPF_MAXINSNS];
+    bpf_jit_func_t jit;      // NULL if the program didn't fit the code space
+    uint64_t packets;        // Frames the filter ran on
+    uint64_t dropped;        // Frames it returned 0 for
+    uint64_t interp_runs;    // Runs and their TSC cycles by path
+    uint64_t interp_cycles;
+    uint64_t jit_runs;
+    uint64_t jit_cycles;
+} bpf_filter_t;
+
+// Check that a program can be run safely: known opcodes only, jumps only
+// forward and inside the program, a RET at the end, no division by a zero
+// constant or shift past 31, scratch memory indices in range and every
+// word stored on all paths before it is loaded. Forward jumps make every
+// program terminate within len instructions, and packet loads are checked
+// against the length when they run. On failure error says why.
+bool bpf_verify(const bpf_insn_t* prog, uint32_t len, const char** error);
+
+// Interpret a verified program over a packet. A load past the end of the
+// packet or a division by a zero X ends it with 0.
+uint32_t bpf_run(const bpf_insn_t* prog, const uint8_t* packet, uint32_t length);
+
+// Verify, compile and attach a program, returns its id or -1 with error set
+int bpf_attach(const bpf_insn_t* prog, uint32_t len, bool use_jit, const char** error);
+
+// Remove a filter, false if the id is not attached
+bool bpf_detach(int id);
+
+// Switch a filter between the JIT and the interpreter. Returns false if
+// the id is not attached or it has no compiled code.
+bool bpf_set_jit(int id, bool use_jit);
+
+// Attached filter by id, NULL if there is none
+const bpf_filter_t* bpf_get_filter(int id);
+
+void bpf_reset_stats(void);
+
+// Run the attached filters over a received frame (p->data at the ethernet
+// header). Returns false if one of them drops it.
+bool bpf_filter_frame(const pbuf_t* p);
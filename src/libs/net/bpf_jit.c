@@ -0,0 +1,343 @@
+#include "bpf_jit.h"
+#include "../string.h"
+
+// Classic BPF to x86-64. A lives in eax, X in ecx, the packet pointer and
+// length stay in rdi and esi where the caller passes them, and M[] is on
+// the stack. edx and r8 are scratch. Every jump is encoded with a 32 bit
+// displacement, so instruction sizes don't depend on their targets and two
+// passes do: the first one only measures, the second writes the code.
+
+// Paging leaves NX off, so code in .bss can be run as it is
+static uint8_t jit_arena[BPF_MAX_FILTERS][BPF_JIT_SLOT_SIZE] __attribute__((aligned(16)));
+
+#define FRAME_SIZE  (BPF_MEMWORDS * 4 + 8)   // M[] and the rest to keep rsp 16 byte aligned
+
+// x86 condition codes for jcc
+#define CC_B   0x2
+#define CC_AE  0x3
+#define CC_E   0x4
+#define CC_NE  0x5
+#define CC_BE  0x6
+#define CC_A   0x7
+
+typedef struct {
+    uint8_t* code;               // NULL while measuring
+    uint32_t pos;
+    uint32_t addrs[BPF_MAXINSNS + 1];   // Code offset of every instruction
+    uint32_t exit0;              // Returns 0
+    uint32_t epilogue;           // Returns eax
+} jit_t;
+
+static void emit(jit_t* jit, const uint8_t* bytes, uint32_t n) {
+    if (jit->code && jit->pos + n <= BPF_JIT_SLOT_SIZE) {
+        memcpy(jit->code + jit->pos, bytes, n);
+    }
+    jit->pos += n;
+}
+
+#define EMIT(jit, ...) do {                        \
+    const uint8_t bytes_[] = { __VA_ARGS__ };      \
+    emit(jit, bytes_, sizeof(bytes_));             \
+} while (0)
+
+static void emit32(jit_t* jit, uint32_t value) {
+    EMIT(jit, value, value >> 8, value >> 16, value >> 24);
+}
+
+// Opcode bytes followed by a rel32 to target
+static void emit_jump(jit_t* jit, const uint8_t* opcode, uint32_t n, uint32_t target) {
+    emit(jit, opcode, n);
+    emit32(jit, target - (jit->pos + 4));
+}
+
+static void jmp(jit_t* jit, uint32_t target) {
+    const uint8_t op[] = { 0xE9 };
+    emit_jump(jit, op, sizeof(op), target);
+}
+
+static void jcc(jit_t* jit, uint8_t cc, uint32_t target) {
+    const uint8_t op[] = { 0x0F, 0x80 | cc };
+    emit_jump(jit, op, sizeof(op), target);
+}
+
+// Leave with 0 unless offset k + size is inside the packet
+static void check_abs(jit_t* jit, uint32_t k, uint32_t size) {
+    if (k > 0xFFFF) {
+        // No frame is that long
+        jmp(jit, jit->exit0);
+        return;
+    }
+    EMIT(jit, 0x81, 0xFE);                  // cmp esi, k + size
+    emit32(jit, k + size);
+    jcc(jit, CC_B, jit->exit0);
+}
+
+// Byte swap the loaded value to host order
+static void swap(jit_t* jit, uint32_t size) {
+    if (size == 4) {
+        EMIT(jit, 0x0F, 0xC8);              // bswap eax
+    } else if (size == 2) {
+        EMIT(jit, 0x66, 0xC1, 0xC0, 0x08);  // rol ax, 8
+    }
+}
+
+static uint32_t load_size(uint16_t code) {
+    return BPF_SIZE(code) == BPF_W ? 4 : BPF_SIZE(code) == BPF_H ? 2 : 1;
+}
+
+static void emit_load(jit_t* jit, const bpf_insn_t* insn) {
+    uint32_t size = load_size(insn->code);
+
+    if (BPF_MODE(insn->code) == BPF_ABS) {
+        check_abs(jit, insn->k, size);
+        if (insn->k > 0xFFFF) return;
+        if (size == 4) {
+            EMIT(jit, 0x8B, 0x87);              // mov eax, [rdi + k]
+        } else if (size == 2) {
+            EMIT(jit, 0x0F, 0xB7, 0x87);        // movzx eax, word [rdi + k]
+        } else {
+            EMIT(jit, 0x0F, 0xB6, 0x87);        // movzx eax, byte [rdi + k]
+        }
+        emit32(jit, insn->k);
+        swap(jit, size);
+        return;
+    }
+
+    // X + k can wrap in 32 bits, so the offset is formed in 64
+    EMIT(jit, 0x89, 0xCA);                      // mov edx, ecx
+    EMIT(jit, 0x41, 0xB8);                      // mov r8d, k
+    emit32(jit, insn->k);
+    EMIT(jit, 0x4C, 0x01, 0xC2);                // add rdx, r8
+    EMIT(jit, 0x4C, 0x8D, 0x42, size);          // lea r8, [rdx + size]
+    EMIT(jit, 0x49, 0x39, 0xF0);                // cmp r8, rsi
+    jcc(jit, CC_A, jit->exit0);
+    if (size == 4) {
+        EMIT(jit, 0x8B, 0x04, 0x17);            // mov eax, [rdi + rdx]
+    } else if (size == 2) {
+        EMIT(jit, 0x0F, 0xB7, 0x04, 0x17);      // movzx eax, word [rdi + rdx]
+    } else {
+        EMIT(jit, 0x0F, 0xB6, 0x04, 0x17);      // movzx eax, byte [rdi + rdx]
+    }
+    swap(jit, size);
+}
+
+static void emit_alu(jit_t* jit, const bpf_insn_t* insn) {
+    bool x = BPF_SRC(insn->code) == BPF_X;
+    uint8_t op;
+
+    switch (BPF_OP(insn->code)) {
+    case BPF_ADD: op = 0x01; break;
+    case BPF_SUB: op = 0x29; break;
+    case BPF_OR:  op = 0x09; break;
+    case BPF_AND: op = 0x21; break;
+    case BPF_XOR: op = 0x31; break;
+    case BPF_MUL:
+        if (x) {
+            EMIT(jit, 0x0F, 0xAF, 0xC1);        // imul eax, ecx
+        } else {
+            EMIT(jit, 0x69, 0xC0);              // imul eax, eax, k
+            emit32(jit, insn->k);
+        }
+        return;
+    case BPF_LSH:
+    case BPF_RSH: {
+        uint8_t modrm = BPF_OP(insn->code) == BPF_LSH ? 0xE0 : 0xE8;
+        if (x) {
+            EMIT(jit, 0xD3, modrm);             // shl/shr eax, cl
+        } else {
+            EMIT(jit, 0xC1, modrm, insn->k);    // shl/shr eax, k
+        }
+        return;
+    }
+    case BPF_DIV:
+    case BPF_MOD:
+        if (x) {
+            EMIT(jit, 0x85, 0xC9);              // test ecx, ecx
+            jcc(jit, CC_E, jit->exit0);
+            EMIT(jit, 0x31, 0xD2);              // xor edx, edx
+            EMIT(jit, 0xF7, 0xF1);              // div ecx
+        } else {
+            EMIT(jit, 0x41, 0xB8);              // mov r8d, k
+            emit32(jit, insn->k);
+            EMIT(jit, 0x31, 0xD2);              // xor edx, edx
+            EMIT(jit, 0x41, 0xF7, 0xF0);        // div r8d
+        }
+        if (BPF_OP(insn->code) == BPF_MOD) {
+            EMIT(jit, 0x89, 0xD0);              // mov eax, edx
+        }
+        return;
+    default:
+        EMIT(jit, 0xF7, 0xD8);                  // neg eax
+        return;
+    }
+
+    if (x) {
+        EMIT(jit, op, 0xC8);                    // op eax, ecx
+    } else {
+        // The eax forms of add, or, and, sub and xor are op + 4 with imm32
+        EMIT(jit, op + 4);
+        emit32(jit, insn->k);
+    }
+}
+
+static void emit_jmp(jit_t* jit, const bpf_insn_t* insn, uint32_t i) {
+    uint32_t jt = jit->addrs[i + 1 + insn->jt];
+    uint32_t jf = jit->addrs[i + 1 + insn->jf];
+    bool x = BPF_SRC(insn->code) == BPF_X;
+    uint8_t cc;
+
+    if (insn->jt == insn->jf) {
+        if (insn->jt) jmp(jit, jt);
+        return;
+    }
+
+    if (BPF_OP(insn->code) == BPF_JSET) {
+        if (x) {
+            EMIT(jit, 0x85, 0xC8);              // test eax, ecx
+        } else {
+            EMIT(jit, 0xA9);                    // test eax, k
+            emit32(jit, insn->k);
+        }
+        cc = CC_NE;
+    } else {
+        if (x) {
+            EMIT(jit, 0x39, 0xC8);              // cmp eax, ecx
+        } else {
+            EMIT(jit, 0x3D);                    // cmp eax, k
+            emit32(jit, insn->k);
+        }
+        cc = BPF_OP(insn->code) == BPF_JEQ ? CC_E : BPF_OP(insn->code) == BPF_JGT ? CC_A : CC_AE;
+    }
+
+    // Whichever branch goes to the next instruction falls through. Flipping
+    // the lowest bit of a condition code gives its opposite.
+    if (insn->jt == 0) {
+        jcc(jit, cc ^ 1, jf);
+    } else {
+        jcc(jit, cc, jt);
+        if (insn->jf) jmp(jit, jf);
+    }
+}
+
+static void emit_insn(jit_t* jit, const bpf_insn_t* insn, uint32_t i, uint32_t len) {
+    uint8_t mem = insn->k * 4;
+
+    switch (BPF_CLASS(insn->code)) {
+    case BPF_LD:
+        switch (BPF_MODE(insn->code)) {
+        case BPF_IMM:
+            EMIT(jit, 0xB8);                    // mov eax, k
+            emit32(jit, insn->k);
+            break;
+        case BPF_MEM:
+            EMIT(jit, 0x8B, 0x44, 0x24, mem);   // mov eax, [rsp + 4k]
+            break;
+        case BPF_LEN:
+            EMIT(jit, 0x89, 0xF0);              // mov eax, esi
+            break;
+        default:
+            emit_load(jit, insn);
+            break;
+        }
+        break;
+
+    case BPF_LDX:
+        switch (BPF_MODE(insn->code)) {
+        case BPF_IMM:
+            EMIT(jit, 0xB9);                    // mov ecx, k
+            emit32(jit, insn->k);
+            break;
+        case BPF_MEM:
+            EMIT(jit, 0x8B, 0x4C, 0x24, mem);   // mov ecx, [rsp + 4k]
+            break;
+        case BPF_LEN:
+            EMIT(jit, 0x89, 0xF1);              // mov ecx, esi
+            break;
+        case BPF_MSH:
+            check_abs(jit, insn->k, 1);
+            if (insn->k > 0xFFFF) break;
+            EMIT(jit, 0x0F, 0xB6, 0x8F);        // movzx ecx, byte [rdi + k]
+            emit32(jit, insn->k);
+            EMIT(jit, 0x83, 0xE1, 0x0F);        // and ecx, 0xf
+            EMIT(jit, 0xC1, 0xE1, 0x02);        // shl ecx, 2
+            break;
+        }
+        break;
+
+    case BPF_ST:
+        EMIT(jit, 0x89, 0x44, 0x24, mem);       // mov [rsp + 4k], eax
+        break;
+
+    case BPF_STX:
+        EMIT(jit, 0x89, 0x4C, 0x24, mem);       // mov [rsp + 4k], ecx
+        break;
+
+    case BPF_ALU:
+        emit_alu(jit, insn);
+        break;
+
+    case BPF_JMP:
+        if (BPF_OP(insn->code) == BPF_JA) {
+            if (insn->k) jmp(jit, jit->addrs[i + 1 + insn->k]);
+        } else {
+            emit_jmp(jit, insn, i);
+        }
+        break;
+
+    case BPF_RET:
+        if (BPF_RVAL(insn->code) == BPF_K) {
+            EMIT(jit, 0xB8);                    // mov eax, k
+            emit32(jit, insn->k);
+        }
+        if (i + 1 < len) jmp(jit, jit->epilogue);
+        break;
+
+    case BPF_MISC:
+        if (BPF_MISCOP(insn->code) == BPF_TAX) {
+            EMIT(jit, 0x89, 0xC1);              // mov ecx, eax
+        } else {
+            EMIT(jit, 0x89, 0xC8);              // mov eax, ecx
+        }
+        break;
+    }
+}
+
+static void emit_program(jit_t* jit, const bpf_insn_t* prog, uint32_t len) {
+    jit->pos = 0;
+    EMIT(jit, 0x48, 0x83, 0xEC, FRAME_SIZE);    // sub rsp, FRAME_SIZE
+    EMIT(jit, 0x89, 0xF6);                      // mov esi, esi
+    EMIT(jit, 0x31, 0xC0);                      // xor eax, eax
+    EMIT(jit, 0x31, 0xC9);                      // xor ecx, ecx
+
+    for (uint32_t i = 0; i < len; i++) {
+        jit->addrs[i] = jit->pos;
+        emit_insn(jit, &prog[i], i, len);
+    }
+    jit->addrs[len] = jit->pos;
+
+    // The last instruction is a RET, which falls through to the epilogue
+    jit->epilogue = jit->pos;
+    EMIT(jit, 0x48, 0x83, 0xC4, FRAME_SIZE);    // add rsp, FRAME_SIZE
+    EMIT(jit, 0xC3);                            // ret
+
+    jit->exit0 = jit->pos;
+    EMIT(jit, 0x31, 0xC0);                      // xor eax, eax
+    EMIT(jit, 0x48, 0x83, 0xC4, FRAME_SIZE);    // add rsp, FRAME_SIZE
+    EMIT(jit, 0xC3);                            // ret
+}
+
+bpf_jit_func_t bpf_jit_compile(const bpf_insn_t* prog, uint32_t len, int slot) {
+    static jit_t jit;
+
+    if (slot < 0 || slot >= BPF_MAX_FILTERS || len == 0 || len > BPF_MAXINSNS) return NULL;
+
+    // The first pass finds where every instruction and the exits start, the
+    // second jumps to them
+    jit.code = NULL;
+    emit_program(&jit, prog, len);
+    if (jit.pos > BPF_JIT_SLOT_SIZE) return NULL;
+
+    jit.code = jit_arena[slot];
+    emit_program(&jit, prog, len);
+    return (bpf_jit_func_t)(uintptr_t)jit.code;
+}
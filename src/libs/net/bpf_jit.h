@@ -0,0 +1,11 @@
+#pragma once
+
+#include "bpf.h"
+
+// Code space of one filter. The longest instruction takes about 30 bytes,
+// so every program of BPF_MAXINSNS fits.
+#define BPF_JIT_SLOT_SIZE 8192
+
+// Compile a verified program to x86-64 in the code slot of a filter id,
+// replacing what was there. Returns NULL if it doesn't fit.
+bpf_jit_func_t bpf_jit_compile(const bpf_insn_t* prog, uint32_t len, int slot);
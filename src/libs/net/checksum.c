@@ -0,0 +1,172 @@
+#include "checksum.h"
+#include "ip.h"
+
+// Unaligned loads and stores are cheap on x86, these let the compiler emit them
+typedef uint64_t __attribute__((may_alias, aligned(1))) unaligned_u64;
+typedef uint32_t __attribute__((may_alias, aligned(1))) unaligned_u32;
+typedef uint16_t __attribute__((may_alias, aligned(1))) unaligned_u16;
+
+// Add a 64-bit word as two 32-bit halves. The 64-bit accumulator then has
+// room for gigabytes of data before it could overflow, so carries are folded
+// once at the end instead of after every add.
+#define ADD64(acc, w) ((acc) += ((w) & 0xFFFFFFFF) + ((w) >> 32))
+
+// Fold a 64-bit accumulator down to a 32-bit partial sum
+static inline uint32_t fold64(uint64_t acc) {
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    acc = (acc & 0xFFFFFFFF) + (acc >> 32);
+    return (uint32_t)acc;
+}
+
+// Sum of the trailing odd byte. In network order it is the high byte of a
+// 16-bit word padded with zero, build that word in memory so the result is
+// right regardless of host byte order.
+static inline uint16_t tail_word(uint8_t byte) {
+    uint8_t word[2] = {byte, 0};
+    return *(unaligned_u16*)word;
+}
+
+uint32_t csum_partial(const void* data, size_t length, uint32_t sum) {
+    const uint8_t* ptr = (const uint8_t*)data;
+    uint64_t acc = sum;
+
+    // 32 bytes per iteration
+    while (length >= 32) {
+        uint64_t w0 = ((const unaligned_u64*)ptr)[0];
+        uint64_t w1 = ((const unaligned_u64*)ptr)[1];
+        uint64_t w2 = ((const unaligned_u64*)ptr)[2];
+        uint64_t w3 = ((const unaligned_u64*)ptr)[3];
+        ADD64(acc, w0);
+        ADD64(acc, w1);
+        ADD64(acc, w2);
+        ADD64(acc, w3);
+        ptr += 32;
+        length -= 32;
+    }
+
+    while (length >= 8) {
+        uint64_t w = *(const unaligned_u64*)ptr;
+        ADD64(acc, w);
+        ptr += 8;
+        length -= 8;
+    }
+
+    if (length >= 4) {
+        acc += *(const unaligned_u32*)ptr;
+        ptr += 4;
+        length -= 4;
+    }
+
+    if (length >= 2) {
+        acc += *(const unaligned_u16*)ptr;
+        ptr += 2;
+        length -= 2;
+    }
+
+    if (length > 0) {
+        acc += tail_word(*ptr);
+    }
+
+    return fold64(acc);
+}
+
+uint32_t csum_partial_copy(void* dest, const void* src, size_t length, uint32_t sum) {
+    uint8_t* out = (uint8_t*)dest;
+    const uint8_t* in = (const uint8_t*)src;
+    uint64_t acc = sum;
+
+    // 32 bytes per iteration, each word is summed while it is in a register
+    while (length >= 32) {
+        uint64_t w0 = ((const unaligned_u64*)in)[0];
+        uint64_t w1 = ((const unaligned_u64*)in)[1];
+        uint64_t w2 = ((const unaligned_u64*)in)[2];
+        uint64_t w3 = ((const unaligned_u64*)in)[3];
+        ((unaligned_u64*)out)[0] = w0;
+        ((unaligned_u64*)out)[1] = w1;
+        ((unaligned_u64*)out)[2] = w2;
+        ((unaligned_u64*)out)[3] = w3;
+        ADD64(acc, w0);
+        ADD64(acc, w1);
+        ADD64(acc, w2);
+        ADD64(acc, w3);
+        in += 32;
+        out += 32;
+        length -= 32;
+    }
+
+    while (length >= 8) {
+        uint64_t w = *(const unaligned_u64*)in;
+        *(unaligned_u64*)out = w;
+        ADD64(acc, w);
+        in += 8;
+        out += 8;
+        length -= 8;
+    }
+
+    if (length >= 4) {
+        uint32_t w = *(const unaligned_u32*)in;
+        *(unaligned_u32*)out = w;
+        acc += w;
+        in += 4;
+        out += 4;
+        length -= 4;
+    }
+
+    if (length >= 2) {
+        uint16_t w = *(const unaligned_u16*)in;
+        *(unaligned_u16*)out = w;
+        acc += w;
+        in += 2;
+        out += 2;
+        length -= 2;
+    }
+
+    if (length > 0) {
+        *out = *in;
+        acc += tail_word(*in);
+    }
+
+    return fold64(acc);
+}
+
+uint32_t csum_pseudo_header(uint32_t src_ip, uint32_t dest_ip, uint8_t protocol, uint16_t length) {
+    // Zero byte + protocol and the length, as 16-bit words in network order
+    uint8_t words[4] = {0, protocol, (uint8_t)(length >> 8), (uint8_t)length};
+
+    uint64_t acc = (uint64_t)src_ip + dest_ip + *(unaligned_u32*)words;
+    return fold64(acc);
+}
+
+void csum_tx_fallback(pbuf_t* p) {
+    if (p->flags & PBUF_TX_IP_CSUM) {
+        uint8_t* ip = p->head + p->l3_start;
+        uint16_t header_length = (ip[0] & 0x0F) * 4;
+        unaligned_u16* check = (unaligned_u16*)(ip + 10);
+
+        *check = 0;
+        *check = inet_checksum(ip, header_length);
+    }
+
+    if (p->flags & PBUF_TX_L4_CSUM) {
+        // The checksum field already holds the seed (pseudo header sum or
+        // zero), so summing over it gives the final value just like the NIC
+        uint8_t* start = p->head + p->csum_start;
+        size_t length = (p->data + p->len) - start;
+        unaligned_u16* check = (unaligned_u16*)(start + p->csum_offset);
+        uint32_t sum = csum_partial(start, length, 0);
+
+        // A fragment that starts on an odd byte has its bytes in the other
+        // halves of the 16-bit words, which swaps its folded sum
+        if (p->frag_len) {
+            uint16_t frag = (uint16_t)~csum_fold(csum_partial(p->frag, p->frag_len, 0));
+            sum = (uint16_t)~csum_fold(sum) + (uint32_t)(length & 1 ? __builtin_bswap16(frag) : frag);
+        }
+        uint16_t result = csum_fold(sum);
+
+        // UDP sends a zero checksum as all ones, zero means there is none
+        if (result == 0 && p->head[p->l3_start + 9] == IP_PROTOCOL_UDP) result = 0xFFFF;
+        *check = result;
+    }
+
+    p->flags &= ~(PBUF_TX_IP_CSUM | PBUF_TX_L4_CSUM);
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include "../types.h"
+#include "pbuf.h"
+
+// Internet checksum (RFC 1071) helpers shared by IP, ICMP, UDP and TCP.
+//
+// A partial sum is an unfolded 32-bit one's complement accumulator. Partial
+// sums of consecutive chunks can be added together as long as every chunk
+// except the last one has an even length. All values are in network byte
+// order as they sit in the packet, so no swapping is needed anywhere.
+
+// Add length bytes at data to a partial sum
+uint32_t csum_partial(const void* data, size_t length, uint32_t sum);
+
+// Copy length bytes from src to dest and add them to a partial sum in the same pass
+uint32_t csum_partial_copy(void* dest, const void* src, size_t length, uint32_t sum);
+
+// Fold a partial sum to 16 bits and complement it, ready to store in a header
+static inline uint16_t csum_fold(uint32_t sum) {
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Checksum of a whole buffer
+static inline uint16_t inet_checksum(const void* data, size_t length) {
+    return csum_fold(csum_partial(data, length, 0));
+}
+
+// Partial sum of the IPv4 pseudo header used by UDP and TCP.
+// Addresses are in network byte order, length in host byte order.
+uint32_t csum_pseudo_header(uint32_t src_ip, uint32_t dest_ip, uint8_t protocol, uint16_t length);
+
+// Checksum fields sit in packed headers and may be unaligned
+typedef uint16_t __attribute__((may_alias, aligned(1))) csum_field_t;
+
+// Update a stored checksum after a 16-bit word it covers changed from
+// old_value to new_value (RFC 1624, eqn. 3). Both words as stored in the packet.
+static inline void csum_replace16(void* check, uint16_t old_value, uint16_t new_value) {
+    csum_field_t* field = (csum_field_t*)check;
+    uint32_t sum = (uint16_t)~*field;
+    sum += (uint16_t)~old_value;
+    sum += new_value;
+    *field = csum_fold(sum);
+}
+
+// Same as csum_replace16 for a 32-bit field such as an address
+static inline void csum_replace32(void* check, uint32_t old_value, uint32_t new_value) {
+    csum_replace16(check, (uint16_t)old_value, (uint16_t)new_value);
+    csum_replace16(check, (uint16_t)(old_value >> 16), (uint16_t)(new_value >> 16));
+}
+
+// Fill in the checksums a packet asked the NIC to insert (PBUF_TX_IP_CSUM,
+// PBUF_TX_L4_CSUM) in software, for devices without checksum offload.
+// p->data must point at the start of the frame. A UDP checksum that comes
+// out zero is sent as 0xFFFF, as a NIC does.
+void csum_tx_fallback(pbuf_t* p);
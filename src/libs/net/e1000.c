@@ -0,0 +1,665 @@
+#include "e1000.h"
+#include "../pci.h"
+#include "../interrupt.h"
+#include "../port.h"
+#include "../string.h"
+#include "../timer.h"
+#include "checksum.h"
+#include "netstat.h"
+#include "ethernet.h"
+#include "ip.h"
+
+// E1000 Register offsets
+#define REG_CTRL        0x0000
+#define REG_STATUS      0x0008
+#define REG_EEPROM      0x0014
+#define REG_CTRL_EXT    0x0018
+#define REG_ICR         0x00C0
+#define REG_IMS         0x00D0
+#define REG_RCTL        0x0100
+#define REG_TCTL        0x0400
+#define REG_RDBAL       0x2800
+#define REG_RDBAH       0x2804
+#define REG_RDLEN       0x2808
+#define REG_RDH         0x2810
+#define REG_RDT         0x2818
+#define REG_TDBAL       0x3800
+#define REG_TDBAH       0x3804
+#define REG_TDLEN       0x3808
+#define REG_TDH         0x3810
+#define REG_TDT         0x3818
+#define REG_RXCSUM      0x5000
+#define REG_MTA         0x5200
+#define REG_RAL         0x5400
+#define REG_RAH         0x5404
+
+// Receive Descriptor status bits
+#define RDES_DD        0x01    // Descriptor Done
+#define RDES_EOP       0x02    // End of Packet
+#define RDES_IXSM      0x04    // Ignore checksum indication
+#define RDES_TCPCS     0x20    // TCP/UDP checksum calculated
+#define RDES_IPCS      0x40    // IP checksum calculated
+
+// Receive Descriptor error bits
+#define RERR_TCPE      0x20    // TCP/UDP checksum error
+#define RERR_IPE       0x40    // IP checksum error
+
+// Interrupt cause bits
+#define ICR_RXT0       (1 << 7)   // Receiver timer interrupt
+#define ICR_RXO        (1 << 6)   // Receiver overrun
+
+// RCTL bits. BSIZE picks the receive buffer size, BSEX multiplies it by 16.
+#define RCTL_EN        (1 << 1)
+#define RCTL_LPE       (1 << 5)    // Long packet enable, frames over 1522 bytes
+#define RCTL_BAM       (1 << 15)   // Accept broadcast frames, ARP requests come that way
+#define RCTL_BSIZE_MASK (3 << 16)
+#define RCTL_BSIZE_2048 (0 << 16)
+#define RCTL_BSIZE_8192 ((2 << 16) | RCTL_BSEX)
+#define RCTL_BSEX      (1 << 25)
+#define RCTL_SECRC     (1 << 26)   // Strip ethernet CRC
+
+// RXCSUM register bits
+#define RXCSUM_IPOFLD  (1 << 8)   // IP checksum offload
+#define RXCSUM_TUOFLD  (1 << 9)   // TCP/UDP checksum offload
+
+// Transmit Descriptor status bits
+#define TDES_DD        0x01    // Descriptor Done
+
+// Transmit Descriptor command bits
+#define TCMD_EOP       0x01    // End of Packet
+#define TCMD_IFCS      0x02    // Insert FCS
+#define TCMD_TSE       0x04    // TCP segmentation, on the context and its data descriptors
+#define TCMD_RS        0x08    // Report Status
+#define TCMD_DEXT      0x20    // Extended descriptor
+
+// Extended descriptor types (bits 20-23 of cmd_length)
+#define TDTYP_CONTEXT  (0x0 << 20)
+#define TDTYP_DATA     (0x1 << 20)
+
+// Context descriptor TUCMD bits describing the packets to segment
+#define TUCMD_TCP      0x01    // TCP rather than UDP
+#define TUCMD_IP       0x02    // IPv4 rather than IPv6
+
+// Data descriptor POPTS bits
+#define TPOPTS_IXSM    0x01    // Insert IP checksum
+#define TPOPTS_TXSM    0x02    // Insert TCP/UDP checksum
+
+// Number of receive/transmit descriptors
+#define RX_DESC_COUNT  32
+#define TX_DESC_COUNT  128     // A super-packet takes up to 17
+
+// A super-packet is spread over data descriptors of at most this size
+#define TX_TSO_CHUNK   4096
+
+// Receive buffers are 2048 bytes at the standard MTU and 8192 above it.
+// Jumbo blocks have room behind those 8192 bytes, so the rest of a 9000
+// byte frame, which the NIC puts in the next descriptor, is appended there.
+#define RX_BUFFER_SIZE       PBUF_DATA_SIZE
+#define RX_JUMBO_BUFFER_SIZE 8192
+
+// Descriptor structures
+struct rx_desc {
+    uint64_t addr;     // Buffer address
+    uint16_t length;   // Length of received data
+    uint16_t checksum; // Checksum
+    uint8_t  status;   // Status bits
+    uint8_t  errors;   // Error bits
+    uint16_t special;
+} __attribute__((packed));
+
+struct tx_desc {
+    uint64_t addr;     // Buffer address
+    uint16_t length;   // Data length
+    uint8_t  cso;      // Checksum offset
+    uint8_t  cmd;      // Command bits
+    uint8_t  status;   // Status bits
+    uint8_t  css;      // Checksum start
+    uint16_t special;
+} __attribute__((packed));
+
+// Context descriptor, tells the NIC where the checksums of the following
+// data descriptors start and where to store them
+struct tx_context_desc {
+    uint8_t  ipcss;    // IP checksum start
+    uint8_t  ipcso;    // IP checksum offset
+    uint16_t ipcse;    // IP checksum end (inclusive)
+    uint8_t  tucss;    // TCP/UDP checksum start
+    uint8_t  tucso;    // TCP/UDP checksum offset
+    uint16_t tucse;    // TCP/UDP checksum end, 0 means end of packet
+    uint32_t cmd_length; // Payload length, type and command bits
+    uint8_t  status;
+    uint8_t  hdrlen;
+    uint16_t mss;
+} __attribute__((packed));
+
+// Extended data descriptor
+struct tx_data_desc {
+    uint64_t addr;
+    uint32_t cmd_length; // Data length, type and command bits
+    uint8_t  status;
+    uint8_t  popts;      // Checksum insertion options
+    uint16_t special;
+} __attribute__((packed));
+
+// Descriptor rings (the hardware wants them 128-byte aligned)
+static struct rx_desc rx_ring[RX_DESC_COUNT] __attribute__((aligned(128)));
+static struct tx_desc tx_ring[TX_DESC_COUNT] __attribute__((aligned(128)));
+
+// Driver state
+static struct {
+    uint64_t mmio_base;            // Memory-mapped I/O base address
+    struct rx_desc* rx_descs;      // Receive descriptors
+    struct tx_desc* tx_descs;      // Transmit descriptors
+    pbuf_t* rx_pbufs[RX_DESC_COUNT];  // Buffers the NIC receives into
+    pbuf_t* tx_pbufs[TX_DESC_COUNT];  // Buffers in flight, freed when sent
+    uint32_t rx_cur;               // Current receive descriptor
+    uint16_t rx_buffer_size;       // Size of the receive buffers the NIC is told about
+    pbuf_t* rx_partial;            // Frame spanning descriptors, first piece onwards
+    bool rx_discard;               // Dropping the rest of a frame that didn't fit
+    uint32_t tx_cur;               // Next free transmit descriptor
+    uint32_t tx_clean;             // Oldest transmit descriptor not yet reclaimed
+    uint32_t tx_context;           // Checksum layout of the last context descriptor
+    bool tx_context_valid;         // Whether a context descriptor was sent yet
+    bool csum_offload;             // Use the NIC for checksums
+    uint8_t irq;                   // Legacy IRQ line
+    uint8_t mac_addr[6];          // MAC address
+} e1000;
+
+// Read from MMIO register
+static inline uint32_t e1000_read_reg(uint32_t reg) {
+    return *(volatile uint32_t*)(e1000.mmio_base + reg);
+}
+
+// Write to MMIO register
+static inline void e1000_write_reg(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(e1000.mmio_base + reg) = value;
+}
+
+// Initialize receive descriptors
+static void init_rx_desc(void) {
+    // Initialize receive descriptors
+    e1000.rx_descs = rx_ring;
+    memset(e1000.rx_descs, 0, RX_DESC_COUNT * sizeof(struct rx_desc));
+
+    // Give every descriptor a packet buffer, the NIC writes frames straight into them
+    e1000.rx_buffer_size = RX_BUFFER_SIZE;
+    for (int i = 0; i < RX_DESC_COUNT; i++) {
+        e1000.rx_pbufs[i] = pbuf_alloc(RX_BUFFER_SIZE);
+        e1000.rx_descs[i].addr = (uint64_t)e1000.rx_pbufs[i]->data;
+    }
+    e1000.rx_cur = 0;
+    e1000.rx_partial = NULL;
+    e1000.rx_discard = false;
+
+    // Setup receive descriptor ring buffer
+    e1000_write_reg(REG_RDBAL, (uint64_t)e1000.rx_descs & 0xFFFFFFFF);
+    e1000_write_reg(REG_RDBAH, (uint64_t)e1000.rx_descs >> 32);
+    e1000_write_reg(REG_RDLEN, RX_DESC_COUNT * sizeof(struct rx_desc));
+    e1000_write_reg(REG_RDH, 0);
+    e1000_write_reg(REG_RDT, RX_DESC_COUNT - 1);
+
+    // Let the NIC verify IP and TCP/UDP checksums
+    e1000_write_reg(REG_RXCSUM, RXCSUM_IPOFLD | RXCSUM_TUOFLD);
+
+    // Enable receiver
+    e1000_write_reg(REG_RCTL, e1000_read_reg(REG_RCTL) | RCTL_EN | RCTL_BAM | RCTL_SECRC);
+}
+
+bool e1000_set_mtu(uint16_t mtu) {
+    bool jumbo = mtu + ETH_HEADER_SIZE > RX_BUFFER_SIZE;
+    uint16_t size = jumbo ? RX_JUMBO_BUFFER_SIZE : RX_BUFFER_SIZE;
+    if (size == e1000.rx_buffer_size) return true;
+
+    // Get all the new buffers first so a failure changes nothing
+    pbuf_t* fresh[RX_DESC_COUNT];
+    for (int i = 0; i < RX_DESC_COUNT; i++) {
+        fresh[i] = pbuf_alloc(size);
+        if (!fresh[i]) {
+            while (i--) pbuf_free(fresh[i]);
+            return false;
+        }
+    }
+
+    uint64_t flags = irq_save();
+
+    // Stop the receiver while the ring is rebuilt, frames in it are lost
+    uint32_t rctl = e1000_read_reg(REG_RCTL);
+    e1000_write_reg(REG_RCTL, rctl & ~RCTL_EN);
+
+    memset(e1000.rx_descs, 0, RX_DESC_COUNT * sizeof(struct rx_desc));
+    for (int i = 0; i < RX_DESC_COUNT; i++) {
+        pbuf_free(e1000.rx_pbufs[i]);
+        e1000.rx_pbufs[i] = fresh[i];
+        e1000.rx_descs[i].addr = (uint64_t)fresh[i]->data;
+    }
+    pbuf_free(e1000.rx_partial);
+    e1000.rx_partial = NULL;
+    e1000.rx_discard = false;
+    e1000.rx_cur = 0;
+    e1000.rx_buffer_size = size;
+    e1000_write_reg(REG_RDH, 0);
+    e1000_write_reg(REG_RDT, RX_DESC_COUNT - 1);
+
+    rctl &= ~(RCTL_BSIZE_MASK | RCTL_BSEX | RCTL_LPE);
+    rctl |= jumbo ? RCTL_BSIZE_8192 | RCTL_LPE : RCTL_BSIZE_2048;
+    e1000_write_reg(REG_RCTL, rctl | RCTL_EN);
+
+    irq_restore(flags);
+    return true;
+}
+
+// Initialize transmit descriptors
+static void init_tx_desc(void) {
+    // Initialize transmit descriptors
+    e1000.tx_descs = tx_ring;
+    memset(e1000.tx_descs, 0, TX_DESC_COUNT * sizeof(struct tx_desc));
+    e1000.tx_cur = 0;
+    e1000.tx_clean = 0;
+    e1000.tx_context_valid = false;
+
+    // Setup transmit descriptor ring buffer
+    e1000_write_reg(REG_TDBAL, (uint64_t)e1000.tx_descs & 0xFFFFFFFF);
+    e1000_write_reg(REG_TDBAH, (uint64_t)e1000.tx_descs >> 32);
+    e1000_write_reg(REG_TDLEN, TX_DESC_COUNT * sizeof(struct tx_desc));
+    e1000_write_reg(REG_TDH, 0);
+    e1000_write_reg(REG_TDT, 0);
+
+    // Enable transmitter
+    uint32_t tctl = e1000_read_reg(REG_TCTL);
+    tctl |= (1 << 1);  // Enable transmitter
+    tctl |= (1 << 3);  // Pad short packets
+    e1000_write_reg(REG_TCTL, tctl);
+}
+
+// Read MAC address from EEPROM
+static void read_mac_address(void) {
+    uint32_t ral = e1000_read_reg(REG_RAL);
+    uint32_t rah = e1000_read_reg(REG_RAH);
+
+    e1000.mac_addr[0] = (ral >>  0) & 0xFF;
+    e1000.mac_addr[1] = (ral >>  8) & 0xFF;
+    e1000.mac_addr[2] = (ral >> 16) & 0xFF;
+    e1000.mac_addr[3] = (ral >> 24) & 0xFF;
+    e1000.mac_addr[4] = (rah >>  0) & 0xFF;
+    e1000.mac_addr[5] = (rah >>  8) & 0xFF;
+}
+
+bool e1000_init(void) {
+    // Find the E1000 PCI device
+    pci_device_t device;
+    if (!pci_find_device(E1000_VENDOR_ID, E1000_DEVICE_ID, &device)) {
+        return false;
+    }
+
+    // Map the device's BAR0 (contains registers)
+    e1000.mmio_base = pci_map_bar(&device, 0);
+    if (!e1000.mmio_base) {
+        return false;
+    }
+
+
+    // Try to read a known register to verify MMIO access works
+        uint32_t test_read = e1000_read_reg(REG_STATUS);
+
+        if (test_read == 0xFFFFFFFF) {
+            // Invalid read - device not responding
+            return false;
+        }
+
+        // Enable PCI bus mastering
+        pci_enable_bus_mastering(&device);
+
+        uint32_t timeout = 100;  // Reduced timeout
+            uint32_t ctrl = e1000_read_reg(REG_CTRL);
+
+            // Only try reset if we can read the control register
+            if (ctrl != 0xFFFFFFFF) {
+                e1000_write_reg(REG_CTRL, ctrl | (1 << 26));  // Set reset bit
+
+                // Wait for reset to complete
+                for (uint32_t i = 0; i < timeout && (e1000_read_reg(REG_CTRL) & (1 << 26)); i++) {
+                    sleep(1);
+
+                    // Break early if we're getting invalid reads
+                    if (e1000_read_reg(REG_CTRL) == 0xFFFFFFFF) {
+                        return false;
+                    }
+                }
+            }
+
+    // Initialize descriptors
+    init_rx_desc();
+    init_tx_desc();
+
+    // Read MAC address
+    read_mac_address();
+
+    e1000.csum_offload = true;
+    e1000.irq = device.interrupt_line;
+
+    // Interrupt when frames arrive
+    e1000_read_reg(REG_ICR);
+    e1000_write_reg(REG_IMS, ICR_RXT0 | ICR_RXO);
+
+    return true;
+}
+
+// Free the buffers of descriptors the NIC has finished sending
+static void reclaim_tx(void) {
+    while (e1000.tx_clean != e1000.tx_cur &&
+           (e1000.tx_descs[e1000.tx_clean].status & TDES_DD)) {
+        pbuf_free(e1000.tx_pbufs[e1000.tx_clean]);
+        e1000.tx_pbufs[e1000.tx_clean] = NULL;
+        e1000.tx_clean = (e1000.tx_clean + 1) % TX_DESC_COUNT;
+    }
+}
+
+// Work out where the checksums of p live relative to the start of the frame.
+// Returns the layout packed into one value so it can be compared against the
+// layout of the last context descriptor.
+static uint32_t checksum_layout(pbuf_t* p, uint8_t* ipcss, uint8_t* ipcse,
+                                uint8_t* tucss, uint8_t* tucso) {
+    uint16_t frame_start = pbuf_headroom(p);
+
+    *ipcss = *ipcse = *tucss = *tucso = 0;
+    if (p->flags & PBUF_TX_IP_CSUM) {
+        *ipcss = p->l3_start - frame_start;
+        *ipcse = *ipcss + (p->head[p->l3_start] & 0x0F) * 4 - 1;
+    }
+    if (p->flags & PBUF_TX_L4_CSUM) {
+        *tucss = p->csum_start - frame_start;
+        *tucso = *tucss + p->csum_offset;
+    }
+
+    return ((uint32_t)*ipcse << 24) | ((uint32_t)*ipcss << 16) |
+           ((uint32_t)*tucss << 8) | *tucso;
+}
+
+// Number of free transmit descriptors
+static uint32_t tx_free(void) {
+    return (e1000.tx_clean + TX_DESC_COUNT - e1000.tx_cur - 1) % TX_DESC_COUNT;
+}
+
+// Advance the tail past a filled descriptor
+static void tx_advance(void) {
+    e1000.tx_cur = (e1000.tx_cur + 1) % TX_DESC_COUNT;
+}
+
+// Queue a TCP super-packet for the NIC to cut into gso_size segments. The
+// context descriptor says where the headers end, which the NIC copies in
+// front of every segment fixing up lengths, IP IDs, sequence numbers and
+// checksums. Caller has interrupts disabled.
+static bool send_tso(pbuf_t* p) {
+    uint8_t* frame = p->data;
+    uint8_t ipcss = p->l3_start - pbuf_headroom(p);
+    uint8_t tucss = p->csum_start - pbuf_headroom(p);
+    uint8_t hdrlen = tucss + (frame[tucss + 12] >> 4) * 4;
+    uint32_t chunks = (p->len + TX_TSO_CHUNK - 1) / TX_TSO_CHUNK;
+
+    if (tx_free() < chunks + 1) {
+        net_stat_drop(NET_LAYER_NIC, NET_DROP_RING_FULL);
+        return false;
+    }
+
+    // The NIC adds each segment's length to the pseudo header sum, so the
+    // seed has to leave it out
+    const ip_header_t* ip = (const ip_header_t*)(frame + ipcss);
+    uint16_t seed = (uint16_t)~csum_fold(csum_pseudo_header(ip->src_ip, ip->dest_ip, IP_PROTOCOL_TCP, 0));
+    memcpy(frame + tucss + 16, &seed, 2);
+
+    struct tx_context_desc* ctx = (struct tx_context_desc*)&e1000.tx_descs[e1000.tx_cur];
+    ctx->ipcss = ipcss;
+    ctx->ipcso = ipcss + 10;
+    ctx->ipcse = tucss - 1;
+    ctx->tucss = tucss;
+    ctx->tucso = tucss + 16;
+    ctx->tucse = 0;
+    ctx->cmd_length = (p->len - hdrlen) | TDTYP_CONTEXT |
+                      ((uint32_t)(TUCMD_TCP | TUCMD_IP | TCMD_TSE | TCMD_DEXT | TCMD_RS) << 24);
+    ctx->status = 0;
+    ctx->hdrlen = hdrlen;
+    ctx->mss = p->gso_size;
+    e1000.tx_pbufs[e1000.tx_cur] = NULL;
+    tx_advance();
+
+    // The checksum context was replaced, plain packets need theirs again
+    e1000.tx_context_valid = false;
+
+    // The buffer is released with the last descriptor
+    for (uint32_t offset = 0; offset < p->len; offset += TX_TSO_CHUNK) {
+        uint32_t length = p->len - offset < TX_TSO_CHUNK ? p->len - offset : TX_TSO_CHUNK;
+        bool last = offset + length == p->len;
+
+        struct tx_data_desc* desc = (struct tx_data_desc*)&e1000.tx_descs[e1000.tx_cur];
+        desc->addr = (uint64_t)(frame + offset);
+        desc->cmd_length = length | TDTYP_DATA |
+                           ((uint32_t)(TCMD_TSE | TCMD_IFCS | TCMD_RS | TCMD_DEXT | (last ? TCMD_EOP : 0)) << 24);
+        desc->status = 0;
+        desc->popts = TPOPTS_IXSM | TPOPTS_TXSM;
+        desc->special = 0;
+        e1000.tx_pbufs[e1000.tx_cur] = last ? pbuf_ref(p) : NULL;
+        tx_advance();
+    }
+
+    e1000_write_reg(REG_TDT, e1000.tx_cur);
+    net_stat_tx(NET_LAYER_NIC, p->len);
+    return true;
+}
+
+bool e1000_send_pbuf(pbuf_t* p) {
+    uint64_t flags = irq_save();
+
+    reclaim_tx();
+
+    if (p->gso_size && e1000.csum_offload) {
+        bool sent = send_tso(p);
+        irq_restore(flags);
+        return sent;
+    }
+
+    bool offload = e1000.csum_offload && (p->flags & (PBUF_TX_IP_CSUM | PBUF_TX_L4_CSUM));
+    uint8_t ipcss, ipcse, tucss, tucso;
+    uint32_t layout = offload ? checksum_layout(p, &ipcss, &ipcse, &tucss, &tucso) : 0;
+    bool new_context = offload && (!e1000.tx_context_valid || layout != e1000.tx_context);
+
+    // A packet needs a data descriptor, another for a page fragment, plus
+    // one if the context changes
+    uint32_t pieces = p->frag_len ? 2 : 1;
+    if (tx_free() < pieces + (new_context ? 1 : 0)) {
+        irq_restore(flags);
+        net_stat_drop(NET_LAYER_NIC, NET_DROP_RING_FULL);
+        return false;
+    }
+
+    // The context stays in effect for every following packet, so it is only
+    // sent when the checksum layout changes (e.g. from ICMP to TCP)
+    if (new_context) {
+        struct tx_context_desc* ctx = (struct tx_context_desc*)&e1000.tx_descs[e1000.tx_cur];
+        ctx->ipcss = ipcss;
+        ctx->ipcso = ipcss + 10;
+        ctx->ipcse = ipcse;
+        ctx->tucss = tucss;
+        ctx->tucso = tucso;
+        ctx->tucse = 0;
+        ctx->cmd_length = TDTYP_CONTEXT | ((uint32_t)(TCMD_DEXT | TCMD_RS) << 24);
+        ctx->status = 0;
+        ctx->hdrlen = 0;
+        ctx->mss = 0;
+
+        e1000.tx_pbufs[e1000.tx_cur] = NULL;
+        e1000.tx_context = layout;
+        e1000.tx_context_valid = true;
+        tx_advance();
+    }
+
+    if (!offload && (p->flags & (PBUF_TX_IP_CSUM | PBUF_TX_L4_CSUM))) {
+        csum_tx_fallback(p);
+    }
+
+    // Point the descriptors straight at the buffer and at the page its
+    // fragment is in, no copy. The buffer is released with the last one.
+    const uint8_t* addrs[2] = { p->data, p->frag };
+    uint16_t lengths[2] = { p->len, p->frag_len };
+    for (uint32_t i = 0; i < pieces; i++) {
+        uint8_t eop = i == pieces - 1 ? TCMD_EOP : 0;
+        e1000.tx_pbufs[e1000.tx_cur] = eop ? pbuf_ref(p) : NULL;
+        if (offload) {
+            struct tx_data_desc* desc = (struct tx_data_desc*)&e1000.tx_descs[e1000.tx_cur];
+            desc->addr = (uint64_t)addrs[i];
+            desc->cmd_length = lengths[i] | TDTYP_DATA |
+                               ((uint32_t)(eop | TCMD_IFCS | TCMD_RS | TCMD_DEXT) << 24);
+            desc->status = 0;
+            desc->popts = ((p->flags & PBUF_TX_IP_CSUM) ? TPOPTS_IXSM : 0) |
+                          ((p->flags & PBUF_TX_L4_CSUM) ? TPOPTS_TXSM : 0);
+            desc->special = 0;
+        } else {
+            struct tx_desc* desc = &e1000.tx_descs[e1000.tx_cur];
+            desc->addr = (uint64_t)addrs[i];
+            desc->length = lengths[i];
+            desc->cso = 0;
+            desc->cmd = eop | TCMD_IFCS | TCMD_RS;
+            desc->status = 0;
+            desc->css = 0;
+            desc->special = 0;
+        }
+        tx_advance();
+    }
+
+    e1000_write_reg(REG_TDT, e1000.tx_cur);
+    net_stat_tx(NET_LAYER_NIC, pbuf_length(p));
+
+    irq_restore(flags);
+    return true;
+}
+
+bool e1000_send_packet(const void* data, uint16_t length) {
+    pbuf_t* p = pbuf_alloc(length);
+    if (!p) return false;
+
+    memcpy(p->data, data, length);
+    bool sent = e1000_send_pbuf(p);
+    pbuf_free(p);
+    return sent;
+}
+
+// Pass on what the NIC found out about the checksums, the last descriptor
+// of a frame has the final word
+static void rx_checksum_flags(pbuf_t* p, const struct rx_desc* desc) {
+    if (desc->status & RDES_IXSM) return;
+
+    if (desc->errors & (RERR_IPE | RERR_TCPE)) {
+        p->flags |= PBUF_RX_CSUM_BAD;
+        NET_STAT_INC(NET_LAYER_NIC, csum_errors);
+    }
+    if ((desc->status & RDES_IPCS) && !(desc->errors & RERR_IPE)) {
+        p->flags |= PBUF_RX_IP_CSUM_OK;
+    }
+    if ((desc->status & RDES_TCPCS) && !(desc->errors & RERR_TCPE)) {
+        p->flags |= PBUF_RX_L4_CSUM_OK;
+    }
+}
+
+pbuf_t* e1000_receive_pbuf(void) {
+    while (1) {
+        // Get next receive descriptor
+        uint32_t cur = e1000.rx_cur;
+        struct rx_desc* desc = &e1000.rx_descs[cur];
+
+        // Check if packet is available
+        if (!(desc->status & RDES_DD)) {
+            return NULL;
+        }
+
+        if (e1000.rx_discard) {
+            // Rest of a frame that is being dropped
+        } else if (e1000.rx_partial) {
+            // Later pieces of a frame go behind the first one, its buffer
+            // stays with the NIC
+            uint8_t* tail = pbuf_put(e1000.rx_partial, desc->length);
+            if (tail) {
+                memcpy(tail, e1000.rx_pbufs[cur]->data, desc->length);
+            } else {
+                net_stat_drop(NET_LAYER_NIC, NET_DROP_TRUNCATED);
+                pbuf_free(e1000.rx_partial);
+                e1000.rx_partial = NULL;
+                e1000.rx_discard = true;
+            }
+        } else {
+            // Swap in a fresh buffer and keep the filled one. If the pool
+            // is empty the frame is dropped and its buffer reused.
+            pbuf_t* fresh = pbuf_alloc(e1000.rx_buffer_size);
+            if (fresh) {
+                e1000.rx_partial = e1000.rx_pbufs[cur];
+                pbuf_trim(e1000.rx_partial, desc->length);
+                e1000.rx_pbufs[cur] = fresh;
+                desc->addr = (uint64_t)fresh->data;
+            } else {
+                net_stat_drop(NET_LAYER_NIC, NET_DROP_NO_BUFFER);
+                e1000.rx_discard = true;
+            }
+        }
+
+        // The frame is complete at the descriptor with EOP set
+        pbuf_t* p = NULL;
+        if (desc->status & RDES_EOP) {
+            p = e1000.rx_partial;
+            if (p) rx_checksum_flags(p, desc);
+            e1000.rx_partial = NULL;
+            e1000.rx_discard = false;
+        }
+
+        // Reset descriptor and give it back to the NIC
+        desc->status = 0;
+        e1000.rx_cur = (cur + 1) % RX_DESC_COUNT;
+        e1000_write_reg(REG_RDT, cur);
+
+        if (p) {
+            net_stat_rx(NET_LAYER_NIC, p->len);
+            return p;
+        }
+    }
+}
+
+uint16_t e1000_receive_packet(void* buffer, uint16_t max_length) {
+    pbuf_t* p = e1000_receive_pbuf();
+    if (!p) {
+        return 0;
+    }
+
+    uint16_t length = p->len;
+    if (length > max_length) {
+        length = max_length;
+        net_stat_drop(NET_LAYER_NIC, NET_DROP_TRUNCATED);
+    }
+
+    // Copy data to buffer
+    memcpy(buffer, p->data, length);
+    pbuf_free(p);
+
+    return length;
+}
+
+bool e1000_tso_supported(void) {
+    return e1000.csum_offload;
+}
+
+bool e1000_checksum_offload(void) {
+    return e1000.csum_offload;
+}
+
+void e1000_set_checksum_offload(bool enabled) {
+    e1000.csum_offload = enabled;
+}
+
+void e1000_get_mac_address(uint8_t mac[6]) {
+    memcpy(mac, e1000.mac_addr, 6);
+}
+
+void e1000_irq_ack(void) {
+    // Reading the cause register clears it
+    e1000_read_reg(REG_ICR);
+}
+
+uint8_t e1000_get_irq(void) {
+    return e1000.irq;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pbuf.h"
+
+#define E1000_VENDOR_ID 0x8086  // Intel
+#define E1000_DEVICE_ID 0x100E  // 82540EM Gigabit Ethernet Controller
+
+// Initialize the network card
+bool e1000_init(void);
+
+// Send a packet
+bool e1000_send_packet(const void* data, uint16_t length);
+
+// Send a packet buffer without copying it. The driver takes its own reference
+// and drops it once the NIC is done, so the caller still has to free p.
+// Returns false if the transmit ring is full.
+bool e1000_send_pbuf(pbuf_t* p);
+
+// Receive a packet (non-blocking)
+// Returns number of bytes received, or 0 if no packet available
+uint16_t e1000_receive_packet(void* buffer, uint16_t max_length);
+
+// Receive a packet buffer (non-blocking), the NIC DMAs straight into it.
+// Returns NULL if no packet is available. The caller owns the reference.
+pbuf_t* e1000_receive_pbuf(void);
+
+// Whether checksums flagged with PBUF_TX_IP_CSUM / PBUF_TX_L4_CSUM are
+// inserted by the NIC. When disabled the driver computes them in software.
+bool e1000_checksum_offload(void);
+void e1000_set_checksum_offload(bool enabled);
+
+// Whether TCP super-packets (gso_size set) are segmented by the NIC (TSO),
+// which needs checksum offload
+bool e1000_tso_supported(void);
+
+// Size the receive buffers for an MTU, frames larger than a buffer span
+// several descriptors. Returns false if the buffers can't be allocated.
+bool e1000_set_mtu(uint16_t mtu);
+
+// Get MAC address
+void e1000_get_mac_address(uint8_t mac[6]);
+
+// Acknowledge the interrupt, called before receiving
+void e1000_irq_ack(void);
+
+// Legacy IRQ line of the card
+uint8_t e1000_get_irq(void);
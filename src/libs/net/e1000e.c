@@ -0,0 +1,564 @@
+#include "e1000e.h"
+#include "../pci.h"
+#include "../apic.h"
+#include "../string.h"
+#include "../timer.h"
+#include "checksum.h"
+#include "netstat.h"
+#include "ethernet.h"
+
+// 82574 register offsets
+#define REG_CTRL        0x0000
+#define REG_STATUS      0x0008
+#define REG_CTRL_EXT    0x0018
+#define REG_ICR         0x00C0
+#define REG_IMS         0x00D0
+#define REG_IMC         0x00D8
+#define REG_EIAC        0x00DC
+#define REG_IVAR        0x00E4
+#define REG_RCTL        0x0100
+#define REG_TCTL        0x0400
+#define REG_RDBAL(q)    (0x2800 + (q) * 0x100)
+#define REG_RDBAH(q)    (0x2804 + (q) * 0x100)
+#define REG_RDLEN(q)    (0x2808 + (q) * 0x100)
+#define REG_RDH(q)      (0x2810 + (q) * 0x100)
+#define REG_RDT(q)      (0x2818 + (q) * 0x100)
+#define REG_TDBAL       0x3800
+#define REG_TDBAH       0x3804
+#define REG_TDLEN       0x3808
+#define REG_TDH         0x3810
+#define REG_TDT         0x3818
+#define REG_RXCSUM      0x5000
+#define REG_RFCTL       0x5008
+#define REG_RAL         0x5400
+#define REG_RAH         0x5404
+#define REG_MRQC        0x5818
+#define REG_RETA        0x5C00    // 32 registers, 4 entries each
+#define REG_RSSRK       0x5C80    // 10 registers, the 40 byte hash key
+
+#define CTRL_SLU        (1 << 6)     // Set link up
+#define CTRL_RST        (1 << 26)
+#define CTRL_EXT_PBA    (1u << 31)   // MSI-X pending bit array support
+
+#define RCTL_EN         (1 << 1)
+#define RCTL_LPE        (1 << 5)     // Long packet enable, frames over 1522 bytes
+#define RCTL_BSIZE_MASK (3 << 16)
+#define RCTL_BSIZE_2048 (0 << 16)
+#define RCTL_BSIZE_8192 ((2 << 16) | RCTL_BSEX)
+#define RCTL_BSEX       (1 << 25)    // Buffer sizes times 16
+#define RCTL_SECRC      (1 << 26)    // Strip ethernet CRC
+#define TCTL_EN         (1 << 1)
+#define TCTL_PSP        (1 << 3)     // Pad short packets
+
+#define RFCTL_EXTEN     (1 << 15)    // Extended receive descriptors
+
+// RXCSUM bits. PCSD puts the RSS hash where the packet checksum would go,
+// the card only does RSS with it set.
+#define RXCSUM_IPOFLD   (1 << 8)
+#define RXCSUM_TUOFLD   (1 << 9)
+#define RXCSUM_PCSD     (1 << 13)
+
+// Hash IPv4 addresses, plus the ports for TCP
+#define MRQC_RSS        0x1
+#define MRQC_IPV4_TCP   (1 << 16)
+#define MRQC_IPV4       (1 << 17)
+
+// Interrupt causes
+#define ICR_RXT0        (1 << 7)
+#define ICR_RXO         (1 << 6)
+#define ICR_RXQ(q)      (1 << (20 + (q)))
+#define ICR_OTHER       (1 << 24)
+
+// IVAR routes the causes to MSI-X vectors, 4 bits each with bit 3 valid
+#define IVAR_VALID      0x8
+#define IVAR_RXQ(q)     ((q) * 4)
+#define IVAR_OTHER      16
+
+// Extended receive descriptor write-back status and errors
+#define RDES_DD         0x01
+#define RDES_EOP        0x02
+#define RDES_IXSM       0x04
+#define RDES_TCPCS      0x20
+#define RDES_IPCS       0x40
+#define RERR_TCPE       0x20000000
+#define RERR_IPE        0x40000000
+
+// Transmit descriptor bits
+#define TDES_DD         0x01
+#define TCMD_EOP        0x01
+#define TCMD_IFCS       0x02
+#define TCMD_RS         0x08
+
+#define RX_DESC_COUNT   32
+#define TX_DESC_COUNT   32
+#define RX_BUFFER_SIZE  PBUF_DATA_SIZE
+
+// Above the standard MTU, see e1000.c: the tail of a 9000 byte frame goes in
+// the room jumbo blocks have behind 8192 bytes
+#define RX_JUMBO_BUFFER_SIZE 8192
+
+// MSI-X table entries: one per receive queue, then link and other causes
+#define VECTOR_OTHER    E1000E_QUEUES
+
+// Extended receive descriptor, the card overwrites the buffer address with
+// the write-back fields
+typedef union {
+    struct {
+        uint64_t addr;
+        uint64_t reserved;   // DD lives here, must start out clear
+    } read;
+    struct {
+        uint32_t mrq;        // RSS type and packet type
+        uint32_t rss_hash;
+        uint32_t status_error;
+        uint16_t length;
+        uint16_t vlan;
+    } wb;
+} __attribute__((packed)) rx_desc_t;
+
+typedef struct {
+    uint64_t addr;
+    uint16_t length;
+    uint8_t  cso;
+    uint8_t  cmd;
+    uint8_t  status;
+    uint8_t  css;
+    uint16_t special;
+} __attribute__((packed)) tx_desc_t;
+
+static rx_desc_t rx_rings[E1000E_QUEUES][RX_DESC_COUNT] __attribute__((aligned(128)));
+static tx_desc_t tx_ring[TX_DESC_COUNT] __attribute__((aligned(128)));
+
+// Microsoft's reference key, so hashes can be checked against other stacks
+static const uint8_t rss_key[40] = {
+    0x6d, 0x5a, 0x56, 0xda, 0x25, 0x5b, 0x0e, 0xc2,
+    0x41, 0x67, 0x25, 0x3d, 0x43, 0xa3, 0x8f, 0xb0,
+    0xd0, 0xca, 0x2b, 0xcb, 0xae, 0x7b, 0x30, 0xb4,
+    0x77, 0xcb, 0x2d, 0xa3, 0x80, 0x30, 0xf2, 0x0c,
+    0x6a, 0x42, 0xb7, 0x3b, 0xbe, 0xac, 0x01, 0xfa,
+};
+
+typedef struct {
+    pbuf_t* pbufs[RX_DESC_COUNT];  // Buffers the NIC receives into
+    uint32_t cur;                  // Next descriptor to look at
+    pbuf_t* partial;               // Frame spanning descriptors, first piece onwards
+    bool discard;                  // Dropping the rest of a frame that didn't fit
+} rx_queue_t;
+
+static struct {
+    uint64_t mmio_base;
+    pci_device_t device;
+    pci_msix_t msix;
+    bool msix_enabled;
+    isr_t handler;                 // Called by the queue vectors
+    rx_queue_t rx[E1000E_QUEUES];
+    uint32_t rx_next;              // Queue receive_pbuf starts with
+    uint16_t rx_buffer_size;
+    pbuf_t* tx_pbufs[TX_DESC_COUNT];
+    uint32_t tx_cur;
+    uint32_t tx_clean;
+    uint8_t irq;
+    uint8_t mac_addr[6];
+    e1000e_queue_stats_t stats[E1000E_QUEUES];
+} e1000e;
+
+static inline uint32_t e1000e_read_reg(uint32_t reg) {
+    return *(volatile uint32_t*)(e1000e.mmio_base + reg);
+}
+
+static inline void e1000e_write_reg(uint32_t reg, uint32_t value) {
+    *(volatile uint32_t*)(e1000e.mmio_base + reg) = value;
+}
+
+// Post buffers, which come from the caller if given
+static void init_rx_queue(int q, pbuf_t** buffers) {
+    rx_queue_t* rxq = &e1000e.rx[q];
+    memset(rx_rings[q], 0, sizeof(rx_rings[q]));
+
+    for (int i = 0; i < RX_DESC_COUNT; i++) {
+        rxq->pbufs[i] = buffers ? buffers[i] : pbuf_alloc(RX_BUFFER_SIZE);
+        rx_rings[q][i].read.addr = (uint64_t)rxq->pbufs[i]->data;
+    }
+    rxq->cur = 0;
+    rxq->partial = NULL;
+    rxq->discard = false;
+
+    e1000e_write_reg(REG_RDBAL(q), (uint64_t)rx_rings[q] & 0xFFFFFFFF);
+    e1000e_write_reg(REG_RDBAH(q), (uint64_t)rx_rings[q] >> 32);
+    e1000e_write_reg(REG_RDLEN(q), sizeof(rx_rings[q]));
+    e1000e_write_reg(REG_RDH(q), 0);
+    e1000e_write_reg(REG_RDT(q), RX_DESC_COUNT - 1);
+}
+
+// Spread flows over the queues by their Toeplitz hash
+static void init_rss(void) {
+    for (int i = 0; i < 10; i++) {
+        const uint8_t* k = &rss_key[i * 4];
+        e1000e_write_reg(REG_RSSRK + i * 4,
+                         k[0] | (k[1] << 8) | (k[2] << 16) | ((uint32_t)k[3] << 24));
+    }
+
+    // 128 one byte entries, bit 7 picks the queue. Alternate between them.
+    for (int i = 0; i < 32; i++) {
+        e1000e_write_reg(REG_RETA + i * 4, 0x80008000);
+    }
+
+    e1000e_write_reg(REG_MRQC, MRQC_RSS | MRQC_IPV4_TCP | MRQC_IPV4);
+}
+
+static void init_rx(void) {
+    for (int q = 0; q < E1000E_QUEUES; q++) {
+        init_rx_queue(q, NULL);
+    }
+    e1000e.rx_next = 0;
+    e1000e.rx_buffer_size = RX_BUFFER_SIZE;
+
+    e1000e_write_reg(REG_RFCTL, e1000e_read_reg(REG_RFCTL) | RFCTL_EXTEN);
+    e1000e_write_reg(REG_RXCSUM, RXCSUM_IPOFLD | RXCSUM_TUOFLD | RXCSUM_PCSD);
+    init_rss();
+
+    e1000e_write_reg(REG_RCTL, e1000e_read_reg(REG_RCTL) | RCTL_EN | RCTL_SECRC);
+}
+
+bool e1000e_set_mtu(uint16_t mtu) {
+    bool jumbo = mtu + ETH_HEADER_SIZE > RX_BUFFER_SIZE;
+    uint16_t size = jumbo ? RX_JUMBO_BUFFER_SIZE : RX_BUFFER_SIZE;
+    if (size == e1000e.rx_buffer_size) return true;
+
+    // Get all the new buffers first so a failure changes nothing
+    static pbuf_t* fresh[E1000E_QUEUES][RX_DESC_COUNT];
+    for (int n = 0; n < E1000E_QUEUES * RX_DESC_COUNT; n++) {
+        pbuf_t** slot = &fresh[n / RX_DESC_COUNT][n % RX_DESC_COUNT];
+        if (!(*slot = pbuf_alloc(size))) {
+            while (n--) pbuf_free(fresh[n / RX_DESC_COUNT][n % RX_DESC_COUNT]);
+            return false;
+        }
+    }
+
+    uint64_t flags = irq_save();
+
+    // Stop the receiver while the rings are rebuilt, frames in them are lost
+    uint32_t rctl = e1000e_read_reg(REG_RCTL);
+    e1000e_write_reg(REG_RCTL, rctl & ~RCTL_EN);
+
+    for (int q = 0; q < E1000E_QUEUES; q++) {
+        rx_queue_t* rxq = &e1000e.rx[q];
+        for (int i = 0; i < RX_DESC_COUNT; i++) {
+            pbuf_free(rxq->pbufs[i]);
+        }
+        pbuf_free(rxq->partial);
+        init_rx_queue(q, fresh[q]);
+    }
+    e1000e.rx_buffer_size = size;
+
+    rctl &= ~(RCTL_BSIZE_MASK | RCTL_BSEX | RCTL_LPE);
+    rctl |= jumbo ? RCTL_BSIZE_8192 | RCTL_LPE : RCTL_BSIZE_2048;
+    e1000e_write_reg(REG_RCTL, rctl | RCTL_EN);
+
+    irq_restore(flags);
+    return true;
+}
+
+// One transmit queue is enough, it belongs to the only CPU
+static void init_tx(void) {
+    memset(tx_ring, 0, sizeof(tx_ring));
+    e1000e.tx_cur = 0;
+    e1000e.tx_clean = 0;
+
+    e1000e_write_reg(REG_TDBAL, (uint64_t)tx_ring & 0xFFFFFFFF);
+    e1000e_write_reg(REG_TDBAH, (uint64_t)tx_ring >> 32);
+    e1000e_write_reg(REG_TDLEN, sizeof(tx_ring));
+    e1000e_write_reg(REG_TDH, 0);
+    e1000e_write_reg(REG_TDT, 0);
+
+    e1000e_write_reg(REG_TCTL, e1000e_read_reg(REG_TCTL) | TCTL_EN | TCTL_PSP);
+}
+
+static void read_mac_address(void) {
+    uint32_t ral = e1000e_read_reg(REG_RAL);
+    uint32_t rah = e1000e_read_reg(REG_RAH);
+
+    for (int i = 0; i < 4; i++) {
+        e1000e.mac_addr[i] = (ral >> (i * 8)) & 0xFF;
+    }
+    e1000e.mac_addr[4] = rah & 0xFF;
+    e1000e.mac_addr[5] = (rah >> 8) & 0xFF;
+}
+
+bool e1000e_init(void) {
+    if (!pci_find_device(E1000E_VENDOR_ID, E1000E_DEVICE_ID, &e1000e.device)) {
+        return false;
+    }
+
+    e1000e.mmio_base = pci_map_bar(&e1000e.device, 0);
+    if (!e1000e.mmio_base || e1000e_read_reg(REG_STATUS) == 0xFFFFFFFF) {
+        return false;
+    }
+    pci_enable_bus_mastering(&e1000e.device);
+
+    // Reset, with interrupts masked before and after
+    e1000e_write_reg(REG_IMC, 0xFFFFFFFF);
+    e1000e_write_reg(REG_CTRL, e1000e_read_reg(REG_CTRL) | CTRL_RST);
+    for (int i = 0; i < 100 && (e1000e_read_reg(REG_CTRL) & CTRL_RST); i++) {
+        sleep(1);
+    }
+    e1000e_write_reg(REG_IMC, 0xFFFFFFFF);
+    e1000e_write_reg(REG_CTRL, e1000e_read_reg(REG_CTRL) | CTRL_SLU);
+
+    init_rx();
+    init_tx();
+    read_mac_address();
+
+    e1000e.irq = e1000e.device.interrupt_line;
+    e1000e.msix_enabled = false;
+
+    // Legacy interrupts until e1000e_bind_irq moves the card to MSI-X
+    e1000e_read_reg(REG_ICR);
+    e1000e_write_reg(REG_IMS, ICR_RXT0 | ICR_RXO);
+
+    return true;
+}
+
+// Queue vectors count their interrupts and go straight to the stack
+static void rx_queue_isr(int q) {
+    e1000e.stats[q].interrupts++;
+    e1000e.handler();
+}
+
+static void rx_queue0_isr(void) {
+    rx_queue_isr(0);
+}
+
+static void rx_queue1_isr(void) {
+    rx_queue_isr(1);
+}
+
+// Link changes and receive overruns, reading ICR acknowledges them
+static void other_isr(void) {
+    e1000e_read_reg(REG_ICR);
+    e1000e_write_reg(REG_IMS, ICR_OTHER);
+}
+
+bool e1000e_bind_irq(isr_t handler) {
+    static const isr_t queue_isrs[E1000E_QUEUES] = { rx_queue0_isr, rx_queue1_isr };
+
+    if (!lapic_enabled() || !pci_msix_init(&e1000e.device, &e1000e.msix) ||
+        e1000e.msix.table_size < E1000E_QUEUES + 1) {
+        return false;
+    }
+
+    int vectors[E1000E_QUEUES + 1];
+    for (int i = 0; i <= E1000E_QUEUES; i++) {
+        vectors[i] = interrupt_alloc_vector();
+        if (vectors[i] < 0) return false;
+    }
+
+    e1000e.handler = handler;
+    for (int q = 0; q < E1000E_QUEUES; q++) {
+        register_interrupt_handler(vectors[q], queue_isrs[q]);
+    }
+    register_interrupt_handler(vectors[VECTOR_OTHER], other_isr);
+
+    // Every queue targets the CPU that polls it. With one CPU that is
+    // always us, but the destination is set per entry.
+    for (int i = 0; i <= E1000E_QUEUES; i++) {
+        pci_msix_set_vector(&e1000e.msix, i, vectors[i], lapic_id());
+    }
+
+    uint32_t ivar = 0;
+    for (int q = 0; q < E1000E_QUEUES; q++) {
+        ivar |= (q | IVAR_VALID) << IVAR_RXQ(q);
+    }
+    ivar |= (VECTOR_OTHER | IVAR_VALID) << IVAR_OTHER;
+
+    e1000e_write_reg(REG_IMC, 0xFFFFFFFF);
+    e1000e_write_reg(REG_CTRL_EXT, e1000e_read_reg(REG_CTRL_EXT) | CTRL_EXT_PBA);
+    e1000e_write_reg(REG_IVAR, ivar);
+
+    // Queue causes clear themselves when their message is sent
+    e1000e_write_reg(REG_EIAC, ICR_RXQ(0) | ICR_RXQ(1));
+    pci_msix_enable(&e1000e.msix, true);
+    e1000e.msix_enabled = true;
+
+    e1000e_read_reg(REG_ICR);
+    e1000e_write_reg(REG_IMS, ICR_RXQ(0) | ICR_RXQ(1) | ICR_OTHER);
+    return true;
+}
+
+bool e1000e_msix(void) {
+    return e1000e.msix_enabled;
+}
+
+static void reclaim_tx(void) {
+    while (e1000e.tx_clean != e1000e.tx_cur && (tx_ring[e1000e.tx_clean].status & TDES_DD)) {
+        pbuf_free(e1000e.tx_pbufs[e1000e.tx_clean]);
+        e1000e.tx_pbufs[e1000e.tx_clean] = NULL;
+        e1000e.tx_clean = (e1000e.tx_clean + 1) % TX_DESC_COUNT;
+    }
+}
+
+bool e1000e_send_pbuf(pbuf_t* p) {
+    uint64_t flags = irq_save();
+
+    reclaim_tx();
+
+    // One descriptor, and another for a page fragment
+    uint32_t pieces = p->frag_len ? 2 : 1;
+    uint32_t room = (e1000e.tx_clean + TX_DESC_COUNT - e1000e.tx_cur - 1) % TX_DESC_COUNT;
+    if (room < pieces) {
+        irq_restore(flags);
+        net_stat_drop(NET_LAYER_NIC, NET_DROP_RING_FULL);
+        return false;
+    }
+
+    // Legacy descriptors carry no checksum context, the stack's software
+    // fallback fills them in
+    if (p->flags & (PBUF_TX_IP_CSUM | PBUF_TX_L4_CSUM)) {
+        csum_tx_fallback(p);
+    }
+
+    // The buffer is released with the last descriptor
+    const uint8_t* addrs[2] = { p->data, p->frag };
+    uint16_t lengths[2] = { p->len, p->frag_len };
+    for (uint32_t i = 0; i < pieces; i++) {
+        uint8_t eop = i == pieces - 1 ? TCMD_EOP : 0;
+        tx_desc_t* desc = &tx_ring[e1000e.tx_cur];
+        e1000e.tx_pbufs[e1000e.tx_cur] = eop ? pbuf_ref(p) : NULL;
+        desc->addr = (uint64_t)addrs[i];
+        desc->length = lengths[i];
+        desc->cso = 0;
+        desc->cmd = eop | TCMD_IFCS | TCMD_RS;
+        desc->status = 0;
+        desc->css = 0;
+        desc->special = 0;
+        e1000e.tx_cur = (e1000e.tx_cur + 1) % TX_DESC_COUNT;
+    }
+    e1000e_write_reg(REG_TDT, e1000e.tx_cur);
+
+    e1000e.stats[0].tx_packets++;
+    e1000e.stats[0].tx_bytes += pbuf_length(p);
+    net_stat_tx(NET_LAYER_NIC, pbuf_length(p));
+
+    irq_restore(flags);
+    return true;
+}
+
+// Pass on what the NIC found out about the checksums, the last descriptor
+// of a frame has the final word
+static void rx_checksum_flags(pbuf_t* p, uint32_t status) {
+    if (status & RDES_IXSM) return;
+
+    if (status & (RERR_IPE | RERR_TCPE)) {
+        p->flags |= PBUF_RX_CSUM_BAD;
+        NET_STAT_INC(NET_LAYER_NIC, csum_errors);
+    }
+    if ((status & RDES_IPCS) && !(status & RERR_IPE)) {
+        p->flags |= PBUF_RX_IP_CSUM_OK;
+    }
+    if ((status & RDES_TCPCS) && !(status & RERR_TCPE)) {
+        p->flags |= PBUF_RX_L4_CSUM_OK;
+    }
+}
+
+// Next frame of one queue, or NULL when it is empty
+static pbuf_t* receive_queue(int q) {
+    rx_queue_t* rxq = &e1000e.rx[q];
+
+    while (1) {
+        uint32_t cur = rxq->cur;
+        rx_desc_t* desc = &rx_rings[q][cur];
+        uint32_t status = desc->wb.status_error;
+
+        if (!(status & RDES_DD)) {
+            return NULL;
+        }
+
+        if (rxq->discard) {
+            // Rest of a frame that is being dropped
+        } else if (rxq->partial) {
+            // Later pieces of a frame go behind the first one, their
+            // buffers stay with the NIC
+            uint8_t* tail = pbuf_put(rxq->partial, desc->wb.length);
+            if (tail) {
+                memcpy(tail, rxq->pbufs[cur]->data, desc->wb.length);
+            } else {
+                net_stat_drop(NET_LAYER_NIC, NET_DROP_TRUNCATED);
+                pbuf_free(rxq->partial);
+                rxq->partial = NULL;
+                rxq->discard = true;
+            }
+        } else {
+            // Swap in a fresh buffer and keep the filled one. If the pool
+            // is empty the frame is dropped and its buffer reused.
+            pbuf_t* fresh = pbuf_alloc(e1000e.rx_buffer_size);
+            if (fresh) {
+                rxq->partial = rxq->pbufs[cur];
+                pbuf_trim(rxq->partial, desc->wb.length);
+                rxq->pbufs[cur] = fresh;
+            } else {
+                net_stat_drop(NET_LAYER_NIC, NET_DROP_NO_BUFFER);
+                rxq->discard = true;
+            }
+        }
+
+        // The frame is complete at the descriptor with EOP set
+        pbuf_t* p = NULL;
+        if (status & RDES_EOP) {
+            p = rxq->partial;
+            if (p) rx_checksum_flags(p, status);
+            rxq->partial = NULL;
+            rxq->discard = false;
+        }
+
+        // Write-back replaced the address, put the read format back
+        desc->read.addr = (uint64_t)rxq->pbufs[cur]->data;
+        desc->read.reserved = 0;
+        rxq->cur = (cur + 1) % RX_DESC_COUNT;
+        e1000e_write_reg(REG_RDT(q), cur);
+
+        if (p) {
+            e1000e.stats[q].rx_packets++;
+            e1000e.stats[q].rx_bytes += p->len;
+            net_stat_rx(NET_LAYER_NIC, p->len);
+            return p;
+        }
+    }
+}
+
+pbuf_t* e1000e_receive_pbuf(void) {
+    // Take turns so a busy queue can't starve the other
+    for (int i = 0; i < E1000E_QUEUES; i++) {
+        int q = e1000e.rx_next;
+        e1000e.rx_next = (e1000e.rx_next + 1) % E1000E_QUEUES;
+
+        pbuf_t* p = receive_queue(q);
+        if (p) return p;
+    }
+    return NULL;
+}
+
+void e1000e_irq_ack(void) {
+    // With MSI-X the queue causes clear themselves
+    if (!e1000e.msix_enabled) {
+        e1000e_read_reg(REG_ICR);
+    }
+}
+
+void e1000e_get_mac_address(uint8_t mac[6]) {
+    memcpy(mac, e1000e.mac_addr, 6);
+}
+
+uint8_t e1000e_get_irq(void) {
+    return e1000e.irq;
+}
+
+const e1000e_queue_stats_t* e1000e_get_queue_stats(int queue) {
+    if (queue < 0 || queue >= E1000E_QUEUES) return NULL;
+    return &e1000e.stats[queue];
+}
+
+void e1000e_reset_queue_stats(void) {
+    uint64_t flags = irq_save();
+    memset(e1000e.stats, 0, sizeof(e1000e.stats));
+    irq_restore(flags);
+}
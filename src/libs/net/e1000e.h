@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pbuf.h"
+#include "../interrupt.h"
+
+#define E1000E_VENDOR_ID 0x8086  // Intel
+#define E1000E_DEVICE_ID 0x10D3  // 82574L Gigabit Network Connection
+
+#define E1000E_QUEUES    2       // Receive queues the card spreads flows over
+
+typedef struct {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t interrupts;     // MSI-X interrupts of the queue's vector
+} e1000e_queue_stats_t;
+
+// Initialize the network card, with receive side scaling over both queues
+bool e1000e_init(void);
+
+// Send a packet buffer without copying it. The driver takes its own reference
+// and drops it once the NIC is done, so the caller still has to free p.
+// Returns false if the transmit ring is full.
+bool e1000e_send_pbuf(pbuf_t* p);
+
+// Receive a packet buffer (non-blocking), taking turns between the queues.
+// Returns NULL if no packet is available. The caller owns the reference.
+pbuf_t* e1000e_receive_pbuf(void);
+
+// Acknowledge the interrupt, called before receiving
+void e1000e_irq_ack(void);
+
+// Size the receive buffers for an MTU, frames larger than a buffer span
+// several descriptors. Returns false if the buffers can't be allocated.
+bool e1000e_set_mtu(uint16_t mtu);
+
+// Get MAC address
+void e1000e_get_mac_address(uint8_t mac[6]);
+
+// Legacy IRQ line of the card
+uint8_t e1000e_get_irq(void);
+
+// Give every receive queue its own MSI-X vector that calls handler. Returns
+// false if MSI-X can't be used, the card then stays on its legacy line.
+bool e1000e_bind_irq(isr_t handler);
+
+// Whether the card interrupts through MSI-X
+bool e1000e_msix(void);
+
+// Per queue counters
+const e1000e_queue_stats_t* e1000e_get_queue_stats(int queue);
+void e1000e_reset_queue_stats(void);
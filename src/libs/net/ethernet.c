@@ -0,0 +1,391 @@
+#include "ethernet.h"
+#include "e1000.h"
+#include "e1000e.h"
+#include "virtio_net.h"
+#include "loopback.h"
+#include "netstat.h"
+#include "offload.h"
+#include "bpf.h"
+#include "../interrupt.h"
+#include "../print.h"
+#include "../timer.h"
+#include "../types.h"
+#include "../string.h"  // Add this for memcpy
+
+static struct {
+    uint16_t type;
+    eth_receive_callback_t callback;
+} protocols[ETH_MAX_PROTOCOLS];
+static int protocol_count = 0;
+static uint8_t our_mac[6];
+
+// Tried in order, virtio-net first since it is much cheaper to emulate
+static const eth_driver_t drivers[] = {
+    {
+        .name = "virtio-net",
+        .init = virtio_net_init,
+        .send_pbuf = virtio_net_send_pbuf,
+        .receive_pbuf = virtio_net_receive_pbuf,
+        .irq_ack = virtio_net_irq_ack,
+        .get_mac_address = virtio_net_get_mac_address,
+        .get_irq = virtio_net_get_irq,
+        .tso_supported = virtio_net_tso_supported,
+    },
+    {
+        .name = "e1000e",
+        .init = e1000e_init,
+        .send_pbuf = e1000e_send_pbuf,
+        .receive_pbuf = e1000e_receive_pbuf,
+        .irq_ack = e1000e_irq_ack,
+        .get_mac_address = e1000e_get_mac_address,
+        .get_irq = e1000e_get_irq,
+        .bind_irq = e1000e_bind_irq,
+        .set_mtu = e1000e_set_mtu,
+    },
+    {
+        .name = "e1000",
+        .init = e1000_init,
+        .send_pbuf = e1000_send_pbuf,
+        .receive_pbuf = e1000_receive_pbuf,
+        .irq_ack = e1000_irq_ack,
+        .get_mac_address = e1000_get_mac_address,
+        .get_irq = e1000_get_irq,
+        .set_mtu = e1000_set_mtu,
+        .tso_supported = e1000_tso_supported,
+    },
+};
+static const eth_driver_t* driver = NULL;
+#define NO_PIC_IRQ 0xFF
+static uint8_t driver_irq;             // NO_PIC_IRQ when the driver bound its own vectors
+
+// Frames we send to ourselves go here instead of to the card
+static const eth_driver_t loopback_driver = {
+    .name = "loopback",
+    .init = loopback_init,
+    .send_pbuf = loopback_send_pbuf,
+    .receive_pbuf = loopback_receive_pbuf,
+    .irq_ack = loopback_irq_ack,
+    .get_mac_address = loopback_get_mac_address,
+    .get_irq = loopback_get_irq,
+    .tso_supported = loopback_tso_supported,
+};
+
+static eth_poll_mode_t poll_mode = ETH_POLL_INTERRUPT;
+static uint32_t poll_duration_us = ETH_POLL_DEFAULT_US;
+static bool adaptive_polling = false;   // Adaptive mode is in its polling state
+static uint64_t window_packets;         // stats.packets at the start of the window
+static eth_poll_stats_t stats;
+
+// Hand a received frame to the handler registered for its type
+static void ethernet_input(pbuf_t* p) {
+    const eth_frame_t* frame = (const eth_frame_t*)p->data;
+    if (!pbuf_pull(p, ETH_HEADER_SIZE)) {
+        net_stat_drop(NET_LAYER_ETH, NET_DROP_TRUNCATED);
+        return;
+    }
+    net_stat_rx(NET_LAYER_ETH, p->len + ETH_HEADER_SIZE);
+
+    uint16_t type = (frame->type >> 8) | (frame->type << 8);
+    for (int i = 0; i < protocol_count; i++) {
+        if (protocols[i].type == type) {
+            protocols[i].callback(p, frame);
+            return;
+        }
+    }
+    net_stat_drop(NET_LAYER_ETH, NET_DROP_NO_HANDLER);
+}
+
+static void ethernet_dispatch(pbuf_t* p) {
+    net_prof_enter(NET_LAYER_ETH);
+    ethernet_input(p);
+    net_prof_exit();
+}
+
+// Hand up to budget packets from a device to the protocols, through the
+// packet filters and then GRO so consecutive TCP segments of a flow go up
+// as one
+static int ethernet_drain_device(const eth_driver_t* dev, int budget) {
+    pbuf_t* p;
+    int count = 0;
+    gro_batch_t batch;
+
+    gro_begin(&batch, ethernet_dispatch);
+    while (count < budget && (p = dev->receive_pbuf()) != NULL) {
+        count++;
+        if (!bpf_filter_frame(p)) {
+            net_stat_drop(NET_LAYER_ETH, NET_DROP_FILTERED);
+            pbuf_free(p);
+            continue;
+        }
+        gro_receive(&batch, p);
+    }
+    gro_end(&batch);
+    return count;
+}
+
+// Same for the card, counting towards the polling statistics
+static int ethernet_drain(int budget) {
+    int count = ethernet_drain_device(driver, budget);
+    stats.packets += count;
+    return count;
+}
+
+// Deliver looped back frames that nobody polled for
+static void ethernet_loopback_tick(void) {
+    ethernet_drain_device(&loopback_driver, ETH_POLL_BUDGET);
+}
+
+static uint64_t poll_cycles(void) {
+    return tsc_per_ms * poll_duration_us / 1000;
+}
+
+// Interrupt handler for received packets
+static void ethernet_irq_handler(void) {
+    stats.interrupts++;
+    driver->irq_ack();
+    while (ethernet_drain(ETH_POLL_BUDGET) == ETH_POLL_BUDGET);
+
+    // While polling is favoured, stay a little longer for the next packet
+    // instead of taking another interrupt for it. The timer is held off
+    // meanwhile, so the whole stay is bounded too.
+    if (ethernet_polling()) {
+        uint64_t limit = poll_cycles();
+        uint64_t max = tsc_per_ms * ETH_POLL_MAX_US / 1000;
+        uint64_t start = rdtsc();
+        uint64_t last = start;
+        while (rdtsc() - last < limit && rdtsc() - start < max) {
+            stats.polls++;
+            if (ethernet_drain(ETH_POLL_BUDGET)) {
+                stats.poll_hits++;
+                last = rdtsc();
+            } else {
+                __asm__ volatile("pause");
+            }
+        }
+    }
+}
+
+// Track the packet rate and switch adaptive polling on and off, with some
+// hysteresis so it doesn't flap
+static void ethernet_adaptive_tick(void) {
+    uint64_t rate = stats.packets - window_packets;
+    window_packets = stats.packets;
+    if (poll_mode != ETH_POLL_ADAPTIVE) return;
+
+    if (!adaptive_polling && rate >= ETH_ADAPTIVE_HIGH) {
+        adaptive_polling = true;
+        stats.mode_switches++;
+    } else if (adaptive_polling && rate < ETH_ADAPTIVE_LOW) {
+        adaptive_polling = false;
+        stats.mode_switches++;
+    }
+}
+
+bool ethernet_init(void) {
+    pbuf_init();
+    loopback_driver.init();
+    timer_register_periodic(ethernet_loopback_tick, 1);
+
+    // Try to initialize a network card
+    for (size_t i = 0; i < sizeof(drivers) / sizeof(drivers[0]); i++) {
+        if (drivers[i].init()) {
+            driver = &drivers[i];
+            break;
+        }
+    }
+    if (!driver) {
+        return false;
+    }
+
+    // Get our MAC address
+    driver->get_mac_address(our_mac);
+
+    // Print MAC address
+    print_str(driver->name);
+    print_str(" MAC Address: ");
+    for (int i = 0; i < 6; i++) {
+        print_hex(our_mac[i]);
+        if (i < 5) print_str(":");
+    }
+    print_str("\n");
+
+    // Prefer message signalled interrupts, otherwise register the handler on
+    // the line the firmware routed the card to
+    if (driver->bind_irq && driver->bind_irq(ethernet_irq_handler)) {
+        driver_irq = NO_PIC_IRQ;
+    } else {
+        driver_irq = driver->get_irq();
+        register_interrupt_handler(IRQ_BASE + driver_irq, ethernet_irq_handler);
+        pic_unmask_irq(driver_irq);
+    }
+    timer_register_periodic(ethernet_adaptive_tick, ETH_ADAPTIVE_WINDOW_MS);
+
+    return true;
+}
+
+static bool ethernet_output(pbuf_t* p, const uint8_t* dest_mac, uint16_t type) {
+    // Frames to ourselves never reach the card
+    const eth_driver_t* dev = memcmp(dest_mac, our_mac, 6) == 0 ? &loopback_driver : driver;
+    if (!dev) {
+        net_stat_drop(NET_LAYER_ETH, NET_DROP_NO_HANDLER);
+        return false;
+    }
+
+    eth_frame_t* eth = pbuf_push(p, ETH_HEADER_SIZE);
+    if (!eth) {
+        net_stat_drop(NET_LAYER_ETH, NET_DROP_NO_BUFFER);
+        return false;
+    }
+
+    // Build ethernet header
+    memcpy(eth->dest_mac, dest_mac, 6);
+    memcpy(eth->src_mac, our_mac, 6);
+    eth->type = (type >> 8) | (type << 8);  // Convert to network byte order
+
+    // Send frame, the device counts why it failed. Super-packets are cut up
+    // here, as late as possible, unless the device does it.
+    net_stat_tx(NET_LAYER_ETH, pbuf_length(p));
+    if (p->gso_size) {
+        if (!(net_offload_get() & NET_OFFLOAD_TSO) || !dev->tso_supported || !dev->tso_supported()) {
+            return gso_output(p, dev->send_pbuf);
+        }
+        gso_count_tso();
+    }
+    return dev->send_pbuf(p);
+}
+
+bool ethernet_send_pbuf(pbuf_t* p, const uint8_t* dest_mac, uint16_t type) {
+    net_prof_enter(NET_LAYER_ETH);
+    bool sent = ethernet_output(p, dest_mac, type);
+    net_prof_exit();
+    return sent;
+}
+
+bool ethernet_send_frame(const uint8_t* dest_mac, uint16_t type,
+                        const void* payload, uint16_t length) {
+    pbuf_t* p = pbuf_alloc(length);
+    if (!p) return false;
+
+    // Copy payload
+    memcpy(p->data, payload, length);
+
+    bool sent = ethernet_send_pbuf(p, dest_mac, type);
+    pbuf_free(p);
+    return sent;
+}
+
+void ethernet_register_callback(uint16_t type, eth_receive_callback_t callback) {
+    for (int i = 0; i < protocol_count; i++) {
+        if (protocols[i].type == type) {
+            protocols[i].callback = callback;
+            return;
+        }
+    }
+
+    if (protocol_count < ETH_MAX_PROTOCOLS) {
+        protocols[protocol_count].type = type;
+        protocols[protocol_count].callback = callback;
+        protocol_count++;
+    }
+}
+
+const eth_driver_t* ethernet_get_driver(void) {
+    return driver;
+}
+
+void ethernet_get_mac_address(uint8_t mac[6]) {
+    memcpy(mac, our_mac, 6);
+}
+
+bool ethernet_set_mtu(uint16_t mtu) {
+    if (!driver || mtu > ETH_MAX_MTU) return false;
+    if (!driver->set_mtu) return mtu <= ETH_DEFAULT_MTU;
+    return driver->set_mtu(mtu);
+}
+
+void ethernet_set_poll_mode(eth_poll_mode_t mode) {
+    poll_mode = mode;
+    adaptive_polling = false;
+}
+
+eth_poll_mode_t ethernet_get_poll_mode(void) {
+    return poll_mode;
+}
+
+void ethernet_set_poll_duration(uint32_t us) {
+    poll_duration_us = us > ETH_POLL_MAX_US ? ETH_POLL_MAX_US : us;
+}
+
+uint32_t ethernet_get_poll_duration(void) {
+    return poll_duration_us;
+}
+
+bool ethernet_polling(void) {
+    return poll_mode == ETH_POLL_BUSY ||
+           (poll_mode == ETH_POLL_ADAPTIVE && adaptive_polling);
+}
+
+int ethernet_poll(int budget) {
+    // Protocol handlers also run from timer callbacks
+    uint64_t flags = irq_save();
+    int count = ethernet_drain_device(&loopback_driver, budget);
+    if (driver && count < budget) {
+        count += ethernet_drain(budget - count);
+    }
+    irq_restore(flags);
+
+    stats.polls++;
+    if (count) stats.poll_hits++;
+    return count;
+}
+
+void ethernet_wait(void) {
+    // Looped back frames are delivered right away, they raise no interrupt
+    if (loopback_pending()) {
+        uint64_t flags = irq_save();
+        ethernet_drain_device(&loopback_driver, ETH_POLL_BUDGET);
+        irq_restore(flags);
+        return;
+    }
+
+    if (driver && ethernet_polling() && poll_duration_us) {
+        // Keep the NIC quiet while spinning, the timer still runs. An MSI
+        // arriving meanwhile only finds the ring already drained.
+        if (driver_irq != NO_PIC_IRQ) pic_mask_irq(driver_irq);
+        uint64_t start = rdtsc();
+        uint64_t limit = poll_cycles();
+        uint64_t tick = tick_count;
+        int count = 0;
+        while (!count && tick_count == tick && rdtsc() - start < limit) {
+            count = ethernet_poll(ETH_POLL_BUDGET);
+            if (!count) __asm__ volatile("pause");
+        }
+
+        // Clear the pending interrupt for whatever was drained, and catch
+        // anything that came in before it was cleared
+        uint64_t flags = irq_save();
+        driver->irq_ack();
+        count += ethernet_drain(ETH_POLL_BUDGET);
+        if (driver_irq != NO_PIC_IRQ) pic_unmask_irq(driver_irq);
+        if (count || tick_count != tick) {
+            irq_restore(flags);
+            return;
+        }
+        // Interrupts are off here, sti only takes effect after hlt so
+        // nothing can slip in between
+        __asm__ volatile("sti; hlt");
+        return;
+    }
+    __asm__ volatile("hlt");
+}
+
+const eth_poll_stats_t* ethernet_get_poll_stats(void) {
+    return &stats;
+}
+
+void ethernet_reset_poll_stats(void) {
+    uint64_t flags = irq_save();
+    memset(&stats, 0, sizeof(stats));
+    window_packets = 0;
+    irq_restore(flags);
+}
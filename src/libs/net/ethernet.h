@@ -0,0 +1,120 @@
+#pragma once
+
+#include "../types.h"
+#include "../print.h"
+#include "../interrupt.h"
+#include "pbuf.h"
+
+#define ETH_TYPE_IP    0x0800
+#define ETH_TYPE_ARP   0x0806
+
+#define ETH_HEADER_SIZE 14
+#define ETH_DEFAULT_MTU 1500
+#define ETH_MAX_MTU     9000    // Jumbo frames, cards with a set_mtu hook only
+#define ETH_MAX_PROTOCOLS 8
+
+// Receive polling
+#define ETH_POLL_DEFAULT_US     50     // How long to spin before sleeping
+#define ETH_POLL_MAX_US         500    // Interrupts are held off this long at most
+#define ETH_POLL_BUDGET         64     // Packets handled per poll
+#define ETH_ADAPTIVE_WINDOW_MS  10     // Packet rate sampling interval
+#define ETH_ADAPTIVE_HIGH       20     // Packets per window to start polling
+#define ETH_ADAPTIVE_LOW        4      // Packets per window to stop again
+
+typedef struct {
+    uint8_t  dest_mac[6];
+    uint8_t  src_mac[6];
+    uint16_t type;
+    uint8_t  payload[];
+} __attribute__((packed)) eth_frame_t;
+
+// A network card driver. The ethernet layer uses the first one that
+// initializes, in the order of the driver table in ethernet.c.
+typedef struct {
+    const char* name;
+    bool (*init)(void);
+    bool (*send_pbuf)(pbuf_t* p);         // Takes its own reference
+    pbuf_t* (*receive_pbuf)(void);        // Non-blocking, NULL when empty
+    void (*irq_ack)(void);                // Called first in the interrupt handler
+    void (*get_mac_address)(uint8_t mac[6]);
+    uint8_t (*get_irq)(void);             // Legacy IRQ line
+    bool (*bind_irq)(isr_t handler);      // Optional, route interrupts to handler
+                                          // without the PIC, false to stay on it
+    bool (*set_mtu)(uint16_t mtu);        // Optional, without it the MTU stays
+                                          // at ETH_DEFAULT_MTU
+    bool (*tso_supported)(void);          // Optional, whether send_pbuf takes TCP
+                                          // super-packets (gso_size set) whole
+} eth_driver_t;
+
+// How waiting for received packets works
+typedef enum {
+    ETH_POLL_INTERRUPT,   // Sleep until the NIC interrupts
+    ETH_POLL_BUSY,        // Spin on the receive ring for the poll duration first
+    ETH_POLL_ADAPTIVE,    // Busy poll while the packet rate is high
+} eth_poll_mode_t;
+
+typedef struct {
+    uint64_t interrupts;     // NIC interrupts taken
+    uint64_t polls;          // Receive ring polls outside the interrupt handler
+    uint64_t poll_hits;      // Polls that found packets
+    uint64_t packets;        // Packets received
+    uint64_t mode_switches;  // Adaptive switches between sleeping and polling
+} eth_poll_stats_t;
+
+// Initialize ethernet subsystem. Returns false if no network card was
+// found, frames to ourselves still work through the loopback device then.
+bool ethernet_init(void);
+
+// The driver in use, NULL before ethernet_init succeeded
+const eth_driver_t* ethernet_get_driver(void);
+
+// Our MAC address
+void ethernet_get_mac_address(uint8_t mac[6]);
+
+// Let the card receive frames for an MTU of up to ETH_MAX_MTU. Returns
+// false if it can't.
+bool ethernet_set_mtu(uint16_t mtu);
+
+// Send an ethernet frame
+bool ethernet_send_frame(const uint8_t* dest_mac, uint16_t type,
+                        const void* payload, uint16_t length);
+
+// Send a packet buffer as an ethernet frame. The header is prepended in the
+// buffer's headroom and the buffer goes to the NIC as is, or to the loopback
+// device when dest_mac is our own address. TCP super-packets are segmented
+// in software first unless the device does TSO. The caller keeps its
+// reference and still has to free p.
+bool ethernet_send_pbuf(pbuf_t* p, const uint8_t* dest_mac, uint16_t type);
+
+// Callback for received frames of a registered type. packet->data points at
+// the payload (past the ethernet header), frame at the start of the frame.
+// The buffer is freed after the callback returns, take a reference to keep it.
+typedef void (*eth_receive_callback_t)(pbuf_t* packet, const eth_frame_t* frame);
+
+// Register a callback for received frames with the given ethertype
+void ethernet_register_callback(uint16_t type, eth_receive_callback_t callback);
+
+// Select the receive polling mode
+void ethernet_set_poll_mode(eth_poll_mode_t mode);
+eth_poll_mode_t ethernet_get_poll_mode(void);
+
+// How long to busy poll before going back to interrupts, capped at ETH_POLL_MAX_US
+void ethernet_set_poll_duration(uint32_t us);
+uint32_t ethernet_get_poll_duration(void);
+
+// Whether waits currently busy poll, always the case in ETH_POLL_BUSY
+bool ethernet_polling(void);
+
+// Handle up to budget received packets, looped back ones first. TCP
+// segments of a flow within one batch are coalesced (GRO). Returns how many
+// there were.
+int ethernet_poll(int budget);
+
+// Wait for something to happen, replaces hlt in blocking network calls.
+// Busy polls the receive ring first when polling is active. Returns after
+// packets were handled or an interrupt came in, callers check their
+// condition again.
+void ethernet_wait(void);
+
+const eth_poll_stats_t* ethernet_get_poll_stats(void);
+void ethernet_reset_poll_stats(void);
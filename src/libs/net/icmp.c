@@ -0,0 +1,131 @@
+#include "icmp.h"
+#include "ip.h"
+#include "checksum.h"
+#include "netstat.h"
+#include "../string.h"
+#include "../print.h"
+
+static icmp_echo_reply_handler_t echo_reply_handler = NULL;
+
+static void icmp_input(pbuf_t* packet, const ip_header_t* ip) {
+    const icmp_header_t* icmp = (const icmp_header_t*)packet->data;
+
+    if (packet->len < sizeof(icmp_header_t)) {
+        net_stat_drop(NET_LAYER_ICMP, NET_DROP_TRUNCATED);
+        return;
+    }
+    net_stat_rx(NET_LAYER_ICMP, packet->len);
+
+    // Loopback vouches for checksums it was asked to fill in without
+    // computing them
+    bool vouched = packet->flags & PBUF_RX_L4_CSUM_OK;
+    if (!vouched && inet_checksum(icmp, packet->len) != 0) {
+        net_stat_drop(NET_LAYER_ICMP, NET_DROP_CHECKSUM);
+        return;
+    }
+
+    if (icmp->type == ICMP_ECHO_REQUEST) {
+        // Turn the request into the reply in place, the payload is never copied
+        pbuf_t* reply = pbuf_writable(packet);
+        if (!reply) {
+            net_stat_drop(NET_LAYER_ICMP, NET_DROP_NO_BUFFER);
+            return;
+        }
+        icmp_header_t* reply_icmp = (icmp_header_t*)reply->data;
+        uint32_t src_ip = ip->src_ip;
+
+        // Modify for reply, only the type changes so the checksum is patched
+        // instead of summing the payload again. A vouched for request may
+        // not carry a checksum to patch, its reply leaves it to the NIC.
+        uint16_t old_word = *(const csum_field_t*)reply_icmp;
+        reply_icmp->type = ICMP_ECHO_REPLY;
+        if (vouched) {
+            reply_icmp->checksum = 0;
+            reply->flags |= PBUF_TX_L4_CSUM;
+            reply->csum_start = pbuf_headroom(reply);
+            reply->csum_offset = 2;
+        } else {
+            csum_replace16(&reply_icmp->checksum, old_word, *(const csum_field_t*)reply_icmp);
+        }
+
+        // Send reply
+        uint16_t length = reply->len;
+        if (ip_send_pbuf(reply, src_ip, IP_PROTOCOL_ICMP)) {
+            net_stat_tx(NET_LAYER_ICMP, length);
+        }
+        pbuf_free(reply);
+    }
+    else if (icmp->type == ICMP_ECHO_REPLY) {
+        if (echo_reply_handler) {
+            echo_reply_handler(ip->src_ip, ntohs(icmp->identifier), ntohs(icmp->sequence),
+                               icmp->data, packet->len - sizeof(icmp_header_t));
+            return;
+        }
+
+        // Print received ping reply
+        print_str("Ping reply from ");
+        print_ip(ntohl(ip->src_ip));
+        print_str(": seq=");
+        print_number(__builtin_bswap16(icmp->sequence));
+        print_str("\n");
+    }
+}
+
+static void icmp_receive(pbuf_t* packet, const ip_header_t* ip) {
+    net_prof_enter(NET_LAYER_ICMP);
+    icmp_input(packet, ip);
+    net_prof_exit();
+}
+
+void icmp_init(void) {
+    ip_register_protocol_handler(IP_PROTOCOL_ICMP, icmp_receive);
+}
+
+void icmp_set_echo_reply_handler(icmp_echo_reply_handler_t handler) {
+    echo_reply_handler = handler;
+}
+
+static bool icmp_output_echo(uint32_t dest_ip, uint16_t identifier,
+                             uint16_t sequence, uint16_t payload_len) {
+    pbuf_t* packet = pbuf_alloc(sizeof(icmp_header_t) + payload_len);
+    if (!packet) {
+        net_stat_drop(NET_LAYER_ICMP, NET_DROP_NO_BUFFER);
+        return false;
+    }
+    icmp_header_t* icmp = (icmp_header_t*)packet->data;
+
+    // Fill ICMP header
+    icmp->type = ICMP_ECHO_REQUEST;
+    icmp->code = 0;
+    icmp->checksum = 0;
+    icmp->identifier = htons(identifier);
+    icmp->sequence = htons(sequence);
+
+    // Add some data
+    for (int i = 0; i < payload_len; i++) {
+        icmp->data[i] = i;
+    }
+
+    // Leave the checksum to the NIC
+    packet->flags |= PBUF_TX_L4_CSUM;
+    packet->csum_start = pbuf_headroom(packet);
+    packet->csum_offset = 2;
+
+    // Send packet
+    bool sent = ip_send_pbuf(packet, dest_ip, IP_PROTOCOL_ICMP);
+    if (sent) {
+        net_stat_tx(NET_LAYER_ICMP, sizeof(icmp_header_t) + payload_len);
+    }
+    pbuf_free(packet);
+    return sent;
+}
+
+bool icmp_send_echo_request(uint32_t dest_ip, uint16_t identifier,
+                            uint16_t sequence, uint16_t payload_len) {
+    if (payload_len > ICMP_ECHO_MAX_PAYLOAD) return false;
+
+    net_prof_enter(NET_LAYER_ICMP);
+    bool sent = icmp_output_echo(dest_ip, identifier, sequence, payload_len);
+    net_prof_exit();
+    return sent;
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+#include <stdint.h>
+#include "../types.h"
+
+#define ICMP_ECHO_REQUEST 8
+#define ICMP_ECHO_REPLY   0
+
+typedef struct {
+    uint8_t  type;
+    uint8_t  code;
+    uint16_t checksum;
+    uint16_t identifier;
+    uint16_t sequence;
+    uint8_t  data[];
+} __attribute__((packed)) icmp_header_t;
+
+#define ICMP_ECHO_MAX_PAYLOAD 8972   // Fills a 9000 byte MTU
+
+// Called from the receive path for every echo reply. payload points at the
+// data after the ICMP header, id and sequence are in host byte order.
+typedef void (*icmp_echo_reply_handler_t)(uint32_t src_ip, uint16_t identifier,
+                                          uint16_t sequence, const uint8_t* payload,
+                                          uint16_t payload_len);
+
+// Initialize ICMP subsystem
+void icmp_init(void);
+
+// Send an ICMP echo request (ping) with payload_len bytes of pattern data
+bool icmp_send_echo_request(uint32_t dest_ip, uint16_t identifier,
+                            uint16_t sequence, uint16_t payload_len);
+
+// Take over echo replies, NULL goes back to printing them
+void icmp_set_echo_reply_handler(icmp_echo_reply_handler_t handler);
@@ -0,0 +1,245 @@
+#include "ip.h"
+#include "arp.h"
+#include "ethernet.h"
+#include "checksum.h"
+#include "netstat.h"
+#include "netif.h"
+#include "route.h"
+#include "../string.h"
+
+static uint16_t ip_id = 0;
+static ip_receive_callback_t protocol_handlers[256] = {0};
+static netif_t* loopback_netif = NULL;
+static netif_t* ethernet_netif = NULL;
+
+static void ip_receive(pbuf_t* packet, const eth_frame_t* frame);
+
+// Frames addressed to our own MAC never reach the card, the ethernet layer
+// loops them back
+static bool loopback_output(netif_t* netif, pbuf_t* p, uint32_t next_hop) {
+    (void)netif;
+    (void)next_hop;
+    uint8_t mac[6];
+    ethernet_get_mac_address(mac);
+    return ethernet_send_pbuf(p, mac, ETH_TYPE_IP);
+}
+
+// Anything else is sent or queued until ARP resolves the next hop
+static bool ethernet_netif_output(netif_t* netif, pbuf_t* p, uint32_t next_hop) {
+    (void)netif;
+    return arp_output(p, next_hop);
+}
+
+static bool ethernet_netif_set_mtu(netif_t* netif, uint16_t mtu) {
+    (void)netif;
+    return ethernet_set_mtu(mtu);
+}
+
+void ip_init(void) {
+    loopback_netif = netif_add("lo", NETIF_DEFAULT_MTU, loopback_output);
+    netif_set_address(loopback_netif, IP_LOOPBACK, IP_ADDR(255, 0, 0, 0));
+    if (ethernet_get_driver()) {
+        ethernet_netif = netif_add("eth0", NETIF_DEFAULT_MTU, ethernet_netif_output);
+        ethernet_netif->set_mtu = ethernet_netif_set_mtu;
+    }
+    ethernet_register_callback(ETH_TYPE_IP, ip_receive);
+}
+
+uint32_t ip_get_address(void) {
+    return ethernet_netif ? ethernet_netif->addr : 0;
+}
+
+void ip_set_address(uint32_t ip) {
+    if (ethernet_netif) {
+        netif_set_address(ethernet_netif, ip, ethernet_netif->netmask);
+    }
+}
+
+bool ip_is_local(uint32_t addr) {
+    return IP_ADDR_PART1(addr) == 127 || netif_for_address(addr) != NULL;
+}
+
+uint32_t ip_source_address(uint32_t dest_ip) {
+    // Packets to ourselves come from the address they are sent to
+    if (ip_is_local(dest_ip)) {
+        return dest_ip;
+    }
+    const route_t* route = route_lookup(dest_ip);
+    return route ? route->netif->addr : 0;
+}
+
+uint16_t ip_route_mtu(uint32_t dest_ip) {
+    if (ip_is_local(dest_ip)) {
+        return loopback_netif->mtu;
+    }
+    const route_t* route = route_lookup(dest_ip);
+    return route ? route_mtu(route) : NETIF_DEFAULT_MTU;
+}
+
+static bool ip_output(pbuf_t* packet, uint32_t dest_ip, uint8_t protocol) {
+    // Local destinations go through the loopback interface, anything else
+    // where the most specific route says
+    netif_t* netif;
+    uint32_t src_ip, next_hop;
+    uint16_t mtu;
+    if (ip_is_local(dest_ip)) {
+        netif = loopback_netif;
+        src_ip = dest_ip;
+        next_hop = dest_ip;
+        mtu = netif->mtu;
+    } else {
+        const route_t* route = route_lookup(dest_ip);
+        if (!route || !route->netif->up) {
+            net_stat_drop(NET_LAYER_IP, NET_DROP_NO_ROUTE);
+            return false;
+        }
+        netif = route->netif;
+        src_ip = netif->addr;
+        next_hop = route->gateway ? route->gateway : dest_ip;
+        mtu = route_mtu(route);
+    }
+
+    // Nothing fragments, packets have to fit as they are. A TCP super-packet
+    // leaves as segments of gso_size payload bytes behind a copy of its TCP
+    // header, each of which has to fit and takes an IP ID.
+    uint32_t length = pbuf_length(packet);
+    uint16_t ids = 1;
+    if (packet->gso_size) {
+        uint16_t tcp_header_len = (packet->data[12] >> 4) * 4;
+        uint32_t payload = packet->len - tcp_header_len;
+        length = tcp_header_len + packet->gso_size;
+        ids = (payload + packet->gso_size - 1) / packet->gso_size;
+    }
+    if (length + sizeof(ip_header_t) > mtu) {
+        net_stat_drop(NET_LAYER_IP, NET_DROP_TOO_BIG);
+        return false;
+    }
+
+    // Prepend the IP header in front of the payload
+    ip_header_t* ip = pbuf_push(packet, sizeof(ip_header_t));
+    if (!ip) {
+        net_stat_drop(NET_LAYER_IP, NET_DROP_NO_BUFFER);
+        return false;
+    }
+
+    // Fill IP header
+    ip->version_ihl = 0x45;  // IPv4, 5 DWORDS header length
+    ip->tos = 0;
+    ip->total_length = __builtin_bswap16(pbuf_length(packet));
+    ip->id = __builtin_bswap16(ip_id);
+    ip_id += ids;
+    ip->flags_fragment = 0;
+    ip->ttl = 64;
+    ip->protocol = protocol;
+    ip->checksum = 0;
+    ip->src_ip = src_ip;
+    ip->dest_ip = dest_ip;
+
+    // The header checksum is filled in by the NIC, or by the driver if it can't
+    packet->flags |= PBUF_TX_IP_CSUM;
+    packet->l3_start = pbuf_headroom(packet);
+    length = pbuf_length(packet);
+
+    if (!netif->output(netif, packet, next_hop)) return false;
+    net_stat_tx(NET_LAYER_IP, length);
+    return true;
+}
+
+bool ip_send_pbuf(pbuf_t* packet, uint32_t dest_ip, uint8_t protocol) {
+    net_prof_enter(NET_LAYER_IP);
+    bool sent = ip_output(packet, dest_ip, protocol);
+    net_prof_exit();
+    return sent;
+}
+
+bool ip_send_packet(uint32_t dest_ip, uint8_t protocol, const void* data, uint16_t length) {
+    pbuf_t* packet = pbuf_alloc(length);
+    if (!packet) return false;
+
+    // Copy payload
+    memcpy(packet->data, data, length);
+
+    bool sent = ip_send_pbuf(packet, dest_ip, protocol);
+    pbuf_free(packet);
+    return sent;
+}
+
+uint32_t ip_str_to_addr(const char* str) {
+    uint32_t addr = 0;
+
+    // Dotted quad, stored in network byte order like IP_ADDR
+    for (int part = 0; part < 4; part++) {
+        if (*str < '0' || *str > '9') return 0;
+        uint32_t value = 0;
+        while (*str >= '0' && *str <= '9') {
+            value = value * 10 + (*str++ - '0');
+            if (value > 255) return 0;
+        }
+        addr |= value << (part * 8);
+        if (part < 3 && *str++ != '.') return 0;
+    }
+    return *str == '\0' ? addr : 0;
+}
+
+void ip_register_protocol_handler(uint8_t protocol, ip_receive_callback_t callback) {
+    protocol_handlers[protocol] = callback;
+}
+
+// Handle received IP packets
+static void ip_input(pbuf_t* packet) {
+    const ip_header_t* ip = (const ip_header_t*)packet->data;
+
+    // Basic validation
+    if (packet->len < sizeof(ip_header_t)) {
+        net_stat_drop(NET_LAYER_IP, NET_DROP_TRUNCATED);
+        return;
+    }
+    net_stat_rx(NET_LAYER_IP, packet->len);
+    if ((ip->version_ihl >> 4) != 4) {  // IPv4 only
+        net_stat_drop(NET_LAYER_IP, NET_DROP_MALFORMED);
+        return;
+    }
+
+    uint16_t header_length = (ip->version_ihl & 0x0F) * 4;
+    uint16_t total_length = __builtin_bswap16(ip->total_length);
+    if (header_length < sizeof(ip_header_t) || total_length < header_length) {
+        net_stat_drop(NET_LAYER_IP, NET_DROP_MALFORMED);
+        return;
+    }
+    if (total_length > packet->len) {
+        net_stat_drop(NET_LAYER_IP, NET_DROP_TRUNCATED);
+        return;
+    }
+
+    // Verify the header checksum unless the NIC already did
+    if (!(packet->flags & PBUF_RX_IP_CSUM_OK) && inet_checksum(ip, header_length) != 0) {
+        net_stat_drop(NET_LAYER_IP, NET_DROP_CHECKSUM);
+        return;
+    }
+
+    // Check if packet is for us
+    if (!ip_is_local(ip->dest_ip)) {
+        net_stat_drop(NET_LAYER_IP, NET_DROP_NOT_FOR_US);
+        return;
+    }
+
+    // Drop ethernet padding and step over the header to the payload. The
+    // header stays in the headroom, upper layers find it through l3_start.
+    packet->l3_start = pbuf_headroom(packet);
+    pbuf_trim(packet, total_length);
+    pbuf_pull(packet, header_length);
+
+    // Call protocol handler if registered
+    if (protocol_handlers[ip->protocol]) {
+        protocol_handlers[ip->protocol](packet, ip);
+    } else {
+        net_stat_drop(NET_LAYER_IP, NET_DROP_NO_HANDLER);
+    }
+}
+
+static void ip_receive(pbuf_t* packet, const eth_frame_t* frame) {
+    (void)frame;
+    net_prof_enter(NET_LAYER_IP);
+    ip_input(packet);
+    net_prof_exit();
+}
@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "../types.h"
+#include "pbuf.h"
 
 // IP Protocol numbers
 #define IP_PROTOCOL_ICMP  1
@@ -40,25 +41,46 @@ typedef struct {
 #define IP_ADDR_PART3(addr) (((addr) >> 16) & 0xFF)
 #define IP_ADDR_PART4(addr) (((addr) >> 24) & 0xFF)
 
-// Callback type for received packets
-typedef void (*ip_receive_callback_t)(const ip_header_t* packet, uint16_t length);
+#define IP_LOOPBACK IP_ADDR(127, 0, 0, 1)
 
-// Initialize IP subsystem with our IP address
-void ip_init(uint32_t our_ip);
+// Callback type for received packets. packet->data points at the protocol
+// payload, ip at the header in front of it. The buffer is freed after the
+// callback returns, take a reference to keep it.
+typedef void (*ip_receive_callback_t)(pbuf_t* packet, const ip_header_t* ip);
 
-// Get our IP address
+// Initialize IP subsystem. Creates the loopback interface (127.0.0.1/8)
+// and, if there is a network card, an unconfigured eth0.
+void ip_init(void);
+
+// Address of eth0, 0 without a network card
 uint32_t ip_get_address(void);
 
-// Set our IP address
+// Change the address of eth0, keeping its netmask
 void ip_set_address(uint32_t ip);
 
+// Source address for packets to dest_ip: the address of the interface the
+// route leads out of, or dest_ip itself for local destinations. 0 if there
+// is no route.
+uint32_t ip_source_address(uint32_t dest_ip);
+
+// Largest packet, IP header included, that can be sent to dest_ip
+uint16_t ip_route_mtu(uint32_t dest_ip);
+
 // Send an IP packet
 bool ip_send_packet(uint32_t dest_ip, uint8_t protocol, const void* data, uint16_t length);
 
+// Send a packet buffer holding the protocol payload. The IP header is
+// prepended in the headroom, the caller keeps its reference. The headers
+// stay in the buffer, so use a fresh buffer for every packet.
+bool ip_send_pbuf(pbuf_t* packet, uint32_t dest_ip, uint8_t protocol);
+
+// Whether an address is ours, including the 127.0.0.0/8 loopback range
+bool ip_is_local(uint32_t addr);
+
 // Register a callback for a specific protocol
 void ip_register_protocol_handler(uint8_t protocol, ip_receive_callback_t callback);
 
-// Convert string to IP address
+// Convert a dotted quad to an address in network byte order, 0 if malformed
 uint32_t ip_str_to_addr(const char* str);
 
 // Convert IP address to string (buffer should be at least 16 bytes)
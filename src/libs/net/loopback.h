@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pbuf.h"
+
+#define LOOPBACK_QUEUE_SIZE 256   // Frames waiting to be received, power of two
+
+// Set up the loopback device, it has no hardware and always succeeds
+bool loopback_init(void);
+
+// Queue a frame to be received again. Takes its own reference, the caller
+// still has to free p. Returns false if the queue is full.
+bool loopback_send_pbuf(pbuf_t* p);
+
+// Next looped back frame or NULL. The caller owns the reference.
+pbuf_t* loopback_receive_pbuf(void);
+
+// Nothing to acknowledge, for the driver table
+void loopback_irq_ack(void);
+
+// All zero, frames are looped back by destination, not by this address
+void loopback_get_mac_address(uint8_t mac[6]);
+
+// No interrupt line
+uint8_t loopback_get_irq(void);
+
+// Super-packets need no segmenting, the receiving side takes them whole
+bool loopback_tso_supported(void);
+
+// Frames waiting in the queue
+uint32_t loopback_pending(void);
@@ -0,0 +1,85 @@
+#include "netif.h"
+#include "route.h"
+#include "ip.h"
+#include "../string.h"
+
+static netif_t interfaces[NETIF_MAX];
+static int interface_count = 0;
+
+netif_t* netif_add(const char* name, uint16_t mtu, netif_output_t output) {
+    if (interface_count == NETIF_MAX || strlen(name) >= NETIF_NAME_LEN || netif_find(name)) {
+        return NULL;
+    }
+
+    netif_t* netif = &interfaces[interface_count++];
+    memset(netif, 0, sizeof(*netif));
+    strcpy(netif->name, name);
+    netif->mtu = mtu;
+    netif->up = true;
+    netif->output = output;
+    return netif;
+}
+
+netif_t* netif_find(const char* name) {
+    for (int i = 0; i < interface_count; i++) {
+        if (strcmp(interfaces[i].name, name) == 0) {
+            return &interfaces[i];
+        }
+    }
+    return NULL;
+}
+
+netif_t* netif_get(int index) {
+    return index >= 0 && index < interface_count ? &interfaces[index] : NULL;
+}
+
+bool netif_set_address(netif_t* netif, uint32_t addr, uint32_t netmask) {
+    int length = netif_mask_to_length(netmask);
+    if (length < 0) return false;
+
+    // Replace the connected route, unless another route took its place
+    if (netif->addr) {
+        int old_length = netif_mask_to_length(netif->netmask);
+        const route_t* old = route_find(netif->addr & netif->netmask, old_length);
+        if (old && old->netif == netif && old->gateway == 0) {
+            route_delete(netif->addr & netif->netmask, old_length);
+        }
+    }
+
+    netif->addr = addr;
+    netif->netmask = netmask;
+    if (addr) {
+        return route_add(addr & netmask, length, 0, netif, 0);
+    }
+    return true;
+}
+
+bool netif_set_mtu(netif_t* netif, uint16_t mtu) {
+    if (mtu < NETIF_MIN_MTU || mtu > NETIF_MAX_MTU) return false;
+    if (netif->set_mtu && !netif->set_mtu(netif, mtu)) return false;
+
+    netif->mtu = mtu;
+    return true;
+}
+
+netif_t* netif_for_address(uint32_t addr) {
+    for (int i = 0; i < interface_count; i++) {
+        if (interfaces[i].addr == addr && addr != 0) {
+            return &interfaces[i];
+        }
+    }
+    return NULL;
+}
+
+int netif_mask_to_length(uint32_t netmask) {
+    uint32_t host = ntohl(netmask);
+    int length = 0;
+    while (length < 32 && (host & (0x80000000u >> length))) {
+        length++;
+    }
+    return netif_length_to_mask(length) == netmask ? length : -1;
+}
+
+uint32_t netif_length_to_mask(uint8_t length) {
+    return length == 0 ? 0 : htonl(0xFFFFFFFFu << (32 - length));
+}
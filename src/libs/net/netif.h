@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pbuf.h"
+
+#define NETIF_MAX          4
+#define NETIF_NAME_LEN     8
+#define NETIF_DEFAULT_MTU  1500
+#define NETIF_MIN_MTU      68      // What IPv4 requires every link to carry
+#define NETIF_MAX_MTU      9000    // Largest frame a jumbo buffer holds
+
+struct netif;
+
+// Hand a packet, IP header included, to the link. next_hop is the neighbor
+// that gets the frame: the destination itself or the route's gateway.
+typedef bool (*netif_output_t)(struct netif* netif, pbuf_t* p, uint32_t next_hop);
+
+// Prepare the link for a new MTU, false if it can't carry it
+typedef bool (*netif_set_mtu_t)(struct netif* netif, uint16_t mtu);
+
+// An IP interface. Addresses are in network byte order, 0 if unconfigured.
+typedef struct netif {
+    char name[NETIF_NAME_LEN];
+    uint32_t addr;
+    uint32_t netmask;
+    uint16_t mtu;
+    bool up;
+    netif_output_t output;
+    netif_set_mtu_t set_mtu;     // Optional, any MTU goes without it
+} netif_t;
+
+// Create an interface, NULL if the table is full or the name is taken
+netif_t* netif_add(const char* name, uint16_t mtu, netif_output_t output);
+
+// Look an interface up by name
+netif_t* netif_find(const char* name);
+
+// Interfaces in the order they were added, NULL past the last one
+netif_t* netif_get(int index);
+
+// Set the address and netmask. The route to the old subnet goes away and
+// one to the new subnet is added, so it is reachable without a gateway.
+bool netif_set_address(netif_t* netif, uint32_t addr, uint32_t netmask);
+
+// Change the MTU, between NETIF_MIN_MTU and NETIF_MAX_MTU. Established TCP
+// connections keep the segment size they agreed on.
+bool netif_set_mtu(netif_t* netif, uint16_t mtu);
+
+// The interface owning a local address, NULL if no interface has it
+netif_t* netif_for_address(uint32_t addr);
+
+// Prefix length of a netmask, or -1 if its bits aren't contiguous
+int netif_mask_to_length(uint32_t netmask);
+
+// Netmask of a prefix length (0-32)
+uint32_t netif_length_to_mask(uint8_t length);
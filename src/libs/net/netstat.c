@@ -0,0 +1,86 @@
+#include "netstat.h"
+#include "../string.h"
+#include "../timer.h"
+#include "../interrupt.h"
+
+net_counters_t net_counters[NET_STATS_CPUS][NET_LAYER_COUNT];
+bool net_prof_enabled = false;
+
+// Layers currently running, innermost last
+static struct {
+    net_layer_t stack[NET_PROF_DEPTH];
+    int depth;
+    uint64_t mark;       // When the innermost layer was last charged up to
+} prof;
+
+static const char* layer_names[NET_LAYER_COUNT] = {
+    "nic", "lo", "eth", "arp", "ip", "icmp", "udp", "tcp",
+};
+
+static const char* drop_names[NET_DROP_COUNT] = {
+    "truncated", "malformed", "checksum", "not-for-us", "no-handler",
+    "no-buffer", "ring-full", "queue-full", "unresolved", "no-route",
+    "too-big", "filtered",
+};
+
+void net_stats_collect(net_counters_t* totals) {
+    memset(totals, 0, sizeof(net_counters_t) * NET_LAYER_COUNT);
+
+    // Counters are 64 bit and written with single instructions, so a
+    // concurrent update can't tear a value, only make the sum a bit stale
+    for (int cpu = 0; cpu < NET_STATS_CPUS; cpu++) {
+        for (int layer = 0; layer < NET_LAYER_COUNT; layer++) {
+            const uint64_t* src = (const uint64_t*)&net_counters[cpu][layer];
+            uint64_t* dst = (uint64_t*)&totals[layer];
+            for (size_t i = 0; i < sizeof(net_counters_t) / sizeof(uint64_t); i++) {
+                dst[i] += ((const volatile uint64_t*)src)[i];
+            }
+        }
+    }
+}
+
+void net_stats_reset(void) {
+    memset(net_counters, 0, sizeof(net_counters));
+}
+
+const char* net_layer_name(net_layer_t layer) {
+    return layer < NET_LAYER_COUNT ? layer_names[layer] : "?";
+}
+
+const char* net_drop_name(net_drop_t reason) {
+    return reason < NET_DROP_COUNT ? drop_names[reason] : "?";
+}
+
+// Charge the time since the last mark to the innermost layer
+static inline void prof_charge(uint64_t now) {
+    if (prof.depth > 0 && prof.depth <= NET_PROF_DEPTH) {
+        net_stat_add(&net_counters[net_stats_cpu()][prof.stack[prof.depth - 1]].cycles,
+                     now - prof.mark);
+    }
+    prof.mark = now;
+}
+
+void net_prof_push(net_layer_t layer) {
+    uint64_t flags = irq_save();
+    prof_charge(rdtsc());
+    if (prof.depth < NET_PROF_DEPTH) {
+        prof.stack[prof.depth] = layer;
+    }
+    prof.depth++;
+    irq_restore(flags);
+}
+
+void net_prof_pop(void) {
+    uint64_t flags = irq_save();
+    if (prof.depth > 0) {
+        prof_charge(rdtsc());
+        prof.depth--;
+    }
+    irq_restore(flags);
+}
+
+void net_prof_enable(bool enabled) {
+    prof.depth = 0;
+    prof.mark = rdtsc();
+    net_prof_enabled = enabled;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdint.h>
+#include "../types.h"
+
+// Counters are kept per CPU and only ever touched by their own CPU, so
+// they need no locks. Each update is a single add instruction, which an
+// interrupt can't split, so the receive path and blocked senders can
+// count into the same slot. There is one CPU for now.
+#define NET_STATS_CPUS 1
+
+typedef enum {
+    NET_LAYER_NIC,      // Descriptor rings of the network card
+    NET_LAYER_LO,       // Loopback queue
+    NET_LAYER_ETH,      // Ethertype demux
+    NET_LAYER_ARP,
+    NET_LAYER_IP,
+    NET_LAYER_ICMP,
+    NET_LAYER_UDP,
+    NET_LAYER_TCP,
+    NET_LAYER_COUNT
+} net_layer_t;
+
+typedef enum {
+    NET_DROP_TRUNCATED,    // Shorter than its headers say, or cut off by the NIC
+    NET_DROP_MALFORMED,    // Bad version, header length or field values
+    NET_DROP_CHECKSUM,     // Checksum failed
+    NET_DROP_NOT_FOR_US,   // Addressed to another host
+    NET_DROP_NO_HANDLER,   // Unknown ethertype or protocol, no socket on the port
+    NET_DROP_NO_BUFFER,    // Buffer pool or headroom exhausted
+    NET_DROP_RING_FULL,    // Transmit ring full
+    NET_DROP_QUEUE_FULL,   // Socket or resolution queue full
+    NET_DROP_UNRESOLVED,   // No link address for the next hop
+    NET_DROP_NO_ROUTE,     // No route to the destination, or its interface is down
+    NET_DROP_TOO_BIG,      // Larger than the MTU of the route
+    NET_DROP_FILTERED,     // Rejected by an attached packet filter
+    NET_DROP_COUNT
+} net_drop_t;
+
+typedef struct {
+    uint64_t rx_packets;
+    uint64_t rx_bytes;
+    uint64_t tx_packets;
+    uint64_t tx_bytes;
+    uint64_t drops[NET_DROP_COUNT];
+    uint64_t ring_full;       // Times the transmit ring had no room
+    uint64_t csum_errors;     // Checksum failures, whoever noticed them
+    uint64_t misses;          // Neighbor cache lookups that found nothing
+    uint64_t cycles;          // TSC cycles spent in the layer itself while profiling
+} net_counters_t;
+
+extern net_counters_t net_counters[NET_STATS_CPUS][NET_LAYER_COUNT];
+
+static inline uint32_t net_stats_cpu(void) {
+    return 0;
+}
+
+static inline void net_stat_add(uint64_t* counter, uint64_t value) {
+    __asm__ volatile("addq %1, %0" : "+m"(*counter) : "er"(value));
+}
+
+static inline void net_stat_rx(net_layer_t layer, uint64_t bytes) {
+    net_counters_t* c = &net_counters[net_stats_cpu()][layer];
+    net_stat_add(&c->rx_packets, 1);
+    net_stat_add(&c->rx_bytes, bytes);
+}
+
+static inline void net_stat_tx(net_layer_t layer, uint64_t bytes) {
+    net_counters_t* c = &net_counters[net_stats_cpu()][layer];
+    net_stat_add(&c->tx_packets, 1);
+    net_stat_add(&c->tx_bytes, bytes);
+}
+
+static inline void net_stat_drop(net_layer_t layer, net_drop_t reason) {
+    net_counters_t* c = &net_counters[net_stats_cpu()][layer];
+    net_stat_add(&c->drops[reason], 1);
+    if (reason == NET_DROP_CHECKSUM) net_stat_add(&c->csum_errors, 1);
+    if (reason == NET_DROP_RING_FULL) net_stat_add(&c->ring_full, 1);
+}
+
+// Layer profiling. Layers mark where they start and end, and the cycles in
+// between, minus those of the layers they call, are charged to them. Off
+// unless a benchmark turns it on, then each mark costs a rdtsc.
+#define NET_PROF_DEPTH 16
+
+extern bool net_prof_enabled;
+
+void net_prof_push(net_layer_t layer);
+void net_prof_pop(void);
+
+static inline void net_prof_enter(net_layer_t layer) {
+    if (net_prof_enabled) net_prof_push(layer);
+}
+
+static inline void net_prof_exit(void) {
+    if (net_prof_enabled) net_prof_pop();
+}
+
+// Start or stop profiling, only call with no layer active
+void net_prof_enable(bool enabled);
+
+// Count an event field (ring_full, csum_errors, misses) without a drop
+#define NET_STAT_INC(layer, field) \
+    net_stat_add(&net_counters[net_stats_cpu()][layer].field, 1)
+
+// Sum the counters of all CPUs into totals[NET_LAYER_COUNT]
+void net_stats_collect(net_counters_t* totals);
+
+// Zero all counters
+void net_stats_reset(void);
+
+const char* net_layer_name(net_layer_t layer);
+const char* net_drop_name(net_drop_t reason);
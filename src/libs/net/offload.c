@@ -0,0 +1,263 @@
+#include "offload.h"
+#include "ethernet.h"
+#include "ip.h"
+#include "tcp.h"
+#include "checksum.h"
+#include "netstat.h"
+#include "../string.h"
+
+static uint32_t features = NET_OFFLOAD_ALL;
+static net_offload_stats_t stats;
+
+uint32_t net_offload_get(void) {
+    return features;
+}
+
+void net_offload_set(uint32_t enabled) {
+    features = enabled & NET_OFFLOAD_ALL;
+}
+
+uint32_t gso_max_payload(uint16_t mss) {
+    if (!(features & NET_OFFLOAD_GSO) || mss == 0 || mss > GSO_MAX_PAYLOAD) {
+        return mss;
+    }
+    return GSO_MAX_PAYLOAD - GSO_MAX_PAYLOAD % mss;
+}
+
+void gso_count_tso(void) {
+    stats.tso_packets++;
+}
+
+bool gso_output(pbuf_t* p, bool (*xmit)(pbuf_t* p)) {
+    const uint8_t* frame = p->data;
+    uint16_t l3 = p->l3_start - pbuf_headroom(p);
+    uint16_t l4 = p->csum_start - pbuf_headroom(p);
+    const ip_header_t* ip = (const ip_header_t*)(frame + l3);
+    const tcp_header_t* tcp = (const tcp_header_t*)(frame + l4);
+    uint16_t header_len = l4 + (tcp->data_offset >> 4) * 4;
+    uint32_t payload = p->len - header_len;
+    uint32_t seq = ntohl(tcp->seq);
+    uint16_t id = ntohs(ip->id);
+
+    stats.gso_packets++;
+    for (uint32_t offset = 0; offset < payload; offset += p->gso_size) {
+        uint16_t length = payload - offset < p->gso_size ? payload - offset : p->gso_size;
+        bool last = offset + length == payload;
+
+        pbuf_t* seg = pbuf_alloc(header_len + length);
+        if (!seg) {
+            net_stat_drop(NET_LAYER_ETH, NET_DROP_NO_BUFFER);
+            return offset > 0;
+        }
+        memcpy(seg->data, frame, header_len);
+        memcpy(seg->data + header_len, frame + header_len + offset, length);
+
+        // Every segment gets its own length, IP ID and sequence number. Only
+        // the last one keeps PSH and FIN.
+        ip_header_t* seg_ip = (ip_header_t*)(seg->data + l3);
+        tcp_header_t* seg_tcp = (tcp_header_t*)(seg->data + l4);
+        seg_ip->total_length = htons(header_len - l3 + length);
+        seg_ip->id = htons(id++);
+        seg_tcp->seq = htonl(seq + offset);
+        if (!last) seg_tcp->flags &= ~(TCP_PSH | TCP_FIN);
+
+        uint32_t sum = csum_pseudo_header(seg_ip->src_ip, seg_ip->dest_ip, IP_PROTOCOL_TCP,
+                                          header_len - l4 + length);
+        seg_tcp->checksum = (uint16_t)~csum_fold(sum);
+        seg->flags = PBUF_TX_IP_CSUM | PBUF_TX_L4_CSUM;
+        seg->l3_start = pbuf_headroom(seg) + l3;
+        seg->csum_start = pbuf_headroom(seg) + l4;
+        seg->csum_offset = 16;
+
+        bool sent = xmit(seg);
+        pbuf_free(seg);
+
+        // Once part of it is out the rest counts as lost on the way, TCP
+        // retransmits it. Failing the whole packet would make TCP send the
+        // same leading segments again and again into a ring that is too small.
+        if (!sent) return offset > 0;
+        stats.gso_segments++;
+    }
+    return true;
+}
+
+// The IP and TCP headers of a frame if it is TCP over IPv4 without IP
+// options, NULL for anything else
+static tcp_header_t* tcp_frame(pbuf_t* p, ip_header_t** ip_out) {
+    if (p->len < ETH_HEADER_SIZE + IP_HEADER_SIZE + sizeof(tcp_header_t)) return NULL;
+
+    const eth_frame_t* eth = (const eth_frame_t*)p->data;
+    ip_header_t* ip = (ip_header_t*)eth->payload;
+    if (eth->type != htons(ETH_TYPE_IP) || ip->version_ihl != 0x45 ||
+        ip->protocol != IP_PROTOCOL_TCP) {
+        return NULL;
+    }
+    *ip_out = ip;
+    return (tcp_header_t*)ip->payload;
+}
+
+// Whether a segment may be glued to others: checksums verified, payload
+// and only ACK (and PSH) set, not a fragment and not already a super-packet.
+// Returns the payload length, 0 if not.
+static uint16_t mergeable(pbuf_t* p, const ip_header_t* ip, const tcp_header_t* tcp) {
+    if (!(features & NET_OFFLOAD_GRO) || p->gso_size) return 0;
+    if (!(p->flags & PBUF_RX_L4_CSUM_OK) || (p->flags & PBUF_RX_CSUM_BAD)) return 0;
+    if (ip->flags_fragment & htons(IP_FLAG_MF | 0x1FFF)) return 0;
+    if ((tcp->flags & ~TCP_PSH) != TCP_ACK) return 0;
+
+    uint16_t total = ntohs(ip->total_length);
+    uint16_t header_len = IP_HEADER_SIZE + (tcp->data_offset >> 4) * 4;
+    if (total > p->len - ETH_HEADER_SIZE || total <= header_len ||
+        header_len < IP_HEADER_SIZE + sizeof(tcp_header_t)) {
+        return 0;
+    }
+    if (!(p->flags & PBUF_RX_IP_CSUM_OK) && inet_checksum(ip, IP_HEADER_SIZE) != 0) return 0;
+    return total - header_len;
+}
+
+static gro_flow_t* find_flow(gro_batch_t* batch, const ip_header_t* ip, const tcp_header_t* tcp) {
+    uint32_t ports;
+    memcpy(&ports, tcp, sizeof(ports));
+    for (int i = 0; i < GRO_MAX_FLOWS; i++) {
+        gro_flow_t* flow = &batch->flows[i];
+        if (flow->p && flow->ports == ports &&
+            flow->src_ip == ip->src_ip && flow->dest_ip == ip->dest_ip) {
+            return flow;
+        }
+    }
+    return NULL;
+}
+
+static void deliver(gro_batch_t* batch, pbuf_t* p) {
+    batch->deliver(p);
+    pbuf_free(p);
+}
+
+// Deliver a held flow, fixing up the headers if segments were glued on
+static void flush(gro_batch_t* batch, gro_flow_t* flow) {
+    pbuf_t* p = flow->p;
+    flow->p = NULL;
+
+    if (flow->segments > 1) {
+        ip_header_t* ip = (ip_header_t*)(p->data + ETH_HEADER_SIZE);
+        ip->total_length = htons(p->len - ETH_HEADER_SIZE);
+        ip->checksum = 0;
+        ip->checksum = inet_checksum(ip, IP_HEADER_SIZE);
+        p->flags |= PBUF_RX_IP_CSUM_OK | PBUF_RX_L4_CSUM_OK;
+        p->gso_size = flow->gso_size;
+        stats.gro_packets++;
+        stats.gro_segments += flow->segments;
+    }
+    deliver(batch, p);
+}
+
+// Glue a segment to the end of a held flow. Only full sized segments are
+// followed by more, and the headers besides sequence number and PSH have
+// to match, so the result reads like one segment the peer could have sent.
+static bool append(gro_flow_t* flow, pbuf_t* p, const tcp_header_t* tcp, uint16_t payload) {
+    const tcp_header_t* first = (const tcp_header_t*)(flow->p->data + ETH_HEADER_SIZE + IP_HEADER_SIZE);
+    uint16_t tcp_len = (tcp->data_offset >> 4) * 4;
+
+    if (ntohl(tcp->seq) != flow->next_seq || flow->last_len != flow->gso_size ||
+        payload > flow->gso_size || flow->segments >= GRO_MAX_SEGMENTS ||
+        flow->p->len + payload > PBUF_LARGE_DATA_SIZE) {
+        return false;
+    }
+    if (tcp->ack != first->ack || tcp->window != first->window ||
+        tcp->data_offset != first->data_offset ||
+        memcmp(tcp->options, first->options, tcp_len - sizeof(tcp_header_t)) != 0) {
+        return false;
+    }
+
+    // The segments are copied into a large block behind the first one once
+    // there is a second
+    if (flow->segments == 1) {
+        pbuf_t* large = pbuf_alloc(PBUF_LARGE_DATA_SIZE);
+        if (!large) return false;
+        pbuf_trim(large, flow->p->len);
+        memcpy(large->data, flow->p->data, flow->p->len);
+        large->flags = flow->p->flags;
+        pbuf_free(flow->p);
+        flow->p = large;
+        first = (const tcp_header_t*)(large->data + ETH_HEADER_SIZE + IP_HEADER_SIZE);
+    }
+
+    uint16_t header_len = ETH_HEADER_SIZE + IP_HEADER_SIZE + tcp_len;
+    memcpy(pbuf_put(flow->p, payload), p->data + header_len, payload);
+    ((tcp_header_t*)first)->flags |= tcp->flags & TCP_PSH;
+
+    flow->next_seq += payload;
+    flow->last_len = payload;
+    flow->segments++;
+    return true;
+}
+
+void gro_begin(gro_batch_t* batch, void (*deliver_fn)(pbuf_t* p)) {
+    memset(batch, 0, sizeof(*batch));
+    batch->deliver = deliver_fn;
+}
+
+void gro_receive(gro_batch_t* batch, pbuf_t* p) {
+    ip_header_t* ip;
+    tcp_header_t* tcp = tcp_frame(p, &ip);
+    if (!tcp) {
+        deliver(batch, p);
+        return;
+    }
+
+    uint16_t payload = mergeable(p, ip, tcp);
+    gro_flow_t* flow = find_flow(batch, ip, tcp);
+    if (flow) {
+        if (payload && append(flow, p, tcp, payload)) {
+            bool push = (tcp->flags & TCP_PSH) != 0;
+            pbuf_free(p);
+            if (push || flow->segments == GRO_MAX_SEGMENTS) {
+                flush(batch, flow);
+            }
+            return;
+        }
+        // Whatever the flow held goes up first, segments stay in order
+        stats.gro_flushes++;
+        flush(batch, flow);
+    }
+
+    // A pushed segment is not followed by more soon
+    if (!payload || (tcp->flags & TCP_PSH)) {
+        deliver(batch, p);
+        return;
+    }
+
+    flow = NULL;
+    for (int i = 0; i < GRO_MAX_FLOWS && !flow; i++) {
+        if (!batch->flows[i].p) flow = &batch->flows[i];
+    }
+    if (!flow) {
+        flow = &batch->flows[0];
+        stats.gro_flushes++;
+        flush(batch, flow);
+    }
+
+    pbuf_trim(p, ETH_HEADER_SIZE + ntohs(ip->total_length));
+    flow->p = p;
+    flow->src_ip = ip->src_ip;
+    flow->dest_ip = ip->dest_ip;
+    memcpy(&flow->ports, tcp, sizeof(flow->ports));
+    flow->next_seq = ntohl(tcp->seq) + payload;
+    flow->gso_size = payload;
+    flow->last_len = payload;
+    flow->segments = 1;
+}
+
+void gro_end(gro_batch_t* batch) {
+    for (int i = 0; i < GRO_MAX_FLOWS; i++) {
+        if (batch->flows[i].p) flush(batch, &batch->flows[i]);
+    }
+}
+
+const net_offload_stats_t* net_offload_get_stats(void) {
+    return &stats;
+}
+
+void net_offload_reset_stats(void) {
+    memset(&stats, 0, sizeof(stats));
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "../types.h"
+#include "pbuf.h"
+
+// TCP segmentation offloads. On the way out TCP builds super-packets of up
+// to GSO_MAX_PAYLOAD bytes with gso_size set to the MSS, and they travel
+// down the stack as one packet. A NIC with TSO cuts them into frames itself,
+// for any other device GSO does it in software right before the driver. On
+// the way in GRO glues consecutive segments of a flow back together before
+// they go up the stack, so every layer pays its per-packet cost once.
+#define NET_OFFLOAD_TSO  0x01   // Hand super-packets to NICs that segment them
+#define NET_OFFLOAD_GSO  0x02   // Let TCP build super-packets at all
+#define NET_OFFLOAD_GRO  0x04   // Coalesce received TCP segments
+#define NET_OFFLOAD_ALL  (NET_OFFLOAD_TSO | NET_OFFLOAD_GSO | NET_OFFLOAD_GRO)
+
+// Largest TCP payload of a super-packet, leaving room for a TCP header with
+// options in a large block
+#define GSO_MAX_PAYLOAD  (PBUF_LARGE_DATA_SIZE - 60)
+
+#define GRO_MAX_FLOWS    8      // Flows held at once while draining a batch
+#define GRO_MAX_SEGMENTS 44     // Segments glued into one packet
+
+typedef struct {
+    uint64_t tso_packets;     // Super-packets handed to a device whole
+    uint64_t gso_packets;     // Super-packets segmented in software
+    uint64_t gso_segments;    // Frames they were cut into
+    uint64_t gro_packets;     // Packets delivered after coalescing
+    uint64_t gro_segments;    // Segments that went into them
+    uint64_t gro_flushes;     // Held flows delivered early (mismatch, flags, full)
+} net_offload_stats_t;
+
+// Segments of one flow held back while a receive batch is drained
+typedef struct {
+    pbuf_t* p;               // NULL when the slot is free, frame at p->data
+    uint32_t src_ip;
+    uint32_t dest_ip;
+    uint32_t ports;          // Source and destination port as in the header
+    uint32_t next_seq;       // Host byte order
+    uint16_t segments;
+    uint16_t gso_size;       // Payload of the first segment, none after it may be larger
+    uint16_t last_len;       // Payload of the newest segment
+} gro_flow_t;
+
+typedef struct {
+    gro_flow_t flows[GRO_MAX_FLOWS];
+    void (*deliver)(pbuf_t* p);   // Takes the frame up the stack, doesn't free it
+} gro_batch_t;
+
+// Enabled offloads, NET_OFFLOAD_* bits. All are on at boot.
+uint32_t net_offload_get(void);
+void net_offload_set(uint32_t features);
+
+// Largest TCP payload to send in one packet: mss when GSO is off, else as
+// many whole segments as fit GSO_MAX_PAYLOAD
+uint32_t gso_max_payload(uint16_t mss);
+
+// Cut a super-packet into frames of gso_size payload bytes and send them
+// with xmit. p->data points at the ethernet header, the caller keeps its
+// reference. Returns false if a buffer ran out or xmit failed, frames
+// before that were sent.
+bool gso_output(pbuf_t* p, bool (*xmit)(pbuf_t* p));
+
+// Count a super-packet going to a device that segments it
+void gso_count_tso(void);
+
+// Start draining a batch of received frames
+void gro_begin(gro_batch_t* batch, void (*deliver)(pbuf_t* p));
+
+// Hand a received frame to GRO, which takes over the reference. It is
+// delivered now or held to be glued to the next segments of its flow.
+void gro_receive(gro_batch_t* batch, pbuf_t* p);
+
+// Deliver everything still held, at the end of the batch
+void gro_end(gro_batch_t* batch);
+
+const net_offload_stats_t* net_offload_get_stats(void);
+void net_offload_reset_stats(void);
@@ -0,0 +1,252 @@
+#include "pbuf.h"
+#include "../fs/pcache.h"
+#include "../interrupt.h"
+#include "../string.h"
+
+// Data blocks live in static pools. The memory is identity mapped, so the
+// address of a block can be handed straight to the NIC for DMA. Block
+// numbers past PBUF_POOL_SIZE are jumbo blocks, and past those large ones.
+#define LARGE_FIRST (PBUF_POOL_SIZE + PBUF_JUMBO_POOL_SIZE)
+#define BLOCK_COUNT (LARGE_FIRST + PBUF_LARGE_POOL_SIZE)
+#define IS_JUMBO(block) ((block) >= PBUF_POOL_SIZE && (block) < LARGE_FIRST)
+#define IS_LARGE(block) ((block) >= LARGE_FIRST)
+
+static uint8_t block_pool[PBUF_POOL_SIZE][PBUF_BLOCK_SIZE] __attribute__((aligned(64)));
+static uint8_t jumbo_pool[PBUF_JUMBO_POOL_SIZE][PBUF_JUMBO_BLOCK_SIZE] __attribute__((aligned(64)));
+static uint8_t large_pool[PBUF_LARGE_POOL_SIZE][PBUF_LARGE_BLOCK_SIZE] __attribute__((aligned(64)));
+static uint16_t block_refs[BLOCK_COUNT];
+static uint16_t free_blocks[PBUF_POOL_SIZE];
+static uint32_t free_block_count = 0;
+static uint16_t free_jumbo[PBUF_JUMBO_POOL_SIZE];
+static uint32_t free_jumbo_count = 0;
+static uint16_t free_large[PBUF_LARGE_POOL_SIZE];
+static uint32_t free_large_count = 0;
+
+static pbuf_t header_pool[PBUF_HEADER_COUNT];
+static pbuf_t* free_headers = NULL;
+
+void pbuf_init(void) {
+    uint64_t flags = irq_save();
+
+    free_block_count = 0;
+    for (int i = PBUF_POOL_SIZE - 1; i >= 0; i--) {
+        block_refs[i] = 0;
+        free_blocks[free_block_count++] = i;
+    }
+    free_jumbo_count = 0;
+    for (int i = LARGE_FIRST - 1; i >= PBUF_POOL_SIZE; i--) {
+        block_refs[i] = 0;
+        free_jumbo[free_jumbo_count++] = i;
+    }
+    free_large_count = 0;
+    for (int i = BLOCK_COUNT - 1; i >= LARGE_FIRST; i--) {
+        block_refs[i] = 0;
+        free_large[free_large_count++] = i;
+    }
+
+    free_headers = NULL;
+    for (int i = PBUF_HEADER_COUNT - 1; i >= 0; i--) {
+        header_pool[i].next = free_headers;
+        free_headers = &header_pool[i];
+    }
+
+    irq_restore(flags);
+}
+
+// Take a header off the free list, caller must have interrupts disabled
+static pbuf_t* header_get(void) {
+    pbuf_t* p = free_headers;
+    if (p) {
+        free_headers = p->next;
+        p->next = NULL;
+        p->refcount = 1;
+        p->flags = 0;
+        p->gso_size = 0;
+        p->frag = NULL;
+        p->frag_len = 0;
+        p->frag_page = NULL;
+    }
+    return p;
+}
+
+// Drop a reference on a data block, caller must have interrupts disabled
+static void block_put(uint16_t block) {
+    if (--block_refs[block] == 0) {
+        if (IS_LARGE(block)) {
+            free_large[free_large_count++] = block;
+        } else if (IS_JUMBO(block)) {
+            free_jumbo[free_jumbo_count++] = block;
+        } else {
+            free_blocks[free_block_count++] = block;
+        }
+    }
+}
+
+static uint8_t* block_address(uint16_t block) {
+    if (IS_LARGE(block)) return large_pool[block - LARGE_FIRST];
+    return IS_JUMBO(block) ? jumbo_pool[block - PBUF_POOL_SIZE] : block_pool[block];
+}
+
+pbuf_t* pbuf_alloc(uint16_t length) {
+    if (length > PBUF_LARGE_DATA_SIZE) return NULL;
+
+    // Pick the smallest pool the data fits
+    uint16_t* free_list = free_blocks;
+    uint32_t* free_count = &free_block_count;
+    if (length > PBUF_JUMBO_DATA_SIZE) {
+        free_list = free_large;
+        free_count = &free_large_count;
+    } else if (length > PBUF_DATA_SIZE) {
+        free_list = free_jumbo;
+        free_count = &free_jumbo_count;
+    }
+
+    uint64_t flags = irq_save();
+
+    if (*free_count == 0 || free_headers == NULL) {
+        irq_restore(flags);
+        return NULL;
+    }
+
+    uint16_t block = free_list[--*free_count];
+    block_refs[block] = 1;
+
+    pbuf_t* p = header_get();
+    irq_restore(flags);
+
+    p->block = block;
+    p->head = block_address(block);
+    p->data = p->head + PBUF_HEADROOM;
+    p->len = length;
+    return p;
+}
+
+pbuf_t* pbuf_ref(pbuf_t* p) {
+    uint64_t flags = irq_save();
+    p->refcount++;
+    irq_restore(flags);
+    return p;
+}
+
+void pbuf_free(pbuf_t* p) {
+    if (!p) return;
+
+    uint64_t flags = irq_save();
+    if (--p->refcount == 0) {
+        block_put(p->block);
+        if (p->frag_page) pcache_release(p->frag_page);
+        p->next = free_headers;
+        free_headers = p;
+    }
+    irq_restore(flags);
+}
+
+// Copy the offload metadata, offsets are rebased when data moved within the block
+static void copy_metadata(pbuf_t* to, const pbuf_t* from) {
+    int shift = pbuf_headroom(to) - pbuf_headroom(from);
+
+    to->flags = from->flags;
+    to->l3_start = from->l3_start + shift;
+    to->csum_start = from->csum_start + shift;
+    to->csum_offset = from->csum_offset;
+    to->gso_size = from->gso_size;
+}
+
+pbuf_t* pbuf_clone(pbuf_t* p) {
+    uint64_t flags = irq_save();
+
+    pbuf_t* clone = header_get();
+    if (clone) {
+        block_refs[p->block]++;
+    }
+    irq_restore(flags);
+
+    if (!clone) return NULL;
+
+    clone->block = p->block;
+    clone->head = p->head;
+    clone->data = p->data;
+    clone->len = p->len;
+    copy_metadata(clone, p);
+    if (p->frag_page) pcache_ref(p->frag_page);
+    clone->frag = p->frag;
+    clone->frag_len = p->frag_len;
+    clone->frag_page = p->frag_page;
+    return clone;
+}
+
+pbuf_t* pbuf_copy(pbuf_t* p) {
+    pbuf_t* copy = pbuf_alloc(pbuf_length(p));
+    if (copy) {
+        memcpy(copy->data, p->data, p->len);
+        if (p->frag_len) memcpy(copy->data + p->len, p->frag, p->frag_len);
+        copy_metadata(copy, p);
+    }
+    return copy;
+}
+
+pbuf_t* pbuf_writable(pbuf_t* p) {
+    uint64_t flags = irq_save();
+    bool exclusive = p->refcount == 1 && block_refs[p->block] == 1;
+    if (exclusive) {
+        p->refcount++;
+    }
+    irq_restore(flags);
+
+    return exclusive ? p : pbuf_copy(p);
+}
+
+void* pbuf_push(pbuf_t* p, uint16_t length) {
+    if (pbuf_headroom(p) < length) return NULL;
+
+    p->data -= length;
+    p->len += length;
+    return p->data;
+}
+
+void* pbuf_pull(pbuf_t* p, uint16_t length) {
+    if (p->len < length) return NULL;
+
+    p->data += length;
+    p->len -= length;
+    return p->data;
+}
+
+void pbuf_trim(pbuf_t* p, uint16_t length) {
+    if (length < p->len) {
+        p->len = length;
+    }
+}
+
+void* pbuf_put(pbuf_t* p, uint16_t length) {
+    if (pbuf_tailroom(p) < length) return NULL;
+
+    uint8_t* tail = p->data + p->len;
+    p->len += length;
+    return tail;
+}
+
+uint16_t pbuf_tailroom(const pbuf_t* p) {
+    uint16_t size = IS_LARGE(p->block) ? PBUF_LARGE_BLOCK_SIZE :
+                    IS_JUMBO(p->block) ? PBUF_JUMBO_BLOCK_SIZE : PBUF_BLOCK_SIZE;
+    return size - (uint16_t)(p->data - p->head) - p->len;
+}
+
+void pbuf_attach_page(pbuf_t* p, struct pcache_page* page, uint16_t offset, uint16_t length) {
+    pcache_ref(page);
+    p->frag_page = page;
+    p->frag = page->data + offset;
+    p->frag_len = length;
+}
+
+uint32_t pbuf_free_count(void) {
+    return free_block_count;
+}
+
+uint32_t pbuf_jumbo_free_count(void) {
+    return free_jumbo_count;
+}
+
+uint32_t pbuf_large_free_count(void) {
+    return free_large_count;
+}
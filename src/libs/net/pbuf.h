@@ -0,0 +1,134 @@
+#pragma once
+
+#include "../types.h"
+
+// Bytes reserved in front of every freshly allocated buffer so that lower
+// layers can prepend their headers in place (Ethernet + IP + TCP with options)
+#define PBUF_HEADROOM   128
+
+// Data a regular buffer holds after the headroom. Matches the 2048 byte
+// receive buffers the NICs use at the standard MTU.
+#define PBUF_DATA_SIZE  2048
+#define PBUF_BLOCK_SIZE (PBUF_HEADROOM + PBUF_DATA_SIZE)
+
+// Larger allocations come from a separate pool of jumbo blocks, big enough
+// for a 9000 byte MTU frame with room to spare
+#define PBUF_JUMBO_DATA_SIZE  9216
+#define PBUF_JUMBO_BLOCK_SIZE (PBUF_HEADROOM + PBUF_JUMBO_DATA_SIZE)
+
+// TCP super-packets, which the NIC or the GSO layer cuts into MTU sized
+// frames, come from a third pool of blocks close to the 64 KiB an IP packet
+// can hold. The block size still fits the 16-bit offsets.
+#define PBUF_LARGE_DATA_SIZE  65280
+#define PBUF_LARGE_BLOCK_SIZE (PBUF_HEADROOM + PBUF_LARGE_DATA_SIZE)
+
+// Number of data blocks in the pools. Headers are more plentiful than blocks
+// because clones share a block but need their own header.
+#define PBUF_POOL_SIZE       256
+#define PBUF_JUMBO_POOL_SIZE 96
+#define PBUF_LARGE_POOL_SIZE 16
+#define PBUF_HEADER_COUNT    ((PBUF_POOL_SIZE + PBUF_JUMBO_POOL_SIZE + PBUF_LARGE_POOL_SIZE) * 2)
+
+// Checksums left for the NIC to insert on transmit
+#define PBUF_TX_IP_CSUM     0x0001  // IP header checksum, header at l3_start
+#define PBUF_TX_L4_CSUM     0x0002  // Protocol checksum from csum_start to the end
+
+// Checksum results reported by the NIC on receive
+#define PBUF_RX_IP_CSUM_OK  0x0010  // IP header checksum verified
+#define PBUF_RX_L4_CSUM_OK  0x0020  // TCP/UDP checksum verified
+#define PBUF_RX_CSUM_BAD    0x0040  // NIC found a bad IP or TCP/UDP checksum
+
+struct pcache_page;
+
+// Packet buffer. The header is reference counted, and so is the data block
+// it points at, so clones can share the bytes while keeping their own view.
+// Outgoing packets may end in a fragment: bytes of a page cache page that
+// follow the data on the wire without being copied into the block. The
+// buffer holds a reference on the page until its header is freed. Only
+// the transmit path up to the drivers knows about fragments; whatever
+// reads a packet linearly gets a copy from pbuf_copy.
+typedef struct pbuf {
+    struct pbuf* next;   // Free for use by whoever currently queues the buffer
+    uint8_t* head;       // Start of the data block (beginning of the headroom)
+    uint8_t* data;       // First byte of valid data
+    uint16_t len;        // Number of valid bytes starting at data
+    uint16_t block;      // Index of the data block in the pool
+    uint16_t refcount;   // References held on this header
+    uint16_t flags;      // PBUF_TX_* / PBUF_RX_* bits
+    uint16_t l3_start;   // Offset of the IP header from head
+    uint16_t csum_start; // Offset from head where the protocol checksum starts
+    uint16_t csum_offset; // Offset of the checksum field from csum_start
+    uint16_t gso_size;   // TCP payload per segment of a super-packet, 0 for a plain packet
+    uint32_t cb;         // Scratch space for the layer currently holding the buffer
+    const uint8_t* frag; // Bytes after data, NULL if there are none
+    uint16_t frag_len;
+    struct pcache_page* frag_page; // Page frag points into
+} pbuf_t;
+
+// Initialize the buffer pool
+void pbuf_init(void);
+
+// Allocate a buffer with PBUF_HEADROOM bytes of headroom and length bytes of
+// data, from the jumbo pool when length is larger than PBUF_DATA_SIZE and
+// from the large pool when it is larger than PBUF_JUMBO_DATA_SIZE. Returns
+// NULL if that pool is exhausted or length is larger than
+// PBUF_LARGE_DATA_SIZE.
+pbuf_t* pbuf_alloc(uint16_t length);
+
+// Take another reference on a buffer, returns the buffer for convenience
+pbuf_t* pbuf_ref(pbuf_t* p);
+
+// Drop a reference. The header and data block return to the pool when unused.
+void pbuf_free(pbuf_t* p);
+
+// Create a new header that shares p's data block
+pbuf_t* pbuf_clone(pbuf_t* p);
+
+// Create a private deep copy of p with fresh headroom, with the fragment
+// copied in behind the data
+pbuf_t* pbuf_copy(pbuf_t* p);
+
+// Get a reference the caller may modify in place: p itself when nothing else
+// shares its header or data, otherwise a private copy. Release with pbuf_free.
+pbuf_t* pbuf_writable(pbuf_t* p);
+
+// Grow the data area at the front by length bytes, returns the new start of
+// data or NULL if there is not enough headroom
+void* pbuf_push(pbuf_t* p, uint16_t length);
+
+// Remove length bytes from the front of the data area, returns the new start
+// of data or NULL if the buffer is shorter than length
+void* pbuf_pull(pbuf_t* p, uint16_t length);
+
+// Shrink the data area to length bytes (no-op if it is already shorter)
+void pbuf_trim(pbuf_t* p, uint16_t length);
+
+// Grow the data area at the end by length bytes, returns the old end of data
+// or NULL if the block has no room for it
+void* pbuf_put(pbuf_t* p, uint16_t length);
+
+// Bytes available behind the data
+uint16_t pbuf_tailroom(const pbuf_t* p);
+
+// Point the end of the packet at length bytes of a page, taking a
+// reference on it. A buffer has at most one fragment.
+void pbuf_attach_page(pbuf_t* p, struct pcache_page* page, uint16_t offset, uint16_t length);
+
+// Bytes of the whole packet, fragment included
+static inline uint32_t pbuf_length(const pbuf_t* p) {
+    return p->len + p->frag_len;
+}
+
+// Bytes available in front of the data
+static inline uint16_t pbuf_headroom(const pbuf_t* p) {
+    return (uint16_t)(p->data - p->head);
+}
+
+// Number of regular blocks currently free
+uint32_t pbuf_free_count(void);
+
+// Number of jumbo blocks currently free
+uint32_t pbuf_jumbo_free_count(void);
+
+// Number of large blocks currently free
+uint32_t pbuf_large_free_count(void);
@@ -0,0 +1,257 @@
+#include "route.h"
+#include "ip.h"
+#include "../interrupt.h"
+#include "../string.h"
+
+// A table entry is 0 (no route), a leaf holding the route index + 1 and the
+// prefix length it came from, or a pointer to the next level's chunk
+#define ENTRY_CHUNK        (1u << 31)
+#define ENTRY_LEAF(index, length)  (((uint32_t)(length) << 16) | ((index) + 1))
+#define ENTRY_INDEX(e)     (((e) & 0xFFFF) - 1)
+#define ENTRY_LENGTH(e)    (((e) >> 16) & 0x3F)
+
+#define LEVEL1_SIZE        (1 << 16)
+#define CHUNK_SIZE         256
+
+typedef struct {
+    uint32_t dest;
+    uint32_t generation;   // Valid while it matches the table's
+    const route_t* route;
+} route_cache_entry_t;
+
+static route_t routes[ROUTE_MAX];
+static uint32_t level1[LEVEL1_SIZE];
+static uint32_t chunks[ROUTE_CHUNKS][CHUNK_SIZE];
+static uint16_t free_chunks[ROUTE_CHUNKS];
+static uint32_t free_chunk_count = 0;
+static bool initialized = false;
+
+static route_cache_entry_t cache[ROUTE_CACHE_SIZE];
+static uint32_t generation = 1;   // Bumped on every change, emptying the cache
+static route_stats_t stats;
+
+static void route_init(void) {
+    for (int i = 0; i < ROUTE_CHUNKS; i++) {
+        free_chunks[i] = ROUTE_CHUNKS - 1 - i;
+    }
+    free_chunk_count = ROUTE_CHUNKS;
+    initialized = true;
+}
+
+// Turn a leaf into a chunk whose entries all carry the leaf, so that a
+// longer prefix can be stored below it
+static uint32_t* expand(uint32_t* entry) {
+    if (*entry & ENTRY_CHUNK) {
+        return chunks[*entry & ~ENTRY_CHUNK];
+    }
+
+    uint16_t index = free_chunks[--free_chunk_count];
+    for (int i = 0; i < CHUNK_SIZE; i++) {
+        chunks[index][i] = *entry;
+    }
+    *entry = ENTRY_CHUNK | index;
+    stats.chunks++;
+    return chunks[index];
+}
+
+// Turn a chunk back into a leaf once all its entries are the same
+static void collapse(uint32_t* entry) {
+    if (!(*entry & ENTRY_CHUNK)) return;
+
+    uint16_t index = *entry & ~ENTRY_CHUNK;
+    uint32_t first = chunks[index][0];
+    if (first & ENTRY_CHUNK) return;
+    for (int i = 1; i < CHUNK_SIZE; i++) {
+        if (chunks[index][i] != first) return;
+    }
+
+    *entry = first;
+    free_chunks[free_chunk_count++] = index;
+    stats.chunks--;
+}
+
+// Store a leaf in count entries, and everything below them, unless a
+// longer prefix is already there
+static void fill(uint32_t* table, uint32_t first, uint32_t count, uint32_t leaf) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (table[i] & ENTRY_CHUNK) {
+            fill(chunks[table[i] & ~ENTRY_CHUNK], 0, CHUNK_SIZE, leaf);
+        } else if (table[i] == 0 || ENTRY_LENGTH(table[i]) <= ENTRY_LENGTH(leaf)) {
+            table[i] = leaf;
+        }
+    }
+}
+
+// Replace a leaf in count entries, and everything below them, by another
+static void replace(uint32_t* table, uint32_t first, uint32_t count, uint32_t old, uint32_t leaf) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (table[i] & ENTRY_CHUNK) {
+            replace(chunks[table[i] & ~ENTRY_CHUNK], 0, CHUNK_SIZE, old, leaf);
+            collapse(&table[i]);
+        } else if (table[i] == old) {
+            table[i] = leaf;
+        }
+    }
+}
+
+// Walk down to the table holding a prefix and apply fill or replace to its
+// range. Prefixes up to /16 live in the first level, up to /24 in the
+// second and the rest in the third.
+static void update(uint32_t host_prefix, uint8_t length, uint32_t old, uint32_t leaf) {
+    uint32_t* table = level1;
+    uint32_t* parent[2] = { NULL, NULL };
+    uint32_t index = host_prefix >> 16;
+    uint8_t bits = 16;
+
+    if (length > 16) {
+        parent[0] = &level1[index];
+        table = expand(parent[0]);
+        index = (host_prefix >> 8) & 0xFF;
+        bits = 24;
+    }
+    if (length > 24) {
+        parent[1] = &table[index];
+        table = expand(parent[1]);
+        index = host_prefix & 0xFF;
+        bits = 32;
+    }
+
+    uint32_t count = 1u << (bits - length);
+    if (old) {
+        replace(table, index, count, old, leaf);
+    } else {
+        fill(table, index, count, leaf);
+    }
+
+    if (parent[1]) collapse(parent[1]);
+    if (parent[0]) collapse(parent[0]);
+}
+
+static int find_index(uint32_t prefix, uint8_t length) {
+    for (int i = 0; i < ROUTE_MAX; i++) {
+        if (routes[i].used && routes[i].prefix == prefix && routes[i].length == length) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+bool route_add(uint32_t prefix, uint8_t length, uint32_t gateway, netif_t* netif, uint16_t mtu) {
+    if (length > 32 || !netif || (prefix & ~netif_length_to_mask(length))) {
+        return false;
+    }
+    if (!initialized) route_init();
+
+    uint64_t flags = irq_save();
+    int index = find_index(prefix, length);
+    if (index < 0) {
+        for (index = 0; index < ROUTE_MAX && routes[index].used; index++);
+
+        // A new prefix longer than /16 may need a chunk on each lower
+        // level it reaches
+        uint32_t chunks_needed = length > 24 ? 2 : length > 16 ? 1 : 0;
+        if (index == ROUTE_MAX || free_chunk_count < chunks_needed) {
+            irq_restore(flags);
+            return false;
+        }
+        routes[index].prefix = prefix;
+        routes[index].length = length;
+        routes[index].used = true;
+        update(ntohl(prefix), length, 0, ENTRY_LEAF(index, length));
+        stats.routes++;
+    }
+
+    routes[index].gateway = gateway;
+    routes[index].netif = netif;
+    routes[index].mtu = mtu;
+    generation++;
+    irq_restore(flags);
+    return true;
+}
+
+bool route_delete(uint32_t prefix, uint8_t length) {
+    uint64_t flags = irq_save();
+    int index = find_index(prefix, length);
+    if (index < 0) {
+        irq_restore(flags);
+        return false;
+    }
+
+    // Where the route was, the next shorter prefix covering it takes over
+    int cover = -1;
+    for (int i = 0; i < ROUTE_MAX; i++) {
+        const route_t* r = &routes[i];
+        if (r->used && r->length < length &&
+            (prefix & netif_length_to_mask(r->length)) == r->prefix &&
+            (cover < 0 || r->length > routes[cover].length)) {
+            cover = i;
+        }
+    }
+
+    uint32_t leaf = cover < 0 ? 0 : ENTRY_LEAF(cover, routes[cover].length);
+    update(ntohl(prefix), length, ENTRY_LEAF(index, length), leaf);
+    routes[index].used = false;
+    stats.routes--;
+    generation++;
+    irq_restore(flags);
+    return true;
+}
+
+const route_t* route_find(uint32_t prefix, uint8_t length) {
+    int index = find_index(prefix, length);
+    return index < 0 ? NULL : &routes[index];
+}
+
+const route_t* route_lookup_lpm(uint32_t dest) {
+    uint32_t host = ntohl(dest);
+    uint32_t e = level1[host >> 16];
+    if (e & ENTRY_CHUNK) {
+        e = chunks[e & ~ENTRY_CHUNK][(host >> 8) & 0xFF];
+        if (e & ENTRY_CHUNK) {
+            e = chunks[e & ~ENTRY_CHUNK][host & 0xFF];
+        }
+    }
+    return e ? &routes[ENTRY_INDEX(e)] : NULL;
+}
+
+const route_t* route_lookup(uint32_t dest) {
+    route_cache_entry_t* c = &cache[(dest * 2654435761u) >> (32 - ROUTE_CACHE_BITS)];
+    const route_t* route;
+
+    // Receive interrupts look up routes too, one that came in halfway
+    // through a fill would take the new dest with the old route
+    uint64_t flags = irq_save();
+    stats.lookups++;
+    if (c->generation == generation && c->dest == dest) {
+        stats.cache_hits++;
+        route = c->route;
+    } else {
+        route = route_lookup_lpm(dest);
+        c->dest = dest;
+        c->route = route;
+        c->generation = generation;
+    }
+    irq_restore(flags);
+    return route;
+}
+
+uint16_t route_mtu(const route_t* route) {
+    if (route->mtu && route->mtu < route->netif->mtu) {
+        return route->mtu;
+    }
+    return route->netif->mtu;
+}
+
+const route_t* route_get(int index) {
+    if (index < 0 || index >= ROUTE_MAX || !routes[index].used) return NULL;
+    return &routes[index];
+}
+
+const route_stats_t* route_get_stats(void) {
+    return &stats;
+}
+
+void route_reset_stats(void) {
+    stats.lookups = 0;
+    stats.cache_hits = 0;
+}
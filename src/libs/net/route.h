@@ -0,0 +1,57 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "netif.h"
+
+// Longest prefix match is a three level table with strides of 16, 8 and 8
+// bits (DIR-16-8-8). Every prefix is expanded into the entries it covers,
+// so a lookup is one to three array reads however many routes there are.
+#define ROUTE_MAX          4096   // Routes in the table
+#define ROUTE_CHUNKS       2048   // 256 entry tables for prefixes longer than /16
+#define ROUTE_CACHE_BITS   8      // Destinations remembered by the lookup cache
+#define ROUTE_CACHE_SIZE   (1 << ROUTE_CACHE_BITS)
+
+// Addresses are in network byte order
+typedef struct {
+    uint32_t prefix;     // Host bits clear
+    uint8_t length;
+    bool used;
+    uint16_t mtu;        // 0 to use the interface's
+    uint32_t gateway;    // 0 when the destination is on the link
+    netif_t* netif;
+} route_t;
+
+typedef struct {
+    uint64_t lookups;
+    uint64_t cache_hits;
+    uint32_t routes;
+    uint32_t chunks;     // Second and third level tables in use
+} route_stats_t;
+
+// Add a route, or change the gateway, interface and MTU of an existing one
+// with the same prefix. Returns false if the table is full or the prefix
+// has host bits set.
+bool route_add(uint32_t prefix, uint8_t length, uint32_t gateway, netif_t* netif, uint16_t mtu);
+
+// Remove a route, false if there is none with this prefix
+bool route_delete(uint32_t prefix, uint8_t length);
+
+// The route with exactly this prefix, NULL if there is none
+const route_t* route_find(uint32_t prefix, uint8_t length);
+
+// Most specific route to a destination, NULL if none matches. Recent
+// destinations are answered from a cache.
+const route_t* route_lookup(uint32_t dest);
+
+// Same without the cache
+const route_t* route_lookup_lpm(uint32_t dest);
+
+// The MTU packets along a route may have
+uint16_t route_mtu(const route_t* route);
+
+// Routes by slot for listing, NULL for unused slots and past the end
+const route_t* route_get(int index);
+
+const route_stats_t* route_get_stats(void);
+void route_reset_stats(void);
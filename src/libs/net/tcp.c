@@ -0,0 +1,1725 @@
+#include "tcp.h"
+#include "ip.h"
+#include "ethernet.h"
+#include "checksum.h"
+#include "netstat.h"
+#include "offload.h"
+#include "../interrupt.h"
+#include "../timer.h"
+#include "../random.h"
+#include "../string.h"
+
+// Sequence number comparisons that survive wrap-around
+#define SEQ_LT(a, b)  ((int32_t)((a) - (b)) < 0)
+#define SEQ_LEQ(a, b) ((int32_t)((a) - (b)) <= 0)
+#define SEQ_GT(a, b)  ((int32_t)((a) - (b)) > 0)
+#define SEQ_GEQ(a, b) ((int32_t)((a) - (b)) >= 0)
+
+#define BUF_MASK (TCP_BUF_SIZE - 1)
+
+// Option kinds
+#define OPT_END        0
+#define OPT_NOP        1
+#define OPT_MSS        2
+#define OPT_WSCALE     3
+#define OPT_SACK_PERM  4
+#define OPT_SACK       5
+
+#define MAX_OPTIONS    40
+
+typedef struct {
+    uint32_t start;
+    uint32_t end;
+} sack_block_t;
+
+// What the receive path pulls out of a segment
+typedef struct {
+    uint32_t seq;
+    uint32_t ack;
+    uint32_t len;            // Payload bytes
+    uint32_t window;         // Unscaled
+    uint8_t flags;
+    uint16_t mss;            // 0 if not present
+    int8_t wscale;           // -1 if not present
+    bool sack_permitted;
+    uint8_t sack_count;
+    sack_block_t sack[TCP_MAX_SACK];
+} segment_t;
+
+struct tcp_socket {
+    tcp_socket_t* hash_next;     // Next connection in the demux bucket
+    bool in_use;
+    bool hashed;
+    bool orphan;                 // Nobody holds the socket, release it once closed
+    bool nodelay;
+    bool sack_ok;                // Both sides agreed on SACK
+    bool fin_queued;             // Send a FIN after the buffered data
+    bool fin_sent;
+    bool fin_acked;
+    bool fin_received;
+    bool reset;                  // Connection was reset or timed out
+    bool ack_now;                // Send an ACK on the next output
+    bool in_recovery;            // Fast recovery after duplicate ACKs
+    bool rtt_timing;
+    bool pending;                // Counted in the listener's syn_pending
+    uint8_t state;               // tcp_state_t
+    uint8_t service;             // tcp_service_t
+    uint8_t snd_wscale;          // Applied to windows the peer announces
+    uint8_t rcv_wscale;          // Applied to windows we announce
+    uint8_t dupacks;
+    uint8_t retries;
+    uint8_t delack_segments;     // Full segments received since the last ACK
+
+    uint32_t local_ip;
+    uint32_t remote_ip;
+    uint16_t local_port;         // Host byte order
+    uint16_t remote_port;
+    uint16_t mss;                // Largest segment we send
+
+    // Listener state
+    tcp_socket_t* parent;
+    tcp_socket_t* accept_queue[TCP_BACKLOG];
+    uint8_t accept_count;
+    uint8_t syn_pending;         // Children still in SYN_RECEIVED
+
+    // Send sequence space. Byte snd_una is at send_buf[send_start].
+    uint32_t iss;
+    uint32_t snd_una;
+    uint32_t snd_nxt;
+    uint32_t snd_max;            // Highest sequence number sent
+    uint32_t snd_wnd;
+    uint32_t snd_wl1;
+    uint32_t snd_wl2;
+    uint32_t fin_seq;
+    uint32_t cwnd;
+    uint32_t ssthresh;
+    uint32_t recover;            // snd_max when fast recovery started
+    uint32_t rtx_next;           // Next hole to fill during recovery
+    sack_block_t sacked[TCP_MAX_SACK];
+    uint8_t sack_count;
+    uint8_t* send_buf;
+    uint32_t send_start;
+    uint32_t send_len;
+
+    // Receive sequence space. Unread data starts at recv_buf[recv_start].
+    uint32_t irs;
+    uint32_t rcv_nxt;
+    uint32_t rcv_adv;            // Right edge of the last announced window
+    uint8_t* recv_buf;
+    uint32_t recv_start;
+    uint32_t recv_len;
+    pbuf_t* ooo_head;            // Out-of-order segments sorted by cb (sequence number)
+    uint32_t ooo_count;
+    uint32_t ooo_last;           // Sequence number of the newest one, reported first in SACK
+
+    // RTT estimation (RFC 6298), srtt scaled by 8 and rttvar by 4
+    uint32_t srtt;
+    uint32_t rttvar;
+    uint32_t rto;
+    uint32_t rtt_seq;
+    uint64_t rtt_start;
+
+    // Deadlines in ticks, 0 when the timer is off
+    uint64_t rtx_deadline;
+    uint64_t delack_deadline;
+    uint64_t persist_deadline;
+    uint64_t close_deadline;     // TIME_WAIT and orphaned FIN_WAIT_2
+    uint32_t persist_backoff;
+
+    tcp_conn_stats_t stats;
+};
+
+static tcp_socket_t sockets[TCP_MAX_SOCKETS];
+static tcp_socket_t* conn_table[TCP_HASH_SIZE];
+static uint8_t send_buffers[TCP_MAX_SOCKETS][TCP_BUF_SIZE] __attribute__((aligned(64)));
+static uint8_t recv_buffers[TCP_MAX_SOCKETS][TCP_BUF_SIZE] __attribute__((aligned(64)));
+static uint16_t next_ephemeral = TCP_EPHEMERAL_FIRST;
+static tcp_stats_t tcp_stats;
+
+static const char* state_names[] = {
+    "CLOSED", "LISTEN", "SYN_SENT", "SYN_RECEIVED", "ESTABLISHED",
+    "FIN_WAIT_1", "FIN_WAIT_2", "CLOSE_WAIT", "CLOSING", "LAST_ACK", "TIME_WAIT"
+};
+
+static inline uint32_t min_u32(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+static inline uint32_t max_u32(uint32_t a, uint32_t b) {
+    return a > b ? a : b;
+}
+
+static inline uint32_t conn_hash(uint32_t remote_ip, uint16_t remote_port, uint16_t local_port) {
+    uint32_t h = remote_ip ^ ((uint32_t)remote_port << 16 | local_port);
+    return ((h * 2654435761u) >> 26) & (TCP_HASH_SIZE - 1);
+}
+
+static tcp_socket_t* find_conn(uint32_t remote_ip, uint16_t remote_port, uint16_t local_port) {
+    for (tcp_socket_t* s = conn_table[conn_hash(remote_ip, remote_port, local_port)]; s; s = s->hash_next) {
+        if (s->remote_ip == remote_ip && s->remote_port == remote_port && s->local_port == local_port) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static tcp_socket_t* find_listener(uint16_t port) {
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        if (sockets[i].in_use && sockets[i].state == TCP_LISTEN && sockets[i].local_port == port) {
+            return &sockets[i];
+        }
+    }
+    return NULL;
+}
+
+static bool port_in_use(uint16_t port) {
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        if (sockets[i].in_use && sockets[i].local_port == port) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void hash_insert(tcp_socket_t* sock) {
+    uint32_t bucket = conn_hash(sock->remote_ip, sock->remote_port, sock->local_port);
+    sock->hash_next = conn_table[bucket];
+    conn_table[bucket] = sock;
+    sock->hashed = true;
+}
+
+static void hash_remove(tcp_socket_t* sock) {
+    if (!sock->hashed) return;
+
+    tcp_socket_t** link = &conn_table[conn_hash(sock->remote_ip, sock->remote_port, sock->local_port)];
+    while (*link && *link != sock) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) {
+        *link = sock->hash_next;
+    }
+    sock->hashed = false;
+}
+
+// Caller has interrupts disabled
+static tcp_socket_t* alloc_socket(void) {
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        if (!sockets[i].in_use) {
+            tcp_socket_t* sock = &sockets[i];
+            memset(sock, 0, sizeof(*sock));
+            sock->in_use = true;
+            sock->send_buf = send_buffers[i];
+            sock->recv_buf = recv_buffers[i];
+            sock->mss = TCP_DEFAULT_MSS;
+            sock->rto = TCP_RTO_INITIAL;
+            return sock;
+        }
+    }
+    return NULL;
+}
+
+static void drop_ooo(tcp_socket_t* sock) {
+    while (sock->ooo_head) {
+        pbuf_t* p = sock->ooo_head;
+        sock->ooo_head = p->next;
+        p->next = NULL;
+        pbuf_free(p);
+    }
+    sock->ooo_count = 0;
+}
+
+static void release_socket(tcp_socket_t* sock) {
+    if (sock->pending && sock->parent) {
+        sock->parent->syn_pending--;
+    }
+    hash_remove(sock);
+    drop_ooo(sock);
+    sock->in_use = false;
+}
+
+static void cancel_timers(tcp_socket_t* sock) {
+    sock->rtx_deadline = 0;
+    sock->delack_deadline = 0;
+    sock->persist_deadline = 0;
+    sock->close_deadline = 0;
+}
+
+// The connection is over. Sockets nobody holds go away, the others stay
+// CLOSED until their owner calls tcp_close.
+static void set_closed(tcp_socket_t* sock, bool reset) {
+    if (reset) {
+        sock->reset = true;
+        tcp_stats.connections_dropped++;
+    }
+    sock->state = TCP_CLOSED;
+    cancel_timers(sock);
+    drop_ooo(sock);
+    hash_remove(sock);
+
+    if (sock->stats.start_tick != 0) {
+        sock->stats.end_tick = tick_count;
+        tcp_stats.last = sock->stats;
+    }
+
+    if (sock->orphan) {
+        release_socket(sock);
+    }
+}
+
+static uint32_t receive_window(tcp_socket_t* sock) {
+    return TCP_BUF_SIZE - sock->recv_len;
+}
+
+// Largest segment the route to the peer carries, announced in our SYN
+static uint16_t route_mss(const tcp_socket_t* sock) {
+    return ip_route_mtu(sock->remote_ip) - IP_HEADER_SIZE - sizeof(tcp_header_t);
+}
+
+// Build the options for an outgoing segment, returns their length
+static uint8_t build_options(tcp_socket_t* sock, uint8_t flags, uint8_t* opt) {
+    uint8_t len = 0;
+
+    if (flags & TCP_SYN) {
+        opt[len++] = OPT_MSS;
+        opt[len++] = 4;
+        uint16_t mss = route_mss(sock);
+        opt[len++] = mss >> 8;
+        opt[len++] = mss & 0xFF;
+
+        // On a SYN-ACK only what the peer offered is echoed
+        if (sock->state == TCP_SYN_SENT || sock->rcv_wscale) {
+            opt[len++] = OPT_NOP;
+            opt[len++] = OPT_WSCALE;
+            opt[len++] = 3;
+            opt[len++] = TCP_WSCALE;
+        }
+        if (sock->state == TCP_SYN_SENT || sock->sack_ok) {
+            opt[len++] = OPT_NOP;
+            opt[len++] = OPT_NOP;
+            opt[len++] = OPT_SACK_PERM;
+            opt[len++] = 2;
+        }
+        return len;
+    }
+
+    if (!sock->sack_ok || !sock->ooo_head) {
+        return len;
+    }
+
+    // Merge the out-of-order queue into ranges, the one holding the newest
+    // segment goes first (RFC 2018)
+    sack_block_t ranges[TCP_OOO_MAX];
+    uint32_t count = 0;
+    for (pbuf_t* p = sock->ooo_head; p; p = p->next) {
+        uint32_t start = p->cb;
+        uint32_t end = p->cb + p->len;
+        if (count > 0 && SEQ_LEQ(start, ranges[count - 1].end)) {
+            if (SEQ_GT(end, ranges[count - 1].end)) {
+                ranges[count - 1].end = end;
+            }
+        } else {
+            ranges[count].start = start;
+            ranges[count].end = end;
+            count++;
+        }
+    }
+
+    uint32_t first = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (SEQ_GEQ(sock->ooo_last, ranges[i].start) && SEQ_LT(sock->ooo_last, ranges[i].end)) {
+            first = i;
+            break;
+        }
+    }
+
+    uint32_t blocks = min_u32(count, TCP_MAX_SACK);
+    opt[len++] = OPT_NOP;
+    opt[len++] = OPT_NOP;
+    opt[len++] = OPT_SACK;
+    opt[len++] = 2 + blocks * 8;
+    for (uint32_t n = 0, i = first; n < blocks; n++, i = (i + 1) % count) {
+        uint32_t start = htonl(ranges[i].start);
+        uint32_t end = htonl(ranges[i].end);
+        memcpy(&opt[len], &start, 4);
+        memcpy(&opt[len + 4], &end, 4);
+        len += 8;
+    }
+    return len;
+}
+
+// Copy length bytes starting offset bytes past snd_una out of the send ring
+static void copy_from_send_buf(tcp_socket_t* sock, uint32_t offset, uint8_t* out, uint32_t length) {
+    uint32_t pos = (sock->send_start + offset) & BUF_MASK;
+    uint32_t first = min_u32(length, TCP_BUF_SIZE - pos);
+    memcpy(out, sock->send_buf + pos, first);
+    memcpy(out + first, sock->send_buf, length - first);
+}
+
+static bool output_segment(tcp_socket_t* sock, uint32_t seq, uint32_t length, uint8_t flags) {
+    uint8_t options[MAX_OPTIONS];
+    uint8_t opt_len = build_options(sock, flags, options);
+    uint32_t header_len = sizeof(tcp_header_t) + opt_len;
+
+    pbuf_t* p = pbuf_alloc(header_len + length);
+    if (!p) {
+        net_stat_drop(NET_LAYER_TCP, NET_DROP_NO_BUFFER);
+        return false;
+    }
+
+    tcp_header_t* tcp = (tcp_header_t*)p->data;
+    memcpy(tcp->options, options, opt_len);
+    if (length > 0) {
+        copy_from_send_buf(sock, seq - sock->snd_una, p->data + header_len, length);
+    }
+
+    uint32_t window = receive_window(sock);
+    uint32_t announced;
+    if (flags & TCP_SYN) {
+        announced = min_u32(window, 65535);
+        tcp->window = htons(announced);
+    } else {
+        announced = min_u32(window >> sock->rcv_wscale, 65535);
+        tcp->window = htons(announced);
+        announced <<= sock->rcv_wscale;
+    }
+
+    tcp->src_port = htons(sock->local_port);
+    tcp->dest_port = htons(sock->remote_port);
+    tcp->seq = htonl(seq);
+    tcp->ack = (flags & TCP_ACK) ? htonl(sock->rcv_nxt) : 0;
+    tcp->data_offset = (header_len / 4) << 4;
+    tcp->flags = flags;
+    tcp->urgent = 0;
+
+    uint32_t sum = csum_pseudo_header(sock->local_ip, sock->remote_ip, IP_PROTOCOL_TCP, p->len);
+    tcp->checksum = (uint16_t)~csum_fold(sum);
+    p->flags |= PBUF_TX_L4_CSUM;
+    p->csum_start = pbuf_headroom(p);
+    p->csum_offset = 16;
+
+    // More than an MSS is a super-packet, cut into MSS sized segments by
+    // the NIC or right before it
+    if (length > sock->mss) {
+        p->gso_size = sock->mss;
+    }
+
+    uint32_t segment_len = p->len;
+    bool sent = ip_send_pbuf(p, sock->remote_ip, IP_PROTOCOL_TCP);
+    pbuf_free(p);
+    if (!sent) return false;
+    net_stat_tx(NET_LAYER_TCP, segment_len);
+
+    if (flags & TCP_ACK) {
+        sock->rcv_adv = sock->rcv_nxt + announced;
+        sock->ack_now = false;
+        sock->delack_deadline = 0;
+        sock->delack_segments = 0;
+    }
+    sock->stats.segments_sent++;
+    tcp_stats.segments_out++;
+    tcp_stats.bytes_out += length;
+    return true;
+}
+
+// Build and send one segment. length payload bytes are taken from the send
+// ring at seq. Returns false if no buffer was available or the ring was full.
+static bool send_segment(tcp_socket_t* sock, uint32_t seq, uint32_t length, uint8_t flags) {
+    net_prof_enter(NET_LAYER_TCP);
+    bool sent = output_segment(sock, seq, length, flags);
+    net_prof_exit();
+    return sent;
+}
+
+static void send_ack(tcp_socket_t* sock) {
+    send_segment(sock, sock->snd_nxt, 0, TCP_ACK);
+}
+
+// Answer a segment that belongs to no connection
+static void send_reset(const ip_header_t* ip, const tcp_header_t* in, const segment_t* seg) {
+    if (seg->flags & TCP_RST) return;
+
+    pbuf_t* p = pbuf_alloc(sizeof(tcp_header_t));
+    if (!p) {
+        net_stat_drop(NET_LAYER_TCP, NET_DROP_NO_BUFFER);
+        return;
+    }
+
+    tcp_header_t* tcp = (tcp_header_t*)p->data;
+    memset(tcp, 0, sizeof(tcp_header_t));
+    tcp->src_port = in->dest_port;
+    tcp->dest_port = in->src_port;
+    tcp->data_offset = (sizeof(tcp_header_t) / 4) << 4;
+
+    if (seg->flags & TCP_ACK) {
+        tcp->seq = htonl(seg->ack);
+        tcp->flags = TCP_RST;
+    } else {
+        uint32_t seg_len = seg->len + ((seg->flags & TCP_SYN) ? 1 : 0) + ((seg->flags & TCP_FIN) ? 1 : 0);
+        tcp->ack = htonl(seg->seq + seg_len);
+        tcp->flags = TCP_RST | TCP_ACK;
+    }
+
+    uint32_t sum = csum_pseudo_header(ip->dest_ip, ip->src_ip, IP_PROTOCOL_TCP, p->len);
+    tcp->checksum = (uint16_t)~csum_fold(sum);
+    p->flags |= PBUF_TX_L4_CSUM;
+    p->csum_start = pbuf_headroom(p);
+    p->csum_offset = 16;
+
+    if (ip_send_pbuf(p, ip->src_ip, IP_PROTOCOL_TCP)) {
+        tcp_stats.resets_sent++;
+        tcp_stats.segments_out++;
+        net_stat_tx(NET_LAYER_TCP, sizeof(tcp_header_t));
+    }
+    pbuf_free(p);
+}
+
+static void send_reset_conn(tcp_socket_t* sock) {
+    if (send_segment(sock, sock->snd_nxt, 0, TCP_RST | TCP_ACK)) {
+        tcp_stats.resets_sent++;
+    }
+}
+
+static void update_rtt(tcp_socket_t* sock, uint32_t rtt) {
+    if (sock->srtt == 0) {
+        sock->srtt = rtt << 3;
+        sock->rttvar = rtt << 1;
+    } else {
+        int32_t delta = (int32_t)rtt - (int32_t)(sock->srtt >> 3);
+        sock->srtt += delta;
+        if (delta < 0) delta = -delta;
+        sock->rttvar += delta - (int32_t)(sock->rttvar >> 2);
+    }
+
+    uint32_t rto = (sock->srtt >> 3) + max_u32(TCP_TIMER_INTERVAL, sock->rttvar);
+    sock->rto = min_u32(max_u32(rto, TCP_RTO_MIN), TCP_RTO_MAX);
+}
+
+// Advance snd_nxt past data the peer reported as received
+static void skip_sacked(tcp_socket_t* sock) {
+    bool moved = true;
+    while (moved && SEQ_LT(sock->snd_nxt, sock->snd_max)) {
+        moved = false;
+        for (uint32_t i = 0; i < sock->sack_count; i++) {
+            sack_block_t* b = &sock->sacked[i];
+            if (SEQ_LEQ(b->start, sock->snd_nxt) && SEQ_LT(sock->snd_nxt, b->end)) {
+                sock->snd_nxt = SEQ_LT(b->end, sock->snd_max) ? b->end : sock->snd_max;
+                moved = true;
+            }
+        }
+    }
+}
+
+// Bytes from seq up to the next SACKed block, or limit if there is none before it
+static uint32_t until_sacked(tcp_socket_t* sock, uint32_t seq, uint32_t limit) {
+    for (uint32_t i = 0; i < sock->sack_count; i++) {
+        if (SEQ_GT(sock->sacked[i].start, seq)) {
+            limit = min_u32(limit, sock->sacked[i].start - seq);
+        }
+    }
+    return limit;
+}
+
+// Send whatever the windows, Nagle and the state allow
+static void tcp_output(tcp_socket_t* sock) {
+    bool sent_ack = false;
+
+    switch (sock->state) {
+    case TCP_ESTABLISHED:
+    case TCP_CLOSE_WAIT:
+    case TCP_FIN_WAIT_1:
+    case TCP_CLOSING:
+    case TCP_LAST_ACK:
+        break;
+    case TCP_SYN_RECEIVED:
+        // The peer repeated its SYN, so our SYN-ACK was lost
+        if (sock->ack_now) {
+            send_segment(sock, sock->iss, 0, TCP_SYN | TCP_ACK);
+        }
+        return;
+    case TCP_FIN_WAIT_2:
+    case TCP_TIME_WAIT_STATE:
+        if (sock->ack_now) {
+            send_ack(sock);
+        }
+        return;
+    default:
+        return;
+    }
+
+    while (1) {
+        skip_sacked(sock);
+
+        uint32_t offset = sock->snd_nxt - sock->snd_una;
+        uint32_t unsent = offset < sock->send_len ? sock->send_len - offset : 0;
+        bool fin_due = sock->fin_queued && offset <= sock->send_len;
+        if (unsent == 0 && !fin_due) break;
+
+        uint32_t window = min_u32(sock->snd_wnd, sock->cwnd);
+        uint32_t usable = window > offset ? window - offset : 0;
+        // New data goes out in super-packets of many segments when GSO is on
+        bool retransmit = SEQ_LT(sock->snd_nxt, sock->snd_max);
+        uint32_t limit = retransmit ? sock->mss : gso_max_payload(sock->mss);
+        uint32_t length = min_u32(min_u32(unsent, limit), usable);
+        if (retransmit) {
+            length = until_sacked(sock, sock->snd_nxt, length);
+        } else if (length > sock->mss && length < unsent) {
+            // Only the end of the data makes a short last segment
+            length -= length % sock->mss;
+        }
+
+        if (unsent > 0 && length == 0) {
+            // Zero window with nothing in flight, probe it
+            if (sock->snd_wnd == 0 && offset == 0 && !sock->persist_deadline) {
+                sock->persist_backoff = sock->rto;
+                sock->persist_deadline = tick_count + sock->persist_backoff;
+            }
+            break;
+        }
+
+        bool fin = fin_due && length == unsent;
+
+        // Nagle: hold back a small segment while data is unacknowledged
+        if (length < sock->mss && !fin && !sock->nodelay && offset > 0 && !retransmit) break;
+
+        uint8_t flags = TCP_ACK;
+        if (length > 0 && length == unsent) flags |= TCP_PSH;
+        if (fin) flags |= TCP_FIN;
+
+        if (!send_segment(sock, sock->snd_nxt, length, flags)) break;
+        sent_ack = true;
+
+        if (retransmit) {
+            sock->stats.retransmits++;
+            tcp_stats.retransmits++;
+        } else if (!sock->rtt_timing && length > 0) {
+            sock->rtt_timing = true;
+            sock->rtt_seq = sock->snd_nxt + length;
+            sock->rtt_start = tick_count;
+        }
+
+        sock->snd_nxt += length + (fin ? 1 : 0);
+        if (SEQ_GT(sock->snd_nxt, sock->snd_max)) {
+            sock->snd_max = sock->snd_nxt;
+        }
+        if (!sock->rtx_deadline) {
+            sock->rtx_deadline = tick_count + sock->rto;
+        }
+
+        if (fin) {
+            sock->fin_seq = sock->snd_nxt - 1;
+            sock->fin_sent = true;
+            if (sock->state == TCP_ESTABLISHED) {
+                sock->state = TCP_FIN_WAIT_1;
+            } else if (sock->state == TCP_CLOSE_WAIT) {
+                sock->state = TCP_LAST_ACK;
+            }
+            break;
+        }
+    }
+
+    if (!sent_ack && sock->ack_now) {
+        send_ack(sock);
+    }
+}
+
+// Retransmit the first hole at or after rtx_next during fast recovery
+static void retransmit_hole(tcp_socket_t* sock) {
+    uint32_t seq = SEQ_GT(sock->rtx_next, sock->snd_una) ? sock->rtx_next : sock->snd_una;
+
+    bool moved = true;
+    while (moved) {
+        moved = false;
+        for (uint32_t i = 0; i < sock->sack_count; i++) {
+            if (SEQ_LEQ(sock->sacked[i].start, seq) && SEQ_LT(seq, sock->sacked[i].end)) {
+                seq = sock->sacked[i].end;
+                moved = true;
+            }
+        }
+    }
+    if (SEQ_GEQ(seq, sock->snd_max)) return;
+
+    uint32_t offset = seq - sock->snd_una;
+    uint32_t data = offset < sock->send_len ? sock->send_len - offset : 0;
+    uint32_t length = until_sacked(sock, seq, min_u32(data, sock->mss));
+    uint8_t flags = TCP_ACK;
+    if (sock->fin_sent && length == data) flags |= TCP_FIN;
+    if (length == 0 && !(flags & TCP_FIN)) return;
+
+    if (send_segment(sock, seq, length, flags)) {
+        sock->rtx_next = seq + length + ((flags & TCP_FIN) ? 1 : 0);
+        sock->rtt_timing = false;
+        sock->stats.retransmits++;
+        sock->stats.fast_retransmits++;
+        tcp_stats.retransmits++;
+        tcp_stats.fast_retransmits++;
+    }
+}
+
+// Merge the SACK blocks of an ACK into the scoreboard
+static void update_sacked(tcp_socket_t* sock, const segment_t* seg) {
+    for (uint32_t i = 0; i < seg->sack_count; i++) {
+        sack_block_t b = seg->sack[i];
+        if (SEQ_LEQ(b.end, sock->snd_una) || SEQ_GT(b.end, sock->snd_max) || SEQ_GEQ(b.start, b.end)) {
+            continue;
+        }
+
+        // Absorb every block that overlaps or touches the new one
+        uint32_t n = 0;
+        for (uint32_t j = 0; j < sock->sack_count; j++) {
+            sack_block_t* old = &sock->sacked[j];
+            if (SEQ_LEQ(old->start, b.end) && SEQ_GEQ(old->end, b.start)) {
+                if (SEQ_LT(old->start, b.start)) b.start = old->start;
+                if (SEQ_GT(old->end, b.end)) b.end = old->end;
+            } else {
+                sock->sacked[n++] = *old;
+            }
+        }
+
+        // Full: forget the highest block, it's the least useful for filling holes
+        if (n == TCP_MAX_SACK) {
+            uint32_t highest = 0;
+            for (uint32_t j = 1; j < n; j++) {
+                if (SEQ_GT(sock->sacked[j].start, sock->sacked[highest].start)) highest = j;
+            }
+            if (SEQ_GT(b.start, sock->sacked[highest].start)) {
+                sock->sack_count = n;
+                continue;
+            }
+            sock->sacked[highest] = sock->sacked[--n];
+        }
+        sock->sacked[n++] = b;
+        sock->sack_count = n;
+    }
+
+    // Drop what the cumulative ACK covers
+    uint32_t n = 0;
+    for (uint32_t j = 0; j < sock->sack_count; j++) {
+        if (SEQ_GT(sock->sacked[j].end, sock->snd_una)) {
+            if (SEQ_LT(sock->sacked[j].start, sock->snd_una)) {
+                sock->sacked[j].start = sock->snd_una;
+            }
+            sock->sacked[n++] = sock->sacked[j];
+        }
+    }
+    sock->sack_count = n;
+}
+
+static uint32_t highest_sacked(tcp_socket_t* sock) {
+    uint32_t highest = sock->snd_una;
+    for (uint32_t i = 0; i < sock->sack_count; i++) {
+        if (SEQ_GT(sock->sacked[i].end, highest)) highest = sock->sacked[i].end;
+    }
+    return highest;
+}
+
+static void enter_recovery(tcp_socket_t* sock) {
+    uint32_t flight = sock->snd_max - sock->snd_una;
+    sock->ssthresh = max_u32(flight / 2, 2 * sock->mss);
+    sock->cwnd = sock->ssthresh + 3 * sock->mss;
+    sock->recover = sock->snd_max;
+    sock->rtx_next = sock->snd_una;
+    sock->in_recovery = true;
+    retransmit_hole(sock);
+}
+
+// Process the acknowledgment and window fields of a segment.
+// Returns false if the segment should not be processed further.
+static bool process_ack(tcp_socket_t* sock, const segment_t* seg) {
+    if (SEQ_GT(seg->ack, sock->snd_max)) {
+        // Acknowledges something we never sent
+        sock->ack_now = true;
+        return false;
+    }
+
+    uint32_t window = seg->window << sock->snd_wscale;
+
+    if (sock->sack_ok && seg->sack_count > 0) {
+        update_sacked(sock, seg);
+    }
+
+    if (SEQ_GT(seg->ack, sock->snd_una)) {
+        uint32_t acked = seg->ack - sock->snd_una;
+        uint32_t data = min_u32(acked, sock->send_len);
+
+        sock->send_start = (sock->send_start + data) & BUF_MASK;
+        sock->send_len -= data;
+        sock->stats.bytes_sent += data;
+        if (sock->fin_sent && SEQ_GT(seg->ack, sock->fin_seq)) {
+            sock->fin_acked = true;
+        }
+
+        sock->snd_una = seg->ack;
+        if (SEQ_LT(sock->snd_nxt, sock->snd_una)) {
+            sock->snd_nxt = sock->snd_una;
+        }
+        update_sacked(sock, seg);
+
+        // Karn: only segments sent once are timed
+        if (sock->rtt_timing && SEQ_GEQ(seg->ack, sock->rtt_seq)) {
+            update_rtt(sock, tick_count - sock->rtt_start);
+            sock->rtt_timing = false;
+        }
+        sock->retries = 0;
+        sock->dupacks = 0;
+
+        if (sock->in_recovery) {
+            if (SEQ_LT(seg->ack, sock->recover)) {
+                // Partial ACK, the next hole is lost too
+                sock->cwnd = sock->cwnd > acked ? sock->cwnd - acked + sock->mss : sock->mss;
+                retransmit_hole(sock);
+            } else {
+                sock->in_recovery = false;
+                sock->cwnd = sock->ssthresh;
+            }
+        } else if (sock->cwnd < sock->ssthresh) {
+            sock->cwnd += min_u32(acked, sock->mss);
+        } else {
+            sock->cwnd += max_u32(sock->mss * sock->mss / sock->cwnd, 1);
+        }
+        sock->cwnd = min_u32(sock->cwnd, 2 * TCP_BUF_SIZE);
+
+        if (sock->snd_una == sock->snd_max) {
+            sock->rtx_deadline = 0;
+        } else {
+            sock->rtx_deadline = tick_count + sock->rto;
+        }
+    } else if (seg->ack == sock->snd_una && seg->len == 0 && window == sock->snd_wnd &&
+               sock->snd_max != sock->snd_una && !(seg->flags & (TCP_SYN | TCP_FIN))) {
+        sock->dupacks++;
+        if (!sock->in_recovery) {
+            // Three duplicates, or SACK showing more than three segments beyond a hole
+            bool sack_loss = sock->sack_ok &&
+                             highest_sacked(sock) - sock->snd_una > 3 * (uint32_t)sock->mss;
+            if (sock->dupacks >= 3 || sack_loss) {
+                enter_recovery(sock);
+            }
+        } else {
+            sock->cwnd += sock->mss;
+            if (sock->sack_ok && SEQ_LT(sock->rtx_next, highest_sacked(sock))) {
+                retransmit_hole(sock);
+            }
+        }
+    }
+
+    // Window update (RFC 793), only from segments that are not older than the last one
+    if (SEQ_LT(sock->snd_wl1, seg->seq) ||
+        (sock->snd_wl1 == seg->seq && SEQ_LEQ(sock->snd_wl2, seg->ack))) {
+        sock->snd_wnd = window;
+        sock->snd_wl1 = seg->seq;
+        sock->snd_wl2 = seg->ack;
+        if (window > 0) {
+            sock->persist_deadline = 0;
+        }
+    }
+    return true;
+}
+
+// Append in-order payload to the receive ring
+static void deliver(tcp_socket_t* sock, const uint8_t* data, uint32_t length) {
+    if (sock->service != TCP_SERVICE_DISCARD && sock->service != TCP_SERVICE_SOURCE) {
+        length = min_u32(length, receive_window(sock));
+        uint32_t pos = (sock->recv_start + sock->recv_len) & BUF_MASK;
+        uint32_t first = min_u32(length, TCP_BUF_SIZE - pos);
+        memcpy(sock->recv_buf + pos, data, first);
+        memcpy(sock->recv_buf, data + first, length - first);
+        sock->recv_len += length;
+    }
+
+    sock->rcv_nxt += length;
+    sock->stats.bytes_received += length;
+    tcp_stats.bytes_in += length;
+}
+
+static void ooo_insert(tcp_socket_t* sock, pbuf_t* packet, uint32_t seq) {
+    if (sock->ooo_count >= TCP_OOO_MAX || pbuf_free_count() < TCP_OOO_RESERVE) {
+        net_stat_drop(NET_LAYER_TCP, NET_DROP_QUEUE_FULL);
+        return;
+    }
+
+    pbuf_t** link = &sock->ooo_head;
+    while (*link && SEQ_LEQ((*link)->cb, seq)) {
+        if ((*link)->cb == seq && (*link)->len >= packet->len) {
+            return;  // Already have it
+        }
+        link = &(*link)->next;
+    }
+
+    pbuf_ref(packet);
+    packet->cb = seq;
+    packet->next = *link;
+    *link = packet;
+    sock->ooo_count++;
+    sock->ooo_last = seq;
+    sock->stats.ooo_segments++;
+}
+
+// Move queued segments that the last delivery made contiguous
+static void ooo_drain(tcp_socket_t* sock) {
+    while (sock->ooo_head && SEQ_LEQ(sock->ooo_head->cb, sock->rcv_nxt)) {
+        pbuf_t* p = sock->ooo_head;
+        sock->ooo_head = p->next;
+        p->next = NULL;
+        sock->ooo_count--;
+
+        uint32_t end = p->cb + p->len;
+        if (SEQ_GT(end, sock->rcv_nxt)) {
+            uint32_t skip = sock->rcv_nxt - p->cb;
+            deliver(sock, p->data + skip, p->len - skip);
+        }
+        pbuf_free(p);
+    }
+}
+
+// Handle the payload and FIN of a segment in a synchronized state
+static void process_data(tcp_socket_t* sock, pbuf_t* packet, segment_t* seg) {
+    uint32_t seq = seg->seq;
+
+    if (seg->len > 0 && (sock->state == TCP_ESTABLISHED || sock->state == TCP_FIN_WAIT_1 ||
+                         sock->state == TCP_FIN_WAIT_2)) {
+        sock->stats.segments_received++;
+
+        // Cut off what we already have and what doesn't fit the window
+        if (SEQ_LT(seq, sock->rcv_nxt)) {
+            uint32_t skip = sock->rcv_nxt - seq;
+            pbuf_pull(packet, skip);
+            seq = sock->rcv_nxt;
+        }
+        uint32_t right = sock->rcv_nxt + receive_window(sock);
+        if (SEQ_GT(seq + packet->len, right)) {
+            pbuf_trim(packet, right - seq);
+            seg->flags &= ~TCP_FIN;
+        }
+
+        if (packet->len == 0) {
+            sock->ack_now = true;
+        } else if (seq == sock->rcv_nxt) {
+            bool filled_hole = sock->ooo_head != NULL;
+            deliver(sock, packet->data, packet->len);
+            ooo_drain(sock);
+
+            // Delayed ACK: every second full segment or after TCP_DELACK_TIME,
+            // right away when a hole was filled so the sender learns quickly.
+            // A coalesced packet counts as the segments it was made of.
+            uint32_t segments = packet->gso_size ? (packet->len + packet->gso_size - 1) / packet->gso_size : 1;
+            sock->delack_segments = min_u32(sock->delack_segments + segments, 255);
+            if (filled_hole || sock->nodelay || sock->delack_segments >= 2) {
+                sock->ack_now = true;
+            } else if (!sock->delack_deadline) {
+                sock->delack_deadline = tick_count + TCP_DELACK_TIME;
+            }
+        } else {
+            // Ahead of a hole, keep it and tell the sender with a duplicate ACK
+            ooo_insert(sock, packet, seq);
+            sock->ack_now = true;
+        }
+        seq += packet->len;
+    }
+
+    if (!(seg->flags & TCP_FIN) || seq != sock->rcv_nxt || sock->fin_received) {
+        return;
+    }
+
+    sock->fin_received = true;
+    sock->rcv_nxt++;
+    sock->ack_now = true;
+
+    switch (sock->state) {
+    case TCP_SYN_RECEIVED:
+    case TCP_ESTABLISHED:
+        sock->state = TCP_CLOSE_WAIT;
+        break;
+    case TCP_FIN_WAIT_1:
+        if (sock->fin_acked) {
+            sock->state = TCP_TIME_WAIT_STATE;
+            cancel_timers(sock);
+            sock->close_deadline = tick_count + TCP_TIME_WAIT;
+        } else {
+            sock->state = TCP_CLOSING;
+        }
+        break;
+    case TCP_FIN_WAIT_2:
+        sock->state = TCP_TIME_WAIT_STATE;
+        cancel_timers(sock);
+        sock->close_deadline = tick_count + TCP_TIME_WAIT;
+        break;
+    default:
+        break;
+    }
+}
+
+static void established(tcp_socket_t* sock) {
+    sock->state = TCP_ESTABLISHED;
+    sock->cwnd = 4 * sock->mss;
+    sock->ssthresh = 2 * TCP_BUF_SIZE;
+    sock->stats.start_tick = tick_count;
+
+    tcp_socket_t* parent = sock->parent;
+    if (!parent) return;
+
+    if (sock->pending) {
+        sock->pending = false;
+        parent->syn_pending--;
+    }
+    tcp_stats.connections_accepted++;
+
+    if (sock->service == TCP_SERVICE_SOURCE) {
+        // The ring never gets anything else written to it, fill it once
+        for (uint32_t i = 0; i < TCP_BUF_SIZE; i++) {
+            sock->send_buf[i] = 'A' + i % 26;
+        }
+    }
+
+    if (!sock->orphan) {
+        if (parent->accept_count >= TCP_BACKLOG) {
+            send_reset_conn(sock);
+            sock->orphan = true;
+            set_closed(sock, true);
+            return;
+        }
+        parent->accept_queue[parent->accept_count++] = sock;
+    }
+}
+
+// Take the options of a SYN
+static void apply_syn_options(tcp_socket_t* sock, const segment_t* seg) {
+    // Segments must also fit the MTU of the route to the peer
+    sock->mss = min_u32(seg->mss ? seg->mss : TCP_DEFAULT_MSS, route_mss(sock));
+    if (seg->wscale >= 0) {
+        sock->snd_wscale = seg->wscale > 14 ? 14 : seg->wscale;
+        sock->rcv_wscale = TCP_WSCALE;
+    } else {
+        sock->snd_wscale = 0;
+        sock->rcv_wscale = 0;
+    }
+    sock->sack_ok = seg->sack_permitted;
+}
+
+static void handle_listen(tcp_socket_t* listener, const ip_header_t* ip,
+                          const tcp_header_t* tcp, const segment_t* seg) {
+    if (seg->flags & TCP_RST) return;
+    if (seg->flags & TCP_ACK) {
+        send_reset(ip, tcp, seg);
+        return;
+    }
+    if (!(seg->flags & TCP_SYN)) return;
+
+    tcp_socket_t* child = NULL;
+    if (listener->accept_count + listener->syn_pending < TCP_BACKLOG) {
+        child = alloc_socket();
+    }
+    if (!child) {
+        tcp_stats.connections_dropped++;
+        return;
+    }
+
+    child->local_ip = ip->dest_ip;
+    child->remote_ip = ip->src_ip;
+    child->local_port = listener->local_port;
+    child->remote_port = ntohs(tcp->src_port);
+    child->parent = listener;
+    child->pending = true;
+    child->service = listener->service;
+    child->orphan = listener->service != TCP_SERVICE_NONE;
+    child->nodelay = listener->nodelay;
+    listener->syn_pending++;
+
+    apply_syn_options(child, seg);
+    child->irs = seg->seq;
+    child->rcv_nxt = seg->seq + 1;
+    child->snd_wnd = seg->window;
+    child->snd_wl1 = seg->seq;
+
+    child->iss = random_next() + (uint32_t)tick_count * 250;
+    child->snd_una = child->iss;
+    child->snd_nxt = child->iss + 1;
+    child->snd_max = child->snd_nxt;
+    child->snd_wl2 = child->iss;
+    child->state = TCP_SYN_RECEIVED;
+    hash_insert(child);
+
+    send_segment(child, child->iss, 0, TCP_SYN | TCP_ACK);
+    child->rtt_timing = true;
+    child->rtt_seq = child->snd_nxt;
+    child->rtt_start = tick_count;
+    child->rtx_deadline = tick_count + child->rto;
+}
+
+static void handle_syn_sent(tcp_socket_t* sock, const ip_header_t* ip,
+                            const tcp_header_t* tcp, const segment_t* seg) {
+    bool ack_ok = false;
+    if (seg->flags & TCP_ACK) {
+        if (SEQ_LEQ(seg->ack, sock->iss) || SEQ_GT(seg->ack, sock->snd_max)) {
+            send_reset(ip, tcp, seg);
+            return;
+        }
+        ack_ok = true;
+    }
+
+    if (seg->flags & TCP_RST) {
+        if (ack_ok) {
+            tcp_stats.resets_received++;
+            set_closed(sock, true);
+        }
+        return;
+    }
+    if (!(seg->flags & TCP_SYN)) return;
+
+    apply_syn_options(sock, seg);
+    sock->irs = seg->seq;
+    sock->rcv_nxt = seg->seq + 1;
+
+    if (ack_ok) {
+        sock->snd_una = seg->ack;
+        sock->snd_wnd = seg->window;
+        sock->snd_wl1 = seg->seq;
+        sock->snd_wl2 = seg->ack;
+        sock->rtx_deadline = 0;
+        if (sock->rtt_timing) {
+            update_rtt(sock, tick_count - sock->rtt_start);
+            sock->rtt_timing = false;
+        }
+        established(sock);
+        sock->ack_now = true;
+    } else {
+        // Simultaneous open
+        sock->state = TCP_SYN_RECEIVED;
+        sock->rtt_timing = false;
+        send_segment(sock, sock->iss, 0, TCP_SYN | TCP_ACK);
+    }
+}
+
+static void handle_synchronized(tcp_socket_t* sock, pbuf_t* packet, segment_t* seg) {
+    // Acceptability test (RFC 793)
+    uint32_t window = receive_window(sock);
+    uint32_t seg_len = seg->len + ((seg->flags & TCP_SYN) ? 1 : 0) + ((seg->flags & TCP_FIN) ? 1 : 0);
+    bool acceptable;
+    if (seg_len == 0) {
+        acceptable = window == 0 ? seg->seq == sock->rcv_nxt
+                                 : SEQ_GEQ(seg->seq, sock->rcv_nxt) && SEQ_LT(seg->seq, sock->rcv_nxt + window);
+    } else if (window == 0) {
+        acceptable = false;
+    } else {
+        uint32_t last = seg->seq + seg_len - 1;
+        acceptable = (SEQ_GEQ(seg->seq, sock->rcv_nxt) && SEQ_LT(seg->seq, sock->rcv_nxt + window)) ||
+                     (SEQ_GEQ(last, sock->rcv_nxt) && SEQ_LT(last, sock->rcv_nxt + window));
+    }
+
+    if (!acceptable) {
+        if (!(seg->flags & TCP_RST)) {
+            sock->ack_now = true;
+            if (sock->state == TCP_TIME_WAIT_STATE && (seg->flags & TCP_FIN)) {
+                sock->close_deadline = tick_count + TCP_TIME_WAIT;
+            }
+        }
+        return;
+    }
+
+    if (seg->flags & TCP_RST) {
+        tcp_stats.resets_received++;
+        if (sock->state == TCP_SYN_RECEIVED && sock->parent) {
+            // Passive open that went nowhere, nobody saw it yet
+            sock->orphan = true;
+        }
+        set_closed(sock, sock->state != TCP_TIME_WAIT_STATE);
+        return;
+    }
+
+    if (seg->flags & TCP_SYN) {
+        send_reset_conn(sock);
+        set_closed(sock, true);
+        return;
+    }
+
+    if (!(seg->flags & TCP_ACK)) return;
+
+    if (sock->state == TCP_SYN_RECEIVED) {
+        if (SEQ_LEQ(seg->ack, sock->snd_una) || SEQ_GT(seg->ack, sock->snd_max)) {
+            send_reset_conn(sock);
+            return;
+        }
+        if (sock->rtt_timing) {
+            update_rtt(sock, tick_count - sock->rtt_start);
+            sock->rtt_timing = false;
+        }
+        sock->snd_una = seg->ack;
+        sock->snd_wnd = seg->window << sock->snd_wscale;
+        sock->snd_wl1 = seg->seq;
+        sock->snd_wl2 = seg->ack;
+        sock->rtx_deadline = 0;
+        sock->retries = 0;
+        established(sock);
+        if (sock->state != TCP_ESTABLISHED) return;
+    }
+
+    if (!process_ack(sock, seg)) return;
+
+    if (sock->fin_acked) {
+        switch (sock->state) {
+        case TCP_FIN_WAIT_1:
+            sock->state = TCP_FIN_WAIT_2;
+            if (sock->orphan) {
+                sock->close_deadline = tick_count + TCP_FIN_WAIT_TIME;
+            }
+            break;
+        case TCP_CLOSING:
+            sock->state = TCP_TIME_WAIT_STATE;
+            cancel_timers(sock);
+            sock->close_deadline = tick_count + TCP_TIME_WAIT;
+            break;
+        case TCP_LAST_ACK:
+            set_closed(sock, false);
+            return;
+        default:
+            break;
+        }
+    }
+
+    process_data(sock, packet, seg);
+}
+
+// Let the built-in services move data along
+static void run_service(tcp_socket_t* sock) {
+    if (!sock->in_use) return;
+
+    switch (sock->service) {
+    case TCP_SERVICE_ECHO: {
+        uint32_t length = min_u32(sock->recv_len, TCP_BUF_SIZE - sock->send_len);
+        uint32_t pos = (sock->send_start + sock->send_len) & BUF_MASK;
+        for (uint32_t done = 0; done < length; ) {
+            uint32_t src = (sock->recv_start + done) & BUF_MASK;
+            uint32_t dst = (pos + done) & BUF_MASK;
+            uint32_t chunk = min_u32(length - done, min_u32(TCP_BUF_SIZE - src, TCP_BUF_SIZE - dst));
+            memcpy(sock->send_buf + dst, sock->recv_buf + src, chunk);
+            done += chunk;
+        }
+        sock->recv_start = (sock->recv_start + length) & BUF_MASK;
+        sock->recv_len -= length;
+        sock->send_len += length;
+        break;
+    }
+    case TCP_SERVICE_SOURCE:
+        if (sock->state == TCP_ESTABLISHED && !sock->fin_queued) {
+            sock->send_len = TCP_BUF_SIZE;
+        }
+        break;
+    default:
+        break;
+    }
+
+    // Services close their side once the peer is done
+    if (sock->service != TCP_SERVICE_NONE && sock->state == TCP_CLOSE_WAIT && !sock->fin_queued) {
+        sock->fin_queued = true;
+    }
+}
+
+// Announce a window that grew by enough to matter (receiver side SWS avoidance)
+static void window_update(tcp_socket_t* sock) {
+    uint32_t announced = sock->rcv_adv - sock->rcv_nxt;
+    uint32_t window = receive_window(sock);
+    if (window >= announced + 2 * (uint32_t)sock->mss || (announced == 0 && window >= TCP_BUF_SIZE / 2)) {
+        sock->ack_now = true;
+    }
+}
+
+static bool parse_options(const tcp_header_t* tcp, uint32_t header_len, segment_t* seg) {
+    const uint8_t* opt = tcp->options;
+    uint32_t len = header_len - sizeof(tcp_header_t);
+    uint32_t i = 0;
+
+    while (i < len) {
+        uint8_t kind = opt[i];
+        if (kind == OPT_END) break;
+        if (kind == OPT_NOP) {
+            i++;
+            continue;
+        }
+        if (i + 1 >= len) return false;
+        uint8_t olen = opt[i + 1];
+        if (olen < 2 || i + olen > len) return false;
+
+        switch (kind) {
+        case OPT_MSS:
+            if (olen == 4) seg->mss = (opt[i + 2] << 8) | opt[i + 3];
+            break;
+        case OPT_WSCALE:
+            if (olen == 3) seg->wscale = opt[i + 2];
+            break;
+        case OPT_SACK_PERM:
+            seg->sack_permitted = true;
+            break;
+        case OPT_SACK:
+            for (uint32_t b = i + 2; b + 8 <= i + olen && seg->sack_count < TCP_MAX_SACK; b += 8) {
+                uint32_t start, end;
+                memcpy(&start, &opt[b], 4);
+                memcpy(&end, &opt[b + 4], 4);
+                seg->sack[seg->sack_count].start = ntohl(start);
+                seg->sack[seg->sack_count].end = ntohl(end);
+                seg->sack_count++;
+            }
+            break;
+        }
+        i += olen;
+    }
+    return true;
+}
+
+static void tcp_input(pbuf_t* packet, const ip_header_t* ip) {
+    const tcp_header_t* tcp = (const tcp_header_t*)packet->data;
+
+    if (packet->len < sizeof(tcp_header_t)) {
+        net_stat_drop(NET_LAYER_TCP, NET_DROP_TRUNCATED);
+        return;
+    }
+    net_stat_rx(NET_LAYER_TCP, packet->len);
+    uint32_t header_len = (tcp->data_offset >> 4) * 4;
+    if (header_len < sizeof(tcp_header_t) || header_len > packet->len) {
+        net_stat_drop(NET_LAYER_TCP, NET_DROP_MALFORMED);
+        return;
+    }
+
+    if (!(packet->flags & PBUF_RX_L4_CSUM_OK)) {
+        uint32_t sum = csum_pseudo_header(ip->src_ip, ip->dest_ip, IP_PROTOCOL_TCP, packet->len);
+        if (csum_fold(csum_partial(tcp, packet->len, sum)) != 0) {
+            tcp_stats.checksum_errors++;
+            net_stat_drop(NET_LAYER_TCP, NET_DROP_CHECKSUM);
+            return;
+        }
+    }
+    tcp_stats.segments_in++;
+
+    segment_t seg;
+    memset(&seg, 0, sizeof(seg));
+    seg.wscale = -1;
+    seg.seq = ntohl(tcp->seq);
+    seg.ack = ntohl(tcp->ack);
+    seg.flags = tcp->flags;
+    seg.window = ntohs(tcp->window);
+    seg.len = packet->len - header_len;
+    if (!parse_options(tcp, header_len, &seg)) {
+        net_stat_drop(NET_LAYER_TCP, NET_DROP_MALFORMED);
+        return;
+    }
+
+    // The header stays readable in the headroom after the pull
+    pbuf_pull(packet, header_len);
+
+    uint64_t flags = irq_save();
+
+    uint16_t local_port = ntohs(tcp->dest_port);
+    tcp_socket_t* sock = find_conn(ip->src_ip, ntohs(tcp->src_port), local_port);
+    if (!sock) {
+        sock = find_listener(local_port);
+    }
+
+    if (!sock) {
+        net_stat_drop(NET_LAYER_TCP, NET_DROP_NO_HANDLER);
+        send_reset(ip, tcp, &seg);
+    } else if (sock->state == TCP_LISTEN) {
+        handle_listen(sock, ip, tcp, &seg);
+    } else if (sock->state == TCP_SYN_SENT) {
+        handle_syn_sent(sock, ip, tcp, &seg);
+        if (sock->in_use) tcp_output(sock);
+    } else {
+        handle_synchronized(sock, packet, &seg);
+        if (sock->in_use) {
+            run_service(sock);
+            tcp_output(sock);
+        }
+    }
+
+    irq_restore(flags);
+}
+
+static void tcp_receive(pbuf_t* packet, const ip_header_t* ip) {
+    net_prof_enter(NET_LAYER_TCP);
+    tcp_input(packet, ip);
+    net_prof_exit();
+}
+
+static void handle_timeout(tcp_socket_t* sock) {
+    if (++sock->retries > TCP_MAX_RETRIES) {
+        send_reset_conn(sock);
+        set_closed(sock, true);
+        return;
+    }
+
+    sock->stats.timeouts++;
+    tcp_stats.timeouts++;
+    sock->rto = min_u32(sock->rto * 2, TCP_RTO_MAX);
+    sock->rtt_timing = false;
+    sock->rtx_deadline = tick_count + sock->rto;
+
+    if (sock->state == TCP_SYN_SENT) {
+        send_segment(sock, sock->iss, 0, TCP_SYN);
+        return;
+    }
+    if (sock->state == TCP_SYN_RECEIVED) {
+        send_segment(sock, sock->iss, 0, TCP_SYN | TCP_ACK);
+        return;
+    }
+
+    // Everything in flight is presumed lost, start over from snd_una in
+    // slow start. skip_sacked keeps what the peer reported from being resent.
+    uint32_t flight = sock->snd_max - sock->snd_una;
+    sock->ssthresh = max_u32(flight / 2, 2 * sock->mss);
+    sock->cwnd = sock->mss;
+    sock->in_recovery = false;
+    sock->dupacks = 0;
+    sock->snd_nxt = sock->snd_una;
+    tcp_output(sock);
+}
+
+static void tcp_timer(void) {
+    uint64_t now = tick_count;
+
+    for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+        tcp_socket_t* sock = &sockets[i];
+        if (!sock->in_use || sock->state == TCP_CLOSED || sock->state == TCP_LISTEN) continue;
+
+        if (sock->close_deadline && now >= sock->close_deadline) {
+            set_closed(sock, false);
+            continue;
+        }
+
+        if (sock->rtx_deadline && now >= sock->rtx_deadline) {
+            handle_timeout(sock);
+            if (!sock->in_use || sock->state == TCP_CLOSED) continue;
+        }
+
+        if (sock->persist_deadline && now >= sock->persist_deadline) {
+            // Probe the zero window with an old sequence number, the peer
+            // answers with an ACK carrying its current window
+            send_segment(sock, sock->snd_una - 1, 0, TCP_ACK);
+            sock->persist_backoff = min_u32(sock->persist_backoff * 2, TCP_RTO_MAX);
+            sock->persist_deadline = now + sock->persist_backoff;
+        }
+
+        if (sock->delack_deadline && now >= sock->delack_deadline) {
+            sock->ack_now = true;
+        }
+
+        // Also picks up sends that found the transmit ring full
+        run_service(sock);
+        tcp_output(sock);
+    }
+}
+
+void tcp_init(void) {
+    memset(sockets, 0, sizeof(sockets));
+    memset(conn_table, 0, sizeof(conn_table));
+    memset(&tcp_stats, 0, sizeof(tcp_stats));
+
+    ip_register_protocol_handler(IP_PROTOCOL_TCP, tcp_receive);
+    timer_register_periodic(tcp_timer, TCP_TIMER_INTERVAL);
+}
+
+tcp_socket_t* tcp_socket(void) {
+    uint64_t flags = irq_save();
+    tcp_socket_t* sock = alloc_socket();
+    irq_restore(flags);
+    return sock;
+}
+
+// Pick an unused port from the ephemeral range, caller has interrupts disabled
+static uint16_t ephemeral_port(void) {
+    for (uint32_t n = 0; n <= TCP_EPHEMERAL_LAST - TCP_EPHEMERAL_FIRST; n++) {
+        uint16_t port = next_ephemeral;
+        next_ephemeral = (port == TCP_EPHEMERAL_LAST) ? TCP_EPHEMERAL_FIRST : port + 1;
+        if (!port_in_use(port)) {
+            return port;
+        }
+    }
+    return 0;
+}
+
+bool tcp_bind(tcp_socket_t* sock, uint16_t port) {
+    uint64_t flags = irq_save();
+
+    if (sock->local_port != 0 || sock->state != TCP_CLOSED) {
+        irq_restore(flags);
+        return false;
+    }
+
+    if (port == 0) {
+        port = ephemeral_port();
+    }
+    if (port == 0 || port_in_use(port)) {
+        irq_restore(flags);
+        return false;
+    }
+    sock->local_port = port;
+
+    irq_restore(flags);
+    return true;
+}
+
+bool tcp_listen(tcp_socket_t* sock) {
+    if (sock->local_port == 0 || sock->state != TCP_CLOSED) {
+        return false;
+    }
+    sock->state = TCP_LISTEN;
+    return true;
+}
+
+tcp_socket_t* tcp_accept(tcp_socket_t* sock, uint32_t timeout_ms) {
+    uint64_t deadline = tick_count + timeout_ms;
+
+    while (1) {
+        uint64_t flags = irq_save();
+        while (sock->accept_count > 0) {
+            tcp_socket_t* child = sock->accept_queue[0];
+            sock->accept_count--;
+            memmove(&sock->accept_queue[0], &sock->accept_queue[1],
+                    sock->accept_count * sizeof(tcp_socket_t*));
+            child->parent = NULL;
+            irq_restore(flags);
+            return child;
+        }
+        irq_restore(flags);
+
+        if (sock->state != TCP_LISTEN || (timeout_ms && tick_count >= deadline)) {
+            return NULL;
+        }
+        ethernet_wait();
+    }
+}
+
+int tcp_connect(tcp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port, uint32_t timeout_ms) {
+    if (sock->state != TCP_CLOSED || sock->reset) {
+        return TCP_ERR_CLOSED;
+    }
+    if (sock->local_port == 0 && !tcp_bind(sock, 0)) {
+        return TCP_ERR_CLOSED;
+    }
+
+    uint64_t flags = irq_save();
+    sock->local_ip = ip_source_address(dest_ip);
+    sock->remote_ip = dest_ip;
+    sock->remote_port = dest_port;
+    sock->iss = random_next() + (uint32_t)tick_count * 250;
+    sock->snd_una = sock->iss;
+    sock->snd_nxt = sock->iss + 1;
+    sock->snd_max = sock->snd_nxt;
+    sock->state = TCP_SYN_SENT;
+    hash_insert(sock);
+
+    send_segment(sock, sock->iss, 0, TCP_SYN);
+    sock->rtt_timing = true;
+    sock->rtt_start = tick_count;
+    sock->rtx_deadline = tick_count + sock->rto;
+    tcp_stats.connections_opened++;
+    irq_restore(flags);
+
+    uint64_t deadline = tick_count + timeout_ms;
+    while (sock->state == TCP_SYN_SENT || sock->state == TCP_SYN_RECEIVED) {
+        if (timeout_ms && tick_count >= deadline) {
+            flags = irq_save();
+            set_closed(sock, true);
+            irq_restore(flags);
+            return TCP_ERR_TIMEOUT;
+        }
+        ethernet_wait();
+    }
+
+    if (sock->state == TCP_CLOSED) {
+        return sock->reset ? TCP_ERR_RESET : TCP_ERR_CLOSED;
+    }
+    return 0;
+}
+
+int tcp_send(tcp_socket_t* sock, const void* data, uint32_t length) {
+    const uint8_t* src = data;
+    uint32_t queued = 0;
+
+    while (queued < length) {
+        uint64_t flags = irq_save();
+
+        if (sock->state != TCP_ESTABLISHED && sock->state != TCP_CLOSE_WAIT) {
+            irq_restore(flags);
+            if (queued > 0) return queued;
+            return sock->reset ? TCP_ERR_RESET : TCP_ERR_CLOSED;
+        }
+        if (sock->fin_queued) {
+            irq_restore(flags);
+            return TCP_ERR_CLOSED;
+        }
+
+        uint32_t space = TCP_BUF_SIZE - sock->send_len;
+        uint32_t chunk = min_u32(space, length - queued);
+        if (chunk > 0) {
+            uint32_t pos = (sock->send_start + sock->send_len) & BUF_MASK;
+            uint32_t first = min_u32(chunk, TCP_BUF_SIZE - pos);
+            memcpy(sock->send_buf + pos, src + queued, first);
+            memcpy(sock->send_buf, src + queued + first, chunk - first);
+            sock->send_len += chunk;
+            queued += chunk;
+            tcp_output(sock);
+        }
+        irq_restore(flags);
+
+        if (queued < length) {
+            ethernet_wait();
+        }
+    }
+    return queued;
+}
+
+int tcp_recv(tcp_socket_t* sock, void* buffer, uint32_t max_length, uint32_t timeout_ms) {
+    uint64_t deadline = tick_count + timeout_ms;
+    uint8_t* out = buffer;
+
+    while (1) {
+        uint64_t flags = irq_save();
+
+        if (sock->recv_len > 0) {
+            uint32_t length = min_u32(sock->recv_len, max_length);
+            uint32_t first = min_u32(length, TCP_BUF_SIZE - sock->recv_start);
+            memcpy(out, sock->recv_buf + sock->recv_start, first);
+            memcpy(out + first, sock->recv_buf, length - first);
+            sock->recv_start = (sock->recv_start + length) & BUF_MASK;
+            sock->recv_len -= length;
+
+            window_update(sock);
+            if (sock->ack_now) {
+                tcp_output(sock);
+            }
+            irq_restore(flags);
+            return length;
+        }
+
+        int result = 1;
+        if (sock->fin_received) {
+            result = 0;
+        } else if (sock->state == TCP_CLOSED) {
+            result = sock->reset ? TCP_ERR_RESET : TCP_ERR_CLOSED;
+        }
+        irq_restore(flags);
+
+        if (result <= 0) return result;
+        if (timeout_ms && tick_count >= deadline) return TCP_ERR_TIMEOUT;
+        ethernet_wait();
+    }
+}
+
+void tcp_set_nodelay(tcp_socket_t* sock, bool nodelay) {
+    uint64_t flags = irq_save();
+    sock->nodelay = nodelay;
+    if (nodelay && sock->in_use) {
+        if (sock->delack_deadline) sock->ack_now = true;
+        tcp_output(sock);
+    }
+    irq_restore(flags);
+}
+
+void tcp_close(tcp_socket_t* sock) {
+    uint64_t flags = irq_save();
+
+    switch (sock->state) {
+    case TCP_LISTEN:
+        // Connections nobody accepted go with the listener
+        for (int i = 0; i < TCP_MAX_SOCKETS; i++) {
+            tcp_socket_t* child = &sockets[i];
+            if (child->in_use && child->parent == sock) {
+                send_reset_conn(child);
+                child->orphan = true;
+                set_closed(child, false);
+            }
+        }
+        release_socket(sock);
+        break;
+
+    case TCP_CLOSED:
+    case TCP_SYN_SENT:
+        release_socket(sock);
+        break;
+
+    case TCP_SYN_RECEIVED:
+    case TCP_ESTABLISHED:
+    case TCP_CLOSE_WAIT:
+        sock->orphan = true;
+        sock->fin_queued = true;
+        tcp_output(sock);
+        break;
+
+    case TCP_FIN_WAIT_2:
+        sock->orphan = true;
+        if (!sock->close_deadline) {
+            sock->close_deadline = tick_count + TCP_FIN_WAIT_TIME;
+        }
+        break;
+
+    default:
+        sock->orphan = true;
+        break;
+    }
+
+    irq_restore(flags);
+}
+
+void tcp_abort(tcp_socket_t* sock) {
+    uint64_t flags = irq_save();
+
+    if (sock->state != TCP_CLOSED && sock->state != TCP_LISTEN && sock->state != TCP_SYN_SENT) {
+        send_reset_conn(sock);
+    }
+    sock->orphan = true;
+    if (sock->state == TCP_LISTEN) {
+        irq_restore(flags);
+        tcp_close(sock);
+        return;
+    }
+    if (sock->state == TCP_CLOSED) {
+        release_socket(sock);
+    } else {
+        set_closed(sock, false);
+    }
+
+    irq_restore(flags);
+}
+
+tcp_state_t tcp_get_state(tcp_socket_t* sock) {
+    return sock->state;
+}
+
+void tcp_get_conn_stats(tcp_socket_t* sock, tcp_conn_stats_t* stats) {
+    uint64_t flags = irq_save();
+    *stats = sock->stats;
+    stats->srtt = sock->srtt >> 3;
+    stats->rto = sock->rto;
+    stats->cwnd = sock->cwnd;
+    irq_restore(flags);
+}
+
+const tcp_stats_t* tcp_get_stats(void) {
+    return &tcp_stats;
+}
+
+const char* tcp_state_name(tcp_state_t state) {
+    if (state > TCP_TIME_WAIT_STATE) return "?";
+    return state_names[state];
+}
+
+bool tcp_listen_service(uint16_t port, tcp_service_t service) {
+    tcp_socket_t* sock = tcp_socket();
+    if (!sock) return false;
+
+    if (!tcp_bind(sock, port) || !tcp_listen(sock)) {
+        tcp_close(sock);
+        return false;
+    }
+    sock->service = service;
+    return true;
+}
+
+// Built-in services for measuring the stack from the host, e.g. with QEMU
+// user networking: -netdev user,id=n0,hostfwd=tcp::5001-:5001
+//
+//   iperf -c 127.0.0.1 -p 5001     receive throughput (discard)
+//   nc 127.0.0.1 <port> < file     echo (7), discard (9)
+//   nc 127.0.0.1 <port> > file     source (19) streams until closed
+void tcp_services_init(void) {
+    tcp_listen_service(TCP_PORT_ECHO, TCP_SERVICE_ECHO);
+    tcp_listen_service(TCP_PORT_DISCARD, TCP_SERVICE_DISCARD);
+    tcp_listen_service(TCP_PORT_SOURCE, TCP_SERVICE_SOURCE);
+    tcp_listen_service(TCP_PORT_IPERF, TCP_SERVICE_DISCARD);
+}
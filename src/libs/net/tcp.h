@@ -0,0 +1,171 @@
+#pragma once
+
+#include "../types.h"
+#include "pbuf.h"
+
+#define TCP_MAX_SOCKETS   16
+#define TCP_HASH_SIZE     64        // Connection demux buckets, power of two
+#define TCP_BUF_SIZE      131072    // Send and receive buffer per socket, power of two
+#define TCP_BACKLOG       8         // Connections waiting in accept() per listener
+#define TCP_OOO_MAX       32        // Out-of-order segments held per socket
+#define TCP_OOO_RESERVE   64        // Buffers left in the pool for the receive ring
+
+#define TCP_DEFAULT_MSS   536
+#define TCP_WSCALE        2         // Our window scale, TCP_BUF_SIZE >> 2 fits in 16 bits
+#define TCP_MAX_SACK      4         // SACK blocks remembered from the peer
+
+// Timers, in milliseconds
+#define TCP_TIMER_INTERVAL 10
+#define TCP_RTO_INITIAL   1000
+#define TCP_RTO_MIN       200
+#define TCP_RTO_MAX       60000
+#define TCP_DELACK_TIME   40        // Longest an ACK is held back
+#define TCP_TIME_WAIT     4000      // 2*MSL, kept short
+#define TCP_FIN_WAIT_TIME 30000     // How long a closed socket waits for the peer's FIN
+#define TCP_MAX_RETRIES   8         // Timeouts in a row before the connection is reset
+
+#define TCP_EPHEMERAL_FIRST 49152
+#define TCP_EPHEMERAL_LAST  65535
+
+// Ports of the built-in services
+#define TCP_PORT_ECHO     7         // Sends everything back
+#define TCP_PORT_DISCARD  9         // Drops everything, counts it
+#define TCP_PORT_SOURCE   19        // Streams data to whoever connects
+#define TCP_PORT_IPERF    5001      // Discard on iperf's default port
+
+// Header flags
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+#define TCP_URG 0x20
+
+// Errors returned by the socket calls
+#define TCP_ERR_TIMEOUT  -1
+#define TCP_ERR_RESET    -2
+#define TCP_ERR_CLOSED   -3
+
+typedef struct {
+    uint16_t src_port;
+    uint16_t dest_port;
+    uint32_t seq;
+    uint32_t ack;
+    uint8_t  data_offset;    // Header length in 32-bit words, upper 4 bits
+    uint8_t  flags;
+    uint16_t window;
+    uint16_t checksum;
+    uint16_t urgent;
+    uint8_t  options[];
+} __attribute__((packed)) tcp_header_t;
+
+typedef enum {
+    TCP_CLOSED = 0,
+    TCP_LISTEN,
+    TCP_SYN_SENT,
+    TCP_SYN_RECEIVED,
+    TCP_ESTABLISHED,
+    TCP_FIN_WAIT_1,
+    TCP_FIN_WAIT_2,
+    TCP_CLOSE_WAIT,
+    TCP_CLOSING,
+    TCP_LAST_ACK,
+    TCP_TIME_WAIT_STATE
+} tcp_state_t;
+
+// What a listener's connections do with data without anyone calling recv/send
+typedef enum {
+    TCP_SERVICE_NONE = 0,
+    TCP_SERVICE_DISCARD,
+    TCP_SERVICE_ECHO,
+    TCP_SERVICE_SOURCE
+} tcp_service_t;
+
+// Counters of one connection
+typedef struct {
+    uint64_t bytes_sent;         // Acknowledged payload bytes
+    uint64_t bytes_received;     // In-order payload bytes
+    uint64_t segments_sent;
+    uint64_t segments_received;
+    uint64_t retransmits;        // Segments sent again for any reason
+    uint64_t fast_retransmits;   // Retransmits triggered by duplicate ACKs / SACK
+    uint64_t timeouts;           // Retransmission timer expirations
+    uint64_t ooo_segments;       // Segments that arrived ahead of a hole
+    uint64_t start_tick;         // When the connection was established
+    uint64_t end_tick;           // When it closed, 0 while it is open
+    uint32_t srtt;               // Smoothed RTT, milliseconds
+    uint32_t rto;                // Current retransmission timeout, milliseconds
+    uint32_t cwnd;               // Congestion window, bytes
+} tcp_conn_stats_t;
+
+// Counters of the whole TCP layer
+typedef struct {
+    uint64_t segments_in;
+    uint64_t segments_out;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t retransmits;
+    uint64_t fast_retransmits;
+    uint64_t timeouts;
+    uint64_t checksum_errors;
+    uint64_t resets_sent;
+    uint64_t resets_received;
+    uint64_t connections_opened;
+    uint64_t connections_accepted;
+    uint64_t connections_dropped;  // Reset, timed out or no room
+    tcp_conn_stats_t last;         // Counters of the most recently closed connection
+} tcp_stats_t;
+
+typedef struct tcp_socket tcp_socket_t;
+
+// Initialize TCP and register it with the IP layer
+void tcp_init(void);
+
+// Open a socket, returns NULL if all sockets are in use
+tcp_socket_t* tcp_socket(void);
+
+// Bind to a local port (host byte order), 0 picks an ephemeral port
+bool tcp_bind(tcp_socket_t* sock, uint16_t port);
+
+// Start accepting connections on a bound socket
+bool tcp_listen(tcp_socket_t* sock);
+
+// Wait up to timeout_ms (0 = forever) for a connection, NULL on timeout
+tcp_socket_t* tcp_accept(tcp_socket_t* sock, uint32_t timeout_ms);
+
+// Connect and wait until the connection is established or fails.
+// Returns 0 on success or a TCP_ERR_* code.
+int tcp_connect(tcp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port, uint32_t timeout_ms);
+
+// Queue data for sending, waiting for buffer space as needed.
+// Returns the number of bytes queued or a TCP_ERR_* code.
+int tcp_send(tcp_socket_t* sock, const void* data, uint32_t length);
+
+// Read up to max_length bytes, waiting up to timeout_ms (0 = forever).
+// Returns the number of bytes read, 0 at the end of the stream or a TCP_ERR_* code.
+int tcp_recv(tcp_socket_t* sock, void* buffer, uint32_t max_length, uint32_t timeout_ms);
+
+// Disable Nagle's algorithm (send small segments right away) and delayed ACKs
+void tcp_set_nodelay(tcp_socket_t* sock, bool nodelay);
+
+// Close gracefully. The socket is released once the connection is done.
+void tcp_close(tcp_socket_t* sock);
+
+// Reset the connection and release the socket right away
+void tcp_abort(tcp_socket_t* sock);
+
+// State and counters of a socket
+tcp_state_t tcp_get_state(tcp_socket_t* sock);
+void tcp_get_conn_stats(tcp_socket_t* sock, tcp_conn_stats_t* stats);
+
+// Counters of the whole layer
+const tcp_stats_t* tcp_get_stats(void);
+
+// Name of a state for printing
+const char* tcp_state_name(tcp_state_t state);
+
+// Open a listener whose connections are served in the kernel
+bool tcp_listen_service(uint16_t port, tcp_service_t service);
+
+// Start the echo, discard, source and iperf services
+void tcp_services_init(void);
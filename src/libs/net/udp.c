@@ -0,0 +1,302 @@
+#include "udp.h"
+#include "ip.h"
+#include "ethernet.h"
+#include "checksum.h"
+#include "netstat.h"
+#include "../fs/vfs.h"
+#include "../fs/pcache.h"
+#include "../memory.h"
+#include "../interrupt.h"
+#include "../timer.h"
+#include "../string.h"
+
+static udp_socket_t sockets[UDP_MAX_SOCKETS];
+static udp_socket_t* port_table[UDP_HASH_SIZE];
+static uint16_t next_ephemeral = UDP_EPHEMERAL_FIRST;
+
+static inline uint32_t port_hash(uint16_t port) {
+    return (port ^ (port >> 6)) & (UDP_HASH_SIZE - 1);
+}
+
+static udp_socket_t* find_socket(uint16_t port) {
+    for (udp_socket_t* s = port_table[port_hash(port)]; s; s = s->hash_next) {
+        if (s->local_port == port) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+static void udp_input(pbuf_t* packet, const ip_header_t* ip) {
+    const udp_header_t* udp = (const udp_header_t*)packet->data;
+
+    if (packet->len < sizeof(udp_header_t)) {
+        net_stat_drop(NET_LAYER_UDP, NET_DROP_TRUNCATED);
+        return;
+    }
+    net_stat_rx(NET_LAYER_UDP, packet->len);
+
+    uint16_t length = ntohs(udp->length);
+    if (length < sizeof(udp_header_t) || length > packet->len) {
+        net_stat_drop(NET_LAYER_UDP, NET_DROP_MALFORMED);
+        return;
+    }
+    pbuf_trim(packet, length);
+
+    // A zero checksum means the sender didn't compute one
+    if (udp->checksum != 0 && !(packet->flags & PBUF_RX_L4_CSUM_OK)) {
+        uint32_t sum = csum_pseudo_header(ip->src_ip, ip->dest_ip, IP_PROTOCOL_UDP, length);
+        if (csum_fold(csum_partial(udp, length, sum)) != 0) {
+            net_stat_drop(NET_LAYER_UDP, NET_DROP_CHECKSUM);
+            return;
+        }
+    }
+
+    udp_socket_t* sock = find_socket(ntohs(udp->dest_port));
+    if (!sock) {
+        net_stat_drop(NET_LAYER_UDP, NET_DROP_NO_HANDLER);
+        return;
+    }
+
+    uint16_t src_port = ntohs(udp->src_port);
+    pbuf_pull(packet, sizeof(udp_header_t));
+    sock->rx_packets++;
+
+    if (sock->handler) {
+        sock->handler(sock, packet, ip->src_ip, src_port);
+        return;
+    }
+
+    // Queue a reference, the payload stays where the NIC put it
+    uint32_t head = sock->ring_head;
+    if (head - sock->ring_tail >= UDP_RING_SIZE) {
+        sock->rx_drops++;
+        net_stat_drop(NET_LAYER_UDP, NET_DROP_QUEUE_FULL);
+        return;
+    }
+    sock->ring[head & (UDP_RING_SIZE - 1)] = pbuf_ref(packet);
+    sock->ring_head = head + 1;
+}
+
+static void udp_receive(pbuf_t* packet, const ip_header_t* ip) {
+    net_prof_enter(NET_LAYER_UDP);
+    udp_input(packet, ip);
+    net_prof_exit();
+}
+
+void udp_init(void) {
+    memset(sockets, 0, sizeof(sockets));
+    memset(port_table, 0, sizeof(port_table));
+    ip_register_protocol_handler(IP_PROTOCOL_UDP, udp_receive);
+}
+
+udp_socket_t* udp_socket(void) {
+    uint64_t flags = irq_save();
+
+    for (int i = 0; i < UDP_MAX_SOCKETS; i++) {
+        if (!sockets[i].in_use) {
+            memset(&sockets[i], 0, sizeof(udp_socket_t));
+            sockets[i].in_use = true;
+            irq_restore(flags);
+            return &sockets[i];
+        }
+    }
+
+    irq_restore(flags);
+    return NULL;
+}
+
+// Pick an unused port from the ephemeral range, caller has interrupts disabled
+static uint16_t ephemeral_port(void) {
+    for (uint32_t n = 0; n <= UDP_EPHEMERAL_LAST - UDP_EPHEMERAL_FIRST; n++) {
+        uint16_t port = next_ephemeral;
+        next_ephemeral = (port == UDP_EPHEMERAL_LAST) ? UDP_EPHEMERAL_FIRST : port + 1;
+        if (!find_socket(port)) {
+            return port;
+        }
+    }
+    return 0;
+}
+
+bool udp_bind(udp_socket_t* sock, uint16_t port) {
+    uint64_t flags = irq_save();
+
+    if (sock->local_port != 0) {
+        irq_restore(flags);
+        return false;
+    }
+
+    if (port == 0) {
+        port = ephemeral_port();
+    }
+    if (port == 0 || find_socket(port)) {
+        irq_restore(flags);
+        return false;
+    }
+
+    uint32_t bucket = port_hash(port);
+    sock->local_port = port;
+    sock->hash_next = port_table[bucket];
+    port_table[bucket] = sock;
+
+    irq_restore(flags);
+    return true;
+}
+
+void udp_close(udp_socket_t* sock) {
+    uint64_t flags = irq_save();
+
+    if (sock->local_port != 0) {
+        udp_socket_t** link = &port_table[port_hash(sock->local_port)];
+        while (*link && *link != sock) {
+            link = &(*link)->hash_next;
+        }
+        if (*link) {
+            *link = sock->hash_next;
+        }
+    }
+
+    while (sock->ring_tail != sock->ring_head) {
+        pbuf_free(sock->ring[sock->ring_tail & (UDP_RING_SIZE - 1)]);
+        sock->ring_tail++;
+    }
+
+    sock->local_port = 0;
+    sock->handler = NULL;
+    sock->in_use = false;
+
+    irq_restore(flags);
+}
+
+void udp_set_handler(udp_socket_t* sock, udp_handler_t handler) {
+    sock->handler = handler;
+}
+
+static bool udp_output(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port, pbuf_t* packet) {
+    udp_header_t* udp = pbuf_push(packet, sizeof(udp_header_t));
+    if (!udp) {
+        net_stat_drop(NET_LAYER_UDP, NET_DROP_NO_BUFFER);
+        return false;
+    }
+
+    udp->src_port = htons(sock->local_port);
+    udp->dest_port = htons(dest_port);
+    udp->length = htons(pbuf_length(packet));
+
+    // Seed the checksum with the pseudo header, the NIC (or the driver's
+    // fallback) sums the rest of the datagram on top of it
+    uint32_t sum = csum_pseudo_header(ip_source_address(dest_ip), dest_ip, IP_PROTOCOL_UDP, pbuf_length(packet));
+    udp->checksum = (uint16_t)~csum_fold(sum);
+    packet->flags |= PBUF_TX_L4_CSUM;
+    packet->csum_start = pbuf_headroom(packet);
+    packet->csum_offset = 6;
+
+    uint16_t length = pbuf_length(packet);
+    if (!ip_send_pbuf(packet, dest_ip, IP_PROTOCOL_UDP)) return false;
+    net_stat_tx(NET_LAYER_UDP, length);
+    return true;
+}
+
+bool udp_sendto_pbuf(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port, pbuf_t* packet) {
+    if (sock->local_port == 0 && !udp_bind(sock, 0)) {
+        return false;
+    }
+
+    net_prof_enter(NET_LAYER_UDP);
+    bool sent = udp_output(sock, dest_ip, dest_port, packet);
+    net_prof_exit();
+    return sent;
+}
+
+bool udp_sendto(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port,
+                const void* data, uint16_t length) {
+    pbuf_t* packet = pbuf_alloc(length);
+    if (!packet) return false;
+
+    memcpy(packet->data, data, length);
+    bool sent = udp_sendto_pbuf(sock, dest_ip, dest_port, packet);
+    pbuf_free(packet);
+    return sent;
+}
+
+uint64_t udp_sendfile(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port,
+                      vfs_inode_t* inode, uint64_t offset, uint64_t len, uint16_t datagram) {
+    if (inode->type != VFS_FILE || datagram == 0 || offset >= inode->size) return 0;
+    if (sock->local_port == 0 && !udp_bind(sock, 0)) return 0;
+    if (len > inode->size - offset) len = inode->size - offset;
+
+    uint64_t sent = 0;
+    while (sent < len) {
+        uint32_t in_page = offset % PAGE_SIZE;
+        uint16_t n = PAGE_SIZE - in_page < datagram ? PAGE_SIZE - in_page : datagram;
+        if (n > len - sent) n = len - sent;
+
+        // Only the headers go in the buffer when the page can be attached
+        pcache_page_t* page = inode->fs->cached ? pcache_get(inode, offset / PAGE_SIZE) : NULL;
+        pbuf_t* packet = pbuf_alloc(page ? 0 : n);
+        if (!packet) {
+            if (page) pcache_release(page);
+            break;
+        }
+        if (page) {
+            pbuf_attach_page(packet, page, in_page, n);
+            pcache_release(page);
+        } else if (vfs_read(inode, offset, packet->data, n) != n) {
+            pbuf_free(packet);
+            break;
+        }
+
+        net_prof_enter(NET_LAYER_UDP);
+        bool ok = udp_output(sock, dest_ip, dest_port, packet);
+        net_prof_exit();
+        pbuf_free(packet);
+        if (!ok) break;
+        sent += n;
+        offset += n;
+    }
+    return sent;
+}
+
+pbuf_t* udp_recv_pbuf(udp_socket_t* sock, uint32_t* src_ip, uint16_t* src_port) {
+    uint32_t tail = sock->ring_tail;
+    if (tail == sock->ring_head) {
+        return NULL;
+    }
+
+    pbuf_t* packet = sock->ring[tail & (UDP_RING_SIZE - 1)];
+    sock->ring_tail = tail + 1;
+
+    // The headers are still in the headroom in front of the payload
+    const udp_header_t* udp = (const udp_header_t*)(packet->data - sizeof(udp_header_t));
+    const ip_header_t* ip = (const ip_header_t*)(packet->head + packet->l3_start);
+    if (src_ip) *src_ip = ip->src_ip;
+    if (src_port) *src_port = ntohs(udp->src_port);
+
+    return packet;
+}
+
+int udp_recvfrom(udp_socket_t* sock, void* buffer, uint16_t max_length,
+                 uint32_t* src_ip, uint16_t* src_port) {
+    pbuf_t* packet = udp_recv_pbuf(sock, src_ip, src_port);
+    if (!packet) {
+        return -1;
+    }
+
+    uint16_t length = packet->len < max_length ? packet->len : max_length;
+    memcpy(buffer, packet->data, length);
+    pbuf_free(packet);
+    return length;
+}
+
+pbuf_t* udp_recv_wait(udp_socket_t* sock, uint32_t timeout_ms,
+                      uint32_t* src_ip, uint16_t* src_port) {
+    uint64_t deadline = tick_count + timeout_ms;
+
+    while (1) {
+        pbuf_t* packet = udp_recv_pbuf(sock, src_ip, src_port);
+        if (packet || tick_count >= deadline) {
+            return packet;
+        }
+        ethernet_wait();
+    }
+}
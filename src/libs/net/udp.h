@@ -0,0 +1,99 @@
+#pragma once
+
+#include "../types.h"
+#include "pbuf.h"
+
+struct vfs_inode;
+
+#define UDP_HEADER_SIZE   8
+#define UDP_MAX_SOCKETS   64
+#define UDP_HASH_SIZE     64        // Port demux buckets, power of two
+#define UDP_RING_SIZE     64        // Datagrams queued per socket, power of two
+
+#define UDP_EPHEMERAL_FIRST 49152
+#define UDP_EPHEMERAL_LAST  65535
+
+// Ports of the built-in services
+#define UDP_PORT_ECHO     7         // Sends every datagram back
+#define UDP_PORT_DISCARD  9         // Counts and drops datagrams
+#define UDP_PORT_BLAST    19        // Accepts "blast <count> <size>", "stats", "reset"
+
+typedef struct {
+    uint16_t src_port;
+    uint16_t dest_port;
+    uint16_t length;
+    uint16_t checksum;
+    uint8_t  payload[];
+} __attribute__((packed)) udp_header_t;
+
+typedef struct udp_socket udp_socket_t;
+
+// Called from the receive path instead of queuing when set on a socket.
+// packet->data points at the payload. Ports are in host byte order.
+typedef void (*udp_handler_t)(udp_socket_t* sock, pbuf_t* packet,
+                              uint32_t src_ip, uint16_t src_port);
+
+struct udp_socket {
+    udp_socket_t* hash_next;        // Next socket in the port bucket
+    uint16_t local_port;            // Host byte order, 0 when unbound
+    bool in_use;
+    udp_handler_t handler;
+
+    // Received datagrams. The receive path produces at head, the reader
+    // consumes at tail, so no lock is needed between them.
+    pbuf_t* ring[UDP_RING_SIZE];
+    volatile uint32_t ring_head;
+    volatile uint32_t ring_tail;
+
+    uint64_t rx_packets;
+    uint64_t rx_drops;               // Ring was full
+};
+
+// Initialize UDP and register it with the IP layer
+void udp_init(void);
+
+// Open a socket, returns NULL if all sockets are in use
+udp_socket_t* udp_socket(void);
+
+// Bind to a local port (host byte order). Port 0 picks an ephemeral port.
+// Returns false if the port is taken.
+bool udp_bind(udp_socket_t* sock, uint16_t port);
+
+// Close a socket and free anything still queued on it
+void udp_close(udp_socket_t* sock);
+
+// Deliver datagrams to handler in the receive path instead of the ring
+void udp_set_handler(udp_socket_t* sock, udp_handler_t handler);
+
+// Send length bytes from data. Binds an ephemeral port if needed.
+bool udp_sendto(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port,
+                const void* data, uint16_t length);
+
+// Send a buffer holding the payload, the UDP header goes in the headroom.
+// The caller keeps its reference.
+bool udp_sendto_pbuf(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port, pbuf_t* packet);
+
+// Send len bytes of a file from offset, in datagrams of at most datagram
+// payload bytes that never cross a page of the file. Pages of files in the
+// page cache are attached to the packets by reference and the NIC reads
+// them where they are, other files are read into each packet. Returns the
+// bytes sent, short when a send fails or the file ends.
+uint64_t udp_sendfile(udp_socket_t* sock, uint32_t dest_ip, uint16_t dest_port,
+                      struct vfs_inode* inode, uint64_t offset, uint64_t len, uint16_t datagram);
+
+// Take the next datagram off the ring without copying (non-blocking).
+// packet->data points at the payload, the caller owns the reference.
+// src_ip/src_port may be NULL. Returns NULL if nothing is queued.
+pbuf_t* udp_recv_pbuf(udp_socket_t* sock, uint32_t* src_ip, uint16_t* src_port);
+
+// Copying receive, returns the payload length or -1 if nothing is queued.
+// Payloads longer than max_length are truncated.
+int udp_recvfrom(udp_socket_t* sock, void* buffer, uint16_t max_length,
+                 uint32_t* src_ip, uint16_t* src_port);
+
+// Wait up to timeout_ms for a datagram, returns NULL on timeout
+pbuf_t* udp_recv_wait(udp_socket_t* sock, uint32_t timeout_ms,
+                      uint32_t* src_ip, uint16_t* src_port);
+
+// Start the echo, discard and blast services
+void udp_services_init(void);
@@ -0,0 +1,207 @@
+#include "udp.h"
+#include "ip.h"
+#include "../timer.h"
+#include "../string.h"
+
+// Built-in services for measuring the stack from the host, e.g. with QEMU
+// user networking: -netdev user,id=n0,hostfwd=udp::5555-:7
+//
+//   echo    (7)  sends every datagram back without copying it
+//   discard (9)  counts datagrams and bytes
+//   blast   (19) "blast <count> <size>" sends count datagrams of size bytes
+//                back to the sender as fast as the ring allows, followed by
+//                a summary. "stats" replies with the discard counters,
+//                "reset" clears them.
+
+#define BLAST_INTERVAL 1    // Milliseconds between refills of the transmit ring
+#define BLAST_MAX_SIZE 8972 // Largest payload that fits a 9000 byte MTU
+
+static udp_socket_t* echo_sock;
+static udp_socket_t* discard_sock;
+static udp_socket_t* blast_sock;
+
+static struct {
+    uint64_t packets;
+    uint64_t bytes;
+    uint64_t first_tick;
+    uint64_t last_tick;
+} discard_stats;
+
+static struct {
+    bool active;
+    uint32_t dest_ip;
+    uint16_t dest_port;
+    uint16_t size;
+    uint32_t remaining;
+    uint32_t sent;
+    uint32_t failed;       // Attempts that found the ring or pool full
+    uint64_t start_tick;
+} blast;
+
+// Small helpers for building the text replies
+static char* append_str(char* out, const char* str) {
+    while (*str) {
+        *out++ = *str++;
+    }
+    return out;
+}
+
+static char* append_number(char* out, uint64_t num) {
+    char digits[20];
+    int count = 0;
+
+    do {
+        digits[count++] = '0' + (num % 10);
+        num /= 10;
+    } while (num > 0);
+
+    while (count > 0) {
+        *out++ = digits[--count];
+    }
+    return out;
+}
+
+static uint32_t parse_number(const char** str, const char* end) {
+    uint32_t value = 0;
+
+    while (*str < end && **str == ' ') (*str)++;
+    while (*str < end && **str >= '0' && **str <= '9') {
+        value = value * 10 + (**str - '0');
+        (*str)++;
+    }
+    return value;
+}
+
+static void echo_handler(udp_socket_t* sock, pbuf_t* packet, uint32_t src_ip, uint16_t src_port) {
+    // The reply reuses the received buffer, the payload is never copied
+    pbuf_t* reply = pbuf_writable(packet);
+    if (!reply) return;
+
+    udp_sendto_pbuf(sock, src_ip, src_port, reply);
+    pbuf_free(reply);
+}
+
+static void discard_handler(udp_socket_t* sock, pbuf_t* packet, uint32_t src_ip, uint16_t src_port) {
+    (void)sock;
+    (void)src_ip;
+    (void)src_port;
+    if (discard_stats.packets == 0) {
+        discard_stats.first_tick = tick_count;
+    }
+    discard_stats.packets++;
+    discard_stats.bytes += packet->len;
+    discard_stats.last_tick = tick_count;
+}
+
+// Send as many datagrams as the ring takes, then wait for the next tick
+static void blast_tick(void) {
+    if (!blast.active) return;
+
+    while (blast.remaining > 0) {
+        pbuf_t* packet = pbuf_alloc(blast.size);
+        if (!packet) {
+            blast.failed++;
+            return;
+        }
+
+        memset(packet->data, 0, blast.size);
+        bool sent = udp_sendto_pbuf(blast_sock, blast.dest_ip, blast.dest_port, packet);
+        pbuf_free(packet);
+
+        if (!sent) {
+            blast.failed++;
+            return;
+        }
+        blast.remaining--;
+        blast.sent++;
+    }
+
+    // Done, tell the requester how it went
+    uint64_t elapsed = tick_count - blast.start_tick;
+    char reply[128];
+    char* out = reply;
+    out = append_str(out, "blast sent=");
+    out = append_number(out, blast.sent);
+    out = append_str(out, " ms=");
+    out = append_number(out, elapsed);
+    out = append_str(out, " pps=");
+    out = append_number(out, elapsed ? (uint64_t)blast.sent * 1000 / elapsed : 0);
+    out = append_str(out, " ring_full=");
+    out = append_number(out, blast.failed);
+    out = append_str(out, "\n");
+
+    udp_sendto(blast_sock, blast.dest_ip, blast.dest_port, reply, out - reply);
+    blast.active = false;
+}
+
+static void blast_handler(udp_socket_t* sock, pbuf_t* packet, uint32_t src_ip, uint16_t src_port) {
+    const char* cmd = (const char*)packet->data;
+    const char* end = cmd + packet->len;
+    char reply[160];
+    char* out = reply;
+
+    if (packet->len >= 5 && strncmp(cmd, "blast", 5) == 0) {
+        if (blast.active) return;
+
+        cmd += 5;
+        uint32_t count = parse_number(&cmd, end);
+        uint32_t size = parse_number(&cmd, end);
+        if (size == 0 || size > BLAST_MAX_SIZE) size = 64;
+
+        // Datagrams have to fit the route back, nothing fragments
+        uint32_t fits = ip_route_mtu(src_ip) - IP_HEADER_SIZE - UDP_HEADER_SIZE;
+        if (size > fits) size = fits;
+
+        blast.dest_ip = src_ip;
+        blast.dest_port = src_port;
+        blast.size = size;
+        blast.remaining = count;
+        blast.sent = 0;
+        blast.failed = 0;
+        blast.start_tick = tick_count;
+        blast.active = true;
+        return;
+    }
+
+    if (packet->len >= 5 && strncmp(cmd, "reset", 5) == 0) {
+        memset(&discard_stats, 0, sizeof(discard_stats));
+        out = append_str(out, "reset\n");
+    } else if (packet->len >= 5 && strncmp(cmd, "stats", 5) == 0) {
+        uint64_t elapsed = discard_stats.last_tick - discard_stats.first_tick;
+        out = append_str(out, "discard packets=");
+        out = append_number(out, discard_stats.packets);
+        out = append_str(out, " bytes=");
+        out = append_number(out, discard_stats.bytes);
+        out = append_str(out, " ms=");
+        out = append_number(out, elapsed);
+        out = append_str(out, " pps=");
+        out = append_number(out, elapsed ? discard_stats.packets * 1000 / elapsed : 0);
+        out = append_str(out, "\n");
+    } else {
+        out = append_str(out, "usage: blast <count> <size> | stats | reset\n");
+    }
+
+    udp_sendto(sock, src_ip, src_port, reply, out - reply);
+}
+
+static udp_socket_t* open_service(uint16_t port, udp_handler_t handler) {
+    udp_socket_t* sock = udp_socket();
+    if (!sock) return NULL;
+
+    if (!udp_bind(sock, port)) {
+        udp_close(sock);
+        return NULL;
+    }
+    udp_set_handler(sock, handler);
+    return sock;
+}
+
+void udp_services_init(void) {
+    echo_sock = open_service(UDP_PORT_ECHO, echo_handler);
+    discard_sock = open_service(UDP_PORT_DISCARD, discard_handler);
+    blast_sock = open_service(UDP_PORT_BLAST, blast_handler);
+
+    if (blast_sock) {
+        timer_register_periodic(blast_tick, BLAST_INTERVAL);
+    }
+}
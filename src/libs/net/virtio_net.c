@@ -0,0 +1,254 @@
+#include "virtio_net.h"
+#include "../virtio.h"
+#include "../interrupt.h"
+#include "../string.h"
+#include "checksum.h"
+#include "netstat.h"
+
+// Feature bits
+#define VIRTIO_NET_F_CSUM        (1ULL << 0)   // Device checksums what we send
+#define VIRTIO_NET_F_GUEST_CSUM  (1ULL << 1)   // Device tells us about checksums it verified
+#define VIRTIO_NET_F_MAC         (1ULL << 5)
+#define VIRTIO_NET_F_HOST_TSO4   (1ULL << 11)
+#define VIRTIO_NET_F_MRG_RXBUF   (1ULL << 15)
+#define VIRTIO_NET_F_STATUS      (1ULL << 16)
+
+// Header flags
+#define VIRTIO_NET_HDR_F_NEEDS_CSUM  1
+#define VIRTIO_NET_HDR_F_DATA_VALID  2
+#define VIRTIO_NET_HDR_GSO_NONE      0
+#define VIRTIO_NET_HDR_GSO_TCPV4     1
+
+#define RX_QUEUE 0
+#define TX_QUEUE 1
+
+// Every packet starts with this header, on both queues
+typedef struct {
+    uint8_t  flags;
+    uint8_t  gso_type;
+    uint16_t hdr_len;
+    uint16_t gso_size;
+    uint16_t csum_start;
+    uint16_t csum_offset;
+    uint16_t num_buffers;     // Buffers the packet spans with mergeable receive buffers
+} __attribute__((packed)) virtio_net_hdr_t;
+
+static virtq_t rx_queue;
+static virtq_t tx_queue;
+
+static struct {
+    virtio_device_t dev;
+    uint8_t mac_addr[6];
+    uint32_t rx_posted;
+} vnet;
+
+// Post a buffer for the device to receive into
+static bool post_rx(pbuf_t* p) {
+    virtq_buf_t buf = { (uint64_t)p->data, PBUF_DATA_SIZE };
+    if (!virtq_add_buf(&rx_queue, &buf, 0, 1, p)) {
+        return false;
+    }
+    vnet.rx_posted++;
+    return true;
+}
+
+static void fill_rx(void) {
+    while (vnet.rx_posted < VIRTIO_NET_RX_BUFFERS) {
+        pbuf_t* p = pbuf_alloc(PBUF_DATA_SIZE);
+        if (!p) break;
+        if (!post_rx(p)) {
+            pbuf_free(p);
+            break;
+        }
+    }
+    virtq_kick(&rx_queue);
+}
+
+bool virtio_net_init(void) {
+    if (!virtio_pci_init(&vnet.dev, VIRTIO_NET_DEVICE_ID, VIRTIO_NET_TRANSITIONAL_ID)) {
+        return false;
+    }
+
+    uint64_t wanted = VIRTIO_NET_F_CSUM | VIRTIO_NET_F_GUEST_CSUM | VIRTIO_NET_F_MAC |
+                      VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_F_EVENT_IDX;
+    if (VIRTIO_NET_PACKED_RING) {
+        wanted |= VIRTIO_F_RING_PACKED;
+    }
+    if (!virtio_negotiate(&vnet.dev, wanted)) {
+        return false;
+    }
+
+    if (!virtio_setup_queue(&vnet.dev, &rx_queue, RX_QUEUE) ||
+        !virtio_setup_queue(&vnet.dev, &tx_queue, TX_QUEUE)) {
+        return false;
+    }
+
+    if ((vnet.dev.features & VIRTIO_NET_F_MAC) && vnet.dev.device_cfg) {
+        for (int i = 0; i < 6; i++) {
+            vnet.mac_addr[i] = vnet.dev.device_cfg[i];
+        }
+    } else {
+        // Locally administered address
+        static const uint8_t fallback[6] = {0x02, 0x00, 0x00, 0x00, 0x00, 0x01};
+        memcpy(vnet.mac_addr, fallback, 6);
+    }
+
+    // Completed transmits are reclaimed on the next send, never interrupt for them
+    virtq_disable_interrupts(&tx_queue);
+    virtq_enable_interrupts(&rx_queue);
+
+    vnet.rx_posted = 0;
+    fill_rx();
+
+    virtio_driver_ok(&vnet.dev);
+    return true;
+}
+
+// Free the buffers the device has finished sending
+static void reclaim_tx(void) {
+    pbuf_t* p;
+    while ((p = virtq_get_buf(&tx_queue, NULL)) != NULL) {
+        pbuf_free(p);
+    }
+}
+
+bool virtio_net_send_pbuf(pbuf_t* p) {
+    uint64_t flags = irq_save();
+
+    reclaim_tx();
+
+    // The header goes in the headroom so the packet is a single descriptor
+    virtio_net_hdr_t* hdr = pbuf_push(p, sizeof(virtio_net_hdr_t));
+    if (!hdr) {
+        irq_restore(flags);
+        net_stat_drop(NET_LAYER_NIC, NET_DROP_NO_BUFFER);
+        return false;
+    }
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+
+    // The IP header checksum is ours, the device only does the one at csum_start
+    if (p->flags & PBUF_TX_IP_CSUM) {
+        uint8_t* ip = p->head + p->l3_start;
+        uint16_t header_length = (ip[0] & 0x0F) * 4;
+        ip[10] = ip[11] = 0;
+        uint16_t check = inet_checksum(ip, header_length);
+        memcpy(ip + 10, &check, 2);
+        p->flags &= ~PBUF_TX_IP_CSUM;
+    }
+    if (p->flags & PBUF_TX_L4_CSUM) {
+        if (vnet.dev.features & VIRTIO_NET_F_CSUM) {
+            // Offsets are from the start of the ethernet frame
+            hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+            hdr->csum_start = p->csum_start - (pbuf_headroom(p) + sizeof(virtio_net_hdr_t));
+            hdr->csum_offset = p->csum_offset;
+            p->flags &= ~PBUF_TX_L4_CSUM;
+
+            // A super-packet is cut into gso_size segments behind the headers
+            if (p->gso_size && (vnet.dev.features & VIRTIO_NET_F_HOST_TSO4)) {
+                const uint8_t* tcp = p->head + p->csum_start;
+                hdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+                hdr->gso_size = p->gso_size;
+                hdr->hdr_len = hdr->csum_start + (tcp[12] >> 4) * 4;
+            }
+        } else {
+            csum_tx_fallback(p);
+        }
+    }
+
+    // A page fragment is a second descriptor, the device reads it in place
+    virtq_buf_t bufs[2] = { { (uint64_t)p->data, p->len }, { (uint64_t)p->frag, p->frag_len } };
+    bool sent = virtq_add_buf(&tx_queue, bufs, p->frag_len ? 2 : 1, 0, p);
+    if (sent) {
+        pbuf_ref(p);
+        virtq_kick(&tx_queue);
+        net_stat_tx(NET_LAYER_NIC, pbuf_length(p) - sizeof(virtio_net_hdr_t));
+    } else {
+        net_stat_drop(NET_LAYER_NIC, NET_DROP_RING_FULL);
+    }
+
+    // The caller sees the frame as it handed it over
+    pbuf_pull(p, sizeof(virtio_net_hdr_t));
+
+    irq_restore(flags);
+    return sent;
+}
+
+pbuf_t* virtio_net_receive_pbuf(void) {
+    uint64_t flags = irq_save();
+
+    while (1) {
+        uint32_t len;
+        pbuf_t* p = virtq_get_buf(&rx_queue, &len);
+        if (!p) {
+            // Ring empty, ask for an interrupt and make sure nothing slipped in
+            fill_rx();
+            if (virtq_enable_interrupts(&rx_queue)) {
+                irq_restore(flags);
+                return NULL;
+            }
+            continue;
+        }
+        vnet.rx_posted--;
+
+        virtio_net_hdr_t hdr;
+        memcpy(&hdr, p->data, sizeof(hdr));
+
+        // With mergeable buffers a packet can span several, which only happens
+        // for frames larger than a buffer. Those are dropped.
+        uint16_t extra = (vnet.dev.features & VIRTIO_NET_F_MRG_RXBUF) ? hdr.num_buffers : 1;
+        bool drop = extra != 1 || len < sizeof(hdr);
+        while (extra-- > 1) {
+            pbuf_t* rest = virtq_get_buf(&rx_queue, NULL);
+            if (!rest) break;
+            vnet.rx_posted--;
+            pbuf_free(rest);
+        }
+
+        // Refill in batches, one notification for many buffers
+        if (vnet.rx_posted < VIRTIO_NET_RX_BUFFERS / 2) {
+            fill_rx();
+        }
+
+        if (drop) {
+            net_stat_drop(NET_LAYER_NIC, len < sizeof(hdr) ? NET_DROP_MALFORMED : NET_DROP_TRUNCATED);
+            pbuf_free(p);
+            continue;
+        }
+
+        virtq_disable_interrupts(&rx_queue);
+        pbuf_trim(p, len);
+        pbuf_pull(p, sizeof(hdr));
+
+        // A partial checksum comes from a sender on the same host and was
+        // never on a wire, it counts as good
+        if (hdr.flags & (VIRTIO_NET_HDR_F_DATA_VALID | VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            p->flags |= PBUF_RX_L4_CSUM_OK;
+        }
+        net_stat_rx(NET_LAYER_NIC, p->len);
+
+        irq_restore(flags);
+        return p;
+    }
+}
+
+void virtio_net_irq_ack(void) {
+    virtio_read_isr(&vnet.dev);
+}
+
+void virtio_net_get_mac_address(uint8_t mac[6]) {
+    memcpy(mac, vnet.mac_addr, 6);
+}
+
+uint8_t virtio_net_get_irq(void) {
+    return vnet.dev.pci.interrupt_line;
+}
+
+bool virtio_net_tso_supported(void) {
+    uint64_t needed = VIRTIO_NET_F_HOST_TSO4 | VIRTIO_NET_F_CSUM;
+    return (vnet.dev.features & needed) == needed;
+}
+
+bool virtio_net_packed(void) {
+    return (vnet.dev.features & VIRTIO_F_RING_PACKED) != 0;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pbuf.h"
+
+#define VIRTIO_NET_DEVICE_ID        0x1041  // Modern virtio-net
+#define VIRTIO_NET_TRANSITIONAL_ID  0x1000  // What QEMU's virtio-net-pci shows by default
+
+#define VIRTIO_NET_RX_BUFFERS  64     // Receive buffers kept posted
+#define VIRTIO_NET_PACKED_RING 1      // Use the packed layout when the device offers it
+
+// Initialize the first virtio-net device found
+bool virtio_net_init(void);
+
+// Send a packet buffer without copying it. The driver takes its own reference
+// and drops it once the device is done, so the caller still has to free p.
+// Returns false if the transmit queue is full.
+bool virtio_net_send_pbuf(pbuf_t* p);
+
+// Receive a packet buffer (non-blocking), the device writes straight into it.
+// Returns NULL if no packet is available. The caller owns the reference.
+pbuf_t* virtio_net_receive_pbuf(void);
+
+// Acknowledge the interrupt, called before receiving
+void virtio_net_irq_ack(void);
+
+// Get MAC address
+void virtio_net_get_mac_address(uint8_t mac[6]);
+
+// Legacy IRQ line of the device
+uint8_t virtio_net_get_irq(void);
+
+// Whether the device segments TCP super-packets itself (VIRTIO_NET_F_HOST_TSO4,
+// which needs VIRTIO_NET_F_CSUM)
+bool virtio_net_tso_supported(void);
+
+// Whether the packed ring layout was negotiated
+bool virtio_net_packed(void);
@@ -0,0 +1,61 @@
+#include "paging.h"
+
+#define PAGE_PRESENT   (1ULL << 0)
+#define PAGE_WRITABLE  (1ULL << 1)
+#define PAGE_PWT       (1ULL << 3)   // Write-through
+#define PAGE_PCD       (1ULL << 4)   // Cache disable
+#define PAGE_HUGE      (1ULL << 7)
+
+#define PAGE_ADDR_MASK 0x000FFFFFFFFFF000ULL
+#define TABLE_POOL_SIZE 8
+
+// Tables handed out for new mappings, each maps 1 GiB (L2) or 512 GiB (L3)
+static uint64_t table_pool[TABLE_POOL_SIZE][512] __attribute__((aligned(4096)));
+static int tables_used = 0;
+
+static uint64_t* new_table(void) {
+    if (tables_used >= TABLE_POOL_SIZE) {
+        return 0;
+    }
+
+    uint64_t* table = table_pool[tables_used++];
+    for (int i = 0; i < 512; i++) {
+        table[i] = 0;
+    }
+    return table;
+}
+
+static uint64_t* read_cr3(void) {
+    uint64_t cr3;
+    __asm__ volatile("mov %%cr3, %0" : "=r"(cr3));
+    return (uint64_t*)(cr3 & PAGE_ADDR_MASK);
+}
+
+bool paging_map_mmio(uint64_t phys, uint64_t size) {
+    uint64_t* l4 = read_cr3();
+    uint64_t end = phys + (size ? size : 1);
+
+    for (uint64_t gib = phys >> 30; gib <= (end - 1) >> 30; gib++) {
+        uint64_t* l4e = &l4[(gib >> 9) & 511];
+        if (!(*l4e & PAGE_PRESENT)) {
+            uint64_t* l3 = new_table();
+            if (!l3) return false;
+            *l4e = (uint64_t)l3 | PAGE_PRESENT | PAGE_WRITABLE;
+        }
+
+        uint64_t* l3 = (uint64_t*)(*l4e & PAGE_ADDR_MASK);
+        uint64_t* l3e = &l3[gib & 511];
+        if (*l3e & PAGE_PRESENT) {
+            continue;  // Already mapped, e.g. the first GiB by the boot code
+        }
+
+        uint64_t* l2 = new_table();
+        if (!l2) return false;
+        for (uint64_t i = 0; i < 512; i++) {
+            l2[i] = ((gib << 30) + (i << 21)) |
+                    PAGE_PRESENT | PAGE_WRITABLE | PAGE_HUGE | PAGE_PWT | PAGE_PCD;
+        }
+        *l3e = (uint64_t)l2 | PAGE_PRESENT | PAGE_WRITABLE;
+    }
+    return true;
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Identity map [phys, phys + size) uncached so device registers can be
+// accessed at their physical address. The boot code only maps the first
+// GiB, this adds 2 MiB pages for whole GiBs above it.
+// Returns false if the page table pool is exhausted.
+bool paging_map_mmio(uint64_t phys, uint64_t size);
@@ -1,5 +1,7 @@
 #include "pci.h"
 #include "port.h"
+#include "paging.h"
+#include "apic.h"
 
 #define PCI_CONFIG_ADDRESS 0xCF8
 #define PCI_CONFIG_DATA    0xCFC
@@ -19,6 +21,29 @@ static void pci_write_config(uint8_t bus, uint8_t device, uint8_t func,
     port_dword_out(PCI_CONFIG_DATA, value);
 }
 
+// Fill in a device found at bus/dev/func
+static void pci_read_device(uint8_t bus, uint8_t dev, uint8_t func, pci_device_t* device) {
+    uint32_t config = pci_read_config(bus, dev, func, 0);
+    device->bus = bus;
+    device->device = dev;
+    device->function = func;
+    device->vendor_id = config & 0xFFFF;
+    device->device_id = (config >> 16) & 0xFFFF;
+
+    // Read class information
+    uint32_t class_info = pci_read_config(bus, dev, func, 0x08);
+    device->revision_id = class_info & 0xFF;
+    device->prog_if = (class_info >> 8) & 0xFF;
+    device->subclass = (class_info >> 16) & 0xFF;
+    device->class_code = (class_info >> 24) & 0xFF;
+
+    // Read BARs
+    for (int i = 0; i < 6; i++) {
+        device->bar[i] = pci_read_config(bus, dev, func, 0x10 + (i * 4));
+    }
+    device->interrupt_line = pci_read_config(bus, dev, func, 0x3C) & 0xFF;
+}
+
 bool pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t* device) {
     for (uint16_t bus = 0; bus < 256; bus++) {
         for (uint16_t dev = 0; dev < 32; dev++) {
@@ -27,24 +52,7 @@ bool pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t* devic
 
                 if ((config & 0xFFFF) == vendor_id) {
                     if (((config >> 16) & 0xFFFF) == device_id) {
-                        device->bus = bus;
-                        device->device = dev;
-                        device->function = func;
-                        device->vendor_id = vendor_id;
-                        device->device_id = device_id;
-
-                        // Read class information
-                        uint32_t class_info = pci_read_config(bus, dev, func, 0x08);
-                        device->revision_id = class_info & 0xFF;
-                        device->prog_if = (class_info >> 8) & 0xFF;
-                        device->subclass = (class_info >> 16) & 0xFF;
-                        device->class_code = (class_info >> 24) & 0xFF;
-
-                        // Read BARs
-                        for (int i = 0; i < 6; i++) {
-                            device->bar[i] = pci_read_config(bus, dev, func, 0x10 + (i * 4));
-                        }
-
+                        pci_read_device(bus, dev, func, device);
                         return true;
                     }
                 }
@@ -54,6 +62,23 @@ bool pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t* devic
     return false;
 }
 
+bool pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, pci_device_t* device) {
+    for (uint16_t bus = 0; bus < 256; bus++) {
+        for (uint16_t dev = 0; dev < 32; dev++) {
+            for (uint16_t func = 0; func < 8; func++) {
+                if ((pci_read_config(bus, dev, func, 0) & 0xFFFF) == 0xFFFF) continue;
+
+                uint32_t class_info = pci_read_config(bus, dev, func, 0x08);
+                if ((class_info >> 8) == ((uint32_t)class_code << 16 | subclass << 8 | prog_if)) {
+                    pci_read_device(bus, dev, func, device);
+                    return true;
+                }
+            }
+        }
+    }
+    return false;
+}
+
 void pci_enable_bus_mastering(pci_device_t* device) {
     uint32_t command = pci_read_config(device->bus, device->device, device->function, 0x04);
     command |= (1 << 2);  // Enable Bus Mastering
@@ -75,8 +100,122 @@ uint64_t pci_map_bar(pci_device_t* device, int bar_num) {
             base |= ((uint64_t)device->bar[bar_num + 1] << 32);
         }
 
+        // The boot page tables only cover the first GiB
+        if (!paging_map_mmio(base, 1)) {
+            return 0;
+        }
+
         return base;
     }
 
     return 0;
 }
+
+uint32_t pci_config_read(pci_device_t* device, uint8_t offset) {
+    return pci_read_config(device->bus, device->device, device->function, offset);
+}
+
+void pci_config_write(pci_device_t* device, uint8_t offset, uint32_t value) {
+    pci_write_config(device->bus, device->device, device->function, offset, value);
+}
+
+uint8_t pci_find_capability(pci_device_t* device, uint8_t cap_id, uint8_t start) {
+    // Bit 4 of the status register says whether there is a capability list
+    if (!(pci_config_read(device, 0x04) & (1 << 20))) {
+        return 0;
+    }
+
+    uint8_t offset;
+    if (start == 0) {
+        offset = pci_config_read(device, 0x34) & 0xFC;
+    } else {
+        offset = (pci_config_read(device, start) >> 8) & 0xFC;
+    }
+
+    // Bounded in case of a looping list
+    for (int i = 0; offset != 0 && i < 48; i++) {
+        uint32_t header = pci_config_read(device, offset);
+        if ((header & 0xFF) == cap_id) {
+            return offset;
+        }
+        offset = (header >> 8) & 0xFC;
+    }
+    return 0;
+}
+
+bool pci_msix_init(pci_device_t* device, pci_msix_t* msix) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSIX, 0);
+    if (!cap) return false;
+
+    uint32_t control = pci_config_read(device, cap) >> 16;
+    uint32_t table = pci_config_read(device, cap + 4);
+    uint64_t base = pci_map_bar(device, table & 0x7);
+    if (!base) return false;
+
+    msix->device = device;
+    msix->cap = cap;
+    msix->table_size = (control & 0x7FF) + 1;
+    msix->table = (volatile uint32_t*)(base + (table & ~0x7));
+
+    for (uint16_t i = 0; i < msix->table_size; i++) {
+        msix->table[i * 4 + 3] |= 1;   // Masked
+    }
+    return true;
+}
+
+void pci_msix_set_vector(pci_msix_t* msix, uint16_t entry, uint8_t vector, uint8_t apic_id) {
+    volatile uint32_t* e = &msix->table[entry * 4];
+    e[0] = MSI_ADDRESS(apic_id);
+    e[1] = 0;
+    e[2] = MSI_DATA(vector);
+    e[3] &= ~1u;
+}
+
+void pci_msix_mask(pci_msix_t* msix, uint16_t entry, bool masked) {
+    volatile uint32_t* control = &msix->table[entry * 4 + 3];
+    if (masked) {
+        *control |= 1;
+    } else {
+        *control &= ~1u;
+    }
+}
+
+void pci_msix_enable(pci_msix_t* msix, bool enabled) {
+    uint32_t header = pci_config_read(msix->device, msix->cap);
+    uint32_t command = pci_config_read(msix->device, 0x04);
+
+    // Message control is the upper half of the first dword, bit 15 enables
+    if (enabled) {
+        header |= 1u << 31;
+        command |= 1 << 10;     // INTx disable
+    } else {
+        header &= ~(1u << 31);
+        command &= ~(1 << 10);
+    }
+    pci_config_write(msix->device, msix->cap, header);
+    pci_config_write(msix->device, 0x04, command & 0xFFFF);
+}
+
+bool pci_msi_enable(pci_device_t* device, uint8_t vector, uint8_t apic_id) {
+    uint8_t cap = pci_find_capability(device, PCI_CAP_MSI, 0);
+    if (!cap) return false;
+
+    // One message, the data register moves back when the address is 64 bit
+    uint32_t header = pci_config_read(device, cap);
+    bool is64 = header & (1 << 23);
+    pci_config_write(device, cap + 4, MSI_ADDRESS(apic_id));
+    if (is64) {
+        pci_config_write(device, cap + 8, 0);
+        pci_config_write(device, cap + 12, MSI_DATA(vector));
+    } else {
+        pci_config_write(device, cap + 8, MSI_DATA(vector));
+    }
+
+    header &= ~(7u << 20);      // Multiple message enable: 1 vector
+    header |= 1u << 16;         // MSI enable
+    pci_config_write(device, cap, header);
+
+    uint32_t command = pci_config_read(device, 0x04);
+    pci_config_write(device, 0x04, (command | (1 << 10)) & 0xFFFF);   // INTx disable
+    return true;
+}
@@ -13,9 +13,54 @@ typedef struct {
     uint8_t subclass;
     uint8_t prog_if;
     uint8_t revision_id;
+    uint8_t interrupt_line;  // Legacy IRQ the firmware routed INTx to
     uint32_t bar[6];
 } pci_device_t;
 
+#define PCI_CAP_MSI       0x05
+#define PCI_CAP_VENDOR    0x09
+#define PCI_CAP_MSIX      0x11
+
 bool pci_find_device(uint16_t vendor_id, uint16_t device_id, pci_device_t* device);
+
+// First device of a class, subclass and programming interface
+bool pci_find_class(uint8_t class_code, uint8_t subclass, uint8_t prog_if, pci_device_t* device);
 void pci_enable_bus_mastering(pci_device_t* device);
+
+// Physical address of a memory BAR, mapped so it can be accessed directly.
+// Returns 0 for I/O BARs.
 uint64_t pci_map_bar(pci_device_t* device, int bar_num);
+
+// Access the configuration space of a device
+uint32_t pci_config_read(pci_device_t* device, uint8_t offset);
+void pci_config_write(pci_device_t* device, uint8_t offset, uint32_t value);
+
+// Offset of the first capability with the given ID after start (0 to begin
+// at the head of the list), or 0 if there is none
+uint8_t pci_find_capability(pci_device_t* device, uint8_t cap_id, uint8_t start);
+
+// An MSI-X capability, set up by pci_msix_init
+typedef struct {
+    pci_device_t* device;
+    uint8_t cap;                 // Capability offset in config space
+    uint16_t table_size;         // Number of vectors
+    volatile uint32_t* table;    // Vector table, 4 dwords per entry
+} pci_msix_t;
+
+// Find the MSI-X capability and map its vector table. All vectors start
+// masked and MSI-X stays disabled until pci_msix_enable.
+bool pci_msix_init(pci_device_t* device, pci_msix_t* msix);
+
+// Point a vector table entry at an interrupt vector on a CPU and unmask it
+void pci_msix_set_vector(pci_msix_t* msix, uint16_t entry, uint8_t vector, uint8_t apic_id);
+
+// Mask or unmask one vector table entry, a message that comes in while
+// it is masked is sent when it is unmasked
+void pci_msix_mask(pci_msix_t* msix, uint16_t entry, bool masked);
+
+// Turn MSI-X on (and legacy INTx off) or off again
+void pci_msix_enable(pci_msix_t* msix, bool enabled);
+
+// Point the device's MSI capability at a vector on a CPU with a single
+// message and turn it on (and legacy INTx off). False without MSI.
+bool pci_msi_enable(pci_device_t* device, uint8_t vector, uint8_t apic_id);
@@ -102,3 +102,28 @@ int strncmp(const char* s1, const char* s2, size_t n) {
     }
     return *(const unsigned char*)s1 - *(const unsigned char*)s2;
 }
+
+const char* str_next_word(const char* args, char* word, size_t size) {
+    if (!args) return NULL;
+    while (*args == ' ') args++;
+    if (!*args) return NULL;
+
+    size_t i = 0;
+    while (*args && *args != ' ') {
+        if (i + 1 < size) word[i++] = *args;
+        args++;
+    }
+    word[i] = '\0';
+    return args;
+}
+
+int str_to_uint(const char* str, uint64_t* value) {
+    uint64_t result = 0;
+    if (*str < '0' || *str > '9') return 0;
+    while (*str >= '0' && *str <= '9') {
+        result = result * 10 + (*str++ - '0');
+    }
+    if (*str) return 0;
+    *value = result;
+    return 1;
+}
@@ -13,4 +13,11 @@ char* strncpy(char* dest, const char* src, size_t n);
 int strcmp(const char* s1, const char* s2);
 int strncmp(const char* s1, const char* s2, size_t n);
 char* cli_strtok(char* str, const char* delim);
-int cli_strcmp(const char* str1, const char* str2);
\ No newline at end of file
+int cli_strcmp(const char* str1, const char* str2);
+
+// Copy the next space separated word of args into word (at most size - 1
+// characters). Returns where parsing continues, NULL when there are no more words.
+const char* str_next_word(const char* args, char* word, size_t size);
+
+// Parse a decimal number, returns 0 if str isn't one
+int str_to_uint(const char* str, uint64_t* value);
@@ -7,12 +7,30 @@
 #define PIT_DATA_PORT 0x40
 #define PIT_COMMAND_PORT 0x43
 
+#define TSC_CALIBRATE_MS 50
+
 volatile uint64_t tick_count = 0;
+uint64_t tsc_per_ms = 1000000;  // Placeholder until calibrated
+
+// Periodic callbacks run from the timer interrupt
+static struct {
+    timer_periodic_t callback;
+    uint32_t interval;
+    uint64_t next_tick;
+} periodic[TIMER_MAX_PERIODIC];
+static int periodic_count = 0;
 
 // ISR for timer (IRQ0, which is mapped to interrupt 32)
 void timer_callback() {
     tick_count++;
 
+    for (int i = 0; i < periodic_count; i++) {
+        if (tick_count >= periodic[i].next_tick) {
+            periodic[i].next_tick = tick_count + periodic[i].interval;
+            periodic[i].callback();
+        }
+    }
+
     // Read from a safe I/O port to keep timer alive
     // Keyboard status port (0x64) is generally safe to read
     port_byte_in(0x64);
@@ -33,6 +51,25 @@ void timer_init() {
     register_interrupt_handler(32, timer_callback);
 }
 
+void timer_calibrate_tsc() {
+    // Start on a tick edge so the whole interval is measured
+    uint64_t start_tick = tick_count;
+    while (tick_count == start_tick) {
+        __asm__ volatile("pause");
+    }
+
+    uint64_t start = rdtsc();
+    start_tick = tick_count;
+    while (tick_count < start_tick + TSC_CALIBRATE_MS) {
+        __asm__ volatile("pause");
+    }
+    tsc_per_ms = (rdtsc() - start) / TSC_CALIBRATE_MS;
+}
+
+uint64_t tsc_to_ns(uint64_t cycles) {
+    return cycles * 1000000 / tsc_per_ms;
+}
+
 void sleep(uint32_t ms) {
     uint64_t target_tick = tick_count + ms;
     while (tick_count < target_tick) {
@@ -42,3 +79,15 @@ void sleep(uint32_t ms) {
         __asm__ volatile("hlt");
     }
 }
+
+bool timer_register_periodic(timer_periodic_t callback, uint32_t interval_ms) {
+    if (periodic_count >= TIMER_MAX_PERIODIC || interval_ms == 0) {
+        return false;
+    }
+
+    periodic[periodic_count].callback = callback;
+    periodic[periodic_count].interval = interval_ms;
+    periodic[periodic_count].next_tick = tick_count + interval_ms;
+    periodic_count++;
+    return true;
+}
@@ -1,11 +1,36 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#define TIMER_MAX_PERIODIC 16
 
 extern volatile uint64_t tick_count;
 
+// Time stamp counter cycles per millisecond, set by timer_calibrate_tsc
+extern uint64_t tsc_per_ms;
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
 // Initialize the timer system
 void timer_init();
 
+// Measure the TSC frequency against the timer, needs interrupts enabled
+void timer_calibrate_tsc();
+
+// Convert TSC cycles to nanoseconds
+uint64_t tsc_to_ns(uint64_t cycles);
+
 // Sleep for the specified number of milliseconds
 void sleep(uint32_t ms);
+
+// Function called periodically from the timer interrupt
+typedef void (*timer_periodic_t)(void);
+
+// Call callback every interval_ms milliseconds. It runs in interrupt context
+// so it should be short. Returns false if no slot is free.
+bool timer_register_periodic(timer_periodic_t callback, uint32_t interval_ms);
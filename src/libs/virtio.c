@@ -0,0 +1,459 @@
+#include "virtio.h"
+#include "string.h"
+
+// PCI capability types of the modern transport
+#define VIRTIO_PCI_CAP_COMMON  1
+#define VIRTIO_PCI_CAP_NOTIFY  2
+#define VIRTIO_PCI_CAP_ISR     3
+#define VIRTIO_PCI_CAP_DEVICE  4
+
+// Common configuration structure offsets
+#define COMMON_DFSELECT      0x00
+#define COMMON_DF            0x04
+#define COMMON_GFSELECT      0x08
+#define COMMON_GF            0x0C
+#define COMMON_MSIX          0x10
+#define COMMON_NUMQ          0x12
+#define COMMON_STATUS        0x14
+#define COMMON_CFGGEN        0x15
+#define COMMON_Q_SELECT      0x16
+#define COMMON_Q_SIZE        0x18
+#define COMMON_Q_MSIX        0x1A
+#define COMMON_Q_ENABLE      0x1C
+#define COMMON_Q_NOFF        0x1E
+#define COMMON_Q_DESC        0x20
+#define COMMON_Q_DRIVER      0x28
+#define COMMON_Q_DEVICE      0x30
+
+// x86 keeps stores in order, only a store followed by a load of another
+// location needs a real fence
+#define barrier() __asm__ volatile("" : : : "memory")
+#define mb()      __asm__ volatile("mfence" : : : "memory")
+
+static inline void write8(volatile uint8_t* base, uint32_t off, uint8_t v)   { *(volatile uint8_t*)(base + off) = v; }
+static inline void write16(volatile uint8_t* base, uint32_t off, uint16_t v) { *(volatile uint16_t*)(base + off) = v; }
+static inline void write32(volatile uint8_t* base, uint32_t off, uint32_t v) { *(volatile uint32_t*)(base + off) = v; }
+static inline uint8_t read8(volatile uint8_t* base, uint32_t off)   { return *(volatile uint8_t*)(base + off); }
+static inline uint16_t read16(volatile uint8_t* base, uint32_t off) { return *(volatile uint16_t*)(base + off); }
+static inline uint32_t read32(volatile uint8_t* base, uint32_t off) { return *(volatile uint32_t*)(base + off); }
+
+static inline void write64(volatile uint8_t* base, uint32_t off, uint64_t v) {
+    write32(base, off, v & 0xFFFFFFFF);
+    write32(base, off + 4, v >> 32);
+}
+
+// Same test as the Linux vring_need_event: has new_idx moved past event
+// since old_idx?
+static inline bool need_event(uint16_t event, uint16_t new_idx, uint16_t old_idx) {
+    return (uint16_t)(new_idx - event - 1) < (uint16_t)(new_idx - old_idx);
+}
+
+bool virtio_pci_init(virtio_device_t* dev, uint16_t modern_id, uint16_t transitional_id) {
+    memset(dev, 0, sizeof(*dev));
+
+    if (!pci_find_device(VIRTIO_VENDOR_ID, modern_id, &dev->pci) &&
+        !pci_find_device(VIRTIO_VENDOR_ID, transitional_id, &dev->pci)) {
+        return false;
+    }
+
+    // Walk the vendor capabilities for the configuration structures
+    for (uint8_t cap = pci_find_capability(&dev->pci, PCI_CAP_VENDOR, 0); cap != 0;
+         cap = pci_find_capability(&dev->pci, PCI_CAP_VENDOR, cap)) {
+        uint32_t header = pci_config_read(&dev->pci, cap);
+        uint8_t type = (header >> 24) & 0xFF;
+        uint8_t bar = pci_config_read(&dev->pci, cap + 4) & 0xFF;
+        uint32_t offset = pci_config_read(&dev->pci, cap + 8);
+        if (bar > 5) continue;
+
+        uint64_t base = pci_map_bar(&dev->pci, bar);
+        if (!base) continue;  // I/O BARs are for the legacy interface
+
+        switch (type) {
+        case VIRTIO_PCI_CAP_COMMON:
+            if (!dev->common) dev->common = (volatile uint8_t*)(base + offset);
+            break;
+        case VIRTIO_PCI_CAP_NOTIFY:
+            if (!dev->notify_base) {
+                dev->notify_base = base + offset;
+                dev->notify_multiplier = pci_config_read(&dev->pci, cap + 16);
+            }
+            break;
+        case VIRTIO_PCI_CAP_ISR:
+            if (!dev->isr) dev->isr = (volatile uint8_t*)(base + offset);
+            break;
+        case VIRTIO_PCI_CAP_DEVICE:
+            if (!dev->device_cfg) dev->device_cfg = (volatile uint8_t*)(base + offset);
+            break;
+        }
+    }
+
+    // Legacy-only devices have none of these
+    if (!dev->common || !dev->notify_base || !dev->isr) {
+        return false;
+    }
+
+    pci_enable_bus_mastering(&dev->pci);
+
+    // Reset, then announce ourselves
+    write8(dev->common, COMMON_STATUS, 0);
+    while (read8(dev->common, COMMON_STATUS) != 0) {
+        barrier();
+    }
+    write8(dev->common, COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE);
+    write8(dev->common, COMMON_STATUS, VIRTIO_STATUS_ACKNOWLEDGE | VIRTIO_STATUS_DRIVER);
+
+    // No MSI-X until a driver asks for it, interrupts come in through INTx
+    write16(dev->common, COMMON_MSIX, VIRTIO_MSI_NO_VECTOR);
+    return true;
+}
+
+bool virtio_negotiate(virtio_device_t* dev, uint64_t wanted) {
+    wanted |= VIRTIO_F_VERSION_1;
+
+    write32(dev->common, COMMON_DFSELECT, 0);
+    uint64_t offered = read32(dev->common, COMMON_DF);
+    write32(dev->common, COMMON_DFSELECT, 1);
+    offered |= (uint64_t)read32(dev->common, COMMON_DF) << 32;
+
+    dev->features = offered & wanted;
+    if (!(dev->features & VIRTIO_F_VERSION_1)) {
+        write8(dev->common, COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+
+    write32(dev->common, COMMON_GFSELECT, 0);
+    write32(dev->common, COMMON_GF, dev->features & 0xFFFFFFFF);
+    write32(dev->common, COMMON_GFSELECT, 1);
+    write32(dev->common, COMMON_GF, dev->features >> 32);
+
+    uint8_t status = read8(dev->common, COMMON_STATUS);
+    write8(dev->common, COMMON_STATUS, status | VIRTIO_STATUS_FEATURES_OK);
+    if (!(read8(dev->common, COMMON_STATUS) & VIRTIO_STATUS_FEATURES_OK)) {
+        write8(dev->common, COMMON_STATUS, VIRTIO_STATUS_FAILED);
+        return false;
+    }
+    return true;
+}
+
+bool virtio_setup_queue(virtio_device_t* dev, virtq_t* vq, uint16_t index) {
+    return virtio_setup_queue_vector(dev, vq, index, VIRTIO_MSI_NO_VECTOR);
+}
+
+bool virtio_setup_queue_vector(virtio_device_t* dev, virtq_t* vq, uint16_t index,
+                               uint16_t msix_entry) {
+    write16(dev->common, COMMON_Q_SELECT, index);
+    uint16_t size = read16(dev->common, COMMON_Q_SIZE);
+    if (size == 0) {
+        return false;
+    }
+    if (size > VIRTQ_MAX_SIZE) {
+        size = VIRTQ_MAX_SIZE;
+    }
+
+    memset(vq, 0, sizeof(*vq));
+    vq->index = index;
+    vq->size = size;
+    vq->packed = (dev->features & VIRTIO_F_RING_PACKED) != 0;
+    vq->event_idx = (dev->features & VIRTIO_F_EVENT_IDX) != 0;
+    vq->num_free = size;
+
+    uint64_t desc, driver, device;
+    if (vq->packed) {
+        // Both wrap counters start at 1
+        vq->avail_wrap = true;
+        vq->used_wrap = true;
+        for (uint16_t i = 0; i < size; i++) {
+            vq->free_ids[i] = size - 1 - i;
+        }
+        vq->free_id_count = size;
+
+        desc = (uint64_t)vq->ring.packed.desc;
+        driver = (uint64_t)&vq->ring.packed.driver;
+        device = (uint64_t)&vq->ring.packed.device;
+    } else {
+        for (uint16_t i = 0; i < size - 1; i++) {
+            vq->ring.split.desc[i].next = i + 1;
+        }
+        vq->free_head = 0;
+
+        desc = (uint64_t)vq->ring.split.desc;
+        driver = (uint64_t)&vq->ring.split.avail;
+        device = (uint64_t)&vq->ring.split.used;
+    }
+
+    write16(dev->common, COMMON_Q_SIZE, size);
+    // The device reads back NO_VECTOR if it couldn't take the entry
+    write16(dev->common, COMMON_Q_MSIX, msix_entry);
+    if (read16(dev->common, COMMON_Q_MSIX) != msix_entry) {
+        return false;
+    }
+    write64(dev->common, COMMON_Q_DESC, desc);
+    write64(dev->common, COMMON_Q_DRIVER, driver);
+    write64(dev->common, COMMON_Q_DEVICE, device);
+
+    uint16_t notify_off = read16(dev->common, COMMON_Q_NOFF);
+    vq->notify = (volatile uint16_t*)(dev->notify_base + (uint64_t)notify_off * dev->notify_multiplier);
+
+    write16(dev->common, COMMON_Q_ENABLE, 1);
+    return true;
+}
+
+void virtio_driver_ok(virtio_device_t* dev) {
+    uint8_t status = read8(dev->common, COMMON_STATUS);
+    write8(dev->common, COMMON_STATUS, status | VIRTIO_STATUS_DRIVER_OK);
+}
+
+uint8_t virtio_read_isr(virtio_device_t* dev) {
+    return *dev->isr;
+}
+
+// extra_flags go on every descriptor of the chain
+static bool add_split(virtq_t* vq, const virtq_buf_t* bufs, uint16_t out_count,
+                      uint16_t in_count, void* token, uint16_t extra_flags) {
+    uint16_t count = out_count + in_count;
+    uint16_t head = vq->free_head;
+    uint16_t idx = head;
+    uint16_t last = head;
+
+    for (uint16_t i = 0; i < count; i++) {
+        virtq_desc_t* d = &vq->ring.split.desc[idx];
+        d->addr = bufs[i].addr;
+        d->len = bufs[i].len;
+        d->flags = (i < out_count ? 0 : VIRTQ_DESC_F_WRITE) |
+                   (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0) | extra_flags;
+        last = idx;
+        idx = d->next;
+    }
+    vq->free_head = vq->ring.split.desc[last].next;
+    vq->num_free -= count;
+    vq->tokens[head] = token;
+    vq->chain_len[head] = count;
+
+    vq->ring.split.avail.ring[vq->avail_idx % vq->size] = head;
+    barrier();
+    vq->avail_idx++;
+    vq->ring.split.avail.idx = vq->avail_idx;
+    return true;
+}
+
+static bool add_packed(virtq_t* vq, const virtq_buf_t* bufs, uint16_t out_count,
+                       uint16_t in_count, void* token, uint16_t extra_flags) {
+    uint16_t count = out_count + in_count;
+    uint16_t id = vq->free_ids[--vq->free_id_count];
+    uint16_t pos = vq->next_avail;
+    bool wrap = vq->avail_wrap;
+    uint16_t head_flags = 0;
+
+    for (uint16_t i = 0; i < count; i++) {
+        virtq_packed_desc_t* d = &vq->ring.packed.desc[pos];
+        uint16_t flags = (i < out_count ? 0 : VIRTQ_DESC_F_WRITE) |
+                         (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0) |
+                         (wrap ? VIRTQ_DESC_F_AVAIL : VIRTQ_DESC_F_USED) | extra_flags;
+        d->addr = bufs[i].addr;
+        d->len = bufs[i].len;
+        d->id = id;
+
+        // The head's flags go last, they hand the whole chain to the device
+        if (i == 0) {
+            head_flags = flags;
+        } else {
+            d->flags = flags;
+        }
+
+        if (++pos == vq->size) {
+            pos = 0;
+            wrap = !wrap;
+        }
+    }
+
+    barrier();
+    vq->ring.packed.desc[vq->next_avail].flags = head_flags;
+
+    vq->next_avail = pos;
+    vq->avail_wrap = wrap;
+    vq->num_free -= count;
+    vq->tokens[id] = token;
+    vq->chain_len[id] = count;
+    return true;
+}
+
+// One ring descriptor pointing at a table of the chain. Split and packed
+// descriptors have the same size, only the flags differ.
+static bool add_indirect(virtq_t* vq, void* table, const virtq_buf_t* bufs, uint16_t out_count,
+                         uint16_t in_count, void* token) {
+    uint16_t count = out_count + in_count;
+
+    if (vq->packed) {
+        virtq_packed_desc_t* d = table;
+        for (uint16_t i = 0; i < count; i++) {
+            d[i].addr = bufs[i].addr;
+            d[i].len = bufs[i].len;
+            d[i].id = 0;
+            d[i].flags = i < out_count ? 0 : VIRTQ_DESC_F_WRITE;
+        }
+    } else {
+        virtq_desc_t* d = table;
+        for (uint16_t i = 0; i < count; i++) {
+            d[i].addr = bufs[i].addr;
+            d[i].len = bufs[i].len;
+            d[i].flags = (i < out_count ? 0 : VIRTQ_DESC_F_WRITE) |
+                         (i + 1 < count ? VIRTQ_DESC_F_NEXT : 0);
+            d[i].next = i + 1;
+        }
+    }
+
+    // The table is written before the ring descriptor is made available
+    virtq_buf_t ring_buf = { (uint64_t)table, count * sizeof(virtq_desc_t) };
+    return vq->packed ? add_packed(vq, &ring_buf, 1, 0, token, VIRTQ_DESC_F_INDIRECT)
+                      : add_split(vq, &ring_buf, 1, 0, token, VIRTQ_DESC_F_INDIRECT);
+}
+
+bool virtq_add_buf(virtq_t* vq, const virtq_buf_t* bufs, uint16_t out_count,
+                   uint16_t in_count, void* token) {
+    uint16_t count = out_count + in_count;
+    if (count == 0 || count > vq->num_free) {
+        return false;
+    }
+
+    bool added = vq->packed ? add_packed(vq, bufs, out_count, in_count, token, 0)
+                            : add_split(vq, bufs, out_count, in_count, token, 0);
+    if (added) {
+        // A packed ring moves one slot per descriptor, and the device's
+        // event offset is a slot
+        vq->num_added += vq->packed ? count : 1;
+    }
+    return added;
+}
+
+bool virtq_add_indirect(virtq_t* vq, void* table, const virtq_buf_t* bufs, uint16_t out_count,
+                        uint16_t in_count, void* token) {
+    if (out_count + in_count == 0 || vq->num_free == 0) {
+        return false;
+    }
+
+    bool added = add_indirect(vq, table, bufs, out_count, in_count, token);
+    if (added) {
+        vq->num_added++;
+    }
+    return added;
+}
+
+void virtq_kick(virtq_t* vq) {
+    if (vq->num_added == 0) return;
+
+    // The buffers must be visible before we look at what the device wants
+    mb();
+
+    bool notify;
+    if (vq->packed) {
+        uint16_t new_idx = vq->next_avail;
+        uint16_t old_idx = new_idx - vq->num_added;
+        virtq_event_t event = vq->ring.packed.device;
+
+        if (event.flags == VIRTQ_EVENT_DESC) {
+            uint16_t event_idx = event.off_wrap & 0x7FFF;
+            bool event_wrap = (event.off_wrap >> 15) != 0;
+            if (event_wrap != vq->avail_wrap) {
+                event_idx -= vq->size;
+            }
+            notify = need_event(event_idx, new_idx, old_idx);
+        } else {
+            notify = event.flags != VIRTQ_EVENT_DISABLE;
+        }
+    } else if (vq->event_idx) {
+        // avail_event sits right after the last used element
+        volatile uint8_t* ring_end = (volatile uint8_t*)vq->ring.split.used.ring +
+                                     vq->size * sizeof(virtq_used_elem_t);
+        uint16_t avail_event = *(volatile uint16_t*)ring_end;
+        notify = need_event(avail_event, vq->avail_idx, vq->avail_idx - vq->num_added);
+    } else {
+        notify = !(vq->ring.split.used.flags & VIRTQ_USED_F_NO_NOTIFY);
+    }
+
+    vq->num_added = 0;
+    if (notify) {
+        *vq->notify = vq->index;
+    }
+}
+
+bool virtq_has_used(virtq_t* vq) {
+    if (vq->packed) {
+        uint16_t flags = *(volatile uint16_t*)&vq->ring.packed.desc[vq->last_used].flags;
+        bool avail = (flags & VIRTQ_DESC_F_AVAIL) != 0;
+        bool used = (flags & VIRTQ_DESC_F_USED) != 0;
+        return avail == used && used == vq->used_wrap;
+    }
+    return vq->last_used != *(volatile uint16_t*)&vq->ring.split.used.idx;
+}
+
+void* virtq_get_buf(virtq_t* vq, uint32_t* len) {
+    if (!virtq_has_used(vq)) {
+        return NULL;
+    }
+    barrier();
+
+    void* token;
+    if (vq->packed) {
+        virtq_packed_desc_t* d = &vq->ring.packed.desc[vq->last_used];
+        uint16_t id = d->id;
+        if (len) *len = d->len;
+
+        token = vq->tokens[id];
+        uint16_t count = vq->chain_len[id];
+        vq->free_ids[vq->free_id_count++] = id;
+        vq->num_free += count;
+
+        vq->last_used += count;
+        if (vq->last_used >= vq->size) {
+            vq->last_used -= vq->size;
+            vq->used_wrap = !vq->used_wrap;
+        }
+    } else {
+        virtq_used_elem_t* e = &vq->ring.split.used.ring[vq->last_used % vq->size];
+        uint16_t head = e->id;
+        if (len) *len = e->len;
+        vq->last_used++;
+
+        // Put the chain back on the free list
+        token = vq->tokens[head];
+        uint16_t tail = head;
+        while (vq->ring.split.desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+            tail = vq->ring.split.desc[tail].next;
+        }
+        vq->ring.split.desc[tail].next = vq->free_head;
+        vq->free_head = head;
+        vq->num_free += vq->chain_len[head];
+    }
+    return token;
+}
+
+void virtq_disable_interrupts(virtq_t* vq) {
+    if (vq->packed) {
+        vq->ring.packed.driver.flags = VIRTQ_EVENT_DISABLE;
+    } else {
+        // With event indexes the flag is only a hint, used_event still
+        // stops the device once it is behind us
+        vq->ring.split.avail.flags = VIRTQ_AVAIL_F_NO_INTERRUPT;
+    }
+}
+
+bool virtq_enable_interrupts(virtq_t* vq) {
+    if (vq->packed) {
+        if (vq->event_idx) {
+            vq->ring.packed.driver.off_wrap = vq->last_used | (vq->used_wrap ? 0x8000 : 0);
+            barrier();
+            vq->ring.packed.driver.flags = VIRTQ_EVENT_DESC;
+        } else {
+            vq->ring.packed.driver.flags = VIRTQ_EVENT_ENABLE;
+        }
+    } else {
+        vq->ring.split.avail.flags = 0;
+        if (vq->event_idx) {
+            vq->ring.split.avail.ring[vq->size] = vq->last_used;
+        }
+    }
+
+    // The device may have used buffers before it saw the change
+    mb();
+    return !virtq_has_used(vq);
+}
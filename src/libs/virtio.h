@@ -0,0 +1,183 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pci.h"
+
+#define VIRTIO_VENDOR_ID        0x1AF4
+
+// Device status bits
+#define VIRTIO_STATUS_ACKNOWLEDGE  0x01
+#define VIRTIO_STATUS_DRIVER       0x02
+#define VIRTIO_STATUS_DRIVER_OK    0x04
+#define VIRTIO_STATUS_FEATURES_OK  0x08
+#define VIRTIO_STATUS_FAILED       0x80
+
+// Transport feature bits
+#define VIRTIO_F_INDIRECT_DESC  (1ULL << 28)
+#define VIRTIO_F_EVENT_IDX      (1ULL << 29)
+#define VIRTIO_F_VERSION_1      (1ULL << 32)
+#define VIRTIO_F_RING_PACKED    (1ULL << 34)
+
+#define VIRTIO_MSI_NO_VECTOR    0xFFFF
+
+#define VIRTQ_MAX_SIZE          256   // Queues are shortened to this if the device allows more
+
+// Split ring layout
+#define VIRTQ_DESC_F_NEXT       1
+#define VIRTQ_DESC_F_WRITE      2
+#define VIRTQ_DESC_F_INDIRECT   4
+
+// Packed ring descriptor flags
+#define VIRTQ_DESC_F_AVAIL      (1 << 7)
+#define VIRTQ_DESC_F_USED       (1 << 15)
+
+// Event suppression
+#define VIRTQ_AVAIL_F_NO_INTERRUPT  1
+#define VIRTQ_USED_F_NO_NOTIFY      1
+#define VIRTQ_EVENT_ENABLE      0
+#define VIRTQ_EVENT_DISABLE     1
+#define VIRTQ_EVENT_DESC        2
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+} __attribute__((packed)) virtq_desc_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[VIRTQ_MAX_SIZE + 1];   // ring[size] is used_event
+} __attribute__((packed)) virtq_avail_t;
+
+typedef struct {
+    uint32_t id;
+    uint32_t len;
+} __attribute__((packed)) virtq_used_elem_t;
+
+typedef struct {
+    uint16_t flags;
+    uint16_t idx;
+    virtq_used_elem_t ring[VIRTQ_MAX_SIZE];
+    uint16_t avail_event_space[2];       // avail_event follows ring[size]
+} __attribute__((packed)) virtq_used_t;
+
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} __attribute__((packed)) virtq_packed_desc_t;
+
+typedef struct {
+    uint16_t off_wrap;
+    uint16_t flags;
+} __attribute__((packed)) virtq_event_t;
+
+// One buffer of a request, out buffers (read by the device) come first
+typedef struct {
+    uint64_t addr;
+    uint32_t len;
+} virtq_buf_t;
+
+typedef struct {
+    uint16_t index;
+    uint16_t size;
+    bool packed;
+    bool event_idx;
+    volatile uint16_t* notify;
+
+    uint16_t num_free;       // Free descriptors
+    uint16_t num_added;      // Made available since the last kick: buffers on a split
+                             // ring, descriptors on a packed one
+    uint16_t last_used;      // Next used entry to look at
+    void* tokens[VIRTQ_MAX_SIZE];
+    uint16_t chain_len[VIRTQ_MAX_SIZE];
+
+    // Split ring
+    uint16_t free_head;      // Free descriptors are chained through next
+    uint16_t avail_idx;      // Shadow of avail->idx
+
+    // Packed ring
+    uint16_t next_avail;
+    bool avail_wrap;
+    bool used_wrap;
+    uint16_t free_ids[VIRTQ_MAX_SIZE];   // Stack of unused buffer IDs
+    uint16_t free_id_count;
+
+    // Ring memory, one of the two layouts
+    union {
+        struct {
+            virtq_desc_t desc[VIRTQ_MAX_SIZE] __attribute__((aligned(16)));
+            virtq_avail_t avail __attribute__((aligned(2)));
+            virtq_used_t used __attribute__((aligned(4)));
+        } split;
+        struct {
+            virtq_packed_desc_t desc[VIRTQ_MAX_SIZE] __attribute__((aligned(16)));
+            virtq_event_t driver __attribute__((aligned(4)));
+            virtq_event_t device __attribute__((aligned(4)));
+        } packed;
+    } ring __attribute__((aligned(4096)));
+} virtq_t;
+
+// A virtio device behind the modern (1.x) PCI transport
+typedef struct {
+    pci_device_t pci;
+    volatile uint8_t* common;    // Common configuration structure
+    volatile uint8_t* isr;
+    volatile uint8_t* device_cfg;
+    uint64_t notify_base;
+    uint32_t notify_multiplier;
+    uint64_t features;           // Negotiated features
+} virtio_device_t;
+
+// Find a device by its modern or transitional PCI ID, locate its
+// configuration structures and reset it
+bool virtio_pci_init(virtio_device_t* dev, uint16_t modern_id, uint16_t transitional_id);
+
+// Accept the wanted features the device offers. VIRTIO_F_VERSION_1 is
+// always requested. Returns false if the device rejects the result.
+bool virtio_negotiate(virtio_device_t* dev, uint64_t wanted);
+
+// Set up queue index with the layout matching the negotiated features
+bool virtio_setup_queue(virtio_device_t* dev, virtq_t* vq, uint16_t index);
+
+// Same, with the queue's interrupts going to an MSI-X table entry. False
+// if the device doesn't accept the entry.
+bool virtio_setup_queue_vector(virtio_device_t* dev, virtq_t* vq, uint16_t index,
+                               uint16_t msix_entry);
+
+// Tell the device the driver is ready
+void virtio_driver_ok(virtio_device_t* dev);
+
+// Read and acknowledge the interrupt status (bit 0: queue, bit 1: config)
+uint8_t virtio_read_isr(virtio_device_t* dev);
+
+// Make a request available. Returns false if there aren't enough free
+// descriptors. token comes back from virtq_get_buf when the device is done.
+bool virtq_add_buf(virtq_t* vq, const virtq_buf_t* bufs, uint16_t out_count,
+                   uint16_t in_count, void* token);
+
+// Same, but the chain goes into table (count entries of 16 bytes, owned by
+// the caller until the request completes) and takes one ring descriptor.
+// Needs VIRTIO_F_INDIRECT_DESC.
+bool virtq_add_indirect(virtq_t* vq, void* table, const virtq_buf_t* bufs, uint16_t out_count,
+                        uint16_t in_count, void* token);
+
+// Notify the device of new buffers, unless it said it doesn't need it
+void virtq_kick(virtq_t* vq);
+
+// Next completed request or NULL. len is the number of bytes the device wrote.
+void* virtq_get_buf(virtq_t* vq, uint32_t* len);
+
+// Whether completed requests are waiting
+bool virtq_has_used(virtq_t* vq);
+
+// Ask the device not to interrupt for this queue
+void virtq_disable_interrupts(virtq_t* vq);
+
+// Ask for interrupts again. Returns false if requests completed in the
+// meantime, the caller should process them instead of waiting.
+bool virtq_enable_interrupts(virtq_t* vq);